@@ -0,0 +1,645 @@
+
+#include "hpack.h"
+
+/*
+    Static table (RFC 7541 Appendix A), index 1 is static_table[0]
+*/
+static const struct
+{
+    const char *name;
+    const char *value;
+} static_table[HPACK_STATIC_TABLE_LENGTH] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+/*
+    Huffman code length of every symbol (RFC 7541 Appendix B), symbol 256 is EOS
+
+    The code is canonical and, within one length, ordered by symbol, so the lengths are enough
+    to rebuild it.
+*/
+static const uint8_t huffman_code_lengths[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+#define HUFFMAN_MAX_CODE_LENGTH 30
+#define HUFFMAN_EOS 256
+
+/*
+    Canonical decoding tables, built on first use
+
+    Codes of length n occupy [first_code[n], first_code[n] + code_count[n]) and map to
+    sorted_symbols[symbol_offset[n] + code - first_code[n]].
+*/
+static uint32_t first_code[HUFFMAN_MAX_CODE_LENGTH + 1];
+static uint32_t code_count[HUFFMAN_MAX_CODE_LENGTH + 1];
+static uint32_t symbol_offset[HUFFMAN_MAX_CODE_LENGTH + 1];
+static uint16_t sorted_symbols[257];
+static bool huffman_ready = false;
+
+static void
+build_huffman_tables(void)
+{
+    uint32_t code = 0;
+    uint32_t offset = 0;
+
+    for (int length = 1; length <= HUFFMAN_MAX_CODE_LENGTH; length++) {
+        first_code[length] = code;
+        symbol_offset[length] = offset;
+        code_count[length] = 0;
+
+        for (int symbol = 0; symbol < 257; symbol++) {
+            if (huffman_code_lengths[symbol] == length) {
+                sorted_symbols[offset++] = symbol;
+                code_count[length]++;
+            }
+        }
+
+        code = (code + code_count[length]) << 1;
+    }
+
+    huffman_ready = true;
+}
+
+/*
+    Decodes a Huffman coded string
+
+    Returns the decoded length, or -1 on an invalid code, EOS, bad padding or a full dst
+*/
+int
+hpack_huffman_decode(const uint8_t *src, int src_length, char *dst, int dst_size)
+{
+    uint32_t code = 0;
+    int code_length = 0;
+    int out = 0;
+
+    if (!huffman_ready) {
+        build_huffman_tables();
+    }
+
+    for (int i = 0; i < src_length; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            code = (code << 1) | ((src[i] >> bit) & 1);
+            code_length++;
+
+            if (code_length > HUFFMAN_MAX_CODE_LENGTH) {
+                return -1;
+            }
+
+            if (code - first_code[code_length] >= code_count[code_length]) {
+                continue;
+            }
+
+            int symbol = sorted_symbols[symbol_offset[code_length] + code - first_code[code_length]];
+
+            if (symbol == HUFFMAN_EOS || out >= dst_size) {
+                return -1;
+            }
+
+            dst[out++] = (char) symbol;
+            code = 0;
+            code_length = 0;
+        }
+    }
+
+    // Padding is the most significant bits of EOS (all ones) and shorter than a byte
+    if (code_length > 7 || code != (1u << code_length) - 1) {
+        return -1;
+    }
+
+    return out;
+}
+
+/*
+    Reads an integer with an N-bit prefix (RFC 7541 5.1)
+*/
+static int
+decode_integer(const uint8_t **pos, const uint8_t *end, int prefix_bits, uint32_t *value)
+{
+    uint32_t max_prefix = (1u << prefix_bits) - 1;
+
+    if (*pos >= end) {
+        return -1;
+    }
+
+    uint32_t result = **pos & max_prefix;
+    (*pos)++;
+
+    if (result < max_prefix) {
+        *value = result;
+        return 0;
+    }
+
+    for (int shift = 0; *pos < end; shift += 7) {
+        uint8_t byte = **pos;
+        (*pos)++;
+
+        if (shift > 21) {
+            return -1; // Nothing legitimate needs more than 28 bits
+        }
+
+        result += (uint32_t) (byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Writes an integer with an N-bit prefix, OR-ing flags into the first byte
+
+    Returns the number of bytes written, or -1 if buf is too small
+*/
+static int
+encode_integer(uint8_t *buf, int buf_size, uint8_t flags, int prefix_bits, uint32_t value)
+{
+    uint32_t max_prefix = (1u << prefix_bits) - 1;
+    int written = 0;
+
+    if (buf_size < 1) {
+        return -1;
+    }
+
+    if (value < max_prefix) {
+        buf[written++] = flags | value;
+        return written;
+    }
+
+    buf[written++] = flags | max_prefix;
+    value -= max_prefix;
+
+    while (value >= 0x80) {
+        if (written >= buf_size) {
+            return -1;
+        }
+        buf[written++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+
+    if (written >= buf_size) {
+        return -1;
+    }
+    buf[written++] = value;
+
+    return written;
+}
+
+/*
+    Reads a string literal into a newly allocated, NUL-terminated buffer
+*/
+static int
+decode_string(const uint8_t **pos, const uint8_t *end, char **out, int *out_length)
+{
+    if (*pos >= end) {
+        return -1;
+    }
+
+    bool huffman = (**pos & 0x80) != 0;
+    uint32_t length;
+
+    if (decode_integer(pos, end, 7, &length) != 0 || length > HPACK_MAX_STRING_LENGTH
+        || length > (uint32_t) (end - *pos)) {
+        return -1;
+    }
+
+    // The shortest Huffman code is 5 bits long
+    int capacity = huffman ? (int) (length * 8 / 5) + 1 : (int) length + 1;
+    char *str = malloc(capacity);
+
+    if (!str) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+
+    int decoded_length = length;
+
+    if (huffman) {
+        decoded_length = hpack_huffman_decode(*pos, length, str, capacity - 1);
+        if (decoded_length < 0) {
+            free(str);
+            return -1;
+        }
+    } else {
+        memcpy(str, *pos, length);
+    }
+
+    str[decoded_length] = '\0';
+    *pos += length;
+    *out = str;
+    *out_length = decoded_length;
+
+    return 0;
+}
+
+static int
+entry_size(int name_length, int value_length)
+{
+    return name_length + value_length + HPACK_ENTRY_OVERHEAD;
+}
+
+/*
+    Drops the oldest entries until the table fits in max_size
+*/
+static void
+evict_entries(HPACK_TABLE *table, int max_size)
+{
+    while (table->count > 0 && table->size > max_size) {
+        struct hpack_entry *oldest
+            = &table->entries[(table->head + table->count - 1) % HPACK_MAX_ENTRIES];
+
+        table->size -= entry_size(oldest->name_length, oldest->value_length);
+        free(oldest->name);
+        free(oldest->value);
+        memset(oldest, 0, sizeof(struct hpack_entry));
+        table->count--;
+    }
+}
+
+/*
+    Inserts an entry at the front of the dynamic table, taking ownership of name and value
+*/
+static void
+add_entry(HPACK_TABLE *table, char *name, int name_length, char *value, int value_length)
+{
+    int size = entry_size(name_length, value_length);
+
+    evict_entries(table, table->max_size - size);
+
+    // An entry larger than the table just empties it
+    if (size > table->max_size) {
+        free(name);
+        free(value);
+        return;
+    }
+
+    table->head = (table->head + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    table->entries[table->head].name = name;
+    table->entries[table->head].name_length = name_length;
+    table->entries[table->head].value = value;
+    table->entries[table->head].value_length = value_length;
+    table->count++;
+    table->size += size;
+}
+
+/*
+    Looks up a 1-based index across the static and dynamic tables
+*/
+static int
+get_entry(const HPACK_TABLE *table, uint32_t index, const char **name, int *name_length,
+          const char **value, int *value_length)
+{
+    if (index == 0) {
+        return -1;
+    }
+
+    if (index <= HPACK_STATIC_TABLE_LENGTH) {
+        *name = static_table[index - 1].name;
+        *name_length = strlen(*name);
+        *value = static_table[index - 1].value;
+        *value_length = strlen(*value);
+        return 0;
+    }
+
+    index -= HPACK_STATIC_TABLE_LENGTH + 1;
+
+    if (index >= (uint32_t) table->count) {
+        return -1;
+    }
+
+    const struct hpack_entry *entry = &table->entries[(table->head + index) % HPACK_MAX_ENTRIES];
+
+    *name = entry->name;
+    *name_length = entry->name_length;
+    *value = entry->value;
+    *value_length = entry->value_length;
+    return 0;
+}
+
+void
+hpack_table_init(HPACK_TABLE *table, int max_size)
+{
+    memset(table, 0, sizeof(HPACK_TABLE));
+    table->max_size = MIN(max_size, HPACK_DEFAULT_TABLE_SIZE);
+    table->settings_max_size = table->max_size;
+}
+
+void
+hpack_table_free(HPACK_TABLE *table)
+{
+    evict_entries(table, 0);
+}
+
+/*
+    Applies a new SETTINGS_HEADER_TABLE_SIZE from the peer to an encoder table
+
+    The table never grows past HPACK_DEFAULT_TABLE_SIZE. Any change is signalled to the peer at
+    the start of the next header block.
+*/
+void
+hpack_table_set_max_size(HPACK_TABLE *table, int max_size)
+{
+    max_size = MIN(max_size, HPACK_DEFAULT_TABLE_SIZE);
+
+    if (max_size == table->max_size) {
+        return;
+    }
+
+    evict_entries(table, max_size);
+    table->max_size = max_size;
+    table->settings_max_size = max_size;
+    table->size_update_pending = true;
+}
+
+/*
+    Decodes a complete header block, calling callback for every header field
+
+    The dynamic table is kept in sync even for fields the caller ignores.
+
+    Returns 0 on success, or -1 on a compression error (fatal for the connection)
+*/
+int
+hpack_decode(HPACK_TABLE *table, const uint8_t *block, int block_length,
+             hpack_header_callback callback, void *ctx)
+{
+    const uint8_t *pos = block;
+    const uint8_t *end = block + block_length;
+    bool field_seen = false;
+
+    while (pos < end) {
+        uint8_t first = *pos;
+        uint32_t index;
+        const char *name;
+        const char *value;
+        int name_length;
+        int value_length;
+
+        // Indexed header field
+        if (first & 0x80) {
+            if (decode_integer(&pos, end, 7, &index) != 0
+                || get_entry(table, index, &name, &name_length, &value, &value_length) != 0) {
+                fprintf(stderr, "HPACK: invalid index\n");
+                return -1;
+            }
+            callback(ctx, name, name_length, value, value_length);
+            field_seen = true;
+            continue;
+        }
+
+        // Dynamic table size update, only allowed before the first field
+        if ((first & 0xe0) == 0x20) {
+            uint32_t max_size;
+            if (field_seen || decode_integer(&pos, end, 5, &max_size) != 0
+                || max_size > (uint32_t) table->settings_max_size) {
+                fprintf(stderr, "HPACK: invalid dynamic table size update\n");
+                return -1;
+            }
+            evict_entries(table, max_size);
+            table->max_size = max_size;
+            continue;
+        }
+
+        // Literal header field, with incremental indexing (6-bit prefix) or without (4-bit)
+        bool indexing = (first & 0xc0) == 0x40;
+        char *literal_name = NULL;
+        char *literal_value = NULL;
+
+        if (decode_integer(&pos, end, indexing ? 6 : 4, &index) != 0) {
+            fprintf(stderr, "HPACK: truncated literal\n");
+            return -1;
+        }
+
+        if (index == 0) {
+            if (decode_string(&pos, end, &literal_name, &name_length) != 0) {
+                fprintf(stderr, "HPACK: invalid literal name\n");
+                return -1;
+            }
+        } else {
+            const char *indexed_value;
+            int indexed_value_length;
+
+            if (get_entry(table, index, &name, &name_length, &indexed_value, &indexed_value_length)
+                != 0) {
+                fprintf(stderr, "HPACK: invalid name index\n");
+                return -1;
+            }
+
+            // Copied now, adding the new entry may evict the one the name came from
+            literal_name = malloc(name_length + 1);
+            if (!literal_name) {
+                perror("Failed to allocate memory");
+                return -1;
+            }
+            memcpy(literal_name, name, name_length + 1);
+        }
+
+        if (decode_string(&pos, end, &literal_value, &value_length) != 0) {
+            fprintf(stderr, "HPACK: invalid literal value\n");
+            free(literal_name);
+            return -1;
+        }
+
+        callback(ctx, literal_name, name_length, literal_value, value_length);
+        field_seen = true;
+
+        if (indexing) {
+            add_entry(table, literal_name, name_length, literal_value, value_length);
+        } else {
+            free(literal_name);
+            free(literal_value);
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Writes whatever must open a header block, currently a pending dynamic table size update
+
+    Returns the number of bytes written, or -1 if buf is too small
+*/
+int
+hpack_encode_block_start(HPACK_TABLE *table, uint8_t *buf, int buf_size)
+{
+    if (!table->size_update_pending) {
+        return 0;
+    }
+
+    table->size_update_pending = false;
+    return encode_integer(buf, buf_size, 0x20, 5, table->max_size);
+}
+
+/*
+    Writes a string literal without Huffman coding
+*/
+static int
+encode_string(uint8_t *buf, int buf_size, const char *str, int length)
+{
+    int written = encode_integer(buf, buf_size, 0x00, 7, length);
+
+    if (written < 0 || written + length > buf_size) {
+        return -1;
+    }
+
+    memcpy(buf + written, str, length);
+    return written + length;
+}
+
+/*
+    Encodes one header field, name must already be lowercase
+
+    Exact table matches become a single index. Otherwise the field is sent as a literal, added
+    to the dynamic table when indexing is set (worth it for values that repeat across responses).
+
+    Returns the number of bytes written, or -1 if buf is too small
+*/
+int
+hpack_encode_header(HPACK_TABLE *table, uint8_t *buf, int buf_size, const char *name,
+                    const char *value, bool indexing)
+{
+    int name_length = strlen(name);
+    int value_length = strlen(value);
+    uint32_t name_index = 0;
+    int written;
+    int ret;
+
+    for (int i = 0; i < HPACK_STATIC_TABLE_LENGTH; i++) {
+        if (strcmp(static_table[i].name, name) != 0) {
+            continue;
+        }
+        if (strcmp(static_table[i].value, value) == 0) {
+            return encode_integer(buf, buf_size, 0x80, 7, i + 1);
+        }
+        if (name_index == 0) {
+            name_index = i + 1;
+        }
+    }
+
+    for (int i = 0; i < table->count; i++) {
+        const struct hpack_entry *entry = &table->entries[(table->head + i) % HPACK_MAX_ENTRIES];
+
+        if (entry->name_length != name_length || memcmp(entry->name, name, name_length) != 0) {
+            continue;
+        }
+        if (entry->value_length == value_length && memcmp(entry->value, value, value_length) == 0) {
+            return encode_integer(buf, buf_size, 0x80, 7, HPACK_STATIC_TABLE_LENGTH + 1 + i);
+        }
+        if (name_index == 0) {
+            name_index = HPACK_STATIC_TABLE_LENGTH + 1 + i;
+        }
+    }
+
+    written = encode_integer(buf, buf_size, indexing ? 0x40 : 0x00, indexing ? 6 : 4, name_index);
+    if (written < 0) {
+        return -1;
+    }
+
+    if (name_index == 0) {
+        if ((ret = encode_string(buf + written, buf_size - written, name, name_length)) < 0) {
+            return -1;
+        }
+        written += ret;
+    }
+
+    if ((ret = encode_string(buf + written, buf_size - written, value, value_length)) < 0) {
+        return -1;
+    }
+    written += ret;
+
+    if (indexing) {
+        char *name_copy = malloc(name_length + 1);
+        char *value_copy = malloc(value_length + 1);
+
+        if (!name_copy || !value_copy) {
+            perror("Failed to allocate memory");
+            free(name_copy);
+            free(value_copy);
+            return -1;
+        }
+
+        memcpy(name_copy, name, name_length + 1);
+        memcpy(value_copy, value, value_length + 1);
+        add_entry(table, name_copy, name_length, value_copy, value_length);
+    }
+
+    return written;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "macros.h"
+
+/*
+    HPACK header compression for HTTP/2 (RFC 7541)
+*/
+
+#define HPACK_DEFAULT_TABLE_SIZE 4096 // SETTINGS_HEADER_TABLE_SIZE both peers start with
+#define HPACK_ENTRY_OVERHEAD 32       // Added to name + value length to size an entry
+#define HPACK_MAX_ENTRIES (HPACK_DEFAULT_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_TABLE_LENGTH 61
+#define HPACK_MAX_STRING_LENGTH 16 * KB // Longest name or value accepted by the decoder
+
+/*
+    Dynamic table entry
+*/
+struct hpack_entry
+{
+    char *name;
+    char *value;
+    int name_length;
+    int value_length;
+};
+
+/*
+    HPACK Dynamic Table
+
+    A ring of entries, newest first. One table is kept per direction: the decoder's is sized by
+    our SETTINGS_HEADER_TABLE_SIZE, the encoder's by the peer's.
+*/
+typedef struct
+{
+    struct hpack_entry entries[HPACK_MAX_ENTRIES];
+    int head;                 // Slot of the newest entry
+    int count;                // Number of entries in the table
+    int size;                 // Sum of entry sizes, as defined by RFC 7541 4.1
+    int max_size;             // Current size limit
+    int settings_max_size;    // Limit a size update may not exceed
+    bool size_update_pending; // Encoder must signal max_size at the start of the next block
+} HPACK_TABLE;
+
+/*
+    Receives one decoded header field
+
+    name and value are NUL-terminated and only valid for the duration of the call
+*/
+typedef void (*hpack_header_callback)(void *ctx, const char *name, int name_length,
+                                      const char *value, int value_length);
+
+void hpack_table_init(HPACK_TABLE *table, int max_size);
+void hpack_table_free(HPACK_TABLE *table);
+void hpack_table_set_max_size(HPACK_TABLE *table, int max_size);
+
+int hpack_decode(HPACK_TABLE *table, const uint8_t *block, int block_length,
+                 hpack_header_callback callback, void *ctx);
+
+int hpack_encode_block_start(HPACK_TABLE *table, uint8_t *buf, int buf_size);
+int hpack_encode_header(HPACK_TABLE *table, uint8_t *buf, int buf_size, const char *name,
+                        const char *value, bool indexing);
+
+int hpack_huffman_decode(const uint8_t *src, int src_length, char *dst, int dst_size);
@@ -1,32 +1,14 @@
 #include "http_builder.h"
 
 /*
-    Builds all headers + start line for an HTTP message into a buffer
-    and sends it through the socket file descriptor
+    Adds the Content-Length and Content-Type headers describing the message body
 
-    Flow:
-        1. Build Start Line + Headers into a buffer
-        2. Send To Socket
-
-    Parameters:
-        HTTP_MESSAGE msg - HTTP Message Data
-        int sock_fd - Socket file descriptor
-        int http_message_type - Type of HTTP message (REQUEST or RESPONSE)
-
-    Returns:
-        int - status code
+    Returns 0 on success, or a negative error when the body file cannot be described
 */
 int
-build_and_send_headers(HTTP_MESSAGE *msg, int sock_fd, int off, int continuing,
-                       int http_message_type)
+add_body_headers(HTTP_MESSAGE *msg)
 {
-    if (!msg || sock_fd == -1) {
-        fprintf(stderr, "Invalid parameters\n");
-        return -1;
-    }
-
-    // Create Headers about the body
-    if (!continuing && msg->body_fd != -1) {
+    if (msg->body_fd != -1) {
         // Add Content-Length header
         char content_length_str[32];
         int file_length = get_file_length(msg->body_fd);
@@ -42,62 +24,18 @@ build_and_send_headers(HTTP_MESSAGE *msg, int sock_fd, int off, int continuing,
         add_header(msg, "Content-Length", content_length_str);
 
         // Add Content-Type header
-        char mime_type_buffer[MAX_HEADER_LENGTH] = { 0 };
-        if (get_mime_type_from_path(path, mime_type_buffer, sizeof(mime_type_buffer)) == 0) {
-            char content_type_header[MAX_HEADER_LENGTH] = { 0 };
-            if (strncmp(mime_type_buffer, "text/", 5) == 0
-                || strcmp(mime_type_buffer, "application/json") == 0
-                || strcmp(mime_type_buffer, "application/xml") == 0) {
-                // Manually construct the content type with charset to avoid truncation warning
-                size_t mime_len = strlen(mime_type_buffer);
-                if (mime_len + 15 < sizeof(content_type_header)) { // 15 = strlen("; charset=utf-8")
-                    strcpy(content_type_header, mime_type_buffer);
-                    strcat(content_type_header, "; charset=utf-8");
-                } else {
-                    // Fall back to just the MIME type if adding charset would truncate
-                    strncpy(content_type_header, mime_type_buffer, sizeof(content_type_header) - 1);
-                    content_type_header[sizeof(content_type_header) - 1] = '\0';
-                }
-            } else {
-                strncpy(content_type_header, mime_type_buffer, sizeof(content_type_header) - 1);
-                content_type_header[sizeof(content_type_header) - 1] = '\0';
-            }
+        char content_type_header[MAX_HEADER_LENGTH] = { 0 };
+        if (get_content_type_from_path(path, content_type_header, sizeof(content_type_header))
+            == 0) {
             add_header(msg, "Content-Type", content_type_header);
         } else {
             fprintf(stderr, "Failed to get MIME type\n");
             return -5;
         }
-    } else if (!continuing && msg->body_fd == -1) {
+    } else {
         add_header(msg, "Content-Length", "0");
     }
 
-    char buf[MAX_HEADERS_SIZE] = { 0 }; // Buffer to write to the socket
-
-    if (build_header(msg, http_message_type, buf, sizeof(buf)) != 0) {
-        fprintf(stderr, "Failed to build header\n");
-        return -2;
-    }
-
-    int len = strlen(buf);
-
-    while (off < len) {
-        ssize_t n = send(sock_fd, buf, strlen(buf), 0);
-
-        if (n > 0) {
-            off += n;
-            continue;
-        }
-        if (n == -1) {
-            if (errno == EINTR) {
-                continue; // retry
-            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return off;
-            } else {
-                return -1;
-            }
-        }
-    }
-
     return 0;
 }
 
@@ -173,6 +111,16 @@ build_header(HTTP_MESSAGE *msg, int http_message_type, char *buf, int buf_size)
         ptr += strlen(ptr);
     }
 
+    if (msg->body_headers) {
+        if (msg->body_headers_length >= bytes_remaining) {
+            fprintf(stderr, "Not enough space for body headers\n");
+            return -5;
+        }
+        memcpy(ptr, msg->body_headers, msg->body_headers_length);
+        bytes_remaining -= msg->body_headers_length;
+        ptr += msg->body_headers_length;
+    }
+
     if (bytes_remaining >= 3) {
         snprintf(ptr, bytes_remaining, "\r\n");
     } else {
@@ -182,35 +130,3 @@ build_header(HTTP_MESSAGE *msg, int http_message_type, char *buf, int buf_size)
 
     return 0;
 }
-
-int
-build_and_send_body(HTTP_MESSAGE *msg, int sock_fd)
-{
-
-    // Check if msg->body_fd is valid
-    if (msg->body_fd == -1) {
-        fprintf(stderr, "Invalid body file descriptor\n");
-        return -1;
-    }
-
-    int bytes_remaining = get_file_length(msg->body_fd);
-
-    while (bytes_remaining > 0) {
-        ssize_t n = sendfile(sock_fd, msg->body_fd, NULL, bytes_remaining);
-
-        if (n == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return 1;
-            } else {
-                return -1;
-            }
-        } else if (n == 0) {
-            // Unexpected EOF
-            break;
-        } else {
-            bytes_remaining -= n;
-        }
-    }
-
-    return 0;
-}
@@ -1,23 +1,231 @@
+#define _GNU_SOURCE
 
 #include "http_lib.h"
 
+#define KNOWN_HEADER_SLOTS 128
+
+static const char *known_header_names[KNOWN_HEADER_COUNT] = {
+    [HEADER_ACCEPT] = "Accept",
+    [HEADER_ACCEPT_ENCODING] = "Accept-Encoding",
+    [HEADER_ACCEPT_LANGUAGE] = "Accept-Language",
+    [HEADER_ALLOW] = "Allow",
+    [HEADER_AUTHORIZATION] = "Authorization",
+    [HEADER_CACHE_CONTROL] = "Cache-Control",
+    [HEADER_CONNECTION] = "Connection",
+    [HEADER_CONTENT_ENCODING] = "Content-Encoding",
+    [HEADER_CONTENT_LENGTH] = "Content-Length",
+    [HEADER_CONTENT_TYPE] = "Content-Type",
+    [HEADER_COOKIE] = "Cookie",
+    [HEADER_DATE] = "Date",
+    [HEADER_ETAG] = "ETag",
+    [HEADER_EXPECT] = "Expect",
+    [HEADER_HOST] = "Host",
+    [HEADER_HTTP2_SETTINGS] = "HTTP2-Settings",
+    [HEADER_IF_MODIFIED_SINCE] = "If-Modified-Since",
+    [HEADER_IF_NONE_MATCH] = "If-None-Match",
+    [HEADER_KEEP_ALIVE] = "Keep-Alive",
+    [HEADER_LAST_MODIFIED] = "Last-Modified",
+    [HEADER_LOCATION] = "Location",
+    [HEADER_ORIGIN] = "Origin",
+    [HEADER_PROXY_CONNECTION] = "Proxy-Connection",
+    [HEADER_RANGE] = "Range",
+    [HEADER_REFERER] = "Referer",
+    [HEADER_RETRY_AFTER] = "Retry-After",
+    [HEADER_SEC_WEBSOCKET_ACCEPT] = "Sec-WebSocket-Accept",
+    [HEADER_SEC_WEBSOCKET_KEY] = "Sec-WebSocket-Key",
+    [HEADER_SEC_WEBSOCKET_VERSION] = "Sec-WebSocket-Version",
+    [HEADER_SERVER] = "Server",
+    [HEADER_SET_COOKIE] = "Set-Cookie",
+    [HEADER_TE] = "TE",
+    [HEADER_TRANSFER_ENCODING] = "Transfer-Encoding",
+    [HEADER_UPGRADE] = "Upgrade",
+    [HEADER_USER_AGENT] = "User-Agent",
+    [HEADER_VARY] = "Vary",
+};
+
+/*
+    Perfect hash of the well-known names, indexed by known_header_hash()
+
+    The hash is collision free over the names above. Adding a name means finding new
+    multipliers that keep it that way
+*/
+static const uint8_t known_header_slots[KNOWN_HEADER_SLOTS] = {
+    [0] = HEADER_COOKIE,
+    [4] = HEADER_SET_COOKIE,
+    [7] = HEADER_DATE,
+    [10] = HEADER_PROXY_CONNECTION,
+    [14] = HEADER_ETAG,
+    [15] = HEADER_CONNECTION,
+    [19] = HEADER_SEC_WEBSOCKET_ACCEPT,
+    [23] = HEADER_HTTP2_SETTINGS,
+    [29] = HEADER_TE,
+    [30] = HEADER_LOCATION,
+    [35] = HEADER_ACCEPT_LANGUAGE,
+    [37] = HEADER_IF_MODIFIED_SINCE,
+    [39] = HEADER_ORIGIN,
+    [41] = HEADER_ACCEPT_ENCODING,
+    [43] = HEADER_ACCEPT,
+    [47] = HEADER_EXPECT,
+    [49] = HEADER_LAST_MODIFIED,
+    [51] = HEADER_USER_AGENT,
+    [54] = HEADER_TRANSFER_ENCODING,
+    [55] = HEADER_SERVER,
+    [56] = HEADER_HOST,
+    [58] = HEADER_IF_NONE_MATCH,
+    [62] = HEADER_SEC_WEBSOCKET_VERSION,
+    [64] = HEADER_CACHE_CONTROL,
+    [68] = HEADER_AUTHORIZATION,
+    [79] = HEADER_UPGRADE,
+    [82] = HEADER_RANGE,
+    [85] = HEADER_VARY,
+    [103] = HEADER_RETRY_AFTER,
+    [104] = HEADER_CONTENT_ENCODING,
+    [107] = HEADER_SEC_WEBSOCKET_KEY,
+    [110] = HEADER_CONTENT_TYPE,
+    [113] = HEADER_CONTENT_LENGTH,
+    [115] = HEADER_REFERER,
+    [119] = HEADER_ALLOW,
+    [124] = HEADER_KEEP_ALIVE,
+};
+
+static unsigned int
+known_header_hash(const char *key, size_t length)
+{
+    unsigned int first = tolower((unsigned char) key[0]);
+    unsigned int last = tolower((unsigned char) key[length - 1]);
+
+    return (first + 3 * last + 61 * length) % KNOWN_HEADER_SLOTS;
+}
+
+/*
+    Classifies a header name (case-insensitive)
+
+    Returns its HTTP_KNOWN_HEADER, or HEADER_UNKNOWN
+*/
+int
+get_known_header_id(const char *key)
+{
+    size_t length = key ? strlen(key) : 0;
+
+    if (length == 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    int id = known_header_slots[known_header_hash(key, length)];
+
+    // Any name lands in some slot, only the one it was generated from matches it
+    if (id != HEADER_UNKNOWN && strcasecmp(known_header_names[id], key) != 0) {
+        return HEADER_UNKNOWN;
+    }
+
+    return id;
+}
+
+/*
+    Gets the value of a well-known header without searching, or NULL if the message has none
+*/
+const char *
+get_known_header(const HTTP_MESSAGE *msg, int id)
+{
+    if (!msg || id <= HEADER_UNKNOWN || id >= KNOWN_HEADER_COUNT || !msg->known_headers[id])
+        return NULL;
+
+    return msg->headers[msg->known_headers[id] - 1].value;
+}
+
 /*
     Gets the value of a header by key (case-insensitive)
+
+    Well-known names are looked up directly, only other names are searched for
 */
 const char *
-get_header_value(const HTTP_HEADER *header_array, const int header_length, const char *key)
+get_header_value(const HTTP_MESSAGE *msg, const char *key)
 {
-    if (!header_array || !key)
+    if (!msg || !key)
         return NULL;
 
-    for (int i = 0; i < header_length; i++) {
-        if (strcasecmp(header_array[i].key, key) == 0) {
-            return header_array[i].value;
+    int id = get_known_header_id(key);
+
+    if (id != HEADER_UNKNOWN) {
+        return get_known_header(msg, id);
+    }
+
+    for (int i = 0; i < msg->header_count; i++) {
+        if (strcasecmp(msg->headers[i].key, key) == 0) {
+            return msg->headers[i].value;
         }
     }
     return NULL;
 }
 
+/*
+    Records msg->headers[index] if it is the first occurrence of a well-known header
+
+    Called for every header added to the message
+*/
+void
+index_header(HTTP_MESSAGE *msg, int index)
+{
+    int id = get_known_header_id(msg->headers[index].key);
+
+    if (id != HEADER_UNKNOWN && !msg->known_headers[id]) {
+        msg->known_headers[id] = index + 1;
+    }
+}
+
+/*
+    Whether a value holds token in its comma separated list (case-insensitive)
+*/
+bool
+header_has_token(const char *value, const char *token)
+{
+    size_t token_length = strlen(token);
+
+    while (value && *value) {
+        while (*value == ' ' || *value == '\t' || *value == ',') {
+            value++;
+        }
+
+        size_t length = strcspn(value, ", \t");
+
+        if (length == token_length && strncasecmp(value, token, length) == 0) {
+            return true;
+        }
+        value += length;
+    }
+
+    return false;
+}
+
+/*
+    Gets the declared body length of a message
+
+    Returns the length, 0 when there is no Content-Length, or -1 when it is not a decimal number
+    a body length fits in
+*/
+long
+get_content_length(const HTTP_MESSAGE *msg)
+{
+    const char *value = get_known_header(msg, HEADER_CONTENT_LENGTH);
+
+    if (!value) {
+        return 0;
+    }
+
+    char *end = NULL;
+
+    errno = 0;
+    long length = strtol(value, &end, 10);
+
+    // Digits only, a proxy in front could read a sign, blanks or trailing junk differently
+    if (end == value || *end != '\0' || value[0] < '0' || value[0] > '9' || errno == ERANGE
+        || length > INT_MAX) {
+        return -1;
+    }
+
+    return length;
+}
+
 int
 get_mime_type_from_path(const char *path, char *buffer, int buffer_length)
 {
@@ -40,6 +248,14 @@ get_mime_type_from_path(const char *path, char *buffer, int buffer_length)
         strncpy(buffer, "image/jpeg", buffer_length);
     } else if (strcasecmp(ext, ".png") == 0) {
         strncpy(buffer, "image/png", buffer_length);
+    } else if (strcasecmp(ext, ".ico") == 0) {
+        strncpy(buffer, "image/x-icon", buffer_length);
+    } else if (strcasecmp(ext, ".css") == 0) {
+        strncpy(buffer, "text/css", buffer_length);
+    } else if (strcasecmp(ext, ".js") == 0) {
+        strncpy(buffer, "text/javascript", buffer_length);
+    } else if (strcasecmp(ext, ".svg") == 0) {
+        strncpy(buffer, "image/svg+xml", buffer_length);
     } else {
         strncpy(buffer, "application/octet-stream", buffer_length);
     }
@@ -47,6 +263,29 @@ get_mime_type_from_path(const char *path, char *buffer, int buffer_length)
     return 0;
 }
 
+/*
+    Gets the Content-Type value for a file, with a charset for text types
+*/
+int
+get_content_type_from_path(const char *path, char *buffer, int buffer_length)
+{
+    char mime_type_buffer[MAX_HEADER_LENGTH] = { 0 };
+
+    if (get_mime_type_from_path(path, mime_type_buffer, sizeof(mime_type_buffer)) != 0) {
+        return -1;
+    }
+
+    if (strncmp(mime_type_buffer, "text/", 5) == 0
+        || strcmp(mime_type_buffer, "application/json") == 0
+        || strcmp(mime_type_buffer, "application/xml") == 0) {
+        snprintf(buffer, buffer_length, "%s; charset=utf-8", mime_type_buffer);
+    } else {
+        snprintf(buffer, buffer_length, "%s", mime_type_buffer);
+    }
+
+    return 0;
+}
+
 /*
     Initializes an HTTP message
 
@@ -61,10 +300,34 @@ init_http_message()
     msg.body_fd = -1;
     memset(msg.body_path, 0, sizeof(msg.body_path));
     msg.body_length = 0;
+    msg.body_received = 0;
+    msg.buffered_length = 0;
+    msg.body_data = NULL;
+    msg.body_headers = NULL;
+    msg.body_headers_length = 0;
+    msg.body_release = NULL;
+    msg.body_owner = NULL;
 
     return msg;
 }
 
+/*
+    Hands an in-memory body back to its owner
+*/
+static void
+release_body_data(HTTP_MESSAGE *msg)
+{
+    if (msg->body_release) {
+        msg->body_release(msg->body_owner);
+    }
+
+    msg->body_data = NULL;
+    msg->body_headers = NULL;
+    msg->body_headers_length = 0;
+    msg->body_release = NULL;
+    msg->body_owner = NULL;
+}
+
 /*
     Frees the resources associated with an HTTP message
 
@@ -83,8 +346,13 @@ free_http_message(HTTP_MESSAGE *msg)
     }
 
     // Zero remaining fields for safety
+    msg->body_temp = false;
     msg->body_length = 0;
+    msg->body_received = 0;
+    msg->buffered_length = 0;
+    release_body_data(msg);
     msg->header_count = 0;
+    memset(msg->known_headers, 0, sizeof(msg->known_headers));
     memset(msg->body_path, 0, sizeof(msg->body_path));
 
     // Note: we do not touch headers/start_line memory beyond zeroing count; caller
@@ -102,30 +370,80 @@ add_header(HTTP_MESSAGE *msg, const char *key, const char *value)
     if (!msg || !key || !value)
         return -1;
 
+    int id = get_known_header_id(key);
+    int existing = -1;
+
+    // A well-known header's slot says whether it is already there, only others are searched for
+    if (id != HEADER_UNKNOWN) {
+        existing = msg->known_headers[id] - 1;
+    } else {
+        for (int i = 0; i < msg->header_count; i++) {
+            if (strcasecmp(msg->headers[i].key, key) == 0) {
+                existing = i;
+                break;
+            }
+        }
+    }
+
+    if (existing >= 0) {
+        strncpy(msg->headers[existing].value, value, MAX_HEADER_LENGTH - 1);
+        msg->headers[existing].value[MAX_HEADER_LENGTH - 1] = '\0';
+        return 0;
+    }
+
     if (msg->header_count >= MAX_HEADERS) {
         fprintf(stderr, "Max headers reached\n");
         return -2;
     }
 
-    // Check for existing matching headers
-    for (int i = 0; i < msg->header_count; i++) {
-        if (strcasecmp(msg->headers[i].key, key) == 0) {
-            strncpy(msg->headers[i].value, value, MAX_HEADER_LENGTH - 1);
-            msg->headers[i].value[MAX_HEADER_LENGTH - 1] = '\0';
-            return 0;
-        }
-    }
-
     // Add the new header
     strncpy(msg->headers[msg->header_count].key, key, MAX_HEADER_LENGTH - 1);
     msg->headers[msg->header_count].key[MAX_HEADER_LENGTH - 1] = '\0';
     strncpy(msg->headers[msg->header_count].value, value, MAX_HEADER_LENGTH - 1);
     msg->headers[msg->header_count].value[MAX_HEADER_LENGTH - 1] = '\0';
+    if (id != HEADER_UNKNOWN) {
+        msg->known_headers[id] = msg->header_count + 1;
+    }
     msg->header_count++;
 
     return 0;
 }
 
+/*
+    Removes every header matching key (case-insensitive)
+
+    Returns the number of headers removed
+*/
+int
+remove_header(HTTP_MESSAGE *msg, const char *key)
+{
+    if (!msg || !key)
+        return -1;
+
+    int removed = 0;
+
+    for (int i = 0; i < msg->header_count;) {
+        if (strcasecmp(msg->headers[i].key, key) == 0) {
+            memmove(&msg->headers[i], &msg->headers[i + 1],
+                    (msg->header_count - i - 1) * sizeof(HTTP_HEADER));
+            msg->header_count--;
+            removed++;
+        } else {
+            i++;
+        }
+    }
+
+    // Every header after a removed one moved, index them again
+    if (removed > 0) {
+        memset(msg->known_headers, 0, sizeof(msg->known_headers));
+        for (int i = 0; i < msg->header_count; i++) {
+            index_header(msg, i);
+        }
+    }
+
+    return removed;
+}
+
 int
 get_file_length(int fd)
 {
@@ -236,6 +554,7 @@ http_message_open_temp_file(HTTP_MESSAGE *msg, int body_length)
     unlink(temppath);
 
     http_message_set_body_fd(msg, fd, temppath, body_length);
+    msg->body_temp = true;
 
     return 0;
 }
@@ -271,7 +590,10 @@ http_message_set_body_fd(HTTP_MESSAGE *msg, int fd, const char *path, int body_l
 
     memset(msg->body_path, 0, sizeof(msg->body_path));
 
+    release_body_data(msg);
+
     msg->body_fd = fd;
+    msg->body_temp = false;
     msg->body_length = body_length;
 
     if (path) {
@@ -283,6 +605,35 @@ http_message_set_body_fd(HTTP_MESSAGE *msg, int fd, const char *path, int body_l
     return 0;
 }
 
+/*
+    Sets an in-memory body, closing the existing fd if open
+
+    The data and its pre-rendered headers are borrowed and must outlive the message.
+*/
+int
+http_message_set_body_data(HTTP_MESSAGE *msg, const char *data, int body_length,
+                           const char *headers, int headers_length)
+{
+    if (!msg || !data) {
+        return -1;
+    }
+
+    if (msg->body_fd != -1) {
+        close(msg->body_fd);
+        msg->body_fd = -1;
+    }
+
+    memset(msg->body_path, 0, sizeof(msg->body_path));
+    release_body_data(msg);
+
+    msg->body_data = data;
+    msg->body_length = body_length;
+    msg->body_headers = headers;
+    msg->body_headers_length = headers_length;
+
+    return 0;
+}
+
 int
 build_error_response(HTTP_MESSAGE *msg, int status_code, const char *status_message,
                      const char *json_error_message)
@@ -290,7 +641,8 @@ build_error_response(HTTP_MESSAGE *msg, int status_code, const char *status_mess
     if (!msg || status_code < 100 || status_code > 599 || !status_message)
         return -1;
 
-    // Clear the message structure
+    // Clear the message structure, letting go of any body it had
+    free_http_message(msg);
     memset(msg, 0, sizeof(HTTP_MESSAGE));
     *msg = init_http_message();
 
@@ -391,30 +743,31 @@ print_http_message(const HTTP_MESSAGE *msg, int http_message_type)
     printf("Body Path: %s\n", msg->body_path);
 
     printf("Body: ");
-    // Print the body content
+    // Print the start of the body content
     if (msg->body_length > 0) {
         // Read via the file descriptor (works even after unlink)
         if (msg->body_fd >= 0) {
-            // Rewind to start of file
-            if (lseek(msg->body_fd, 0, SEEK_SET) == -1) {
-                perror("lseek");
-            } else {
-                // Read directly from fd using read() system call
-                char body_buffer[8192];
-                ssize_t bytes_read;
-                while ((bytes_read = read(msg->body_fd, body_buffer, sizeof(body_buffer))) > 0) {
-                    fwrite(body_buffer, 1, (size_t) bytes_read, stdout);
-                }
-                if (bytes_read == -1) {
-                    perror("read body");
+            char body_buffer[PRINT_BODY_PREVIEW];
+            struct iovec iov = { .iov_base = body_buffer, .iov_len = sizeof(body_buffer) };
+
+            // Only what is already in the page cache, logging must not wait for the disk
+            ssize_t bytes_read = preadv2(msg->body_fd, &iov, 1, 0, RWF_NOWAIT);
+
+            if (bytes_read > 0) {
+                fwrite(body_buffer, 1, (size_t) bytes_read, stdout);
+                if (msg->body_length > bytes_read) {
+                    printf("... (%d more bytes)", msg->body_length - (int) bytes_read);
                 }
+            } else if (bytes_read == -1 && errno == EAGAIN) {
+                printf("(not in the page cache)");
+            } else if (bytes_read == -1) {
+                perror("read body");
             }
 
-            // Rewind file
+            // Rewind file, a body just written or spooled is read and sent from the start
             if (lseek(msg->body_fd, 0, SEEK_SET) == -1) {
                 perror("lseek");
             }
-
         } else {
             printf("(no body fd available)");
         }
@@ -484,7 +837,13 @@ get_value_from_http_status_code(uint32_t status_code, char *buffer, int buffer_l
         return snprintf(buffer, buffer_length, "415");
     case STATUS_INTERNAL_SERVER_ERROR:
         return snprintf(buffer, buffer_length, "500");
+    case STATUS_BAD_GATEWAY:
+        return snprintf(buffer, buffer_length, "502");
     default:
+        // Codes without an enum entry (e.g. relayed from an upstream) are still valid
+        if (status_code >= 100 && status_code <= 599) {
+            return snprintf(buffer, buffer_length, "%u", status_code);
+        }
         return snprintf(buffer, buffer_length, "???");
     }
 }
@@ -551,8 +910,17 @@ set_http_status_code_from_string(const char *str, uint32_t *status_code)
         *status_code = STATUS_UNSUPPORTED_MEDIA_TYPE;
     } else if (strcmp(str, "500") == 0) {
         *status_code = STATUS_INTERNAL_SERVER_ERROR;
+    } else if (strcmp(str, "502") == 0) {
+        *status_code = STATUS_BAD_GATEWAY;
     } else {
-        *status_code = -1; // Unknown status code
+        char *end = NULL;
+        long code = strtol(str, &end, 10);
+
+        if (end != str && *end == '\0' && code >= 100 && code <= 599) {
+            *status_code = (uint32_t) code;
+        } else {
+            *status_code = HTTP_STATUS_CODE_UNKNOWN;
+        }
     }
 
     return 0;
@@ -3,7 +3,10 @@
 
 #include "macros.h"
 #include "random.h"
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -11,6 +14,7 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 /***************************
@@ -36,6 +40,8 @@
 
 #define MAX_HEADERS_SIZE (MAX_HEADERS * MAX_HEADER_LENGTH) + MAX_START_LINE_SIZE
 
+#define PRINT_BODY_PREVIEW 1 * KB // Body bytes print_http_message() shows
+
 enum HTTP_MESSAGE_TYPE
 {
     REQUEST,
@@ -45,6 +51,8 @@ enum HTTP_MESSAGE_TYPE
 
 enum HTTP_STATUS_CODE
 {
+    STATUS_CONTINUE = 100,
+    STATUS_SWITCHING_PROTOCOLS = 101,
     STATUS_OK = 200,
     STATUS_NO_CONTENT = 204,
     STATUS_BAD_REQUEST = 400,
@@ -52,8 +60,17 @@ enum HTTP_STATUS_CODE
     STATUS_NOT_FOUND = 404,
     STATUS_METHOD_NOT_ALLOWED = 405,
     STATUS_REQUEST_TIMEOUT = 408,
+    STATUS_CONTENT_TOO_LARGE = 413,
     STATUS_UNSUPPORTED_MEDIA_TYPE = 415,
+    STATUS_EXPECTATION_FAILED = 417,
+    STATUS_UPGRADE_REQUIRED = 426,
+    STATUS_TOO_MANY_REQUESTS = 429,
     STATUS_INTERNAL_SERVER_ERROR = 500,
+    STATUS_NOT_IMPLEMENTED = 501,
+    STATUS_BAD_GATEWAY = 502,
+    STATUS_SERVICE_UNAVAILABLE = 503,
+    STATUS_GATEWAY_TIMEOUT = 504,
+    STATUS_HTTP_VERSION_NOT_SUPPORTED = 505,
     HTTP_STATUS_CODE_UNKNOWN = 999
 };
 
@@ -74,6 +91,54 @@ enum HTTP_PROTOCOL
     HTTP_PROTOCOL_UNKNOWN
 };
 
+/*
+    Well-known header names
+
+    The parser classifies every header name against these, and HTTP_MESSAGE records where each
+    one is so it can be read without searching. See get_known_header()
+*/
+enum HTTP_KNOWN_HEADER
+{
+    HEADER_UNKNOWN, // Any other name, found by searching
+    HEADER_ACCEPT,
+    HEADER_ACCEPT_ENCODING,
+    HEADER_ACCEPT_LANGUAGE,
+    HEADER_ALLOW,
+    HEADER_AUTHORIZATION,
+    HEADER_CACHE_CONTROL,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_ENCODING,
+    HEADER_CONTENT_LENGTH,
+    HEADER_CONTENT_TYPE,
+    HEADER_COOKIE,
+    HEADER_DATE,
+    HEADER_ETAG,
+    HEADER_EXPECT,
+    HEADER_HOST,
+    HEADER_HTTP2_SETTINGS,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_IF_NONE_MATCH,
+    HEADER_KEEP_ALIVE,
+    HEADER_LAST_MODIFIED,
+    HEADER_LOCATION,
+    HEADER_ORIGIN,
+    HEADER_PROXY_CONNECTION,
+    HEADER_RANGE,
+    HEADER_REFERER,
+    HEADER_RETRY_AFTER,
+    HEADER_SEC_WEBSOCKET_ACCEPT,
+    HEADER_SEC_WEBSOCKET_KEY,
+    HEADER_SEC_WEBSOCKET_VERSION,
+    HEADER_SERVER,
+    HEADER_SET_COOKIE,
+    HEADER_TE,
+    HEADER_TRANSFER_ENCODING,
+    HEADER_UPGRADE,
+    HEADER_USER_AGENT,
+    HEADER_VARY,
+    KNOWN_HEADER_COUNT
+};
+
 /*
     HTTP Request Start Line Struct
 
@@ -122,14 +187,41 @@ typedef struct
     char value[MAX_HEADER_LENGTH];
 } HTTP_HEADER;
 
+struct arena;
+
+/*
+    HTTP Credentials Struct
+
+    The process on the other end of a Unix socket connection, as the kernel saw it connect.
+    known is false for clients on TCP.
+*/
+typedef struct
+{
+    bool known;
+    int32_t pid;
+    uint32_t uid;
+    uint32_t gid;
+} HTTP_CREDENTIALS;
+
 typedef struct
 {
     HTTP_START_LINE start_line;
     HTTP_HEADER headers[MAX_HEADERS];
     int header_count;
+    uint8_t known_headers[KNOWN_HEADER_COUNT]; // 1 + index of each well-known header, 0 if absent
     int body_fd;                             // file descriptor for body contents
+    bool body_temp;                          // body_fd is a temp file, see memory_budget.c
     char body_path[MAX_HTTP_BODY_FILE_PATH]; // optional file path
     int body_length;                         // length of body in bytes
+    int body_received;                       // body bytes consumed so far
+    int buffered_length;                     // body bytes left in the header parse buffer
+    const char *body_data;    // In-memory body used instead of body_fd, not owned by the message
+    const char *body_headers; // Pre-rendered "Key: value\r\n" lines describing body_data
+    int body_headers_length;
+    void (*body_release)(void *owner); // Called once body_data is no longer needed, or NULL
+    void *body_owner;
+    HTTP_CREDENTIALS credentials; // Client process of a request on a Unix socket
+    struct arena *arena;          // Memory that lasts until the response is out, or NULL
 } HTTP_MESSAGE;
 
 /* HTTP_MESSAGE struct helper functions */
@@ -137,10 +229,14 @@ HTTP_MESSAGE init_http_message();
 void free_http_message(HTTP_MESSAGE *msg);
 int get_file_length(int fd);
 int add_header(HTTP_MESSAGE *msg, const char *key, const char *value);
+int remove_header(HTTP_MESSAGE *msg, const char *key);
+void index_header(HTTP_MESSAGE *msg, int index);
 int http_message_open_existing_file(HTTP_MESSAGE *msg, const char *path, int oflags,
                                     bool is_abspath);
 int http_message_open_temp_file(HTTP_MESSAGE *msg, int body_length);
 int http_message_set_body_fd(HTTP_MESSAGE *msg, int fd, const char *path, int body_length);
+int http_message_set_body_data(HTTP_MESSAGE *msg, const char *data, int body_length,
+                               const char *headers, int headers_length);
 int build_error_response(HTTP_MESSAGE *msg, int status_code, const char *status_message,
                          const char *json_error_message);
 void print_http_message(const HTTP_MESSAGE *msg, int http_message_type);
@@ -154,8 +250,12 @@ int set_http_method_from_string(const char *str, uint32_t *method);
 int set_http_status_code_from_string(const char *str, uint32_t *status_code);
 
 /* HTTP_HEADER functions */
-const char *get_header_value(const HTTP_HEADER *header_array, const int header_length,
-                             const char *key);
+int get_known_header_id(const char *key);
+const char *get_known_header(const HTTP_MESSAGE *msg, int id);
+const char *get_header_value(const HTTP_MESSAGE *msg, const char *key);
+bool header_has_token(const char *value, const char *token);
+long get_content_length(const HTTP_MESSAGE *msg);
 
 /* Other helper functions*/
-int get_mime_type_from_path(const char *path, char *buffer, int buffer_length);
\ No newline at end of file
+int get_mime_type_from_path(const char *path, char *buffer, int buffer_length);
+int get_content_type_from_path(const char *path, char *buffer, int buffer_length);
@@ -142,74 +142,110 @@ parse_header(char *line, HTTP_HEADER *header)
 }
 
 /*
-    Streams the HTTP body from an input socket fd to an output file descriptor
+    Copies the rest of the body from the socket into the message's body file through buffer
 
-    This function assumes that in_fd (socket descriptor) and out_fd (file descriptor) are valid
+    Progress is kept in message->body_received. Returns 0 once the whole body is stored, 1 when
+    the socket would block, or <0 on failure
 */
 int
-parse_body_stream(int sock_fd, int content_length, char *buffer, int buffer_size, int file_fd)
+parse_body_stream(HTTP_MESSAGE *message, int sock_fd, char *buffer, int buffer_size)
 {
-    if (sock_fd < 0 || file_fd < 0 || content_length < 0) {
-        fprintf(stderr, "Invalid arguments to parse_body_stream()\n");
-        return -1;
-    }
-
-    if (content_length == 0)
-        return 0;
+    while (message->body_received < message->body_length) {
+        ssize_t r = recv(sock_fd, buffer,
+                         MIN(message->body_length - message->body_received, buffer_size), 0);
 
-    // Get the size of the file
-    int current_file_length = get_file_length(file_fd);
+        if (r == 0) {
+            fprintf(stderr, "Unexpected EOF while reading body\n");
+            return -2;
+        }
 
-    if (current_file_length < 0) {
-        fprintf(stderr, "Failed to get file length\n");
-        return -1;
-    }
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            } else if (errno == EINTR) {
+                continue;
+            }
 
-    int remaining = content_length - current_file_length;
+            perror("read failed");
+            return -3;
+        }
 
-    if (buffer && strlen(buffer) > 0) {
-        // Write the remaining contents of the current buffer to the file
-        size_t written = write(file_fd, buffer, strlen(buffer));
-        if (written != strlen(buffer)) {
+        if (write(message->body_fd, buffer, r) != r) {
             perror("write failed");
             return -4;
         }
-        remaining -= written;
+
+        message->body_received += (int) r;
     }
 
-    while (remaining > 0) {
-        size_t to_read = remaining > (int) buffer_size ? (size_t) buffer_size : (size_t) remaining;
-        ssize_t r = recv(sock_fd, buffer, to_read, 0);
+    return 0;
+}
 
-        if (r == 0) {
+/*
+    Moves the rest of the body from the socket into the message's body file with splice()
+
+    Bytes go socket -> pipe -> file without being copied to user space, a pipe's capacity at a
+    time. Every batch is drained into the file before the next is read, so the pipe is empty
+    whenever this returns. Returns like parse_body_stream()
+*/
+int
+splice_body_stream(HTTP_MESSAGE *message, int sock_fd, const int pipe_fds[2])
+{
+    while (message->body_received < message->body_length) {
+        ssize_t in = splice(sock_fd, NULL, pipe_fds[1], NULL,
+                            message->body_length - message->body_received,
+                            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+        if (in == 0) {
             fprintf(stderr, "Unexpected EOF while reading body\n");
             return -2;
         }
 
-        if (r == -1) {
-
+        if (in == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return 1;
+            } else if (errno == EINTR) {
+                continue;
             }
 
-            perror("read failed");
+            perror("splice from socket");
             return -3;
         }
 
-        size_t written = write(file_fd, buffer, r);
-        if ((ssize_t) written != r) {
-            perror("write failed");
-            return -4;
+        for (ssize_t left = in; left > 0;) {
+            ssize_t out = splice(pipe_fds[0], NULL, message->body_fd, NULL, left, SPLICE_F_MOVE);
+
+            if (out == -1 && errno == EINTR) {
+                continue;
+            } else if (out <= 0) {
+                perror("splice to body file");
+                return -4;
+            }
+            left -= out;
         }
 
-        remaining -= (int) r;
+        message->body_received += (int) in;
     }
 
-    if (fsync(file_fd) != 0) {
-        perror("fsync");
-        return -5;
+    return 0;
+}
+
+/*
+    Opens the pipe a connection splices request bodies through
+
+    Returns 0, or -1 if the body has to be copied instead
+*/
+static int
+open_body_pipe(int pipe_fds[2])
+{
+    if (pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("pipe2");
+        pipe_fds[0] = pipe_fds[1] = -1;
+        return -1;
     }
 
+    // Best effort, above /proc/sys/fs/pipe-max-size the default capacity is kept
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, BODY_PIPE_SIZE);
     return 0;
 }
 
@@ -246,7 +282,7 @@ parse_http_headers(HTTP_MESSAGE *message, char *buffer, int buffer_size, int cli
 
         if (message->header_count >= MAX_HEADERS) {
             fprintf(stderr, "Maximum header count exceeded\n");
-            break;
+            return -1;
         }
 
         while (bytes_received > 0) {
@@ -271,8 +307,10 @@ parse_http_headers(HTTP_MESSAGE *message, char *buffer, int buffer_size, int cli
                 current_buffer_length = strlen(buffer);
 
                 memmove(buffer, crlf + 1, bytes_received - current_buffer_length);
-                bytes_received -= current_buffer_length;
+                bytes_received -= current_buffer_length + 1;
 
+                // Whatever follows the blank line already belongs to the body
+                message->buffered_length = bytes_received;
                 end_of_header = 1;
 
                 break;
@@ -291,10 +329,15 @@ parse_http_headers(HTTP_MESSAGE *message, char *buffer, int buffer_size, int cli
                 }
                 is_start_line = 0;
             } else {
-                if (parse_header(buffer, &message->headers[message->header_count++]) < 0) {
+                if (message->header_count >= MAX_HEADERS) {
+                    fprintf(stderr, "Maximum header count exceeded\n");
+                    return -1;
+                }
+                if (parse_header(buffer, &message->headers[message->header_count]) < 0) {
                     fprintf(stderr, "Failed to parse header: '%s'\n", buffer);
                     return -1;
                 }
+                index_header(message, message->header_count++);
             }
 
             // Remove the processed line from the buffer
@@ -307,23 +350,32 @@ parse_http_headers(HTTP_MESSAGE *message, char *buffer, int buffer_size, int cli
         }
     }
 
+    // The peer closed the connection before completing the header block
+    if (!end_of_header) {
+        return -2;
+    }
+
     return 0;
 }
 
+/*
+    Stores the request body in a temp file, resumable after EAGAIN with continuing set
+
+    Bodies of at least BODY_SPLICE_MIN bytes are spliced through pipe_fds, opened on first use
+    and kept by the caller for later requests. Without pipe_fds the body is always copied.
+*/
 int
 parse_http_body(HTTP_MESSAGE *message, char *buffer, int buffer_size, int client_fd,
-                bool continuing)
+                bool continuing, int pipe_fds[2])
 {
     int return_code = 0;
+    long content_length = get_content_length(message);
 
-    const char *content_length
-        = get_header_value(message->headers, message->header_count, "Content-Length");
-
-    if (content_length) {
-        message->body_length = atoi(content_length);
-    } else {
-        message->body_length = 0;
+    if (content_length < 0) {
+        fprintf(stderr, "Invalid Content-Length\n");
+        return -1;
     }
+    message->body_length = (int) content_length;
 
     // We always require the sender to specify Content-Length or we dont accept a body
     if (message->body_length > 0) {
@@ -336,14 +388,108 @@ parse_http_body(HTTP_MESSAGE *message, char *buffer, int buffer_size, int client
             }
         }
 
-        // Parse the body
-        if ((return_code = parse_body_stream(client_fd, message->body_length, buffer, buffer_size,
-                                             message->body_fd))
-            < 0) {
+        // Body bytes read along with the headers go first
+        if (message->buffered_length > 0) {
+            int length = MIN(message->buffered_length, message->body_length);
+
+            if (write(message->body_fd, buffer, length) != length) {
+                perror("write failed");
+                return -1;
+            }
+            message->body_received += length;
+            message->buffered_length = 0;
+        }
+
+        if (pipe_fds && message->body_length - message->body_received >= BODY_SPLICE_MIN
+            && (pipe_fds[0] != -1 || open_body_pipe(pipe_fds) == 0)) {
+            return_code = splice_body_stream(message, client_fd, pipe_fds);
+        } else {
+            return_code = parse_body_stream(message, client_fd, buffer, buffer_size);
+        }
+
+        if (return_code < 0) {
             fprintf(stderr, "Failed to parse body. Return code: %d\n", return_code);
             return -1;
         }
     }
 
     return return_code;
-}
\ No newline at end of file
+}
+/*
+    Streams the HTTP body from the socket into a chunk callback instead of a file
+
+    Body bytes already read past the header block are delivered first. Progress is kept in
+    message->body_received so the call can be resumed after EAGAIN or a pause.
+
+    Returns:
+        0 - the whole body has been delivered
+        1 - the socket would block, wait for EPOLLIN
+        2 - the callback asked to pause reading
+        <0 - error (-6 when the callback rejected the body)
+*/
+int
+parse_http_body_chunks(HTTP_MESSAGE *message, char *buffer, int buffer_size, int client_fd,
+                       body_chunk_callback callback, void *ctx)
+{
+    if (!message || !buffer || buffer_size <= 0 || !callback) {
+        fprintf(stderr, "Invalid arguments to parse_http_body_chunks()\n");
+        return -1;
+    }
+
+    long content_length = get_content_length(message);
+
+    if (content_length < 0) {
+        fprintf(stderr, "Invalid Content-Length\n");
+        return -1;
+    }
+    message->body_length = (int) content_length;
+
+    int remaining = message->body_length - message->body_received;
+    int ret;
+
+    if (message->buffered_length > 0) {
+        int chunk_length = MIN(message->buffered_length, remaining);
+
+        message->buffered_length = 0;
+
+        if (chunk_length > 0) {
+            message->body_received += chunk_length;
+            remaining -= chunk_length;
+
+            if ((ret = callback(ctx, buffer, chunk_length)) < 0) {
+                return -6;
+            } else if (ret > 0 && remaining > 0) {
+                return 2;
+            }
+        }
+    }
+
+    while (remaining > 0) {
+        ssize_t r = recv(client_fd, buffer, MIN(remaining, buffer_size), 0);
+
+        if (r == 0) {
+            fprintf(stderr, "Unexpected EOF while reading body\n");
+            return -2;
+        }
+
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 1;
+            }
+
+            perror("recv failed");
+            return -3;
+        }
+
+        message->body_received += (int) r;
+        remaining -= (int) r;
+
+        if ((ret = callback(ctx, buffer, (int) r)) < 0) {
+            return -6;
+        } else if (ret > 0 && remaining > 0) {
+            return 2;
+        }
+    }
+
+    return 0;
+}
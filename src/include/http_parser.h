@@ -2,12 +2,23 @@
 #pragma once
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
 #include "http_lib.h"
 
+#define BODY_SPLICE_MIN (64 * KB) // Smaller bodies are copied, a pipe is not worth it for them
+#define BODY_PIPE_SIZE (1 * MB)   // Requested capacity of the body pipe, the splice() batch
+
+/*
+    Receives one chunk of a streamed body
+
+    Returns 0 to keep reading, 1 to pause reading and <0 to reject the body
+*/
+typedef int (*body_chunk_callback)(void *ctx, const char *chunk, int chunk_length);
+
 // HTTP struct helper functions
 const char *read_crlf_line(const char *str, char *buffer, size_t bufsize);
 
@@ -16,10 +27,14 @@ int parse_start_line(char *line, HTTP_START_LINE *start_line, int http_message_t
 
 int parse_header(char *line, HTTP_HEADER *header);
 
-int parse_body_stream(int in_fd, int content_length, char *buffer, int buffer_size, int out_fd);
+int parse_body_stream(HTTP_MESSAGE *message, int sock_fd, char *buffer, int buffer_size);
+int splice_body_stream(HTTP_MESSAGE *message, int sock_fd, const int pipe_fds[2]);
 
 int parse_http_headers(HTTP_MESSAGE *message, char *buffer, int buffer_size, int client_fd,
                        bool continuing, int http_message_type);
 
 int parse_http_body(HTTP_MESSAGE *message, char *buffer, int buffer_size, int client_fd,
-                    bool continuing);
\ No newline at end of file
+                    bool continuing, int pipe_fds[2]);
+
+int parse_http_body_chunks(HTTP_MESSAGE *message, char *buffer, int buffer_size, int client_fd,
+                           body_chunk_callback callback, void *ctx);
@@ -3,6 +3,10 @@
 
 #define PORT "8080"
 
+// Listen on TCP PORT, on a Unix stream socket at UNIX_SOCKET_PATH ("" for none), or both
+#define TCP_LISTEN_ENABLED true
+#define UNIX_SOCKET_PATH "Build/server.sock"
+
 #define KB (1024)
 #define MB (1024 * KB)
 #define GB (1024 * MB)
@@ -10,4 +14,41 @@
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
 
-#define STATIC_PATH_STR "./static/"
\ No newline at end of file
+#define STATIC_PATH_STR "./static/"
+#define STATIC_PACK_PATH "Build/static.pack" // Written by "make pack", optional
+#define UPLOAD_PATH_STR "./uploads/"           // Where /upload writes file parts
+
+#define SERVER_NAME "HttpServer"
+
+// Terminate TLS on the listener, see "make certs" for a self-signed pair
+#define TLS_ENABLED false
+#define TLS_CERT_FILE "tls/cert.pem"
+#define TLS_KEY_FILE "tls/key.pem"
+
+// Spin on epoll_wait() instead of sleeping in it, trading a core for wakeup latency
+#define BUSY_POLL_ENABLED false
+
+// Timestamp every request's phases, SIGUSR1 dumps the last few thousand, see "make traceview"
+#define TRACE_ENABLED true
+#define TRACE_DUMP_PATH "Build/trace.bin"
+
+// USDT probes for bpftrace and perf, see probes.h; needs <sys/sdt.h>, costs a NOP per probe
+#define USDT_ENABLED true
+
+// Per-client token buckets, see rate_limit.h; turn off to benchmark from a single address
+#define RATE_LIMIT_ENABLED true
+
+// Accept HTTP/2 over cleartext, with prior knowledge or through "Upgrade: h2c"
+#define HTTP2_CLEARTEXT true
+
+// Server-Sent Events: GET SSE_ROUTE_PREFIX<channel> subscribes, POST publishes the body
+#define SSE_ROUTE_PREFIX "/events/"
+// Disconnect SSE subscribers whose queue is full instead of dropping the events they miss
+#define SSE_DISCONNECT_SLOW_CONSUMERS false
+
+// Reverse proxy: requests under PROXY_ROUTE_PREFIX are forwarded to PROXY_UPSTREAM_ADDRESS
+#define PROXY_ROUTE_PREFIX "/app/"
+#define PROXY_UPSTREAM_NAME "app"
+#define PROXY_UPSTREAM_ADDRESS "127.0.0.1:9000" // "host:port" or "unix:/path/to.sock"
+// Seconds an upstream may take to connect, or go without a byte in either direction once it has
+#define PROXY_UPSTREAM_TIMEOUT 30
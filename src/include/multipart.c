@@ -0,0 +1,424 @@
+/*
+    Streaming multipart/form-data parser
+
+    Parses a body as it arrives, in chunks of any size, and hands each part's contents to a
+    callback as pointers into those chunks, so uploads go from the receive buffer straight to
+    their destination without being stored whole or copied first.
+
+    Part contents are searched for the "\r\n--boundary" delimiter with Boyer-Moore-Horspool,
+    which for a 40-odd byte boundary looks at only a few bytes of every delimiter length. A
+    delimiter split between two chunks is caught by holding back the tail of a chunk from the
+    first '\r' that could start one, at most a delimiter's length. Part headers are collected
+    into a small block and read line by line with parse_header().
+*/
+
+#define _GNU_SOURCE
+
+#include "multipart.h"
+
+/*
+    Reads parameter out of a header value such as
+        form-data; name="field"; filename="a.txt"
+    Quoted values may escape characters with a backslash, and are cut short at size - 1 bytes.
+
+    Returns 0, or -1 when the parameter is absent
+*/
+static int
+header_parameter(const char *value, const char *parameter, char *out, size_t size)
+{
+    size_t parameter_length = strlen(parameter);
+    const char *p = value + strcspn(value, ";");
+
+    while (*p == ';') {
+        p++;
+        p += strspn(p, " \t");
+
+        const char *key = p;
+        size_t key_length = strcspn(p, "=; \t");
+        bool match = key_length == parameter_length
+                     && strncasecmp(key, parameter, parameter_length) == 0;
+        size_t n = 0;
+
+        p += key_length;
+        p += strspn(p, " \t");
+
+        if (*p == '=') {
+            p++;
+            p += strspn(p, " \t");
+
+            if (*p == '"') {
+                for (p++; *p && *p != '"'; p++) {
+                    if (*p == '\\' && p[1]) {
+                        p++;
+                    }
+                    if (match && n + 1 < size) {
+                        out[n++] = *p;
+                    }
+                }
+                p += *p == '"';
+            } else {
+                for (; *p && *p != ';' && *p != ' ' && *p != '\t'; p++) {
+                    if (match && n + 1 < size) {
+                        out[n++] = *p;
+                    }
+                }
+            }
+        }
+
+        if (match) {
+            out[n] = '\0';
+            return 0;
+        }
+
+        p += strcspn(p, ";");
+    }
+
+    return -1;
+}
+
+/*
+    Copies the boundary of a multipart/form-data Content-Type into boundary
+
+    Returns 0, or -1 when the type is another one or the boundary is missing or too long
+*/
+int
+multipart_boundary(const char *content_type, char *boundary, size_t size)
+{
+    static const char type[] = "multipart/form-data";
+    char parameter[MULTIPART_MAX_BOUNDARY + 2];
+
+    if (!content_type || strncasecmp(content_type, type, sizeof(type) - 1) != 0
+        || (content_type[sizeof(type) - 1] != ';' && content_type[sizeof(type) - 1] != ' ')) {
+        return -1;
+    }
+
+    if (header_parameter(content_type, "boundary", parameter, sizeof(parameter)) != 0) {
+        return -1;
+    }
+
+    size_t length = strlen(parameter);
+
+    if (length == 0 || length > MULTIPART_MAX_BOUNDARY || length >= size) {
+        return -1;
+    }
+
+    memcpy(boundary, parameter, length + 1);
+    return 0;
+}
+
+/*
+    Sets up parser for a body split by boundary
+
+    The body starts with the delimiter itself, so parsing begins as if a CRLF came first.
+    Returns 0, or -1 for a boundary that is empty or too long
+*/
+int
+multipart_init(struct multipart_parser *parser, const char *boundary,
+               const struct multipart_callbacks *callbacks)
+{
+    size_t boundary_length = strlen(boundary);
+
+    if (boundary_length == 0 || boundary_length > MULTIPART_MAX_BOUNDARY) {
+        fprintf(stderr, "Invalid multipart boundary\n");
+        return -1;
+    }
+
+    parser->state = MULTIPART_PREAMBLE;
+    parser->callbacks = *callbacks;
+    parser->delimiter_length
+        = snprintf(parser->delimiter, sizeof(parser->delimiter), "\r\n--%s", boundary);
+
+    // How far the window can move when its last byte is c, so that no match is skipped
+    int n = parser->delimiter_length;
+
+    memset(parser->skip, n, sizeof(parser->skip));
+    for (int i = 0; i < n - 1; i++) {
+        parser->skip[(unsigned char) parser->delimiter[i]] = n - 1 - i;
+    }
+
+    memcpy(parser->carry, "\r\n", 2);
+    parser->carry_length = 2;
+    parser->header_length = 0;
+    memset(&parser->part, 0, sizeof(parser->part));
+
+    return 0;
+}
+
+/*
+    Offset of the first delimiter in data, or -1
+*/
+static int
+find_delimiter(const struct multipart_parser *parser, const char *data, int length)
+{
+    int n = parser->delimiter_length;
+    char last = parser->delimiter[n - 1];
+
+    for (int i = 0; i + n <= length; i += parser->skip[(unsigned char) data[i + n - 1]]) {
+        if (data[i + n - 1] == last && memcmp(data + i, parser->delimiter, n - 1) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+    Passes part contents on, the preamble goes nowhere
+*/
+static int
+emit(struct multipart_parser *parser, const char *data, int length)
+{
+    if (parser->state != MULTIPART_BODY || length == 0) {
+        return 0;
+    }
+
+    parser->part.length += length;
+    return parser->callbacks.part_data(parser->callbacks.ctx, &parser->part, data, length) < 0
+               ? -1
+               : 0;
+}
+
+static int
+end_part(struct multipart_parser *parser)
+{
+    bool in_part = parser->state == MULTIPART_BODY;
+
+    parser->state = MULTIPART_DELIMITER;
+
+    if (in_part && parser->callbacks.part_end(parser->callbacks.ctx, &parser->part) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Passes on contents up to the next delimiter, consuming it too if it is there
+
+    Returns the bytes of data used, or -1 when a callback failed
+*/
+static int
+scan_contents(struct multipart_parser *parser, const char *data, int length)
+{
+    int n = parser->delimiter_length;
+    int at;
+
+    // A delimiter may have started in the tail held back from the last chunk
+    if (parser->carry_length > 0) {
+        int carried = parser->carry_length;
+        int take = MIN(length, n - 1);
+
+        memcpy(parser->carry + carried, data, take);
+        at = find_delimiter(parser, parser->carry, carried + take);
+
+        if (at != -1) {
+            parser->carry_length = 0;
+            if (emit(parser, parser->carry, at) != 0 || end_part(parser) != 0) {
+                return -1;
+            }
+            return at + n - carried;
+        }
+
+        // Too short to tell yet, all of data is held back with it
+        if (carried + take < n) {
+            parser->carry_length += take;
+            return take;
+        }
+
+        // A delimiter may still start at a later '\r' of the carry, only what comes before it
+        // is contents, and the rest is looked at again together with data
+        int viable = 1;
+
+        while (viable < carried
+               && memcmp(parser->carry + viable, parser->delimiter,
+                         MIN(n, carried + take - viable))
+                      != 0) {
+            viable++;
+        }
+
+        if (emit(parser, parser->carry, viable) != 0) {
+            return -1;
+        }
+
+        parser->carry_length = carried - viable;
+        if (parser->carry_length > 0) {
+            memmove(parser->carry, parser->carry + viable, parser->carry_length);
+            return 0;
+        }
+    }
+
+    at = find_delimiter(parser, data, length);
+    if (at != -1) {
+        if (emit(parser, data, at) != 0 || end_part(parser) != 0) {
+            return -1;
+        }
+        return at + n;
+    }
+
+    // Hold back a tail that could be the start of a delimiter, which begins with '\r'
+    int tail = MAX(length - (n - 1), 0);
+    const char *cr = memchr(data + tail, '\r', length - tail);
+    int kept = cr ? length - (int) (cr - data) : 0;
+
+    if (emit(parser, data, length - kept) != 0) {
+        return -1;
+    }
+
+    memcpy(parser->carry, data + length - kept, kept);
+    parser->carry_length = kept;
+    return length;
+}
+
+/*
+    Reads the part's name, filename and type out of its complete header block
+*/
+static int
+parse_part_headers(struct multipart_parser *parser)
+{
+    struct multipart_part *part = &parser->part;
+    bool disposition = false;
+
+    memset(part, 0, sizeof(*part));
+
+    // The block is the CRLF ending the delimiter line, then one CRLF-terminated line per header
+    for (char *line = parser->header_block + 2; *line; line = strstr(line, "\r\n") + 2) {
+        HTTP_HEADER *header = &parser->header;
+
+        if (parse_header(line, header) != 0) {
+            return -1;
+        }
+
+        if (strcasecmp(header->key, "Content-Disposition") == 0) {
+            disposition = header_parameter(header->value, "name", part->name, sizeof(part->name))
+                          == 0;
+            header_parameter(header->value, "filename", part->filename, sizeof(part->filename));
+        } else if (strcasecmp(header->key, "Content-Type") == 0) {
+            size_t length = MIN(strlen(header->value), sizeof(part->content_type) - 1);
+
+            memcpy(part->content_type, header->value, length);
+            part->content_type[length] = '\0';
+        }
+    }
+
+    if (!disposition) {
+        fprintf(stderr, "Multipart part without a Content-Disposition name\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Adds to the part's header block, starting the part once the blank line ending it arrives
+
+    Returns the bytes of data used, or -1
+*/
+static int
+collect_headers(struct multipart_parser *parser, const char *data, int length)
+{
+    int old = parser->header_length;
+    int take = MIN(length, MULTIPART_MAX_HEADERS_SIZE - old);
+    int from = MAX(old - 3, 0);
+
+    memcpy(parser->header_block + old, data, take);
+    parser->header_length += take;
+    parser->header_block[parser->header_length] = '\0';
+
+    char *end = memmem(parser->header_block + from, parser->header_length - from, "\r\n\r\n", 4);
+
+    if (!end) {
+        if (parser->header_length == MULTIPART_MAX_HEADERS_SIZE) {
+            fprintf(stderr, "Multipart part headers too large\n");
+            return -1;
+        }
+        return take;
+    }
+
+    int used = (int) (end + 4 - parser->header_block) - old;
+
+    end[2] = '\0';
+    if (parse_part_headers(parser) != 0) {
+        return -1;
+    }
+
+    parser->state = MULTIPART_BODY;
+    if (parser->callbacks.part_begin(parser->callbacks.ctx, &parser->part) < 0) {
+        return -1;
+    }
+
+    return used;
+}
+
+/*
+    Parses the next length bytes of the body
+
+    Returns 0, or -1 when the body is malformed or a callback failed
+*/
+int
+multipart_feed(struct multipart_parser *parser, const char *data, int length)
+{
+    while (length > 0) {
+        int used = 1;
+
+        switch (parser->state) {
+        case MULTIPART_PREAMBLE:
+            [[fallthrough]];
+        case MULTIPART_BODY:
+            used = scan_contents(parser, data, length);
+            break;
+
+        // Transport padding may follow a delimiter before its CRLF
+        case MULTIPART_DELIMITER:
+            if (*data == '-') {
+                parser->state = MULTIPART_DASH;
+            } else if (*data == '\r') {
+                parser->state = MULTIPART_CR;
+            } else if (*data != ' ' && *data != '\t') {
+                used = -1;
+            }
+            break;
+
+        case MULTIPART_DASH:
+            if (*data != '-') {
+                used = -1;
+            }
+            parser->state = MULTIPART_DONE;
+            break;
+
+        case MULTIPART_CR:
+            if (*data != '\n') {
+                used = -1;
+            }
+            memcpy(parser->header_block, "\r\n", 2);
+            parser->header_length = 2;
+            parser->state = MULTIPART_HEADERS;
+            break;
+
+        case MULTIPART_HEADERS:
+            used = collect_headers(parser, data, length);
+            break;
+
+        default:
+            used = length;
+        }
+
+        if (used < 0) {
+            fprintf(stderr, "Malformed multipart body\n");
+            return -1;
+        }
+
+        data += used;
+        length -= used;
+    }
+
+    return 0;
+}
+
+/*
+    Returns 0 when the body ended with its closing delimiter, or -1 when it was cut short
+*/
+int
+multipart_finish(const struct multipart_parser *parser)
+{
+    return parser->state == MULTIPART_DONE ? 0 : -1;
+}
@@ -0,0 +1,84 @@
+/*
+    Header File for the streaming multipart/form-data parser
+*/
+
+#pragma once
+
+#include "http_lib.h"
+#include "http_parser.h"
+#include "macros.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#define MULTIPART_MAX_BOUNDARY 70           // Longest boundary RFC 2046 allows
+#define MULTIPART_MAX_HEADERS_SIZE (8 * KB) // Header block of one part
+#define MULTIPART_MAX_PARAMETER 256         // Longest name, filename or Content-Type kept
+
+// "\r\n--" and the boundary, what separates parts, with its NUL
+#define MULTIPART_MAX_DELIMITER (MULTIPART_MAX_BOUNDARY + 5)
+
+enum MULTIPART_STATE
+{
+    MULTIPART_PREAMBLE,  // Before the first delimiter, discarded
+    MULTIPART_DELIMITER, // Right after a delimiter, "--" ends the body and CRLF starts a part
+    MULTIPART_DASH,      // Saw the first '-' of the closing "--"
+    MULTIPART_CR,        // Saw the '\r' ending the delimiter line
+    MULTIPART_HEADERS,   // Collecting a part's header block
+    MULTIPART_BODY,      // Passing a part's contents on
+    MULTIPART_DONE,      // Past the closing delimiter, the epilogue is discarded
+};
+
+/*
+    The part being parsed, as described by its headers
+*/
+struct multipart_part
+{
+    char name[MULTIPART_MAX_PARAMETER];         // Content-Disposition name
+    char filename[MULTIPART_MAX_PARAMETER];     // Content-Disposition filename, "" for fields
+    char content_type[MULTIPART_MAX_PARAMETER]; // "" when the part has none
+    long length;                                // Content bytes passed on so far
+};
+
+/*
+    Called as parts begin and end, and with their contents in order, possibly in many pieces
+
+    Returns 0 to go on or <0 to stop parsing, which then fails
+*/
+typedef int (*multipart_part_callback)(void *ctx, struct multipart_part *part);
+typedef int (*multipart_data_callback)(void *ctx, struct multipart_part *part, const char *data,
+                                       int length);
+
+struct multipart_callbacks
+{
+    multipart_part_callback part_begin;
+    multipart_data_callback part_data;
+    multipart_part_callback part_end;
+    void *ctx;
+};
+
+/*
+    State of one body being parsed, fed with chunks as they arrive
+*/
+struct multipart_parser
+{
+    int state;
+    struct multipart_callbacks callbacks;
+    char delimiter[MULTIPART_MAX_DELIMITER];
+    int delimiter_length;
+    uint8_t skip[256];                           // Boyer-Moore-Horspool shifts for the delimiter
+    char carry[2 * MULTIPART_MAX_DELIMITER];     // Chunk tail that may start a delimiter
+    int carry_length;
+    char header_block[MULTIPART_MAX_HEADERS_SIZE + 1];
+    int header_length;
+    HTTP_HEADER header; // Scratch for parse_header()
+    struct multipart_part part;
+};
+
+int multipart_boundary(const char *content_type, char *boundary, size_t size);
+int multipart_init(struct multipart_parser *parser, const char *boundary,
+                   const struct multipart_callbacks *callbacks);
+int multipart_feed(struct multipart_parser *parser, const char *data, int length);
+int multipart_finish(const struct multipart_parser *parser);
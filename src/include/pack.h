@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Static asset pack layout, shared by the "make pack" tool and the server
+
+    A pack is written and read on the same machine, so fields are in host byte order:
+
+        struct pack_header
+        struct pack_entry[entry_count], sorted by hash
+        strings and contents, each located by an offset from the start of the file
+
+    Entries are keyed by the path relative to the static directory, e.g. "html/index.html".
+*/
+
+#define PACK_MAGIC "HSPACK01"
+#define PACK_MAGIC_LENGTH 8
+#define PACK_ALIGNMENT 64 // Contents start on a cache line
+
+struct pack_header
+{
+    char magic[PACK_MAGIC_LENGTH];
+    uint32_t entry_count;
+    uint32_t reserved;
+    uint64_t file_size;
+};
+
+/*
+    An offset and length into the pack
+*/
+struct pack_span
+{
+    uint64_t offset;
+    uint64_t length;
+};
+
+struct pack_entry
+{
+    uint64_t hash;
+    struct pack_span path;
+    struct pack_span mime_type;
+    struct pack_span etag;
+    struct pack_span body;
+    struct pack_span headers;      // Content-Type, Content-Length, ETag (and Vary) lines
+    struct pack_span gzip_body;    // Empty when compressing did not pay off
+    struct pack_span gzip_headers; // Same for gzip_body, plus "Content-Encoding: gzip"
+};
+
+/*
+    FNV-1a, cheap and good enough for a few thousand file names
+*/
+static inline uint64_t
+pack_hash(const char *path, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char) path[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
@@ -0,0 +1,95 @@
+#include "sha1.h"
+
+static uint32_t
+rotate_left(uint32_t value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+/*
+    Mixes one 64-byte block into the hash state
+*/
+static void
+sha1_block(uint32_t state[5], const uint8_t *block)
+{
+    uint32_t w[80];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16)
+               | ((uint32_t) block[i * 4 + 2] << 8) | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+
+        uint32_t temp = rotate_left(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rotate_left(b, 30);
+        b = a;
+        a = temp;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void
+sha1(const void *data, size_t length, uint8_t digest[SHA1_DIGEST_LENGTH])
+{
+    uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    const uint8_t *bytes = data;
+    uint8_t block[64];
+    size_t i;
+
+    for (i = 0; i + 64 <= length; i += 64) {
+        sha1_block(state, bytes + i);
+    }
+
+    // Pad the tail with 0x80, zeros and the message length in bits
+    size_t tail = length - i;
+    uint64_t bit_length = (uint64_t) length * 8;
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, bytes + i, tail);
+    block[tail] = 0x80;
+
+    if (tail >= 56) {
+        sha1_block(state, block);
+        memset(block, 0, sizeof(block));
+    }
+
+    for (int j = 0; j < 8; j++) {
+        block[63 - j] = (bit_length >> (j * 8)) & 0xff;
+    }
+    sha1_block(state, block);
+
+    for (int j = 0; j < 5; j++) {
+        digest[j * 4] = (state[j] >> 24) & 0xff;
+        digest[j * 4 + 1] = (state[j] >> 16) & 0xff;
+        digest[j * 4 + 2] = (state[j] >> 8) & 0xff;
+        digest[j * 4 + 3] = state[j] & 0xff;
+    }
+}
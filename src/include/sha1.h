@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+    SHA-1 (RFC 3174), only used where a protocol mandates it, e.g. the WebSocket handshake
+*/
+
+#define SHA1_DIGEST_LENGTH 20
+
+void sha1(const void *data, size_t length, uint8_t digest[SHA1_DIGEST_LENGTH]);
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+    Request trace dump layout, shared by the server and the "make traceview" tool
+
+    A dump is written and read on the same machine, so fields are in host byte order:
+
+        struct trace_file_header
+        struct trace_record[record_count], oldest first
+
+    Timestamps are CLOCK_MONOTONIC nanoseconds, so only differences between them mean anything.
+*/
+
+#define TRACE_MAGIC "HSTRACE1"
+#define TRACE_MAGIC_LENGTH 8
+
+/*
+    Points in a request's life, in the order they happen
+*/
+enum TRACE_PHASE
+{
+    TRACE_ACCEPT,         // Connection accepted, first request on a connection only
+    TRACE_FIRST_BYTE,     // Request bytes arrived on an idle connection
+    TRACE_HEADERS_PARSED, // Header block complete
+    TRACE_BODY_COMPLETE,  // Body read, the request is ready to route
+    TRACE_ROUTED,         // Response built and about to be sent
+    TRACE_HEADERS_SENT,   // Response header block written to the socket
+    TRACE_LAST_BYTE,      // Response body written to the socket
+    TRACE_PHASE_COUNT
+};
+
+struct trace_file_header
+{
+    char magic[TRACE_MAGIC_LENGTH];
+    uint32_t phase_count; // TRACE_PHASE_COUNT of the server that wrote the dump
+    uint32_t reserved;
+    uint64_t record_count;
+};
+
+/*
+    One request, a cache line each
+*/
+struct trace_record
+{
+    int32_t fd;
+    uint32_t request;              // Request number on its connection, from 1
+    int64_t at[TRACE_PHASE_COUNT]; // Indexed by phase, 0 when the request never reached it
+};
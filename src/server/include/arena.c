@@ -0,0 +1,253 @@
+/*
+    Per-request arenas
+
+    Everything a request allocates while it is handled, from the handler's scratch buffers to
+    the rendered response head, comes out of the connection's arena and is given back in one
+    go once the response is out, so nothing on that path calls free(). Allocating bumps a
+    pointer through a chain of ARENA_BLOCK_SIZE blocks; resetting keeps the first block and
+    splices the rest of the chain onto a free pool in O(1).
+
+    Each thread has its own pool, the event loop and every offload worker, so taking and
+    returning blocks never locks. A block may be taken on one thread and returned on another,
+    it simply moves pools. Allocations too big for a block are the exception, they are
+    malloc()ed on their own and freed on reset.
+*/
+
+#define _GNU_SOURCE
+
+#include "arena.h"
+
+// Block headers are padded so that the bytes after them start aligned
+#define BLOCK_HEADER_SIZE                                                                          \
+    ((sizeof(struct arena_block) + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT)
+
+static __thread struct arena_block *pool = NULL;
+static __thread int pool_blocks = 0;
+
+static char *
+block_data(struct arena_block *block)
+{
+    return (char *) block + BLOCK_HEADER_SIZE;
+}
+
+static struct arena_block *
+take_block(void)
+{
+    struct arena_block *block = pool;
+
+    if (block) {
+        pool = block->next;
+        pool_blocks--;
+    } else {
+        block = malloc(BLOCK_HEADER_SIZE + ARENA_BLOCK_SIZE);
+        if (!block) {
+            perror("Failed to allocate memory");
+            return NULL;
+        }
+        block->size = ARENA_BLOCK_SIZE;
+    }
+
+    block->next = NULL;
+    block->used = 0;
+    return block;
+}
+
+/*
+    Frees what the pool holds over ARENA_POOL_BLOCKS, left behind by an unusually big request
+*/
+static void
+trim_pool(void)
+{
+    while (pool_blocks > ARENA_POOL_BLOCKS) {
+        struct arena_block *block = pool;
+
+        pool = block->next;
+        pool_blocks--;
+        free(block);
+    }
+}
+
+struct arena *
+arena_new(void)
+{
+    struct arena *arena = calloc(1, sizeof(struct arena));
+
+    if (!arena) {
+        perror("Failed to allocate memory");
+    }
+
+    return arena;
+}
+
+/*
+    Gives back everything allocated from the arena, which stays usable
+*/
+void
+arena_reset(struct arena *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+    while (arena->large) {
+        struct arena_block *block = arena->large;
+
+        arena->large = block->next;
+        free(block);
+    }
+
+    if (arena->first && arena->first != arena->current) {
+        arena->current->next = pool;
+        pool = arena->first->next;
+        pool_blocks += arena->blocks - 1;
+        arena->first->next = NULL;
+        trim_pool();
+    }
+
+    if (arena->first) {
+        arena->first->used = 0;
+        arena->blocks = 1;
+    }
+
+    arena->current = arena->first;
+    arena->allocated = 0;
+    arena->footprint = arena->first ? ARENA_BLOCK_SIZE : 0;
+}
+
+void
+arena_free(struct arena *arena)
+{
+    if (!arena) {
+        return;
+    }
+
+    arena_reset(arena);
+
+    if (arena->first) {
+        arena->first->next = pool;
+        pool = arena->first;
+        pool_blocks++;
+        trim_pool();
+    }
+
+    free(arena);
+}
+
+/*
+    Returns size bytes aligned to ARENA_ALIGNMENT, valid until the arena is reset, or NULL
+*/
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+    if (!arena || size > SIZE_MAX - BLOCK_HEADER_SIZE - ARENA_ALIGNMENT) {
+        return NULL;
+    }
+
+    size_t rounded = size == 0 ? ARENA_ALIGNMENT
+                               : (size + ARENA_ALIGNMENT - 1) / ARENA_ALIGNMENT * ARENA_ALIGNMENT;
+
+    if (rounded > ARENA_BLOCK_SIZE) {
+        struct arena_block *block = malloc(BLOCK_HEADER_SIZE + rounded);
+
+        if (!block) {
+            perror("Failed to allocate memory");
+            return NULL;
+        }
+
+        block->size = rounded;
+        block->used = rounded;
+        block->next = arena->large;
+        arena->large = block;
+        arena->allocated += rounded;
+        arena->footprint += rounded;
+        return block_data(block);
+    }
+
+    if (!arena->current || arena->current->size - arena->current->used < rounded) {
+        struct arena_block *block = take_block();
+
+        if (!block) {
+            return NULL;
+        }
+
+        if (arena->current) {
+            arena->current->next = block;
+        } else {
+            arena->first = block;
+        }
+        arena->current = block;
+        arena->blocks++;
+        arena->footprint += ARENA_BLOCK_SIZE;
+    }
+
+    char *ptr = block_data(arena->current) + arena->current->used;
+
+    arena->current->used += rounded;
+    arena->allocated += rounded;
+    return ptr;
+}
+
+void *
+arena_calloc(struct arena *arena, size_t count, size_t size)
+{
+    if (size != 0 && count > SIZE_MAX / size) {
+        return NULL;
+    }
+
+    void *ptr = arena_alloc(arena, count * size);
+
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+
+    return ptr;
+}
+
+/*
+    Copies length bytes of s and a terminating null byte into the arena
+*/
+char *
+arena_strndup(struct arena *arena, const char *s, size_t length)
+{
+    char *copy = arena_alloc(arena, length + 1);
+
+    if (copy) {
+        memcpy(copy, s, length);
+        copy[length] = '\0';
+    }
+
+    return copy;
+}
+
+char *
+arena_strdup(struct arena *arena, const char *s)
+{
+    return arena_strndup(arena, s, strlen(s));
+}
+
+/*
+    Formats into a string allocated from the arena
+*/
+char *
+arena_printf(struct arena *arena, const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    if (length < 0) {
+        return NULL;
+    }
+
+    char *str = arena_alloc(arena, (size_t) length + 1);
+
+    if (str) {
+        va_start(args, format);
+        vsnprintf(str, (size_t) length + 1, format, args);
+        va_end(args);
+    }
+
+    return str;
+}
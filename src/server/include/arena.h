@@ -0,0 +1,50 @@
+/*
+    Header File for per-request arenas
+*/
+
+#pragma once
+
+#include "macros.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE (16 * KB) // Bytes of a pooled block, bigger allocations get their own
+#define ARENA_POOL_BLOCKS 64       // Free blocks each thread keeps for the next requests
+#define ARENA_ALIGNMENT 16         // Every allocation is aligned for any type
+
+struct arena_block
+{
+    struct arena_block *next;
+    size_t size; // Usable bytes after the header
+    size_t used;
+};
+
+/*
+    Memory for one request, handed out by bumping a pointer and given back all at once
+
+    Blocks come from a per-thread pool, see arena.c.
+*/
+struct arena
+{
+    struct arena_block *first;   // Kept across resets, most requests never need a second
+    struct arena_block *current; // Last block of the chain, allocations bump it
+    int blocks;                  // Pooled blocks in the chain, first included
+    struct arena_block *large;   // Allocations over ARENA_BLOCK_SIZE, each in its own block
+    size_t allocated;            // Bytes handed out since the last reset
+    size_t footprint;            // Bytes of the blocks held, what the arena costs
+};
+
+struct arena *arena_new(void);
+void arena_free(struct arena *arena);
+void arena_reset(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+void *arena_calloc(struct arena *arena, size_t count, size_t size);
+char *arena_strndup(struct arena *arena, const char *s, size_t length);
+char *arena_strdup(struct arena *arena, const char *s);
+char *arena_printf(struct arena *arena, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
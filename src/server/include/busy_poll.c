@@ -0,0 +1,144 @@
+/*
+    Busy-polling event loop mode
+
+    With BUSY_POLL_ENABLED the loop calls epoll_wait() with a zero timeout in a spin instead of
+    sleeping in it, so an event is picked up without the scheduler wakeup and the cache and
+    frequency drop that come with a sleeping core. Accepted sockets also get SO_BUSY_POLL and
+    SO_PREFER_BUSY_POLL, letting their reads poll the NIC queue directly.
+
+    Spinning with nothing to do only burns the core, so after BUSY_POLL_IDLE_MS without an event
+    the loop backs off to a blocking epoll_wait(). The first event that wakes it resumes spinning.
+
+    The time spent spinning, blocked and handling events is accounted either way, so the blocking
+    and busy-poll modes can be compared on the same counters.
+*/
+
+#define _GNU_SOURCE
+
+#include "busy_poll.h"
+
+static struct busy_poll_stats stats = { 0 };
+static long last_return = 0; // When the previous wait returned, 0 before the first one
+static long last_event = 0;  // When a wait last returned events
+
+static long
+now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+/*
+    Asks the kernel to busy poll an accepted socket's receive queue
+*/
+void
+busy_poll_setup_socket(int fd)
+{
+    static bool warned = false;
+    int busy_poll = BUSY_POLL_SOCKET_US;
+    int prefer = 1;
+
+    if (!BUSY_POLL_ENABLED) {
+        return;
+    }
+
+    // Raising SO_BUSY_POLL above net.core.busy_read needs CAP_NET_ADMIN, the loop spins anyway
+    if ((setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1
+         || setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1)
+        && !warned) {
+        perror("setsockopt SO_BUSY_POLL");
+        warned = true;
+    }
+}
+
+/*
+    epoll_wait() for the event loop, spinning while BUSY_POLL_ENABLED and the loop is busy
+
+    timeout is in milliseconds, -1 for none, as for epoll_wait()
+*/
+int
+busy_poll_wait(int epoll_fd, struct epoll_event *events, int max_events, int timeout)
+{
+    long start = now_ns();
+    long now = start;
+    int ret;
+
+    if (last_return != 0) {
+        stats.work_ns += start - last_return;
+    }
+
+    if (last_event == 0) {
+        last_event = start;
+    }
+
+    while (BUSY_POLL_ENABLED && now - last_event < BUSY_POLL_IDLE_MS * 1000000L) {
+        ret = epoll_wait(epoll_fd, events, max_events, 0);
+        now = now_ns();
+        stats.polls++;
+
+        if (ret != 0) {
+            stats.spin_ns += now - start;
+            last_return = now;
+            if (ret > 0) {
+                last_event = now;
+            }
+            return ret;
+        }
+
+        stats.empty_polls++;
+
+        if (timeout >= 0 && now - start >= timeout * 1000000L) {
+            stats.spin_ns += now - start;
+            last_return = now;
+            return 0;
+        }
+    }
+
+    long blocked_at = now;
+
+    if (BUSY_POLL_ENABLED) {
+        stats.spin_ns += now - start;
+        stats.back_offs++;
+
+        // What is left of the caller's timeout after spinning
+        if (timeout >= 0) {
+            timeout = MAX(0, timeout - (int) ((now - start) / 1000000L));
+        }
+    }
+
+    ret = epoll_wait(epoll_fd, events, max_events, timeout);
+    now = now_ns();
+    stats.blocked_ns += now - blocked_at;
+    last_return = now;
+    if (ret > 0) {
+        last_event = now;
+    }
+
+    return ret;
+}
+
+void
+busy_poll_get_stats(struct busy_poll_stats *out)
+{
+    *out = stats;
+}
+
+/*
+    Prints where the loop's time went, e.g. at shutdown
+*/
+void
+busy_poll_print_stats(void)
+{
+    double total = stats.spin_ns + stats.blocked_ns + stats.work_ns;
+
+    if (total <= 0) {
+        return;
+    }
+
+    printf("server: event loop %.1f%% spinning, %.1f%% blocked, %.1f%% handling events "
+           "(%ld polls, %ld empty, %ld back-offs)\n",
+           100.0 * stats.spin_ns / total, 100.0 * stats.blocked_ns / total,
+           100.0 * stats.work_ns / total, stats.polls, stats.empty_polls, stats.back_offs);
+}
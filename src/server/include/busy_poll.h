@@ -0,0 +1,36 @@
+/*
+    Header File for the busy-polling event loop mode
+*/
+
+#pragma once
+
+#include "macros.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define BUSY_POLL_IDLE_MS 50   // Spinning without events this long falls back to blocking
+#define BUSY_POLL_SOCKET_US 50 // SO_BUSY_POLL, microseconds a socket read spins on the NIC queue
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69 // Linux 5.11, missing from older headers
+#endif
+
+struct busy_poll_stats
+{
+    long spin_ns;    // Inside epoll_wait(0) calls, with or without events
+    long blocked_ns; // Asleep in a blocking epoll_wait() after backing off
+    long work_ns;    // Between a wait returning and the next one, i.e. handling events
+    long polls;      // epoll_wait(0) calls
+    long empty_polls;
+    long back_offs; // Times the loop went idle long enough to block
+};
+
+void busy_poll_setup_socket(int fd);
+int busy_poll_wait(int epoll_fd, struct epoll_event *events, int max_events, int timeout);
+void busy_poll_get_stats(struct busy_poll_stats *stats);
+void busy_poll_print_stats(void);
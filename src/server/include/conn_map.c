@@ -8,13 +8,34 @@ initialize_conn_map(struct conn *map, int length)
 {
     for (int i = 0; i < length; i++) {
         map[i].fd = -1;
-        map[i].offset = 0;
-        map[i].action_count = 0;
         map[i].state = INACTIVE;
         map[i].buffer = NULL;
         map[i].request = NULL;
         map[i].response = NULL;
         map[i].last_activity = -1;
+        map[i].route = NULL;
+        map[i].stream_state = NULL;
+        map[i].body_paused = false;
+        map[i].budget_paused = false;
+        map[i].peer_fd = -1;
+        map[i].upstream = NULL;
+        map[i].proxy = NULL;
+        map[i].pipe_fds[0] = -1;
+        map[i].pipe_fds[1] = -1;
+        map[i].http2 = NULL;
+        map[i].websocket = NULL;
+        map[i].sse = NULL;
+        map[i].tls = NULL;
+        map[i].offload = NULL;
+        map[i].requests = 0;
+        map[i].read_ahead = false;
+        trace_reset(&map[i].trace);
+        output_queue_init(&map[i].output);
+        map[i].head_end = 0;
+        map[i].memory_used = 0;
+        map[i].arena = NULL;
+        memset(map[i].client_address, 0, sizeof(map[i].client_address));
+        memset(&map[i].credentials, 0, sizeof(map[i].credentials));
     }
 
     return 0;
@@ -41,13 +62,34 @@ add_conn_to_map(struct conn *map, int fd, int length)
     for (int i = 0; i < length; i++) {
         if (map[i].fd == -1) {
             map[i].fd = fd;
-            map[i].offset = 0;
-            map[i].action_count = 0;
-            map[i].state = IDLE;
+                map[i].state = IDLE;
             map[i].buffer = NULL;
             map[i].request = NULL;
             map[i].response = NULL;
             map[i].last_activity = time(NULL);
+            map[i].route = NULL;
+            map[i].stream_state = NULL;
+            map[i].body_paused = false;
+            map[i].budget_paused = false;
+            map[i].peer_fd = -1;
+            map[i].upstream = NULL;
+            map[i].proxy = NULL;
+            map[i].pipe_fds[0] = -1;
+            map[i].pipe_fds[1] = -1;
+            map[i].http2 = NULL;
+            map[i].websocket = NULL;
+            map[i].sse = NULL;
+            map[i].tls = NULL;
+            map[i].offload = NULL;
+            map[i].requests = 0;
+            map[i].read_ahead = false;
+            trace_reset(&map[i].trace);
+            output_queue_init(&map[i].output);
+            map[i].head_end = 0;
+            map[i].memory_used = 0;
+            map[i].arena = NULL;
+            memset(map[i].client_address, 0, sizeof(map[i].client_address));
+            memset(&map[i].credentials, 0, sizeof(map[i].credentials));
             return 0;
         }
     }
@@ -115,25 +157,57 @@ free_conn(struct conn *conn)
     }
 
     conn->fd = -1;
-    conn->offset = 0;
-    conn->action_count = -1;
     conn->state = INACTIVE;
     conn->last_activity = -1;
+    conn->route = NULL;
+    conn->stream_state = NULL;
+    conn->body_paused = false;
+    conn->budget_paused = false;
+    conn->peer_fd = -1;
+    conn->upstream = NULL;
+    conn->proxy = NULL;
+    conn->http2 = NULL;
+    conn->websocket = NULL;
+    conn->sse = NULL;
+    conn->tls = NULL;
+    conn->offload = NULL;
+    conn->requests = 0;
+    conn->read_ahead = false;
+    trace_reset(&conn->trace);
+    output_queue_clear(&conn->output);
+    conn->head_end = 0;
+    conn->memory_used = 0;
+    memset(conn->client_address, 0, sizeof(conn->client_address));
+    memset(&conn->credentials, 0, sizeof(conn->credentials));
+
+    for (int i = 0; i < 2; i++) {
+        if (conn->pipe_fds[i] != -1) {
+            close(conn->pipe_fds[i]);
+            conn->pipe_fds[i] = -1;
+        }
+    }
 
     if (conn->buffer != NULL) {
         free(conn->buffer);
+        conn->buffer = NULL;
     }
 
     if (conn->request != NULL) {
         free_http_message(conn->request);
         free(conn->request);
+        conn->request = NULL;
     }
 
     if (conn->response != NULL) {
         free_http_message(conn->response);
         free(conn->response);
+        conn->response = NULL;
     }
 
+    // Only once nothing queued or held by the messages can point into it
+    arena_free(conn->arena);
+    conn->arena = NULL;
+
     return 0;
 }
 
@@ -162,19 +236,87 @@ set_conn_state(struct conn *conn, int conn_state)
     case SENDING_BODY:
         state = "SENDING_BODY";
         break;
+    case PROXYING:
+        state = "PROXYING";
+        break;
+    case UPSTREAM_CONNECTING:
+        state = "UPSTREAM_CONNECTING";
+        break;
+    case UPSTREAM_SENDING:
+        state = "UPSTREAM_SENDING";
+        break;
+    case UPSTREAM_RECEIVING:
+        state = "UPSTREAM_RECEIVING";
+        break;
+    case UPSTREAM_STREAMING:
+        state = "UPSTREAM_STREAMING";
+        break;
+    case UPSTREAM_IDLE:
+        state = "UPSTREAM_IDLE";
+        break;
+    case HTTP2:
+        state = "HTTP2";
+        break;
+    case WEBSOCKET:
+        state = "WEBSOCKET";
+        break;
+    case EVENT_STREAM:
+        state = "EVENT_STREAM";
+        break;
+    case TLS_HANDSHAKE:
+        state = "TLS_HANDSHAKE";
+        break;
+    case WAITING_HANDLER:
+        state = "WAITING_HANDLER";
+        break;
+    case WAITING_DISK:
+        state = "WAITING_DISK";
+        break;
     default:
         state = "UNKNOWN";
         break;
     }
 
     fprintf(stderr, "[FD: %d] Entering State %s\n", conn->fd, state);
+    PROBE3(state, conn->fd, conn->state, conn_state);
     conn->state = conn_state;
 
+    // The transitions of an HTTP/1.x exchange are its traced phases, see trace.c
+    switch (conn_state) {
+    case IDLE:
+        trace_end(&conn->trace, conn->fd, conn->requests, true);
+        break;
+    case PARSING_HEADERS:
+        trace_mark(&conn->trace, TRACE_FIRST_BYTE);
+        break;
+    case PARSING_BODY:
+        trace_mark(&conn->trace, TRACE_HEADERS_PARSED);
+        break;
+    case PROXYING:
+        [[fallthrough]];
+    case SENDING_HEADERS:
+        trace_mark(&conn->trace, TRACE_ROUTED);
+        break;
+    case SENDING_BODY:
+        trace_mark(&conn->trace, TRACE_HEADERS_SENT);
+        break;
+    case HTTP2:
+        [[fallthrough]];
+    case WEBSOCKET:
+        [[fallthrough]];
+    case EVENT_STREAM:
+        // No longer one request, nothing more is traced
+        trace_reset(&conn->trace);
+        break;
+    }
+
     return 0;
 }
 
 /*
     Takes a HTTP_MESSAGE and allocates memory on the heap to store the message
+
+    The message allocates from the connection's arena, created with the first message.
 */
 int
 shallow_copy_http_message_to_conn(struct conn *conn, HTTP_MESSAGE message, int http_message_type)
@@ -183,6 +325,11 @@ shallow_copy_http_message_to_conn(struct conn *conn, HTTP_MESSAGE message, int h
         return -1;
     }
 
+    if (conn->arena == NULL) {
+        conn->arena = arena_new();
+    }
+    message.arena = conn->arena;
+
     if (http_message_type == REQUEST) {
         conn->request = calloc(1, sizeof(HTTP_MESSAGE));
         *conn->request = message;
@@ -206,7 +353,6 @@ allocate_conn_buffer(struct conn *conn, int char_length)
         return 1; // Not necessarily an error, but keep the old buffer
     }
 
-    conn->offset = 0;
     conn->buffer = calloc(char_length, sizeof(char));
 
     return 0;
@@ -1,10 +1,21 @@
 
 #pragma once
 
+#include "arena.h"
 #include "http_lib.h"
+#include "output_queue.h"
+#include "probes.h"
+#include "trace.h"
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
 #include <time.h>
 
+#define RECV_EPOLL_FLAGS EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR | EPOLLET
+#define SEND_EPOLL_FLAGS EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR | EPOLLET
+#define PAUSED_EPOLL_FLAGS EPOLLRDHUP | EPOLLHUP | EPOLLERR | EPOLLET
+#define DUPLEX_EPOLL_FLAGS EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR | EPOLLET
+
 enum CONN_STATE
 {
     IDLE,
@@ -12,9 +23,30 @@ enum CONN_STATE
     PARSING_BODY,
     SENDING_HEADERS,
     SENDING_BODY,
+    PROXYING,            // Client waiting on, or receiving, a proxied response
+    UPSTREAM_CONNECTING, // Non-blocking connect() to an upstream in progress
+    UPSTREAM_SENDING,    // Forwarding the request head and body to the upstream
+    UPSTREAM_RECEIVING,  // Parsing the upstream response head
+    UPSTREAM_STREAMING,  // Splicing the upstream response body to the client
+    UPSTREAM_IDLE,       // Kept-alive upstream connection parked in its pool
+    HTTP2,               // Connection handed over to its HTTP/2 session
+    WEBSOCKET,           // Connection upgraded to WebSocket
+    EVENT_STREAM,        // Subscribed to a Server-Sent Events channel
+    TLS_HANDSHAKE,       // Non-blocking TLS handshake before kernel TLS takes over
+    WAITING_HANDLER,     // Blocking route handler running on the offload pool
+    WAITING_DISK,        // Next window of the file body being read in, see page_cache.c
     INACTIVE,
 };
 
+struct route;
+struct upstream;
+struct proxy_exchange;
+struct http2_session;
+struct websocket;
+struct sse_subscriber;
+struct ssl_st;
+struct offload_job;
+
 struct conn
 {
     int fd; // A socket FD
@@ -22,9 +54,29 @@ struct conn
     HTTP_MESSAGE *request;
     HTTP_MESSAGE *response;
     char *buffer; // Any stored buffer
-    int offset;
-    int action_count;
     time_t last_activity;
+    const struct route *route;    // Route picked once the headers are parsed
+    void *stream_state;           // Owned by the route's streaming body handler
+    bool body_paused;             // Streaming body handler asked to stop reading
+    bool budget_paused;           // Not read from while over the memory budget
+    int peer_fd;                  // Other side of a proxied exchange, or -1
+    struct upstream *upstream;    // Set on connections to an upstream
+    struct proxy_exchange *proxy; // In-flight proxied request of a client connection
+    int pipe_fds[2];              // splice() pipe for request bodies, or a pooled upstream's
+    struct http2_session *http2;  // Set once the connection speaks HTTP/2
+    struct websocket *websocket;  // Set once the connection is upgraded to WebSocket
+    struct sse_subscriber *sse;   // Set while the connection streams Server-Sent Events
+    struct ssl_st *tls;           // OpenSSL session, only held during the TLS handshake
+    uint8_t client_address[16];   // Peer IP, IPv4-mapped, see client_address_from_sockaddr()
+    HTTP_CREDENTIALS credentials; // Client process on a Unix socket, see get_peer_credentials()
+    struct offload_job *offload;  // Set while the route's handler runs on the offload pool
+    int requests;                 // Requests read on this connection, see keep_alive.c
+    bool read_ahead;              // Bytes past the current request were read along with it
+    struct trace_span trace;      // Phase timestamps of the current request
+    struct output_queue output;   // Bytes waiting for the socket, see output_queue.c
+    long long head_end;           // output.queued_bytes once the response head was queued
+    struct arena *arena;          // What the current request allocates, see arena.c
+    long long memory_used;        // Bytes charged to the budget, see memory_budget.c
 };
 
 // TODO: Add Buffer length parameter
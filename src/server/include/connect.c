@@ -20,12 +20,30 @@ sigchld_handler(int s)
     errno = saved_errno;
 }
 
+/*
+    Reaps child processes as they exit
+*/
+int
+setup_sigchld_handler(void)
+{
+    struct sigaction sa;
+
+    sa.sa_handler = sigchld_handler; // reap all dead processes
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+
+    return 0;
+}
+
 int
 server_setup()
 {
 
     struct addrinfo hints, *servinfo, *p;
-    struct sigaction sa;
     int sockfd;
     int rv;
     int yes = 1;
@@ -73,11 +91,7 @@ server_setup()
         exit(1);
     }
 
-    sa.sa_handler = sigchld_handler; // reap all dead processes
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = SA_RESTART;
-    if (sigaction(SIGCHLD, &sa, NULL) == -1) {
-        perror("sigaction");
+    if (setup_sigchld_handler() != 0) {
         exit(1);
     }
 
@@ -86,8 +100,84 @@ server_setup()
     return sockfd;
 }
 
+static ino_t unix_socket_inode = 0; // The socket file we bound, see unix_server_unlink()
+
+/*
+    Listens on a Unix stream socket at path
+
+    A socket file already at path is replaced, it is either left over from a server that did not
+    exit cleanly or belongs to the process a binary upgrade is taking over from, whose clients
+    should reach us from now on. Anything else at path is left alone. Returns the listening
+    socket, or -1
+*/
 int
-accept_connection(int sockfd)
+unix_server_setup(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+    int sockfd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "server: Unix socket path %s is too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "server: %s exists and is not a socket\n", path);
+            return -1;
+        }
+        unlink(path);
+    }
+
+    if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("server: Unix socket");
+        return -1;
+    }
+
+    if (bind(sockfd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        perror("server: bind Unix socket");
+        close(sockfd);
+        return -1;
+    }
+
+    if (listen(sockfd, BACKLOG) == -1) {
+        perror("listen");
+        close(sockfd);
+        unlink(path);
+        return -1;
+    }
+
+    if (stat(path, &st) == 0) {
+        unix_socket_inode = st.st_ino;
+    }
+
+    printf("server: listening on %s with socket FD %d...\n", path, sockfd);
+
+    return sockfd;
+}
+
+/*
+    Removes the socket file unix_server_setup() created
+
+    Only if it is still the one we bound, after a binary upgrade it is the new process's.
+*/
+void
+unix_server_unlink(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode) && st.st_ino == unix_socket_inode) {
+        unlink(path);
+    }
+}
+
+/*
+    Accepts a connection, storing the peer's address in addr unless it is NULL
+*/
+int
+accept_connection(int sockfd, struct sockaddr_storage *addr)
 {
 
     socklen_t sin_size;
@@ -103,8 +193,41 @@ accept_connection(int sockfd)
         return -1;
     }
 
-    print_ip("server: got connection from", their_addr.ss_family, (struct sockaddr *) &their_addr,
-             false);
+    if (their_addr.ss_family == AF_UNIX) {
+        printf("server: got connection on a Unix socket\n");
+    } else {
+        print_ip("server: got connection from", their_addr.ss_family,
+                 (struct sockaddr *) &their_addr, false);
+    }
+
+    if (addr) {
+        *addr = their_addr;
+    }
 
     return new_fd;
 }
+
+/*
+    Reads the pid, uid and gid of the process that connected to a Unix socket
+
+    Returns 0, or -1 if the socket has none, e.g. it is TCP
+*/
+int
+get_peer_credentials(int fd, HTTP_CREDENTIALS *credentials)
+{
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+
+    memset(credentials, 0, sizeof(*credentials));
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) == -1) {
+        perror("getsockopt SO_PEERCRED");
+        return -1;
+    }
+
+    credentials->known = true;
+    credentials->pid = cred.pid;
+    credentials->uid = cred.uid;
+    credentials->gid = cred.gid;
+    return 0;
+}
@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include "http_lib.h"
 #include "ip_helper.h"
 #include "macros.h"
 #include <arpa/inet.h>
@@ -15,14 +16,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#define BACKLOG 10 // how many pending connections queue will hold
+#define BACKLOG SOMAXCONN // how many pending connections queue will hold, also across an upgrade
 
 void sigchld_handler(int s);
+int setup_sigchld_handler(void);
 
 int server_setup(void);
+int unix_server_setup(const char *path);
+void unix_server_unlink(const char *path);
 
-int accept_connection(int sockfd);
+int accept_connection(int sockfd, struct sockaddr_storage *addr);
+int get_peer_credentials(int fd, HTTP_CREDENTIALS *credentials);
@@ -0,0 +1,304 @@
+/*
+    In-memory cache of small static files
+
+    Files up to FILE_CACHE_MAX_FILE_SIZE are read once, along with their rendered Content-Type
+    and Content-Length lines. Hits are answered from memory, with the header block and contents
+    going out in one writev(). Each hit skips the openat2(), fstat() and sendfile() of a normal
+    request, and the file is only stat()ed again every FILE_CACHE_REVALIDATE seconds.
+
+    Entries are found through a chained hash table on the request key. Eviction is CLOCK: a hit
+    sets the entry's referenced bit, and when an insert needs room under FILE_CACHE_BUDGET the
+    hand sweeps the ring. It clears bits as it goes and evicts the first entry whose bit was
+    already clear. This approximates LRU without moving entries on every hit.
+*/
+
+#define _GNU_SOURCE
+
+#include "file_cache.h"
+
+static struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+static struct file_cache_entry *ring[FILE_CACHE_MAX_ENTRIES];
+static int hand = 0;
+static struct file_cache_stats stats = { 0 };
+
+static uint64_t
+hash_key(const char *key)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *key; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static struct file_cache_entry *
+find_entry(const char *key, uint64_t hash)
+{
+    struct file_cache_entry *entry = buckets[hash & (FILE_CACHE_BUCKETS - 1)];
+
+    while (entry && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->next;
+    }
+
+    return entry;
+}
+
+/*
+    Drops a reference, passed to responses as their body_release
+*/
+static void
+release_entry(void *owner)
+{
+    struct file_cache_entry *entry = owner;
+
+    if (--entry->refcount == 0) {
+        free(entry);
+    }
+}
+
+/*
+    Takes an entry out of the cache, it is freed once no response is still sending it
+*/
+static void
+remove_entry(struct file_cache_entry *entry)
+{
+    struct file_cache_entry **link = &buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+
+    ring[entry->slot] = NULL;
+    entry->slot = -1;
+    stats.entries--;
+    stats.bytes -= entry->size;
+
+    release_entry(entry);
+}
+
+/*
+    Advances the CLOCK hand to the first entry not referenced since it last passed, and evicts it
+*/
+static void
+evict_one(void)
+{
+    // Two turns clear every bit, so an entry is found within them
+    for (int i = 0; i < 2 * FILE_CACHE_MAX_ENTRIES; i++) {
+        struct file_cache_entry *entry = ring[hand];
+
+        hand = (hand + 1) % FILE_CACHE_MAX_ENTRIES;
+
+        if (!entry) {
+            continue;
+        }
+
+        if (entry->referenced) {
+            entry->referenced = false;
+            continue;
+        }
+
+        remove_entry(entry);
+        stats.evictions++;
+        return;
+    }
+}
+
+/*
+    Whether the cached contents still match the file, stat()ing it at most once per interval
+*/
+static bool
+is_fresh(struct file_cache_entry *entry)
+{
+    time_t now = time(NULL);
+
+    if (now - entry->checked_at < FILE_CACHE_REVALIDATE) {
+        return true;
+    }
+
+    struct stat st;
+
+    if (stat(entry->path, &st) == -1 || st.st_dev != entry->dev || st.st_ino != entry->ino
+        || st.st_size != entry->length || st.st_mtim.tv_sec != entry->mtime.tv_sec
+        || st.st_mtim.tv_nsec != entry->mtime.tv_nsec) {
+        return false;
+    }
+
+    entry->checked_at = now;
+    return true;
+}
+
+static int
+serve_entry(struct file_cache_entry *entry, HTTP_MESSAGE *response)
+{
+    if (http_message_set_body_data(response, entry->data, entry->length, entry->headers,
+                                   entry->headers_length)
+        != 0) {
+        return -1;
+    }
+
+    entry->refcount++;
+    response->body_release = release_entry;
+    response->body_owner = entry;
+    return 0;
+}
+
+/*
+    Sets the response body from the cache
+
+    key names the file independently of where it was resolved to, e.g. "html/index.html".
+    Returns 0 on a hit, or -1 when the caller must serve the file itself
+*/
+int
+file_cache_get(const HTTP_MESSAGE *request, HTTP_MESSAGE *response, const char *key)
+{
+    // HTTP/2 streams send their DATA from a file
+    if (request && request->start_line.request.protocol == HTTP_2_0) {
+        return -1;
+    }
+
+    struct file_cache_entry *entry = find_entry(key, hash_key(key));
+
+    if (entry && !is_fresh(entry)) {
+        remove_entry(entry);
+        entry = NULL;
+    }
+
+    if (!entry) {
+        stats.misses++;
+        return -1;
+    }
+
+    stats.hits++;
+    entry->referenced = true;
+    return serve_entry(entry, response);
+}
+
+/*
+    Reads a file that missed into the cache and sets it as the response body
+
+    fd is the file already open, left open for the caller, or -1 to open path. Returns 0, or -1
+    when the file is not cacheable and the caller must serve it itself
+*/
+int
+file_cache_load(const HTTP_MESSAGE *request, HTTP_MESSAGE *response, const char *key,
+                const char *path, int fd)
+{
+    if (request && request->start_line.request.protocol == HTTP_2_0) {
+        return -1;
+    }
+
+    int opened_fd = fd == -1 ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+
+    if (fd == -1 && (fd = opened_fd) == -1) {
+        return -1;
+    }
+
+    struct stat st;
+    char content_type[MAX_HEADER_LENGTH];
+
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size > FILE_CACHE_MAX_FILE_SIZE
+        || get_content_type_from_path(path, content_type, sizeof(content_type)) != 0) {
+        close(opened_fd);
+        return -1;
+    }
+
+    char headers[MAX_HEADER_LENGTH + 64];
+    int headers_length = snprintf(headers, sizeof(headers),
+                                  "Content-Type: %s\r\nContent-Length: %ld\r\n", content_type,
+                                  (long) st.st_size);
+    size_t key_size = strlen(key) + 1;
+    size_t path_size = strlen(path) + 1;
+    size_t size = key_size + path_size + headers_length + st.st_size;
+    struct file_cache_entry *entry = malloc(sizeof(struct file_cache_entry) + size);
+
+    if (!entry) {
+        perror("Failed to allocate memory");
+        close(opened_fd);
+        return -1;
+    }
+
+    entry->key = entry->storage;
+    entry->path = entry->key + key_size;
+    entry->headers = entry->path + path_size;
+    entry->data = entry->headers + headers_length;
+    memcpy(entry->key, key, key_size);
+    memcpy(entry->path, path, path_size);
+    memcpy(entry->headers, headers, headers_length);
+    entry->headers_length = headers_length;
+    entry->length = st.st_size;
+
+    int done = 0;
+
+    while (done < entry->length) {
+        ssize_t n = pread(fd, entry->data + done, entry->length - done, done);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            perror("Failed to read file for the cache");
+            close(opened_fd);
+            free(entry);
+            return -1;
+        }
+        done += n;
+    }
+    close(opened_fd);
+
+    entry->refcount = 1;
+    entry->referenced = true;
+    entry->hash = hash_key(key);
+    entry->size = sizeof(struct file_cache_entry) + size;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    entry->checked_at = time(NULL);
+
+    // A stale copy is replaced
+    struct file_cache_entry *old = find_entry(key, entry->hash);
+
+    if (old) {
+        remove_entry(old);
+    }
+
+    while (stats.entries > 0
+           && (stats.entries == FILE_CACHE_MAX_ENTRIES
+               || stats.bytes + (long) entry->size > FILE_CACHE_BUDGET)) {
+        evict_one();
+    }
+
+    entry->slot = hand;
+    while (ring[entry->slot]) {
+        entry->slot = (entry->slot + 1) % FILE_CACHE_MAX_ENTRIES;
+    }
+
+    ring[entry->slot] = entry;
+    entry->next = buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)];
+    buckets[entry->hash & (FILE_CACHE_BUCKETS - 1)] = entry;
+    stats.entries++;
+    stats.bytes += entry->size;
+
+    return serve_entry(entry, response);
+}
+
+/*
+    Drops every entry, those still being sent are freed once their response is done
+*/
+void
+file_cache_clear(void)
+{
+    for (int i = 0; i < FILE_CACHE_MAX_ENTRIES; i++) {
+        if (ring[i]) {
+            remove_entry(ring[i]);
+        }
+    }
+}
+
+void
+file_cache_get_stats(struct file_cache_stats *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,66 @@
+/*
+    Header File for the in-memory cache of small static files
+*/
+
+#pragma once
+
+#include "http_lib.h"
+#include "macros.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FILE_CACHE_MAX_FILE_SIZE 64 * KB // Larger files keep going out with sendfile()
+#define FILE_CACHE_BUDGET 16 * MB        // Bytes of cached contents and headers
+#define FILE_CACHE_MAX_ENTRIES 1024
+#define FILE_CACHE_BUCKETS 2048 // Hash chains, a power of two
+#define FILE_CACHE_REVALIDATE 1 // Seconds a hit is served before the file is stat()ed again
+
+/*
+    A cached file: headers and contents share the allocation
+
+    Entries are reference counted. The cache holds one reference and every response still
+    sending the contents holds another, so evicting an entry never pulls memory out from under
+    a partially written response.
+*/
+struct file_cache_entry
+{
+    int refcount;
+    bool referenced; // CLOCK bit, set by hits, cleared as the hand passes
+    int slot;        // Index in the CLOCK ring, -1 once evicted
+    struct file_cache_entry *next; // Hash chain
+    uint64_t hash;
+    char *key;
+    char *path; // Where the contents came from, for revalidation
+    char *headers;
+    int headers_length;
+    char *data;
+    int length;
+    size_t size; // Bytes counted against FILE_CACHE_BUDGET
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    time_t checked_at;
+    char storage[];
+};
+
+struct file_cache_stats
+{
+    long hits;
+    long misses;
+    long evictions;
+    long entries;
+    long bytes;
+};
+
+int file_cache_get(const HTTP_MESSAGE *request, HTTP_MESSAGE *response, const char *key);
+int file_cache_load(const HTTP_MESSAGE *request, HTTP_MESSAGE *response, const char *key,
+                    const char *path, int fd);
+void file_cache_clear(void);
+void file_cache_get_stats(struct file_cache_stats *stats);
@@ -0,0 +1,1575 @@
+/*
+    HTTP/2 connection mode (cleartext h2c)
+
+    A connection switches to HTTP/2 either with prior knowledge, when the HTTP/1 parser reads the
+    "PRI * HTTP/2.0" request that opens the connection preface, or through "Upgrade: h2c". From
+    then on the session owns the socket: frames are parsed out of an input buffer, every stream
+    gets its own request/response HTTP_MESSAGE pair and is served by the regular route handlers.
+
+    Control and HEADERS frames are queued in an output buffer. Response bodies are always files,
+    so each DATA frame is a 9-byte header followed by a sendfile() of the payload. DATA frames are
+    scheduled one at a time, round-robin across streams, within the peer's flow-control windows.
+*/
+
+#define _GNU_SOURCE
+
+#include "http2.h"
+
+#define HTTP2_UPGRADE_RESPONSE                                                                     \
+    "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+
+static uint32_t
+read_u32(const uint8_t *buf)
+{
+    return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8)
+           | buf[3];
+}
+
+static void
+write_u32(uint8_t *buf, uint32_t value)
+{
+    buf[0] = (value >> 24) & 0xff;
+    buf[1] = (value >> 16) & 0xff;
+    buf[2] = (value >> 8) & 0xff;
+    buf[3] = value & 0xff;
+}
+
+static void
+write_frame_header(uint8_t *buf, int length, uint8_t type, uint8_t flags, uint32_t stream_id)
+{
+    buf[0] = (length >> 16) & 0xff;
+    buf[1] = (length >> 8) & 0xff;
+    buf[2] = length & 0xff;
+    buf[3] = type;
+    buf[4] = flags;
+    write_u32(&buf[5], stream_id & 0x7fffffff);
+}
+
+/*
+    Makes room for length more bytes in the output buffer
+*/
+static int
+reserve_output(struct http2_session *session, int length)
+{
+    if (session->out_offset == session->out_length) {
+        session->out_offset = 0;
+        session->out_length = 0;
+    }
+
+    if (session->out_length + length <= session->out_capacity) {
+        return 0;
+    }
+
+    int capacity = MAX(session->out_capacity * 2, session->out_length + length);
+    uint8_t *out = realloc(session->out, MAX(capacity, 16 * KB));
+
+    if (!out) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+
+    session->out = out;
+    session->out_capacity = MAX(capacity, 16 * KB);
+    return 0;
+}
+
+static int
+queue_bytes(struct http2_session *session, const void *data, int length)
+{
+    if (reserve_output(session, length) != 0) {
+        return -1;
+    }
+
+    memcpy(session->out + session->out_length, data, length);
+    session->out_length += length;
+    return 0;
+}
+
+static int
+queue_frame(struct http2_session *session, uint8_t type, uint8_t flags, uint32_t stream_id,
+            const uint8_t *payload, int length)
+{
+    if (reserve_output(session, HTTP2_FRAME_HEADER_LENGTH + length) != 0) {
+        return -1;
+    }
+
+    write_frame_header(session->out + session->out_length, length, type, flags, stream_id);
+    session->out_length += HTTP2_FRAME_HEADER_LENGTH;
+
+    if (length > 0) {
+        memcpy(session->out + session->out_length, payload, length);
+        session->out_length += length;
+    }
+
+    return 0;
+}
+
+static int
+queue_u32_frame(struct http2_session *session, uint8_t type, uint32_t stream_id, uint32_t value)
+{
+    uint8_t payload[4];
+
+    write_u32(payload, value);
+    return queue_frame(session, type, 0, stream_id, payload, sizeof(payload));
+}
+
+/*
+    Queues a GOAWAY for a connection error, the caller then closes the connection
+
+    Always returns -1 so handlers can return it directly.
+*/
+static int
+connection_error(struct http2_session *session, uint32_t error_code)
+{
+    uint8_t payload[8];
+
+    fprintf(stderr, "[FD: %d] HTTP/2 connection error 0x%x\n", session->fd, error_code);
+
+    write_u32(&payload[0], session->last_stream_id);
+    write_u32(&payload[4], error_code);
+    queue_frame(session, HTTP2_GOAWAY, 0, 0, payload, sizeof(payload));
+    return -1;
+}
+
+/*
+    Allocates an empty HTTP_MESSAGE for a stream
+
+    calloc() rather than init_http_message() keeps the unused header slots from being touched.
+*/
+static HTTP_MESSAGE *
+new_http_message(void)
+{
+    HTTP_MESSAGE *msg = calloc(1, sizeof(HTTP_MESSAGE));
+
+    if (msg) {
+        msg->body_fd = -1;
+    }
+
+    return msg;
+}
+
+static void
+delete_http_message(HTTP_MESSAGE *msg)
+{
+    if (msg) {
+        free_http_message(msg);
+        free(msg);
+    }
+}
+
+static struct http2_stream *
+find_stream(struct http2_session *session, uint32_t id)
+{
+    for (int i = 0; i < HTTP2_MAX_STREAMS; i++) {
+        if (session->streams[i].state != HTTP2_STREAM_FREE && session->streams[i].id == id) {
+            return &session->streams[i];
+        }
+    }
+
+    return NULL;
+}
+
+static struct http2_stream *
+open_stream(struct http2_session *session, uint32_t id)
+{
+    for (int i = 0; i < HTTP2_MAX_STREAMS; i++) {
+        struct http2_stream *stream = &session->streams[i];
+
+        if (stream->state != HTTP2_STREAM_FREE) {
+            continue;
+        }
+
+        memset(stream, 0, sizeof(struct http2_stream));
+        stream->request = new_http_message();
+        stream->response = new_http_message();
+        stream->arena = arena_new();
+
+        if (!stream->request || !stream->response || !stream->arena) {
+            perror("Failed to allocate memory");
+            delete_http_message(stream->request);
+            delete_http_message(stream->response);
+            arena_free(stream->arena);
+            memset(stream, 0, sizeof(struct http2_stream));
+            return NULL;
+        }
+
+        stream->id = id;
+        stream->state = HTTP2_STREAM_OPEN;
+        stream->send_window = session->peer_initial_window;
+        stream->recv_window = HTTP2_RECV_WINDOW;
+        stream->request->start_line.request.method = HTTP_METHOD_UNKNOWN;
+        stream->request->start_line.request.protocol = HTTP_2_0;
+        stream->request->credentials = session->credentials;
+        stream->request->arena = stream->arena;
+        stream->response->start_line.response.protocol = HTTP_2_0;
+        stream->response->arena = stream->arena;
+        add_header(stream->response, "Server", SERVER_NAME);
+
+        return stream;
+    }
+
+    return NULL;
+}
+
+/*
+    Frees a stream slot, telling a streaming body handler to let go of its state
+
+    A stream whose DATA frame is half-written stays until the writer finishes that frame.
+*/
+static void
+release_stream(struct http2_session *session, struct http2_stream *stream)
+{
+    if (session->data_slot == stream - session->streams) {
+        stream->body_remaining = 0;
+        return;
+    }
+
+    if (stream->route && stream->route->stream_handler && stream->stream_state) {
+        stream->route->stream_handler(stream->request, stream->response, BODY_STREAM_ABORT, NULL,
+                                      0, &stream->stream_state);
+    }
+
+    delete_http_message(stream->request);
+    delete_http_message(stream->response);
+    arena_free(stream->arena);
+    free(stream->spool);
+    memset(stream, 0, sizeof(struct http2_stream));
+}
+
+static int
+reset_stream(struct http2_session *session, struct http2_stream *stream, uint32_t error_code)
+{
+    fprintf(stderr, "[FD: %d] HTTP/2 stream %u reset: 0x%x\n", session->fd, stream->id,
+            error_code);
+
+    int ret = queue_u32_frame(session, HTTP2_RST_STREAM, stream->id, error_code);
+    release_stream(session, stream);
+    return ret;
+}
+
+static bool
+has_paused_stream(const struct http2_session *session)
+{
+    for (int i = 0; i < HTTP2_MAX_STREAMS; i++) {
+        if (session->streams[i].state == HTTP2_STREAM_OPEN && session->streams[i].paused) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool
+has_active_stream(const struct http2_session *session)
+{
+    for (int i = 0; i < HTTP2_MAX_STREAMS; i++) {
+        if (session->streams[i].state != HTTP2_STREAM_FREE) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+    Whether the stream's request is served by a streaming body handler
+*/
+static bool
+is_stream_route(const struct http2_stream *stream)
+{
+    return stream->route && stream->route->stream_handler
+           && stream->route->method == (int) stream->request->start_line.request.method;
+}
+
+/*
+    Encodes the response head into HEADERS (+ CONTINUATION) frames and starts the body
+*/
+static int
+respond(struct http2_session *session, struct http2_stream *stream)
+{
+    static const char *connection_headers[]
+        = { "Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "Upgrade" };
+    HTTP_MESSAGE *response = stream->response;
+
+    // Connection-specific headers are not allowed in HTTP/2
+    for (size_t i = 0; i < sizeof(connection_headers) / sizeof(connection_headers[0]); i++) {
+        remove_header(response, connection_headers[i]);
+    }
+
+    if (add_body_headers(response) < 0) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error",
+                             NULL);
+    }
+
+    long body_length = response->body_fd != -1 ? get_file_length(response->body_fd) : 0;
+
+    // Literal encoding never grows a field by more than a few bytes of length prefixes
+    int block_size = 64;
+    for (int i = 0; i < response->header_count; i++) {
+        block_size += strlen(response->headers[i].key) + strlen(response->headers[i].value) + 16;
+    }
+
+    uint8_t *block = malloc(block_size);
+    if (!block) {
+        perror("Failed to allocate memory");
+        return connection_error(session, HTTP2_INTERNAL_ERROR);
+    }
+
+    char status[16];
+    int length = hpack_encode_block_start(&session->encoder, block, block_size);
+    int ret;
+
+    snprintf(status, sizeof(status), "%u", response->start_line.response.status_code);
+    ret = hpack_encode_header(&session->encoder, block + length, block_size - length, ":status",
+                              status, true);
+
+    for (int i = 0; i < response->header_count && ret >= 0 && length >= 0; i++) {
+        char name[MAX_HEADER_LENGTH];
+        int j;
+
+        length += ret;
+
+        for (j = 0; response->headers[i].key[j] != '\0'; j++) {
+            name[j] = tolower((unsigned char) response->headers[i].key[j]);
+        }
+        name[j] = '\0';
+
+        // Content-Length changes with every response, so keep it out of the dynamic table
+        ret = hpack_encode_header(&session->encoder, block + length, block_size - length, name,
+                                  response->headers[i].value, strcmp(name, "content-length") != 0);
+    }
+
+    if (ret < 0 || length < 0) {
+        free(block);
+        return connection_error(session, HTTP2_COMPRESSION_ERROR);
+    }
+    length += ret;
+
+    // Header blocks larger than a frame continue in CONTINUATION frames
+    int offset = 0;
+    do {
+        int chunk = MIN(length - offset, session->peer_max_frame_size);
+        uint8_t flags = 0;
+
+        if (offset + chunk == length) {
+            flags |= HTTP2_FLAG_END_HEADERS;
+        }
+        if (offset == 0 && body_length == 0) {
+            flags |= HTTP2_FLAG_END_STREAM;
+        }
+
+        if (queue_frame(session, offset == 0 ? HTTP2_HEADERS : HTTP2_CONTINUATION, flags,
+                        stream->id, block + offset, chunk)
+            != 0) {
+            free(block);
+            return -1;
+        }
+        offset += chunk;
+    } while (offset < length);
+
+    free(block);
+
+    stream->state = HTTP2_STREAM_SENDING;
+    stream->body_offset = 0;
+    stream->body_remaining = body_length;
+
+    if (body_length == 0) {
+        release_stream(session, stream);
+    }
+
+    return 0;
+}
+
+/*
+    Runs the route for a complete request and queues the response
+*/
+static int
+dispatch_stream(struct http2_session *session, struct http2_stream *stream)
+{
+    HTTP_MESSAGE *request = stream->request;
+    HTTP_MESSAGE *response = stream->response;
+
+    request->body_length = request->body_received;
+    if (request->body_fd != -1 && lseek(request->body_fd, 0, SEEK_SET) == -1) {
+        perror("lseek");
+    }
+
+    // Print HTTP Request for DEBUG purposes
+    print_http_message(request, REQUEST);
+
+    int retry_after = rate_limit_take(session->client_address);
+
+    if (retry_after > 0) {
+        char retry_after_str[16];
+
+        snprintf(retry_after_str, sizeof(retry_after_str), "%d", retry_after);
+        build_error_response(response, STATUS_TOO_MANY_REQUESTS, "Too Many Requests", NULL);
+        add_header(response, "Retry-After", retry_after_str);
+    } else if (stream->bad_request) {
+        build_error_response(response, STATUS_BAD_REQUEST, "Bad Request", NULL);
+    } else if (is_stream_route(stream)) {
+        if (stream->route->stream_handler(request, response, BODY_STREAM_END, NULL, 0,
+                                          &stream->stream_state)
+            < 0) {
+            // error response is built inside the handler
+            fprintf(stderr, "Streaming body handler failed\n");
+        }
+    } else if (stream->route && stream->route->upstream
+               && route_allows_method(stream->route, request->start_line.request.method)) {
+        // Proxied responses are spliced straight into the client socket, which a stream cannot do
+        build_error_response(response, STATUS_BAD_GATEWAY, "Bad Gateway", NULL);
+    } else if (session->router(request, response) != 0) {
+        // error response is built inside the router
+        fprintf(stderr, "Failed to route HTTP/2 request\n");
+    }
+
+    // Print the built HTTP Response for DEBUG purposes
+    print_http_message(response, RESPONSE);
+
+    return respond(session, stream);
+}
+
+/*
+    Hands request body bytes to the streaming body handler, or spools them to a temp file
+*/
+static int
+deliver_body(struct http2_session *session, struct http2_stream *stream, const char *data,
+             int length)
+{
+    HTTP_MESSAGE *request = stream->request;
+
+    if (length == 0) {
+        return 0;
+    }
+
+    // Past the route's limit nothing more is stored, whatever Content-Length said
+    if (request->body_received + length > route_max_body(stream->route)) {
+        build_error_response(stream->response, STATUS_CONTENT_TOO_LARGE, "Content Too Large",
+                             NULL);
+        return respond(session, stream);
+    }
+
+    if (is_stream_route(stream)) {
+        int ret = stream->route->stream_handler(request, stream->response, BODY_STREAM_DATA, data,
+                                                length, &stream->stream_state);
+        request->body_received += length;
+
+        if (ret < 0) {
+            // error response is built inside the handler
+            fprintf(stderr, "Streaming body handler rejected the request\n");
+            return respond(session, stream);
+        } else if (ret == BODY_STREAM_PAUSE) {
+            stream->paused = true;
+        }
+        return 0;
+    }
+
+    if (request->body_fd == -1) {
+        int expected = (int) get_content_length(request);
+
+        if (http_message_open_temp_file(request, MAX(expected, length)) != 0) {
+            build_error_response(stream->response, STATUS_INTERNAL_SERVER_ERROR,
+                                 "Internal Server Error", NULL);
+            return respond(session, stream);
+        }
+    }
+
+    if (write(request->body_fd, data, length) != length) {
+        perror("Failed to write to temp file");
+        build_error_response(stream->response, STATUS_INTERNAL_SERVER_ERROR,
+                             "Internal Server Error", NULL);
+        return respond(session, stream);
+    }
+
+    request->body_received += length;
+    return 0;
+}
+
+/*
+    Returns consumed request bytes to the client once half the stream window is used up
+*/
+static int
+replenish_stream_window(struct http2_session *session, struct http2_stream *stream)
+{
+    if (stream->paused || stream->end_stream || stream->recv_unacked < HTTP2_RECV_WINDOW / 2) {
+        return 0;
+    }
+
+    int ret = queue_u32_frame(session, HTTP2_WINDOW_UPDATE, stream->id, stream->recv_unacked);
+    stream->recv_window += stream->recv_unacked;
+    stream->recv_unacked = 0;
+    return ret;
+}
+
+static int
+end_of_request(struct http2_session *session, struct http2_stream *stream)
+{
+    stream->end_stream = true;
+
+    // A paused handler gets the rest of the body, and then the END event, once it resumes
+    if (stream->paused) {
+        return 0;
+    }
+
+    return dispatch_stream(session, stream);
+}
+
+/*
+    Maps one decoded request header onto the stream's HTTP_MESSAGE
+*/
+static void
+add_request_header(void *ctx, const char *name, int name_length, const char *value,
+                   int value_length)
+{
+    struct http2_stream *stream = ctx;
+    HTTP_MESSAGE *request = stream->request;
+
+    if (stream->bad_request) {
+        return;
+    }
+
+    if (name_length >= MAX_HEADER_LENGTH || value_length >= MAX_HEADER_LENGTH) {
+        stream->bad_request = true;
+        return;
+    }
+
+    if (name[0] == ':') {
+        if (strcmp(name, ":method") == 0) {
+            set_http_method_from_string(value, &request->start_line.request.method);
+        } else if (strcmp(name, ":path") == 0) {
+            if (value_length >= MAX_TARGET_LENGTH) {
+                stream->bad_request = true;
+                return;
+            }
+            memcpy(request->start_line.request.request_target, value, value_length + 1);
+        } else if (strcmp(name, ":authority") == 0) {
+            stream->bad_request = add_header(request, "Host", value) != 0;
+        } else if (strcmp(name, ":scheme") != 0) {
+            stream->bad_request = true;
+        }
+        return;
+    }
+
+    // Cookie crumbs are joined back into a single header (RFC 9113 8.2.3)
+    const char *cookie
+        = strcmp(name, "cookie") == 0 ? get_known_header(request, HEADER_COOKIE) : NULL;
+
+    if (cookie) {
+        char joined[MAX_HEADER_LENGTH];
+
+        if ((size_t) snprintf(joined, sizeof(joined), "%s; %s", cookie, value) >= sizeof(joined)) {
+            stream->bad_request = true;
+            return;
+        }
+        add_header(request, name, joined);
+        return;
+    }
+
+    if (add_header(request, name, value) != 0) {
+        stream->bad_request = true;
+    }
+}
+
+/*
+    Header callback for blocks that only need decoding to keep the HPACK table in sync
+*/
+static void
+discard_header(void *ctx, const char *name, int name_length, const char *value, int value_length)
+{
+    (void) ctx;
+    (void) name;
+    (void) name_length;
+    (void) value;
+    (void) value_length;
+}
+
+/*
+    Handles a complete header block: a new request, or trailers on an open one
+*/
+static int
+finish_header_block(struct http2_session *session, uint32_t id, bool end_stream)
+{
+    const uint8_t *block = session->header_block;
+    int block_length = session->header_block_length;
+    struct http2_stream *stream = find_stream(session, id);
+
+    session->header_block_length = 0;
+
+    if (stream || id <= session->last_stream_id) {
+        // Trailers are not passed on to handlers
+        if (hpack_decode(&session->decoder, block, block_length, discard_header, NULL) != 0) {
+            return connection_error(session, HTTP2_COMPRESSION_ERROR);
+        }
+
+        if (!stream) {
+            return queue_u32_frame(session, HTTP2_RST_STREAM, id, HTTP2_STREAM_CLOSED);
+        }
+        if (stream->state != HTTP2_STREAM_OPEN) {
+            return 0;
+        }
+        if (!end_stream || stream->end_stream) {
+            return reset_stream(session, stream, HTTP2_PROTOCOL_ERROR);
+        }
+
+        return end_of_request(session, stream);
+    }
+
+    session->last_stream_id = id;
+
+    if (session->goaway_sent || (stream = open_stream(session, id)) == NULL) {
+        if (hpack_decode(&session->decoder, block, block_length, discard_header, NULL) != 0) {
+            return connection_error(session, HTTP2_COMPRESSION_ERROR);
+        }
+        return queue_u32_frame(session, HTTP2_RST_STREAM, id, HTTP2_REFUSED_STREAM);
+    }
+
+    if (hpack_decode(&session->decoder, block, block_length, add_request_header, stream) != 0) {
+        return connection_error(session, HTTP2_COMPRESSION_ERROR);
+    }
+
+    HTTP_MESSAGE *request = stream->request;
+
+    if (request->start_line.request.request_target[0] == '\0') {
+        stream->bad_request = true;
+    }
+
+    stream->route
+        = find_route(request->start_line.request.request_target, request->start_line.request.method);
+
+    fprintf(stderr, "[FD: %d] HTTP/2 stream %u opened: %s\n", session->fd, id,
+            request->start_line.request.request_target);
+
+    // Shed before any of the body arrives, the stream's messages are already charged and a
+    // streamed body is never held, so only a spooled one is charged for on top
+    long held = is_stream_route(stream) ? 0 : get_content_length(request);
+
+    if (!memory_budget_admit(http2_memory_usage(session), held)) {
+        build_error_response(stream->response, STATUS_SERVICE_UNAVAILABLE, "Service Unavailable",
+                             NULL);
+        add_header(stream->response, "Retry-After", "1");
+        return respond(session, stream);
+    }
+
+    if (end_stream) {
+        return end_of_request(session, stream);
+    }
+
+    // A body the route refuses is answered before any of it arrives
+    if (get_content_length(request) > route_max_body(stream->route)) {
+        build_error_response(stream->response, STATUS_CONTENT_TOO_LARGE, "Content Too Large",
+                             NULL);
+        return respond(session, stream);
+    }
+
+    return 0;
+}
+
+/*
+    Appends a HEADERS or CONTINUATION fragment, decoding once the block is complete
+*/
+static int
+append_header_block(struct http2_session *session, uint32_t id, bool end_stream,
+                    bool end_headers, const uint8_t *fragment, int length)
+{
+    if (session->header_block_length + length > HTTP2_HEADER_BLOCK_SIZE) {
+        return connection_error(session, HTTP2_ENHANCE_YOUR_CALM);
+    }
+
+    if (!session->header_block && !(session->header_block = malloc(HTTP2_HEADER_BLOCK_SIZE))) {
+        perror("Failed to allocate memory");
+        return connection_error(session, HTTP2_INTERNAL_ERROR);
+    }
+
+    memcpy(session->header_block + session->header_block_length, fragment, length);
+    session->header_block_length += length;
+
+    if (!end_headers) {
+        session->header_stream_id = id;
+        session->header_end_stream = end_stream;
+        return 0;
+    }
+
+    session->header_stream_id = 0;
+    return finish_header_block(session, id, end_stream);
+}
+
+/*
+    Strips the padding of a DATA or HEADERS payload
+*/
+static int
+strip_padding(uint8_t flags, const uint8_t **payload, int *length)
+{
+    if (!(flags & HTTP2_FLAG_PADDED)) {
+        return 0;
+    }
+
+    if (*length < 1 || (*payload)[0] >= *length) {
+        return -1;
+    }
+
+    *length -= 1 + (*payload)[0];
+    *payload += 1;
+    return 0;
+}
+
+static int
+handle_headers(struct http2_session *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+               int length)
+{
+    if (id == 0 || id % 2 == 0 || strip_padding(flags, &payload, &length) != 0) {
+        return connection_error(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    // Priority information is ignored, streams are served round-robin
+    if (flags & HTTP2_FLAG_PRIORITY) {
+        if (length < 5) {
+            return connection_error(session, HTTP2_FRAME_SIZE_ERROR);
+        }
+        payload += 5;
+        length -= 5;
+    }
+
+    return append_header_block(session, id, flags & HTTP2_FLAG_END_STREAM,
+                               flags & HTTP2_FLAG_END_HEADERS, payload, length);
+}
+
+static int
+handle_data(struct http2_session *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+            int length)
+{
+    int frame_length = length;
+
+    if (id == 0 || strip_padding(flags, &payload, &length) != 0) {
+        return connection_error(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    // The connection window covers every DATA frame, padding included, and a client that
+    // sends past what it was granted ignores flow control altogether
+    if (frame_length > session->recv_window) {
+        return connection_error(session, HTTP2_FLOW_CONTROL_ERROR);
+    }
+
+    session->recv_window -= frame_length;
+    session->recv_unacked += frame_length;
+    if (session->recv_unacked >= HTTP2_RECV_WINDOW / 2) {
+        if (queue_u32_frame(session, HTTP2_WINDOW_UPDATE, 0, session->recv_unacked) != 0) {
+            return -1;
+        }
+        session->recv_window += session->recv_unacked;
+        session->recv_unacked = 0;
+    }
+
+    struct http2_stream *stream = find_stream(session, id);
+
+    if (!stream) {
+        if (id > session->last_stream_id) {
+            return connection_error(session, HTTP2_PROTOCOL_ERROR);
+        }
+        return queue_u32_frame(session, HTTP2_RST_STREAM, id, HTTP2_STREAM_CLOSED);
+    }
+
+    // Whatever is still uploaded after an early response is dropped
+    if (stream->state != HTTP2_STREAM_OPEN) {
+        return 0;
+    }
+
+    if (stream->end_stream) {
+        return reset_stream(session, stream, HTTP2_STREAM_CLOSED);
+    }
+
+    // No WINDOW_UPDATE goes out while paused, so the window also bounds the spool
+    if (frame_length > stream->recv_window) {
+        return reset_stream(session, stream, HTTP2_FLOW_CONTROL_ERROR);
+    }
+
+    stream->recv_window -= frame_length;
+    stream->recv_unacked += frame_length;
+
+    if (stream->paused) {
+        char *spool = realloc(stream->spool, stream->spool_length + length);
+        if (!spool && length > 0) {
+            perror("Failed to allocate memory");
+            return reset_stream(session, stream, HTTP2_INTERNAL_ERROR);
+        }
+
+        memcpy(spool + stream->spool_length, payload, length);
+        stream->spool = spool;
+        stream->spool_length += length;
+    } else if (deliver_body(session, stream, (const char *) payload, length) != 0) {
+        return -1;
+    }
+
+    if (stream->state != HTTP2_STREAM_OPEN) {
+        return 0;
+    }
+
+    if (flags & HTTP2_FLAG_END_STREAM) {
+        return end_of_request(session, stream);
+    }
+
+    return replenish_stream_window(session, stream);
+}
+
+/*
+    Applies a SETTINGS payload from the peer
+
+    Returns 0, or the HTTP/2 error code of a connection error
+*/
+static uint32_t
+apply_settings(struct http2_session *session, const uint8_t *payload, int length)
+{
+    for (int i = 0; i + 6 <= length; i += 6) {
+        int id = (payload[i] << 8) | payload[i + 1];
+        uint32_t value = read_u32(&payload[i + 2]);
+
+        switch (id) {
+        case HTTP2_SETTINGS_HEADER_TABLE_SIZE:
+            hpack_table_set_max_size(&session->encoder, MIN(value, HPACK_DEFAULT_TABLE_SIZE));
+            break;
+
+        case HTTP2_SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                return HTTP2_PROTOCOL_ERROR;
+            }
+            break;
+
+        case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE: {
+            if (value > HTTP2_MAX_WINDOW) {
+                return HTTP2_FLOW_CONTROL_ERROR;
+            }
+
+            // The change applies to the windows of every open stream
+            long delta = (long) value - session->peer_initial_window;
+
+            for (int j = 0; j < HTTP2_MAX_STREAMS; j++) {
+                if (session->streams[j].state == HTTP2_STREAM_FREE) {
+                    continue;
+                }
+                session->streams[j].send_window += delta;
+                if (session->streams[j].send_window > HTTP2_MAX_WINDOW) {
+                    return HTTP2_FLOW_CONTROL_ERROR;
+                }
+            }
+            session->peer_initial_window = value;
+            break;
+        }
+
+        case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < 16 * KB || value > 0xffffff) {
+                return HTTP2_PROTOCOL_ERROR;
+            }
+            session->peer_max_frame_size = value;
+            break;
+
+        default:
+            // SETTINGS_MAX_CONCURRENT_STREAMS only limits pushes, which are never sent
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static int
+handle_settings(struct http2_session *session, uint8_t flags, uint32_t id, const uint8_t *payload,
+                int length)
+{
+    if (id != 0) {
+        return connection_error(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    if (flags & HTTP2_FLAG_ACK) {
+        return length == 0 ? 0 : connection_error(session, HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    if (length % 6 != 0) {
+        return connection_error(session, HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    uint32_t error_code = apply_settings(session, payload, length);
+    if (error_code != 0) {
+        return connection_error(session, error_code);
+    }
+
+    return queue_frame(session, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, NULL, 0);
+}
+
+static int
+handle_window_update(struct http2_session *session, uint32_t id, const uint8_t *payload,
+                     int length)
+{
+    if (length != 4) {
+        return connection_error(session, HTTP2_FRAME_SIZE_ERROR);
+    }
+
+    uint32_t increment = read_u32(payload) & 0x7fffffff;
+
+    if (id == 0) {
+        if (increment == 0) {
+            return connection_error(session, HTTP2_PROTOCOL_ERROR);
+        }
+        session->send_window += increment;
+        if (session->send_window > HTTP2_MAX_WINDOW) {
+            return connection_error(session, HTTP2_FLOW_CONTROL_ERROR);
+        }
+        return 0;
+    }
+
+    struct http2_stream *stream = find_stream(session, id);
+
+    if (!stream) {
+        return 0;
+    }
+
+    if (increment == 0) {
+        return reset_stream(session, stream, HTTP2_PROTOCOL_ERROR);
+    }
+
+    stream->send_window += increment;
+    if (stream->send_window > HTTP2_MAX_WINDOW) {
+        return reset_stream(session, stream, HTTP2_FLOW_CONTROL_ERROR);
+    }
+
+    return 0;
+}
+
+static int
+handle_frame(struct http2_session *session, uint8_t type, uint8_t flags, uint32_t id,
+             const uint8_t *payload, int length)
+{
+    struct http2_stream *stream;
+
+    // A header block must not be interleaved with any other frame
+    if (session->header_stream_id != 0
+        && (type != HTTP2_CONTINUATION || id != session->header_stream_id)) {
+        return connection_error(session, HTTP2_PROTOCOL_ERROR);
+    }
+
+    switch (type) {
+    case HTTP2_DATA:
+        return handle_data(session, flags, id, payload, length);
+
+    case HTTP2_HEADERS:
+        return handle_headers(session, flags, id, payload, length);
+
+    case HTTP2_CONTINUATION:
+        if (session->header_stream_id == 0) {
+            return connection_error(session, HTTP2_PROTOCOL_ERROR);
+        }
+        return append_header_block(session, id, session->header_end_stream,
+                                   flags & HTTP2_FLAG_END_HEADERS, payload, length);
+
+    case HTTP2_PRIORITY:
+        if (id == 0) {
+            return connection_error(session, HTTP2_PROTOCOL_ERROR);
+        }
+        if (length != 5 && (stream = find_stream(session, id)) != NULL) {
+            return reset_stream(session, stream, HTTP2_FRAME_SIZE_ERROR);
+        }
+        return 0;
+
+    case HTTP2_RST_STREAM:
+        if (length != 4) {
+            return connection_error(session, HTTP2_FRAME_SIZE_ERROR);
+        }
+        if (id == 0 || id > session->last_stream_id) {
+            return connection_error(session, HTTP2_PROTOCOL_ERROR);
+        }
+        if ((stream = find_stream(session, id)) != NULL) {
+            fprintf(stderr, "[FD: %d] HTTP/2 stream %u cancelled by the client\n", session->fd,
+                    id);
+            release_stream(session, stream);
+        }
+        return 0;
+
+    case HTTP2_SETTINGS:
+        return handle_settings(session, flags, id, payload, length);
+
+    case HTTP2_PUSH_PROMISE:
+        return connection_error(session, HTTP2_PROTOCOL_ERROR);
+
+    case HTTP2_PING:
+        if (length != 8) {
+            return connection_error(session, HTTP2_FRAME_SIZE_ERROR);
+        }
+        if (id != 0) {
+            return connection_error(session, HTTP2_PROTOCOL_ERROR);
+        }
+        if (flags & HTTP2_FLAG_ACK) {
+            return 0;
+        }
+        return queue_frame(session, HTTP2_PING, HTTP2_FLAG_ACK, 0, payload, length);
+
+    case HTTP2_GOAWAY:
+        if (id != 0) {
+            return connection_error(session, HTTP2_PROTOCOL_ERROR);
+        }
+        session->goaway_received = true;
+        return 0;
+
+    case HTTP2_WINDOW_UPDATE:
+        return handle_window_update(session, id, payload, length);
+
+    default:
+        // Unknown frame types must be ignored
+        return 0;
+    }
+}
+
+/*
+    Matches the connection preface, then handles every complete frame in the input buffer
+*/
+static int
+process_input(struct http2_session *session)
+{
+    int pos = 0;
+    int ret = 0;
+
+    while (session->preface_offset < HTTP2_PREFACE_LENGTH && pos < session->input_length) {
+        if (session->input[pos] != (uint8_t) HTTP2_PREFACE[session->preface_offset]) {
+            fprintf(stderr, "[FD: %d] Invalid HTTP/2 connection preface\n", session->fd);
+            return connection_error(session, HTTP2_PROTOCOL_ERROR);
+        }
+        pos++;
+        session->preface_offset++;
+    }
+
+    while (session->preface_offset == HTTP2_PREFACE_LENGTH
+           && session->input_length - pos >= HTTP2_FRAME_HEADER_LENGTH) {
+        const uint8_t *header = &session->input[pos];
+        int length = (header[0] << 16) | (header[1] << 8) | header[2];
+
+        if (length > HTTP2_MAX_FRAME_SIZE) {
+            ret = connection_error(session, HTTP2_FRAME_SIZE_ERROR);
+            break;
+        }
+
+        if (session->input_length - pos < HTTP2_FRAME_HEADER_LENGTH + length) {
+            break;
+        }
+
+        ret = handle_frame(session, header[3], header[4], read_u32(&header[5]) & 0x7fffffff,
+                           header + HTTP2_FRAME_HEADER_LENGTH, length);
+        pos += HTTP2_FRAME_HEADER_LENGTH + length;
+
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    memmove(session->input, session->input + pos, session->input_length - pos);
+    session->input_length -= pos;
+
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+    Reads and handles frames until the socket would block
+
+    Returns 0, or -1 when the connection must be closed
+*/
+static int
+read_input(struct http2_session *session)
+{
+    while (1) {
+        // process_input() never leaves a whole frame behind, so there is always room
+        ssize_t n = recv(session->fd, session->input + session->input_length,
+                         sizeof(session->input) - session->input_length, 0);
+
+        if (n == 0) {
+            fprintf(stderr, "[FD: %d] Client closed the HTTP/2 connection\n", session->fd);
+            return -1;
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("recv");
+            return -1;
+        }
+
+        session->input_length += n;
+
+        if (process_input(session) < 0) {
+            return -1;
+        }
+    }
+}
+
+/*
+    Picks the next stream allowed to send DATA, round-robin, and frames up to one frame of it
+*/
+static int
+schedule_data(struct http2_session *session)
+{
+    if (session->send_window <= 0) {
+        return 1;
+    }
+
+    for (int i = 0; i < HTTP2_MAX_STREAMS; i++) {
+        int slot = (session->next_slot + i) % HTTP2_MAX_STREAMS;
+        struct http2_stream *stream = &session->streams[slot];
+
+        if (stream->state != HTTP2_STREAM_SENDING || stream->body_remaining <= 0
+            || stream->send_window <= 0) {
+            continue;
+        }
+
+        long length = MIN(stream->body_remaining, (long) session->peer_max_frame_size);
+        length = MIN(length, MIN(stream->send_window, session->send_window));
+
+        write_frame_header(session->data_header, length, HTTP2_DATA,
+                           length == stream->body_remaining ? HTTP2_FLAG_END_STREAM : 0,
+                           stream->id);
+        session->data_header_sent = 0;
+        session->data_remaining = length;
+        session->data_slot = slot;
+
+        stream->body_remaining -= length;
+        stream->send_window -= length;
+        session->send_window -= length;
+        session->next_slot = slot + 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/*
+    Writes queued frames and DATA until the socket would block or nothing is left
+
+    A DATA frame, once started, is finished before anything else goes on the wire.
+
+    Returns 0 when idle, 1 when blocked on EPOLLOUT, -1 on error
+*/
+static int
+flush_output(struct http2_session *session)
+{
+    ssize_t n;
+
+    while (1) {
+        if (session->data_slot != -1) {
+            struct http2_stream *stream = &session->streams[session->data_slot];
+
+            while (session->data_header_sent < HTTP2_FRAME_HEADER_LENGTH) {
+                n = send(session->fd, session->data_header + session->data_header_sent,
+                         HTTP2_FRAME_HEADER_LENGTH - session->data_header_sent, MSG_MORE);
+                if (n == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+                }
+                session->data_header_sent += n;
+            }
+
+            while (session->data_remaining > 0) {
+                n = sendfile(session->fd, stream->response->body_fd, &stream->body_offset,
+                             session->data_remaining);
+                if (n == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+                } else if (n == 0) {
+                    // The frame length is already on the wire, the connection cannot recover
+                    fprintf(stderr, "[FD: %d] Response body ended early\n", session->fd);
+                    return -1;
+                }
+                session->data_remaining -= n;
+            }
+
+            session->data_slot = -1;
+            if (stream->body_remaining == 0) {
+                release_stream(session, stream);
+            }
+            continue;
+        }
+
+        if (session->out_offset < session->out_length) {
+            n = send(session->fd, session->out + session->out_offset,
+                     session->out_length - session->out_offset, 0);
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+            }
+            session->out_offset += n;
+            continue;
+        }
+
+        if (schedule_data(session) != 0) {
+            return 0;
+        }
+    }
+}
+
+/*
+    Decodes the base64url token68 of an HTTP2-Settings header
+*/
+static int
+decode_base64url(const char *src, uint8_t *dst, int dst_size)
+{
+    static const char alphabet[]
+        = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    uint32_t bits = 0;
+    int bit_count = 0;
+    int length = 0;
+
+    for (; *src != '\0' && *src != '='; src++) {
+        const char *pos = strchr(alphabet, *src);
+
+        if (!pos) {
+            return -1;
+        }
+
+        bits = (bits << 6) | (uint32_t) (pos - alphabet);
+        bit_count += 6;
+
+        if (bit_count >= 8) {
+            bit_count -= 8;
+            if (length >= dst_size) {
+                return -1;
+            }
+            dst[length++] = (bits >> bit_count) & 0xff;
+        }
+    }
+
+    return length;
+}
+
+/*
+    Whether the "request" the HTTP/1 parser just read is the start of the HTTP/2 preface
+*/
+bool
+http2_is_preface(const HTTP_MESSAGE *request)
+{
+    return HTTP2_CLEARTEXT && request->start_line.request.method == HTTP_METHOD_UNKNOWN
+           && request->start_line.request.protocol == HTTP_2_0
+           && strcmp(request->start_line.request.request_target, "*") == 0;
+}
+
+/*
+    Whether an HTTP/1.1 request asks to upgrade to h2c
+
+    Requests with a body are served over HTTP/1.1, as the upgrade is optional for the server.
+*/
+bool
+http2_is_upgrade(const HTTP_MESSAGE *request)
+{
+    return HTTP2_CLEARTEXT && request->start_line.request.protocol == HTTP_1_1
+           && header_has_token(get_known_header(request, HEADER_UPGRADE), "h2c")
+           && get_known_header(request, HEADER_HTTP2_SETTINGS) && get_content_length(request) == 0;
+}
+
+/*
+    Switches a connection to HTTP/2
+
+    With upgrade set, conn->request is the HTTP/1.1 request that asked for it: a 101 is queued and
+    the request is served as stream 1. Otherwise the HTTP/1 parser has consumed the first line of
+    the connection preface. Bytes read past the request head are handed to the session.
+
+    Returns 0, or -1 if the connection must be closed
+*/
+int
+http2_start(struct conn *conn, int epoll_fd, bool upgrade, request_handler router)
+{
+    struct http2_session *session = calloc(1, sizeof(struct http2_session));
+
+    if (!session) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+
+    session->fd = conn->fd;
+    memcpy(session->client_address, conn->client_address, sizeof(session->client_address));
+    session->credentials = conn->credentials;
+    session->router = router;
+    session->data_slot = -1;
+    session->peer_initial_window = HTTP2_DEFAULT_WINDOW;
+    session->send_window = HTTP2_DEFAULT_WINDOW;
+    // Opened up to this by the WINDOW_UPDATE sent along with our SETTINGS
+    session->recv_window = HTTP2_RECV_WINDOW;
+    session->peer_max_frame_size = HTTP2_MAX_FRAME_SIZE;
+    hpack_table_init(&session->decoder, HPACK_DEFAULT_TABLE_SIZE);
+    hpack_table_init(&session->encoder, HPACK_DEFAULT_TABLE_SIZE);
+    conn->http2 = session;
+
+    HTTP_MESSAGE *request = conn->request;
+    int buffered_length = request->buffered_length;
+
+    if (upgrade) {
+        uint8_t settings[HTTP2_MAX_FRAME_SIZE];
+        int settings_length = decode_base64url(get_known_header(request, HEADER_HTTP2_SETTINGS),
+                                               settings, sizeof(settings));
+
+        if (settings_length < 0 || settings_length % 6 != 0
+            || apply_settings(session, settings, settings_length) != 0) {
+            fprintf(stderr, "[FD: %d] Invalid HTTP2-Settings header\n", conn->fd);
+            return -1;
+        }
+
+        queue_bytes(session, HTTP2_UPGRADE_RESPONSE, strlen(HTTP2_UPGRADE_RESPONSE));
+    } else {
+        session->preface_offset = HTTP2_PREFACE_REQUEST_LENGTH;
+    }
+
+    // Our SETTINGS must be the first frame, then the connection window is opened up
+    uint8_t settings[12];
+
+    settings[0] = 0;
+    settings[1] = HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    write_u32(&settings[2], HTTP2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = HTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+    write_u32(&settings[8], HTTP2_RECV_WINDOW);
+
+    if (queue_frame(session, HTTP2_SETTINGS, 0, 0, settings, sizeof(settings)) != 0
+        || queue_u32_frame(session, HTTP2_WINDOW_UPDATE, 0,
+                           HTTP2_RECV_WINDOW - HTTP2_DEFAULT_WINDOW)
+               != 0) {
+        return -1;
+    }
+
+    if (buffered_length > 0) {
+        memcpy(session->input, conn->buffer, buffered_length);
+        session->input_length = buffered_length;
+    }
+
+    if (upgrade) {
+        struct http2_stream *stream = open_stream(session, 1);
+
+        if (!stream) {
+            return -1;
+        }
+
+        // The upgrade request becomes stream 1, already half-closed by the client
+        delete_http_message(stream->request);
+        stream->request = request;
+        stream->request->credentials = session->credentials;
+        stream->request->arena = stream->arena;
+        conn->request = NULL;
+        remove_header(request, "Upgrade");
+        remove_header(request, "HTTP2-Settings");
+        remove_header(request, "Connection");
+        request->buffered_length = 0;
+        stream->route = find_route(request->start_line.request.request_target,
+                                   request->start_line.request.method);
+        session->last_stream_id = 1;
+
+        if (end_of_request(session, stream) < 0) {
+            return -1;
+        }
+    }
+
+    // The session has its own buffers from here on
+    free(conn->buffer);
+    conn->buffer = NULL;
+    delete_http_message(conn->request);
+    conn->request = NULL;
+    delete_http_message(conn->response);
+    conn->response = NULL;
+
+    set_conn_state(conn, HTTP2);
+
+    struct epoll_event ev = { 0 };
+
+    ev.events = DUPLEX_EPOLL_FLAGS;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        return -1;
+    }
+
+    if (process_input(session) < 0) {
+        flush_output(session);
+        return -1;
+    }
+
+    return http2_handle_event(conn, EPOLLIN);
+}
+
+/*
+    Handles an epoll event on an HTTP/2 connection
+
+    Returns 0, or -1 if the connection must be closed
+*/
+int
+http2_handle_event(struct conn *conn, uint32_t events)
+{
+    struct http2_session *session = conn->http2;
+    int ret = 0;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        return -1;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        ret = read_input(session);
+    }
+
+    // Also sends the GOAWAY of a connection error, as far as the socket takes it
+    int flushed = flush_output(session);
+
+    if (ret < 0 || flushed < 0) {
+        return -1;
+    }
+
+    conn->body_paused = has_paused_stream(session);
+
+    // Once either side sent GOAWAY, the connection is done with its last stream
+    if ((session->goaway_received || session->goaway_sent) && flushed == 0
+        && !has_active_stream(session)) {
+        fprintf(stderr, "[FD: %d] HTTP/2 connection finished\n", conn->fd);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Polls paused streaming body handlers, feeding them what arrived while they were paused
+
+    Returns 0, or -1 if the connection must be closed
+*/
+int
+http2_resume_streams(struct conn *conn)
+{
+    struct http2_session *session = conn->http2;
+
+    for (int i = 0; i < HTTP2_MAX_STREAMS; i++) {
+        struct http2_stream *stream = &session->streams[i];
+
+        if (stream->state != HTTP2_STREAM_OPEN || !stream->paused) {
+            continue;
+        }
+
+        int ret = stream->route->stream_handler(stream->request, stream->response,
+                                                BODY_STREAM_RESUME, NULL, 0,
+                                                &stream->stream_state);
+        if (ret < 0) {
+            // error response is built inside the handler
+            if (respond(session, stream) < 0) {
+                return -1;
+            }
+            continue;
+        } else if (ret != BODY_STREAM_CONTINUE) {
+            continue;
+        }
+
+        stream->paused = false;
+
+        if (stream->spool_length > 0) {
+            char *spool = stream->spool;
+            int spool_length = stream->spool_length;
+
+            stream->spool = NULL;
+            stream->spool_length = 0;
+            ret = deliver_body(session, stream, spool, spool_length);
+            free(spool);
+
+            if (ret < 0) {
+                return -1;
+            }
+        }
+
+        if (stream->state != HTTP2_STREAM_OPEN || stream->paused) {
+            continue;
+        }
+
+        if ((stream->end_stream ? dispatch_stream(session, stream)
+                                : replenish_stream_window(session, stream))
+            < 0) {
+            return -1;
+        }
+    }
+
+    conn->body_paused = has_paused_stream(session);
+
+    return flush_output(session) < 0 ? -1 : 0;
+}
+
+/*
+    Sends GOAWAY so the client takes new requests elsewhere, streams already open still finish
+
+    Returns 0, or -1 if the connection can be closed right away
+*/
+int
+http2_drain(struct conn *conn)
+{
+    struct http2_session *session = conn->http2;
+    uint8_t payload[8];
+
+    if (session->goaway_sent) {
+        return 0;
+    }
+
+    write_u32(&payload[0], session->last_stream_id);
+    write_u32(&payload[4], HTTP2_NO_ERROR);
+    session->goaway_sent = true;
+
+    if (queue_frame(session, HTTP2_GOAWAY, 0, 0, payload, sizeof(payload)) != 0) {
+        return -1;
+    }
+
+    int flushed = flush_output(session);
+
+    return flushed < 0 || (flushed == 0 && !has_active_stream(session)) ? -1 : 0;
+}
+
+/*
+    Bytes the session holds for the memory budget: its buffers and every open stream
+*/
+long long
+http2_memory_usage(const struct http2_session *session)
+{
+    long long used = sizeof(struct http2_session) + session->out_capacity;
+
+    if (session->header_block) {
+        used += HTTP2_HEADER_BLOCK_SIZE;
+    }
+
+    for (int i = 0; i < HTTP2_MAX_STREAMS; i++) {
+        const struct http2_stream *stream = &session->streams[i];
+
+        if (stream->state == HTTP2_STREAM_FREE) {
+            continue;
+        }
+
+        used += memory_budget_message(stream->request) + memory_budget_message(stream->response)
+                + memory_budget_arena(stream->arena) + stream->spool_length;
+    }
+
+    return used;
+}
+
+/*
+    Releases the HTTP/2 state of a connection that is going away
+*/
+void
+http2_abort(struct conn *conn)
+{
+    if (!conn || !conn->http2) {
+        return;
+    }
+
+    struct http2_session *session = conn->http2;
+
+    session->data_slot = -1;
+    for (int i = 0; i < HTTP2_MAX_STREAMS; i++) {
+        if (session->streams[i].state != HTTP2_STREAM_FREE) {
+            release_stream(session, &session->streams[i]);
+        }
+    }
+
+    hpack_table_free(&session->decoder);
+    hpack_table_free(&session->encoder);
+    free(session->header_block);
+    free(session->out);
+    free(session);
+    conn->http2 = NULL;
+}
@@ -0,0 +1,165 @@
+/*
+    Header File for the HTTP/2 connection mode (cleartext h2c)
+*/
+
+#pragma once
+
+#include "conn_map.h"
+#include "hpack.h"
+#include "http_builder.h"
+#include "http_parser.h"
+#include "macros.h"
+#include "memory_budget.h"
+#include "rate_limit.h"
+#include "routes.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LENGTH 24
+#define HTTP2_PREFACE_REQUEST_LENGTH 18 // "PRI * HTTP/2.0\r\n\r\n", what the HTTP/1 parser consumes
+
+#define HTTP2_FRAME_HEADER_LENGTH 9
+#define HTTP2_MAX_FRAME_SIZE 16 * KB     // Largest frame we accept, the protocol default
+#define HTTP2_MAX_STREAMS 32             // SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define HTTP2_DEFAULT_WINDOW 65535       // Flow-control window before any SETTINGS/WINDOW_UPDATE
+#define HTTP2_RECV_WINDOW 256 * KB       // Receive window we grant per stream and connection
+#define HTTP2_HEADER_BLOCK_SIZE 64 * KB  // Largest header block across CONTINUATION frames
+#define HTTP2_MAX_WINDOW 0x7fffffff
+
+enum HTTP2_FRAME_TYPE
+{
+    HTTP2_DATA = 0x0,
+    HTTP2_HEADERS = 0x1,
+    HTTP2_PRIORITY = 0x2,
+    HTTP2_RST_STREAM = 0x3,
+    HTTP2_SETTINGS = 0x4,
+    HTTP2_PUSH_PROMISE = 0x5,
+    HTTP2_PING = 0x6,
+    HTTP2_GOAWAY = 0x7,
+    HTTP2_WINDOW_UPDATE = 0x8,
+    HTTP2_CONTINUATION = 0x9,
+};
+
+enum HTTP2_FLAG
+{
+    HTTP2_FLAG_END_STREAM = 0x1,
+    HTTP2_FLAG_ACK = 0x1,
+    HTTP2_FLAG_END_HEADERS = 0x4,
+    HTTP2_FLAG_PADDED = 0x8,
+    HTTP2_FLAG_PRIORITY = 0x20,
+};
+
+enum HTTP2_SETTING
+{
+    HTTP2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+    HTTP2_SETTINGS_ENABLE_PUSH = 0x2,
+    HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+    HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+    HTTP2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+    HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+};
+
+enum HTTP2_ERROR_CODE
+{
+    HTTP2_NO_ERROR = 0x0,
+    HTTP2_PROTOCOL_ERROR = 0x1,
+    HTTP2_INTERNAL_ERROR = 0x2,
+    HTTP2_FLOW_CONTROL_ERROR = 0x3,
+    HTTP2_STREAM_CLOSED = 0x5,
+    HTTP2_FRAME_SIZE_ERROR = 0x6,
+    HTTP2_REFUSED_STREAM = 0x7,
+    HTTP2_CANCEL = 0x8,
+    HTTP2_COMPRESSION_ERROR = 0x9,
+    HTTP2_ENHANCE_YOUR_CALM = 0xb,
+};
+
+enum HTTP2_STREAM_STATE
+{
+    HTTP2_STREAM_FREE,    // Slot not in use
+    HTTP2_STREAM_OPEN,    // Receiving the request
+    HTTP2_STREAM_SENDING, // Request handled, response queued or being sent
+};
+
+/*
+    One request/response exchange multiplexed on an HTTP/2 connection
+
+    The request and response are ordinary HTTP_MESSAGEs, so the route handlers serve HTTP/2
+    streams unchanged.
+*/
+struct http2_stream
+{
+    uint32_t id;
+    int state;
+    HTTP_MESSAGE *request;
+    HTTP_MESSAGE *response;
+    const struct route *route; // Picked once the request headers are decoded
+    void *stream_state;        // Owned by the route's streaming body handler
+    bool bad_request;          // Headers could not be mapped onto an HTTP_MESSAGE
+    bool end_stream;           // The client finished sending the request
+    bool paused;               // Streaming body handler asked to stop reading
+    char *spool;               // DATA received while paused, at most one receive window
+    int spool_length;
+    int recv_unacked;          // Request bytes consumed but not yet returned in a WINDOW_UPDATE
+    long recv_window;          // Bytes the client may still send on this stream
+    long send_window;          // Peer's flow-control window for this stream
+    off_t body_offset;         // Next response body byte to send
+    long body_remaining;       // Response body bytes not yet framed
+    struct arena *arena;       // What the stream's request allocates, see arena.c
+};
+
+/*
+    HTTP/2 state of a connection, hung off struct conn once it switches protocols
+*/
+struct http2_session
+{
+    int fd;
+    request_handler router;    // Serves streams that have no streaming body handler
+    int preface_offset;        // Bytes of the client connection preface matched so far
+    uint8_t input[HTTP2_FRAME_HEADER_LENGTH + HTTP2_MAX_FRAME_SIZE];
+    int input_length;
+    uint8_t *header_block;     // Header block being assembled from HEADERS + CONTINUATION
+    int header_block_length;
+    uint32_t header_stream_id; // Stream whose header block is incomplete, or 0
+    bool header_end_stream;    // END_STREAM carried by that HEADERS frame
+    HPACK_TABLE decoder;
+    HPACK_TABLE encoder;
+    struct http2_stream streams[HTTP2_MAX_STREAMS];
+    uint32_t last_stream_id;   // Highest stream id the client opened
+    long peer_initial_window;  // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+    long send_window;          // Peer's connection flow-control window
+    int peer_max_frame_size;
+    int recv_unacked;          // Connection-level bytes not yet returned in a WINDOW_UPDATE
+    long recv_window;          // Bytes the client may still send on the connection
+    bool goaway_received;
+    bool goaway_sent;          // Server is draining, new streams are refused
+    uint8_t *out;              // Control and HEADERS frames waiting to be sent
+    int out_length;
+    int out_offset;
+    int out_capacity;
+    int data_slot;             // Stream whose DATA frame is on the wire, or -1
+    uint8_t data_header[HTTP2_FRAME_HEADER_LENGTH];
+    int data_header_sent;
+    long data_remaining;       // Payload bytes of that frame still to sendfile()
+    int next_slot;             // Round-robin position for DATA scheduling
+    uint8_t client_address[16]; // Rate limiting key, every stream is charged as a request
+    HTTP_CREDENTIALS credentials; // Unix socket client, handed to every stream's request
+};
+
+bool http2_is_preface(const HTTP_MESSAGE *request);
+bool http2_is_upgrade(const HTTP_MESSAGE *request);
+
+int http2_start(struct conn *conn, int epoll_fd, bool upgrade, request_handler router);
+int http2_handle_event(struct conn *conn, uint32_t events);
+int http2_resume_streams(struct conn *conn);
+int http2_drain(struct conn *conn);
+void http2_abort(struct conn *conn);
+long long http2_memory_usage(const struct http2_session *session);
@@ -0,0 +1,110 @@
+/*
+    HTTP/1.x persistent connections
+
+    An HTTP/1.1 connection stays open unless either side says "Connection: close", an HTTP/1.0
+    one only when the client asks with "Connection: keep-alive". Either way a connection is
+    closed after KEEP_ALIVE_MAX_REQUESTS requests, and every response that leaves it open says
+    for how long and for how many more with a Keep-Alive header.
+
+    Requests are not pipelined. When bytes past a request were already read along with it, what
+    they hold would be lost with the buffer, so that connection closes after its response and
+    the client sends the unanswered requests again on a new one.
+
+    A connection waiting for its next request holds an fd and a map slot for a client that may
+    never come back. It is closed after KEEP_ALIVE_TIMEOUT seconds, and once more than
+    KEEP_ALIVE_IDLE_BUDGET connections are waiting, or a new client finds the map full, the
+    ones that have waited longest are closed first.
+*/
+
+#define _GNU_SOURCE
+
+#include "keep_alive.h"
+
+/*
+    Whether the client asked to keep the connection open, by its protocol's default
+*/
+bool
+keep_alive_requested(const HTTP_MESSAGE *request)
+{
+    const char *connection = get_known_header(request, HEADER_CONNECTION);
+
+    if (request->start_line.request.protocol == HTTP_1_0) {
+        return header_has_token(connection, "keep-alive");
+    }
+
+    return !header_has_token(connection, "close");
+}
+
+/*
+    Whether the connection stays open once its current response is sent
+*/
+bool
+keep_alive_persists(const struct conn *conn, bool draining)
+{
+    if (draining || !conn->request || !keep_alive_requested(conn->request)
+        || conn->requests >= KEEP_ALIVE_MAX_REQUESTS || conn->read_ahead) {
+        return false;
+    }
+
+    // A handler or the proxy may have decided to close it
+    return !conn->response
+           || !header_has_token(get_known_header(conn->response, HEADER_CONNECTION), "close");
+}
+
+/*
+    Tells the client whether the connection stays open after this response
+*/
+void
+keep_alive_add_headers(const struct conn *conn, HTTP_MESSAGE *response, bool draining)
+{
+    if (!keep_alive_persists(conn, draining)) {
+        add_header(response, "Connection", "close");
+        return;
+    }
+
+    char keep_alive[64];
+
+    snprintf(keep_alive, sizeof(keep_alive), "timeout=%d, max=%d", KEEP_ALIVE_TIMEOUT,
+             KEEP_ALIVE_MAX_REQUESTS - conn->requests);
+
+    // HTTP/1.0 clients close by default, so they are told the request was honoured
+    if (conn->request->start_line.request.protocol == HTTP_1_0) {
+        add_header(response, "Connection", "keep-alive");
+    }
+    add_header(response, "Keep-Alive", keep_alive);
+}
+
+/*
+    Whether the connection is kept open and waiting for its next request
+*/
+bool
+keep_alive_is_idle(const struct conn *conn)
+{
+    return conn->fd != -1 && conn->state == IDLE && conn->requests > 0 && !conn->upstream
+           && !conn->http2 && !conn->websocket && !conn->sse && !conn->offload;
+}
+
+/*
+    Finds the connection that has waited longest for its next request, or NULL if none is
+
+    *idle_count is set to how many are waiting
+*/
+struct conn *
+keep_alive_oldest_idle(struct conn *map, int length, int *idle_count)
+{
+    struct conn *oldest = NULL;
+
+    *idle_count = 0;
+    for (int i = 0; i < length; i++) {
+        if (!keep_alive_is_idle(&map[i])) {
+            continue;
+        }
+
+        (*idle_count)++;
+        if (!oldest || map[i].last_activity < oldest->last_activity) {
+            oldest = &map[i];
+        }
+    }
+
+    return oldest;
+}
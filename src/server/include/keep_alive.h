@@ -0,0 +1,22 @@
+/*
+    Header File for HTTP/1.x persistent connections
+*/
+
+#pragma once
+
+#include "conn_map.h"
+#include "http_lib.h"
+#include "macros.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#define KEEP_ALIVE_TIMEOUT 5        // Seconds a connection may sit idle between requests
+#define KEEP_ALIVE_MAX_REQUESTS 100 // Requests served on one connection before it is closed
+#define KEEP_ALIVE_IDLE_BUDGET 32   // Idle connections kept open before the oldest are closed
+
+bool keep_alive_requested(const HTTP_MESSAGE *request);
+bool keep_alive_persists(const struct conn *conn, bool draining);
+void keep_alive_add_headers(const struct conn *conn, HTTP_MESSAGE *response, bool draining);
+bool keep_alive_is_idle(const struct conn *conn);
+struct conn *keep_alive_oldest_idle(struct conn *map, int length, int *idle_count);
@@ -0,0 +1,201 @@
+/*
+    Global and per-connection memory budgets
+
+    Every connection is charged for what it holds: its read buffer, its request and response
+    messages, the arena its request allocates from, bodies spooled to temp files (which live in
+    /tmp, often a tmpfs), and for HTTP/2 the session with all of its streams. Charges are summed
+    once per loop iteration into a global figure that drives two limits.
+
+    Over MEMORY_SOFT_LIMIT the server stops accepting and stops reading from the connections
+    holding more than their share of what is in flight, so the rest can finish and give memory
+    back. The smallest in-flight connection is never over its share, so something always makes
+    progress, and connections are read from again as soon as usage is back under the limit.
+    Over MEMORY_HARD_LIMIT, and for a connection over MEMORY_CONNECTION_LIMIT, new requests are
+    answered with a 503 before their body is read. A request is charged its Content-Length up
+    front only when the body will be spooled, streaming body handlers never hold theirs.
+
+    Connections whose handler runs on the offload pool keep the charge they had when it
+    started, their messages belong to the worker until it returns.
+*/
+
+#define _GNU_SOURCE
+
+#include "memory_budget.h"
+#include "http2.h"
+#include "keep_alive.h"
+
+static struct memory_budget_stats stats = { .accepting = true };
+
+/*
+    Bytes of a body spooled to a temp file, what the file will hold once the body is complete
+*/
+static long long
+temp_file_bytes(const HTTP_MESSAGE *msg)
+{
+    if (!msg || !msg->body_temp) {
+        return 0;
+    }
+
+    return MAX(msg->body_length, msg->body_received);
+}
+
+long long
+memory_budget_message(const HTTP_MESSAGE *msg)
+{
+    return msg ? (long long) sizeof(HTTP_MESSAGE) + temp_file_bytes(msg) : 0;
+}
+
+long long
+memory_budget_arena(const struct arena *arena)
+{
+    return arena ? (long long) (sizeof(struct arena) + arena->footprint) : 0;
+}
+
+/*
+    Adds up what conn holds, tallying it by kind into stats
+*/
+static long long
+charge_conn(const struct conn *conn)
+{
+    if (conn->http2) {
+        long long used = http2_memory_usage(conn->http2);
+
+        stats.http2 += used;
+        return used;
+    }
+
+    long long messages = conn->buffer ? MEMORY_CONNECTION_BUFFER : 0;
+    long long temp_files = temp_file_bytes(conn->request) + temp_file_bytes(conn->response);
+    long long arenas = memory_budget_arena(conn->arena);
+
+    messages += conn->request ? (long long) sizeof(HTTP_MESSAGE) : 0;
+    messages += conn->response ? (long long) sizeof(HTTP_MESSAGE) : 0;
+
+    stats.messages += messages;
+    stats.temp_files += temp_files;
+    stats.arenas += arenas;
+    return messages + temp_files + arenas;
+}
+
+/*
+    An HTTP/1.x connection reading a request, whose socket can be left unread for a while
+*/
+static bool
+is_pausable(const struct conn *conn)
+{
+    return (conn->state == PARSING_HEADERS || conn->state == PARSING_BODY) && !conn->body_paused
+           && !conn->http2 && !conn->websocket && !conn->sse && !conn->upstream && !conn->tls
+           && !conn->offload;
+}
+
+static int
+set_paused(struct conn *conn, bool paused, int epoll_fd)
+{
+    struct epoll_event ev = { 0 };
+
+    ev.events = paused ? PAUSED_EPOLL_FLAGS : RECV_EPOLL_FLAGS;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        return -1;
+    }
+
+    conn->budget_paused = paused;
+    if (!paused) {
+        // Waiting on the budget is not a slow request
+        update_conn_time(conn);
+    }
+
+    fprintf(stderr, "[FD: %d] %s by the memory budget\n", conn->fd,
+            paused ? "Paused" : "Resumed");
+    return 0;
+}
+
+/*
+    Recharges every connection, then pauses or resumes reads and accepts to match
+
+    Resuming re-arms EPOLLIN with EPOLL_CTL_MOD, which reports any bytes that arrived meanwhile.
+*/
+void
+memory_budget_update(struct conn *map, int length, int epoll_fd)
+{
+    int in_flight = 0;
+    long long in_flight_used = 0;
+
+    stats.used = 0;
+    stats.messages = 0;
+    stats.arenas = 0;
+    stats.temp_files = 0;
+    stats.http2 = 0;
+
+    for (int i = 0; i < length; i++) {
+        struct conn *conn = &map[i];
+
+        if (conn->fd == -1) {
+            continue;
+        }
+
+        if (!conn->offload) {
+            conn->memory_used = charge_conn(conn);
+        }
+        stats.used += conn->memory_used;
+
+        if (conn->memory_used > 0 && !keep_alive_is_idle(conn)) {
+            in_flight++;
+            in_flight_used += conn->memory_used;
+        }
+    }
+
+    stats.peak = MAX(stats.peak, stats.used);
+    stats.accepting = stats.used <= MEMORY_SOFT_LIMIT;
+    stats.paused = 0;
+
+    for (int i = 0; i < length; i++) {
+        struct conn *conn = &map[i];
+        bool pause;
+
+        if (conn->fd == -1 || !(conn->budget_paused || is_pausable(conn))) {
+            continue;
+        }
+
+        // Compared as conn->memory_used > in_flight_used / in_flight, without the division
+        pause = !stats.accepting && conn->memory_used * in_flight > in_flight_used;
+
+        if (pause != conn->budget_paused && set_paused(conn, pause, epoll_fd) != 0) {
+            continue;
+        }
+
+        stats.paused += conn->budget_paused;
+    }
+}
+
+bool
+memory_budget_accepting(void)
+{
+    return stats.accepting;
+}
+
+/*
+    Whether a new request with a body_length byte body fits, on a connection holding conn_used
+
+    Refusals are counted as shed.
+*/
+bool
+memory_budget_admit(long long conn_used, long body_length)
+{
+    body_length = MAX(body_length, 0);
+
+    if (stats.used + body_length > MEMORY_HARD_LIMIT
+        || conn_used + body_length > MEMORY_CONNECTION_LIMIT) {
+        stats.shed++;
+        return false;
+    }
+
+    return true;
+}
+
+void
+memory_budget_get_stats(struct memory_budget_stats *stats_out)
+{
+    *stats_out = stats;
+}
@@ -0,0 +1,39 @@
+/*
+    Header File for the global and per-connection memory budgets
+*/
+
+#pragma once
+
+#include "arena.h"
+#include "conn_map.h"
+#include "http_lib.h"
+#include "macros.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+
+#define MEMORY_SOFT_LIMIT (128L * MB)      // Over it, the biggest readers pause and accepts stop
+#define MEMORY_HARD_LIMIT (192L * MB)      // Over it, new requests get a 503
+#define MEMORY_CONNECTION_LIMIT (48L * MB) // What one connection may hold before it is refused
+#define MEMORY_CONNECTION_BUFFER (8 * KB)  // Header parse buffer of an HTTP/1.x connection
+
+struct memory_budget_stats
+{
+    long long used; // Bytes charged to connections after the last update
+    long long peak;
+    long long messages;   // Part of used: HTTP/1.x messages and read buffers
+    long long arenas;     // Part of used: HTTP/1.x request arenas
+    long long temp_files; // Part of used: HTTP/1.x bodies in temp files
+    long long http2;      // Part of used: HTTP/2 sessions, all of their streams included
+    int paused;           // Connections not read from until usage is back under the soft limit
+    long shed;            // Requests refused with a 503
+    bool accepting;
+};
+
+long long memory_budget_message(const HTTP_MESSAGE *msg);
+long long memory_budget_arena(const struct arena *arena);
+
+void memory_budget_update(struct conn *map, int length, int epoll_fd);
+bool memory_budget_accepting(void);
+bool memory_budget_admit(long long conn_used, long body_length);
+void memory_budget_get_stats(struct memory_budget_stats *stats);
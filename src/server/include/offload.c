@@ -0,0 +1,340 @@
+/*
+    Blocking route handlers run on a worker pool
+
+    A route marked blocking has its handler run on one of OFFLOAD_THREADS workers instead of the
+    event loop, so a handler stuck on disk I/O or heavy CPU work does not stall every other
+    connection. The connection waits in WAITING_HANDLER with only hangups reported, and the loop
+    keeps serving everything else.
+
+    Jobs reach the workers through a mutex protected queue. Finished jobs come back on a
+    lock-free stack every worker pushes to and only the loop takes from, and an eventfd in the
+    epoll set wakes the loop to take them. The loop then sends the response like any other.
+
+    A connection that closes while its handler runs gives its request and response to the job,
+    which frees them once the handler is done with them.
+*/
+
+#define _GNU_SOURCE
+
+#include "offload.h"
+
+static pthread_t threads[OFFLOAD_THREADS];
+static int thread_count = 0;
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static struct offload_job *queue_head = NULL; // Submitted, oldest first
+static struct offload_job *queue_tail = NULL;
+static bool stopping = false;
+
+static struct offload_job *done_stack = NULL; // Pushed by workers, newest first
+static struct offload_job *done_list = NULL;  // Taken by the loop, oldest first
+static int event_fd = -1;
+
+static struct offload_stats stats = { 0 };
+
+static long
+now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void
+free_job_messages(struct offload_job *job)
+{
+    free_http_message(job->request);
+    free(job->request);
+    free_http_message(job->response);
+    free(job->response);
+    arena_free(job->arena);
+}
+
+/*
+    Hands a finished job back to the loop, called by workers
+*/
+static void
+push_done(struct offload_job *job)
+{
+    struct offload_job *head = __atomic_load_n(&done_stack, __ATOMIC_RELAXED);
+    uint64_t one = 1;
+
+    // Release, so the loop sees everything the handler wrote once it sees the job
+    do {
+        job->next = head;
+    } while (!__atomic_compare_exchange_n(&done_stack, &head, job, true, __ATOMIC_RELEASE,
+                                          __ATOMIC_RELAXED));
+
+    if (write(event_fd, &one, sizeof(one)) == -1) {
+        perror("write offload eventfd");
+    }
+}
+
+static void *
+run_worker(void *arg)
+{
+    (void) arg;
+
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (!queue_head && !stopping) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+
+        // Jobs still queued at shutdown are dropped by offload_shutdown()
+        if (stopping) {
+            pthread_mutex_unlock(&queue_lock);
+            return NULL;
+        }
+
+        struct offload_job *job = queue_head;
+
+        queue_head = job->next;
+        if (!queue_head) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        job->started_at = now_ns();
+        job->ret = job->handler(job->request, job->response);
+        job->finished_at = now_ns();
+
+        push_done(job);
+    }
+}
+
+/*
+    Starts the workers and registers the completion eventfd
+
+    Returns the eventfd, the loop calls offload_next_completed() when it is readable, or -1
+*/
+int
+offload_init(int epoll_fd)
+{
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd == -1) {
+        perror("eventfd");
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = event_fd };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, event_fd, &ev) == -1) {
+        perror("epoll_ctl for offload eventfd");
+        close(event_fd);
+        event_fd = -1;
+        return -1;
+    }
+
+    for (; thread_count < OFFLOAD_THREADS; thread_count++) {
+        int ret = pthread_create(&threads[thread_count], NULL, run_worker, NULL);
+
+        if (ret != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+            offload_shutdown();
+            return -1;
+        }
+    }
+
+    return event_fd;
+}
+
+/*
+    Drops a job the loop will never resume, returning the messages to the connection if any
+*/
+static void
+drop_job(struct offload_job *job)
+{
+    if (job->conn) {
+        job->conn->offload = NULL;
+    } else {
+        free_job_messages(job);
+    }
+    free(job);
+}
+
+/*
+    Stops the workers once their current handlers return and drops every outstanding job
+*/
+void
+offload_shutdown(void)
+{
+    pthread_mutex_lock(&queue_lock);
+    stopping = true;
+    pthread_cond_broadcast(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    thread_count = 0;
+
+    while (queue_head) {
+        struct offload_job *job = queue_head;
+
+        queue_head = job->next;
+        drop_job(job);
+    }
+    queue_tail = NULL;
+
+    struct offload_job *job = __atomic_exchange_n(&done_stack, NULL, __ATOMIC_ACQUIRE);
+
+    while (job || done_list) {
+        if (!job) {
+            job = done_list;
+            done_list = NULL;
+        }
+
+        struct offload_job *next = job->next;
+
+        drop_job(job);
+        job = next;
+    }
+
+    if (event_fd != -1) {
+        close(event_fd);
+        event_fd = -1;
+    }
+}
+
+/*
+    Runs handler on the connection's messages on the pool
+
+    The connection waits in waiting_state, e.g. WAITING_HANDLER, until offload_next_completed()
+    returns it. Returns 0, or -1 if the pool is saturated and the caller should answer 503
+*/
+int
+offload_submit(struct conn *conn, request_handler handler, int waiting_state, int epoll_fd)
+{
+    if (stats.queue_depth >= OFFLOAD_MAX_QUEUED) {
+        stats.rejected++;
+        return -1;
+    }
+
+    struct offload_job *job = calloc(1, sizeof(struct offload_job));
+
+    if (!job) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+
+    // Nothing to read until the response is out, but hangups still cancel the job
+    struct epoll_event ev = { .events = PAUSED_EPOLL_FLAGS, .data.fd = conn->fd };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        free(job);
+        return -1;
+    }
+
+    job->conn = conn;
+    job->handler = handler;
+    job->request = conn->request;
+    job->response = conn->response;
+    job->queued_at = now_ns();
+
+    conn->offload = job;
+    set_conn_state(conn, waiting_state);
+
+    stats.submitted++;
+    stats.queue_depth++;
+    stats.max_queue_depth = MAX(stats.max_queue_depth, stats.queue_depth);
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) {
+        queue_tail->next = job;
+    } else {
+        queue_head = job;
+    }
+    queue_tail = job;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+
+    return 0;
+}
+
+/*
+    Returns the next connection whose handler finished, or NULL once there are none
+
+    *ret is set to what the handler returned. Called by the loop when the eventfd is readable
+*/
+struct conn *
+offload_next_completed(int *ret)
+{
+    while (1) {
+        while (done_list) {
+            struct offload_job *job = done_list;
+            long wait_ns = job->started_at - job->queued_at;
+
+            done_list = job->next;
+
+            stats.completed++;
+            stats.queue_depth--;
+            stats.wait_ns += wait_ns;
+            stats.max_wait_ns = MAX(stats.max_wait_ns, wait_ns);
+            stats.run_ns += job->finished_at - job->started_at;
+
+            struct conn *conn = job->conn;
+
+            *ret = job->ret;
+            if (conn) {
+                conn->offload = NULL;
+                free(job);
+                return conn;
+            }
+
+            free_job_messages(job);
+            free(job);
+        }
+
+        uint64_t count;
+
+        // Reset the eventfd before taking the stack, a job pushed after this wakes us again
+        if (read(event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            perror("read offload eventfd");
+        }
+
+        struct offload_job *job = __atomic_exchange_n(&done_stack, NULL, __ATOMIC_ACQUIRE);
+
+        if (!job) {
+            return NULL;
+        }
+
+        // The stack is newest first, complete in submission order
+        while (job) {
+            struct offload_job *next = job->next;
+
+            job->next = done_list;
+            done_list = job;
+            job = next;
+        }
+    }
+}
+
+/*
+    Detaches a closing connection from its running job, which frees the messages and their
+    arena when done
+*/
+void
+offload_cancel(struct conn *conn)
+{
+    if (!conn || !conn->offload) {
+        return;
+    }
+
+    conn->offload->conn = NULL;
+    conn->offload->arena = conn->arena;
+    conn->offload = NULL;
+    conn->request = NULL;
+    conn->response = NULL;
+    conn->arena = NULL;
+    stats.cancelled++;
+}
+
+void
+offload_get_stats(struct offload_stats *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,60 @@
+/*
+    Header File for running blocking route handlers on a worker pool
+*/
+
+#pragma once
+
+#include "conn_map.h"
+#include "http_lib.h"
+#include "macros.h"
+#include "routes.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OFFLOAD_THREADS 4
+#define OFFLOAD_MAX_QUEUED 256 // Jobs waiting for a worker before new ones get a 503
+
+/*
+    A request handed to the pool, hung off struct conn while it runs
+*/
+struct offload_job
+{
+    struct offload_job *next; // Submission queue, then completion queue
+    struct conn *conn;        // NULL once the connection closed, the job then owns the messages
+    struct arena *arena;      // and their arena, set along with conn going NULL
+    request_handler handler;
+    HTTP_MESSAGE *request;
+    HTTP_MESSAGE *response;
+    int ret;        // What the handler returned
+    long queued_at; // Nanoseconds, CLOCK_MONOTONIC
+    long started_at;
+    long finished_at;
+};
+
+struct offload_stats
+{
+    long submitted;
+    long completed;
+    long cancelled;   // Connection closed while its handler ran
+    long rejected;    // Pool saturated
+    long queue_depth; // Submitted and not yet completed
+    long max_queue_depth;
+    long wait_ns; // Total time jobs spent queued before a worker picked them up
+    long max_wait_ns;
+    long run_ns; // Total time spent in handlers
+};
+
+int offload_init(int epoll_fd);
+void offload_shutdown(void);
+int offload_submit(struct conn *conn, request_handler handler, int waiting_state, int epoll_fd);
+struct conn *offload_next_completed(int *ret);
+void offload_cancel(struct conn *conn);
+void offload_get_stats(struct offload_stats *stats);
@@ -0,0 +1,241 @@
+/*
+    Per-connection output queues
+
+    Everything an HTTP/1.x connection sends goes through its queue as a list of segments, each
+    either bytes in memory (a rendered header block, a cached body) or a range of a file. One
+    routine drains it: consecutive memory segments go out together in a single sendmsg(), file
+    ranges with sendfile(), and every segment keeps its own cursor. A write the socket only
+    partly takes resumes from those cursors on the next EPOLLOUT, so nothing is rebuilt and no
+    byte is sent twice, and whatever is queued behind a response, or in front of it, goes out in
+    the same calls.
+*/
+
+#define _GNU_SOURCE
+
+#include "output_queue.h"
+
+void
+output_queue_init(struct output_queue *queue)
+{
+    memset(queue, 0, sizeof(*queue));
+}
+
+static void
+release_segment(struct output_segment *segment)
+{
+    if (segment->type == OUTPUT_MEMORY && segment->owned) {
+        free((char *) segment->data);
+    }
+    memset(segment, 0, sizeof(*segment));
+}
+
+/*
+    Drops whatever is still queued, freeing the memory the queue owns
+*/
+void
+output_queue_clear(struct output_queue *queue)
+{
+    while (queue->count > 0) {
+        release_segment(&queue->segments[queue->head]);
+        queue->head = (queue->head + 1) % OUTPUT_QUEUE_SEGMENTS;
+        queue->count--;
+    }
+
+    output_queue_init(queue);
+}
+
+bool
+output_queue_empty(const struct output_queue *queue)
+{
+    return queue->count == 0;
+}
+
+/*
+    The segment sent next, or NULL if nothing is queued
+*/
+struct output_segment *
+output_queue_front(struct output_queue *queue)
+{
+    return queue->count > 0 ? &queue->segments[queue->head] : NULL;
+}
+
+static struct output_segment *
+push_segment(struct output_queue *queue, int type, off_t offset, off_t length)
+{
+    if (queue->count == OUTPUT_QUEUE_SEGMENTS) {
+        fprintf(stderr, "Output queue is full\n");
+        return NULL;
+    }
+
+    struct output_segment *segment
+        = &queue->segments[(queue->head + queue->count) % OUTPUT_QUEUE_SEGMENTS];
+
+    memset(segment, 0, sizeof(*segment));
+    segment->type = type;
+    segment->fd = -1;
+    segment->offset = offset;
+    segment->end = offset + length;
+    queue->count++;
+    queue->queued_bytes += length;
+
+    return segment;
+}
+
+/*
+    Queues length bytes at data
+
+    An owned buffer must come from malloc() and is freed once sent, or by the failed push.
+    Returns 0, or -1 when the queue is full
+*/
+int
+output_queue_push_memory(struct output_queue *queue, const char *data, size_t length, bool owned)
+{
+    if (length == 0) {
+        if (owned) {
+            free((char *) data);
+        }
+        return 0;
+    }
+
+    struct output_segment *segment = push_segment(queue, OUTPUT_MEMORY, 0, length);
+
+    if (!segment) {
+        if (owned) {
+            free((char *) data);
+        }
+        return -1;
+    }
+
+    segment->data = data;
+    segment->owned = owned;
+    return 0;
+}
+
+/*
+    Queues length bytes of fd from offset, fd must stay open until they are sent
+
+    Returns 0, or -1 when the queue is full
+*/
+int
+output_queue_push_file(struct output_queue *queue, int fd, off_t offset, off_t length)
+{
+    if (length <= 0) {
+        return 0;
+    }
+
+    struct output_segment *segment = push_segment(queue, OUTPUT_FILE, offset, length);
+
+    if (!segment) {
+        return -1;
+    }
+
+    segment->fd = fd;
+    return 0;
+}
+
+static void
+pop_sent(struct output_queue *queue)
+{
+    while (queue->count > 0) {
+        struct output_segment *front = &queue->segments[queue->head];
+
+        if (front->offset < front->end) {
+            return;
+        }
+
+        release_segment(front);
+        queue->head = (queue->head + 1) % OUTPUT_QUEUE_SEGMENTS;
+        queue->count--;
+    }
+}
+
+/*
+    Sends the memory segments at the front of the queue in one call and moves their cursors
+
+    Returns what sendmsg() did
+*/
+static ssize_t
+send_memory(struct output_queue *queue, int sock_fd)
+{
+    struct iovec iov[OUTPUT_QUEUE_IOVECS];
+    struct msghdr msg = { .msg_iov = iov };
+    int i = 0;
+
+    for (; i < queue->count && msg.msg_iovlen < OUTPUT_QUEUE_IOVECS; i++) {
+        struct output_segment *segment
+            = &queue->segments[(queue->head + i) % OUTPUT_QUEUE_SEGMENTS];
+
+        if (segment->type != OUTPUT_MEMORY) {
+            break;
+        }
+
+        iov[msg.msg_iovlen].iov_base = (char *) segment->data + segment->offset;
+        iov[msg.msg_iovlen].iov_len = segment->end - segment->offset;
+        msg.msg_iovlen++;
+    }
+
+    // More follows, e.g. the file body after its header block, so do not push a short segment
+    ssize_t n = sendmsg(sock_fd, &msg, i < queue->count ? MSG_MORE : 0);
+
+    ssize_t left = n;
+
+    while (left > 0) {
+        struct output_segment *front = &queue->segments[queue->head];
+        off_t take = MIN(left, front->end - front->offset);
+
+        front->offset += take;
+        left -= take;
+        pop_sent(queue);
+    }
+
+    return n;
+}
+
+/*
+    Writes as much of the queue to sock_fd as it takes, at most max_file_bytes of it from files
+
+    Returns 0 once the queue is empty, 1 if the socket is full, 2 if max_file_bytes went out and
+    a file segment still has more, or -1 on failure
+*/
+int
+output_queue_flush(struct output_queue *queue, int sock_fd, long max_file_bytes)
+{
+    while (queue->count > 0) {
+        struct output_segment *front = &queue->segments[queue->head];
+        ssize_t n;
+
+        if (front->type == OUTPUT_FILE) {
+            if (max_file_bytes <= 0) {
+                return 2;
+            }
+
+            // sendfile() moves the segment's cursor itself
+            n = sendfile(sock_fd, front->fd, &front->offset,
+                         MIN(front->end - front->offset, max_file_bytes));
+            if (n == 0) {
+                fprintf(stderr, "File ended before its queued range was sent\n");
+                return -1;
+            } else if (n > 0) {
+                max_file_bytes -= n;
+                pop_sent(queue);
+            }
+        } else {
+            n = send_memory(queue, sock_fd);
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                PROBE2(send_blocked, sock_fd, queue->queued_bytes - queue->sent_bytes);
+                return 1;
+            }
+            return -1;
+        }
+
+        queue->sent_bytes += n;
+        PROBE3(send, sock_fd, n, queue->queued_bytes - queue->sent_bytes);
+    }
+
+    return 0;
+}
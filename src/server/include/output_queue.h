@@ -0,0 +1,59 @@
+/*
+    Header File for per-connection output queues
+*/
+
+#pragma once
+
+#include "macros.h"
+#include "probes.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define OUTPUT_QUEUE_SEGMENTS 8 // Segments a connection can have queued at once
+#define OUTPUT_QUEUE_IOVECS 8   // Memory segments gathered into one sendmsg()
+
+enum OUTPUT_SEGMENT_TYPE
+{
+    OUTPUT_MEMORY, // Bytes in memory, sent with sendmsg()
+    OUTPUT_FILE,   // A range of a file, sent with sendfile()
+};
+
+/*
+    A slice of what is still to be written to the socket
+
+    offset only ever moves forward, so a partial write resumes exactly where it stopped.
+*/
+struct output_segment
+{
+    int type;
+    const char *data; // OUTPUT_MEMORY bytes
+    bool owned;       // data is freed once sent, otherwise it must outlive the segment
+    int fd;           // OUTPUT_FILE file, left open for whoever queued it
+    off_t offset;     // Next byte to send, into data or the file
+    off_t end;        // One past the last byte to send
+};
+
+struct output_queue
+{
+    struct output_segment segments[OUTPUT_QUEUE_SEGMENTS]; // Ring, oldest at head
+    int head;
+    int count;
+    long long queued_bytes; // Bytes ever queued, see sent_bytes
+    long long sent_bytes;   // Bytes ever sent, once it reaches a queued_bytes all of those are out
+};
+
+void output_queue_init(struct output_queue *queue);
+void output_queue_clear(struct output_queue *queue);
+bool output_queue_empty(const struct output_queue *queue);
+struct output_segment *output_queue_front(struct output_queue *queue);
+int output_queue_push_memory(struct output_queue *queue, const char *data, size_t length,
+                             bool owned);
+int output_queue_push_file(struct output_queue *queue, int fd, off_t offset, off_t length);
+int output_queue_flush(struct output_queue *queue, int sock_fd, long max_file_bytes);
@@ -0,0 +1,112 @@
+/*
+    Keeping sendfile() from blocking on page cache misses
+
+    sendfile() runs on the event loop, and when the file data is not in the page cache it waits
+    for the disk with every other connection stalled behind it. File bodies are therefore sent
+    in windows of PAGE_CACHE_WINDOW bytes. Before each window is sent, mincore() on a mapping of
+    it reports whether all of its pages are resident. If some are not, the connection waits in
+    WAITING_DISK while an offload pool worker faults the window in, and the send resumes once it
+    is back.
+
+    Large bodies are also read ahead: the file is marked sequential, and each window sent asks
+    for the next one, so a download streaming at disk speed rarely finds a cold window.
+*/
+
+#define _GNU_SOURCE
+
+#include "page_cache.h"
+
+static long
+page_size(void)
+{
+    static long size = 0;
+
+    if (size == 0) {
+        size = sysconf(_SC_PAGESIZE);
+    }
+
+    return size;
+}
+
+/*
+    Whether sendfile() can send length bytes from offset without going to disk
+
+    Files that cannot be mapped are reported resident, they are simply sent
+*/
+bool
+page_cache_is_resident(int fd, off_t offset, long length)
+{
+    off_t start = offset & ~(page_size() - 1);
+    long span = length + (offset - start);
+    unsigned char pages[PAGE_CACHE_WINDOW / PAGE_CACHE_MIN_PAGE_SIZE + 2];
+
+    if (length <= 0 || span / page_size() + 1 > (long) sizeof(pages)) {
+        return true;
+    }
+
+    void *map = mmap(NULL, span, PROT_READ, MAP_SHARED, fd, start);
+
+    if (map == MAP_FAILED) {
+        return true;
+    }
+
+    bool resident = mincore(map, span, pages) == 0;
+
+    for (long i = 0; resident && i < (span + page_size() - 1) / page_size(); i++) {
+        resident = pages[i] & 1;
+    }
+
+    munmap(map, span);
+    return resident;
+}
+
+/*
+    Read-ahead hints for a body about to be sent from offset
+*/
+void
+page_cache_advise(int fd, off_t offset, long file_length)
+{
+    if (file_length < PAGE_CACHE_SEQUENTIAL_MIN) {
+        return;
+    }
+
+    if (offset == 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+
+    // The window after the one going out now starts reading in the background
+    if (offset + PAGE_CACHE_WINDOW < file_length) {
+        posix_fadvise(fd, offset + PAGE_CACHE_WINDOW, PAGE_CACHE_WINDOW, POSIX_FADV_WILLNEED);
+    }
+}
+
+/*
+    Reads the response body's next window into the page cache, run on the offload pool
+*/
+int
+page_cache_fault_in(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
+{
+    (void) request;
+
+    int fd = response->body_fd;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    long file_length = get_file_length(fd);
+
+    if (offset == -1 || file_length <= offset) {
+        return -1;
+    }
+
+    off_t start = offset & ~(page_size() - 1);
+    long span = MIN(file_length - offset, PAGE_CACHE_WINDOW) + (offset - start);
+
+    // MAP_POPULATE returns once every page of the window has been read in
+    void *map = mmap(NULL, span, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, start);
+
+    if (map == MAP_FAILED) {
+        perror("mmap body window");
+        return -1;
+    }
+
+    munmap(map, span);
+    return 0;
+}
@@ -0,0 +1,23 @@
+/*
+    Header File for keeping sendfile() from blocking on page cache misses
+*/
+
+#pragma once
+
+#include "http_lib.h"
+#include "macros.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PAGE_CACHE_WINDOW (1 * MB)         // Body bytes checked for residency, then sent
+#define PAGE_CACHE_SEQUENTIAL_MIN (4 * MB) // Bodies this large get sequential read-ahead
+#define PAGE_CACHE_MIN_PAGE_SIZE 4096      // Sizes the mincore() vector
+
+bool page_cache_is_resident(int fd, off_t offset, long length);
+void page_cache_advise(int fd, off_t offset, long file_length);
+int page_cache_fault_in(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
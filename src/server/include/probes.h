@@ -0,0 +1,46 @@
+/*
+    Header File for USDT probes
+
+    Static tracepoints of the "httpserver" provider, for bpftrace, perf or SystemTap, e.g.
+        bpftrace -l 'usdt:Build/server:httpserver:*'
+    See scripts/bpftrace for examples.
+
+    With <sys/sdt.h> (systemtap-sdt-dev) installed and USDT_ENABLED, each probe is a single NOP
+    in the code and a note in the binary describing where its arguments live; a tracer attaching
+    turns the NOP into a breakpoint. Without either, probes compile to nothing.
+
+    Probe                Arguments
+    accept               fd, address family
+    close                fd, requests served on the connection
+    state                fd, old CONN_STATE, new CONN_STATE
+    route_start          request target, method
+    route_end            request target, method, status code
+    handler_start        route path
+    handler_end          route path, handler return value
+    send                 fd, bytes written, bytes still queued
+    send_blocked         fd, bytes still queued when the socket filled up
+    response_end         fd, status code, body bytes, once an HTTP/1.x response is written
+*/
+
+#pragma once
+
+#include "macros.h"
+#include <stdbool.h>
+
+#if USDT_ENABLED && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_COMPILED 1
+#endif
+#endif
+
+#ifdef PROBES_COMPILED
+#define PROBE1(name, a) DTRACE_PROBE1(httpserver, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(httpserver, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(httpserver, name, a, b, c)
+#else
+// sizeof() never evaluates its operand, it only keeps variables kept for a probe from being unused
+#define PROBE1(name, a) ((void) sizeof(a))
+#define PROBE2(name, a, b) ((void) (sizeof(a) + sizeof(b)))
+#define PROBE3(name, a, b, c) ((void) (sizeof(a) + sizeof(b) + sizeof(c)))
+#endif
@@ -0,0 +1,825 @@
+/*
+    Reverse proxy route type
+
+    A proxied request is forwarded to an upstream over a non-blocking connection taken from the
+    upstream's idle pool (or freshly connected), entirely inside the epoll loop. Requests are sent
+    as HTTP/1.0 with "Connection: keep-alive", so an upstream answers with either a Content-Length
+    or a close-delimited body and never with chunked encoding. Response bodies are then moved with
+    splice() from the upstream socket through a pipe into the client socket, without a copy
+    through user space.
+*/
+
+#define _GNU_SOURCE
+
+#include "proxy.h"
+
+/*
+    State of one proxied request, owned by the client connection
+*/
+struct proxy_exchange
+{
+    char *out;         // Request head for the upstream, then response head for the client
+    int out_length;    // Length of out
+    int out_offset;    // Bytes of out already sent
+    off_t body_offset; // Request body bytes forwarded so far
+    long remaining;    // Response body bytes left to splice, -1 to read until upstream EOF
+    int in_pipe;       // Bytes sitting in the splice pipe
+    int pipe_capacity; // Capacity of the splice pipe
+    bool reused;       // The upstream connection came from the pool
+    bool reusable;     // The upstream connection may go back to the pool afterwards
+    bool upstream_eof; // The upstream closed its side
+};
+
+static struct upstream upstreams[] = {
+    { .name = PROXY_UPSTREAM_NAME, .address = PROXY_UPSTREAM_ADDRESS },
+};
+
+/*
+    Resolves an upstream address of the form "host:port" or "unix:/path/to.sock"
+*/
+static int
+resolve_upstream(struct upstream *upstream)
+{
+    upstream->addrlen = 0;
+    upstream->idle_count = 0;
+
+    if (strncmp(upstream->address, "unix:", 5) == 0) {
+        struct sockaddr_un *sun = (struct sockaddr_un *) &upstream->addr;
+        const char *path = upstream->address + 5;
+
+        if (strlen(path) >= sizeof(sun->sun_path)) {
+            fprintf(stderr, "Upstream socket path too long: %s\n", path);
+            return -1;
+        }
+
+        memset(sun, 0, sizeof(*sun));
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, path);
+        upstream->addrlen = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    char host[256] = { 0 };
+    const char *port = strrchr(upstream->address, ':');
+
+    if (!port || (size_t) (port - upstream->address) >= sizeof(host)) {
+        fprintf(stderr, "Invalid upstream address: %s\n", upstream->address);
+        return -1;
+    }
+    memcpy(host, upstream->address, port - upstream->address);
+    port++;
+
+    struct addrinfo hints, *result;
+    int rv;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((rv = getaddrinfo(host, port, &hints, &result)) != 0) {
+        fprintf(stderr, "getaddrinfo(%s): %s\n", upstream->address, gai_strerror(rv));
+        return -1;
+    }
+
+    memcpy(&upstream->addr, result->ai_addr, result->ai_addrlen);
+    upstream->addrlen = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    return 0;
+}
+
+/*
+    Resolves every configured upstream once at startup
+
+    An upstream that fails to resolve stays configured and answers its routes with 502s.
+*/
+int
+proxy_init(void)
+{
+    for (size_t i = 0; i < sizeof(upstreams) / sizeof(upstreams[0]); i++) {
+        if (resolve_upstream(&upstreams[i]) == 0) {
+            printf("proxy: upstream %s -> %s\n", upstreams[i].name, upstreams[i].address);
+        }
+    }
+
+    return 0;
+}
+
+struct upstream *
+find_upstream(const char *name)
+{
+    if (!name) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sizeof(upstreams) / sizeof(upstreams[0]); i++) {
+        if (strcmp(upstreams[i].name, name) == 0) {
+            return &upstreams[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int
+watch_fd(int epoll_fd, int fd, uint32_t events)
+{
+    struct epoll_event ev = { 0 };
+
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        perror("epoll_ctl for proxied socket:");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Takes an upstream connection out of its idle pool, if it is there
+*/
+static void
+forget_idle(struct upstream *upstream, int fd)
+{
+    for (int i = 0; i < upstream->idle_count; i++) {
+        if (upstream->idle_fds[i] == fd) {
+            upstream->idle_fds[i] = upstream->idle_fds[--upstream->idle_count];
+            return;
+        }
+    }
+}
+
+static void
+close_upstream(struct conn *map, int length, struct conn *upstream_conn, int epoll_fd)
+{
+    int fd = upstream_conn->fd;
+
+    if (upstream_conn->upstream) {
+        forget_idle(upstream_conn->upstream, fd);
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    remove_conn_from_map(map, fd, length);
+}
+
+/*
+    Puts a finished upstream connection back into its pool, or closes it
+*/
+static void
+release_upstream(struct conn *map, int length, struct conn *upstream_conn, bool reusable,
+                 int epoll_fd)
+{
+    struct upstream *upstream = upstream_conn->upstream;
+
+    upstream_conn->peer_fd = -1;
+
+    if (reusable && upstream->idle_count < UPSTREAM_POOL_SIZE) {
+        upstream->idle_fds[upstream->idle_count++] = upstream_conn->fd;
+        set_conn_state(upstream_conn, UPSTREAM_IDLE);
+        return;
+    }
+
+    close_upstream(map, length, upstream_conn, epoll_fd);
+}
+
+static void
+free_exchange(struct conn *client)
+{
+    if (client->proxy) {
+        free(client->proxy->out);
+        free(client->proxy);
+        client->proxy = NULL;
+    }
+    client->peer_fd = -1;
+}
+
+/*
+    Links the client to an upstream connection, reusing an idle pooled one when possible
+*/
+static int
+open_upstream(struct conn *map, int length, struct conn *client, struct upstream *upstream,
+              int epoll_fd)
+{
+    struct proxy_exchange *px = client->proxy;
+
+    while (upstream->idle_count > 0) {
+        int fd = upstream->idle_fds[--upstream->idle_count];
+        struct conn *upstream_conn = get_conn(map, fd, length);
+
+        if (upstream_conn == NULL || upstream_conn->state != UPSTREAM_IDLE) {
+            continue;
+        }
+
+        upstream_conn->peer_fd = client->fd;
+        client->peer_fd = fd;
+        px->reused = true;
+        memset(upstream_conn->buffer, 0, UPSTREAM_BUFFER_SIZE);
+        // Its time idle in the pool does not count against the exchange
+        update_conn_time(upstream_conn);
+
+        set_conn_state(upstream_conn, UPSTREAM_SENDING);
+        // EPOLLOUT fires right away on a writable socket, which starts the request
+        return watch_fd(epoll_fd, fd, SEND_EPOLL_FLAGS);
+    }
+
+    int fd = socket(upstream->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("proxy: socket");
+        return -1;
+    }
+
+    if (upstream->addr.ss_family != AF_UNIX) {
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+
+    int state = UPSTREAM_SENDING;
+
+    if (connect(fd, (struct sockaddr *) &upstream->addr, upstream->addrlen) == -1) {
+        if (errno != EINPROGRESS) {
+            perror("proxy: connect");
+            close(fd);
+            return -1;
+        }
+        state = UPSTREAM_CONNECTING;
+    }
+
+    if (add_conn_to_map(map, fd, length) != 0) {
+        fprintf(stderr, "proxy: connection map is full\n");
+        close(fd);
+        return -1;
+    }
+
+    struct conn *upstream_conn = get_conn(map, fd, length);
+    struct epoll_event ev = { 0 };
+
+    ev.events = SEND_EPOLL_FLAGS;
+    ev.data.fd = fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl ADD upstream");
+        remove_conn_from_map(map, fd, length);
+        return -1;
+    }
+
+    if (allocate_conn_buffer(upstream_conn, UPSTREAM_BUFFER_SIZE) < 0
+        || upstream_conn->buffer == NULL) {
+        close_upstream(map, length, upstream_conn, epoll_fd);
+        return -1;
+    }
+
+    upstream_conn->upstream = upstream;
+    upstream_conn->peer_fd = client->fd;
+    client->peer_fd = fd;
+    px->reused = false;
+    set_conn_state(upstream_conn, state);
+
+    return 0;
+}
+
+/*
+    Serializes the client request for the upstream with build_header()
+
+    The request goes out as HTTP/1.0 with "Connection: keep-alive". The client's own protocol
+    and Connection header are restored afterwards since they still decide its keep-alive.
+*/
+static int
+build_upstream_request(struct proxy_exchange *px, HTTP_MESSAGE *request)
+{
+    char connection[MAX_HEADER_LENGTH] = { 0 };
+    const char *value = get_known_header(request, HEADER_CONNECTION);
+    bool had_connection = value != NULL;
+    uint32_t protocol = request->start_line.request.protocol;
+
+    if (had_connection) {
+        strncpy(connection, value, sizeof(connection) - 1);
+    }
+
+    // Hop-by-hop headers only concern the client connection
+    remove_header(request, "Keep-Alive");
+    remove_header(request, "Proxy-Connection");
+    remove_header(request, "Transfer-Encoding");
+    remove_header(request, "Upgrade");
+    remove_header(request, "TE");
+
+    // So do the ones the client lists in Connection, but the body stays framed by its length
+    char options[MAX_HEADER_LENGTH];
+    char *save = NULL;
+
+    memcpy(options, connection, sizeof(options));
+    for (char *token = strtok_r(options, ",", &save); token; token = strtok_r(NULL, ",", &save)) {
+        token += strspn(token, " \t");
+        token[strcspn(token, " \t")] = '\0';
+        if (*token && strcasecmp(token, "Content-Length") != 0) {
+            remove_header(request, token);
+        }
+    }
+
+    // The client's "Expect: 100-continue" was answered before its body was read
+    remove_header(request, "Expect");
+
+    request->start_line.request.protocol = HTTP_1_0;
+    add_header(request, "Connection", "keep-alive");
+
+    char *head = malloc(MAX_HEADERS_SIZE);
+    int ret = head ? build_header(request, REQUEST, head, MAX_HEADERS_SIZE) : -1;
+
+    request->start_line.request.protocol = protocol;
+    if (had_connection) {
+        add_header(request, "Connection", connection);
+    } else {
+        remove_header(request, "Connection");
+    }
+
+    if (ret != 0) {
+        fprintf(stderr, "proxy: failed to build upstream request\n");
+        free(head);
+        return -1;
+    }
+
+    px->out_length = strlen(head);
+    px->out_offset = 0;
+    px->out = head;
+    px->body_offset = 0;
+
+    return 0;
+}
+
+/*
+    Sends the request head and then the spooled request body to the upstream
+
+    Returns 0 when everything was sent, 1 when the socket would block, -1 on error
+*/
+static int
+send_upstream_request(struct proxy_exchange *px, int fd, const HTTP_MESSAGE *request)
+{
+    while (px->out_offset < px->out_length) {
+        ssize_t n = send(fd, px->out + px->out_offset, px->out_length - px->out_offset,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            px->out_offset += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        } else {
+            return -1;
+        }
+    }
+
+    while (request->body_fd != -1 && px->body_offset < request->body_length) {
+        ssize_t n
+            = sendfile(fd, request->body_fd, &px->body_offset, request->body_length - px->body_offset);
+        if (n > 0) {
+            continue;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 1;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Turns the parsed upstream response head into the head sent to the client
+
+    Works out how the body is delimited and whether the upstream connection can be pooled
+    afterwards. Body bytes that were read along with the head are appended to it.
+*/
+static int
+build_client_response(struct proxy_exchange *px, struct conn *client, const char *buffered)
+{
+    HTTP_MESSAGE *response = client->response;
+    const char *connection = get_known_header(response, HEADER_CONNECTION);
+    const char *content_length = get_known_header(response, HEADER_CONTENT_LENGTH);
+    uint32_t status = response->start_line.response.status_code;
+
+    if (status == STATUS_NO_CONTENT || status == 304 || status < 200) {
+        px->remaining = 0;
+    } else if (content_length) {
+        char *end = NULL;
+
+        errno = 0;
+        px->remaining = strtol(content_length, &end, 10);
+
+        // Digits only, as for a request, a bad length would end the relay early or never
+        if (end == content_length || *end != '\0' || content_length[0] < '0'
+            || content_length[0] > '9' || errno == ERANGE) {
+            fprintf(stderr, "proxy: invalid upstream Content-Length: %s\n", content_length);
+            return -1;
+        }
+    } else {
+        px->remaining = -1;
+    }
+
+    // An HTTP/1.0 exchange only stays open when the upstream says so
+    px->reusable = connection && strcasecmp(connection, "keep-alive") == 0 && px->remaining >= 0;
+
+    remove_header(response, "Connection");
+    remove_header(response, "Keep-Alive");
+    if (px->remaining < 0) {
+        // Close-delimited body, so the client can only see its end as a close too
+        add_header(response, "Connection", "close");
+    } else {
+        keep_alive_add_headers(client, response, false);
+    }
+    response->start_line.response.protocol = HTTP_1_1;
+
+    long leftover = response->buffered_length;
+    if (px->remaining >= 0 && leftover > px->remaining) {
+        leftover = px->remaining;
+        px->reusable = false;
+    }
+
+    char *head = malloc(MAX_HEADERS_SIZE);
+    if (!head || build_header(response, RESPONSE, head, MAX_HEADERS_SIZE) != 0) {
+        fprintf(stderr, "proxy: failed to build client response\n");
+        free(head);
+        return -1;
+    }
+
+    int head_length = strlen(head);
+    char *out = realloc(head, head_length + leftover);
+    if (!out) {
+        free(head);
+        return -1;
+    }
+    memcpy(out + head_length, buffered, leftover);
+
+    free(px->out);
+    px->out = out;
+    px->out_length = head_length + leftover;
+    px->out_offset = 0;
+    if (px->remaining > 0) {
+        px->remaining -= leftover;
+    }
+    response->buffered_length = 0;
+
+    return 0;
+}
+
+/*
+    Moves response body bytes upstream -> pipe -> client with splice()
+
+    Returns 0 when the body is complete, 1 when waiting on either socket, -1 on error
+*/
+static int
+splice_body(struct proxy_exchange *px, int upstream_fd, int client_fd, const int pipe_fds[2])
+{
+    while (1) {
+        bool progress = false;
+
+        // Drain the pipe into the client first so there is room to fill it again
+        while (px->in_pipe > 0) {
+            ssize_t n = splice(pipe_fds[0], NULL, client_fd, NULL, px->in_pipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                px->in_pipe -= n;
+                progress = true;
+            } else if (n == -1 && errno == EINTR) {
+                continue;
+            } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return -1;
+            }
+        }
+
+        if (px->in_pipe == 0 && (px->remaining == 0 || px->upstream_eof)) {
+            return 0;
+        }
+
+        if (!px->upstream_eof && px->remaining != 0 && px->in_pipe < px->pipe_capacity) {
+            size_t room = px->pipe_capacity - px->in_pipe;
+            size_t want = px->remaining < 0 ? room : (size_t) MIN((long) room, px->remaining);
+            ssize_t n = splice(upstream_fd, NULL, pipe_fds[1], NULL, want,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                px->in_pipe += n;
+                if (px->remaining > 0) {
+                    px->remaining -= n;
+                }
+                progress = true;
+            } else if (n == 0) {
+                if (px->remaining > 0) {
+                    fprintf(stderr, "proxy: upstream closed with %ld body bytes missing\n",
+                            px->remaining);
+                    return -1;
+                }
+                px->upstream_eof = true;
+                px->remaining = 0;
+                progress = true;
+            } else if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return -1;
+            }
+        }
+
+        if (!progress) {
+            return 1;
+        }
+    }
+}
+
+/*
+    Sends the response head to the client, then splices the body
+
+    Returns a PROXY_RESULT
+*/
+static int
+stream_response(struct conn *map, int length, struct conn *client, struct conn *upstream_conn,
+                int epoll_fd)
+{
+    struct proxy_exchange *px = client->proxy;
+
+    while (px->out_offset < px->out_length) {
+        ssize_t n = send(client->fd, px->out + px->out_offset, px->out_length - px->out_offset,
+                         MSG_NOSIGNAL);
+        if (n > 0) {
+            px->out_offset += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return PROXY_IN_PROGRESS;
+        } else {
+            close_upstream(map, length, upstream_conn, epoll_fd);
+            free_exchange(client);
+            return PROXY_FAILED;
+        }
+    }
+
+    // The pipe lives with the upstream connection and is reused along with it
+    if (upstream_conn->pipe_fds[0] == -1) {
+        if (pipe2(upstream_conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+            perror("proxy: pipe2");
+            close_upstream(map, length, upstream_conn, epoll_fd);
+            free_exchange(client);
+            return PROXY_FAILED;
+        }
+        fcntl(upstream_conn->pipe_fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+    }
+    if (px->pipe_capacity == 0) {
+        px->pipe_capacity = fcntl(upstream_conn->pipe_fds[1], F_GETPIPE_SZ);
+        if (px->pipe_capacity <= 0) {
+            px->pipe_capacity = 64 * KB;
+        }
+    }
+
+    int ret = splice_body(px, upstream_conn->fd, client->fd, upstream_conn->pipe_fds);
+
+    if (ret > 0) {
+        return PROXY_IN_PROGRESS;
+    }
+
+    if (ret < 0) {
+        close_upstream(map, length, upstream_conn, epoll_fd);
+        free_exchange(client);
+        return PROXY_FAILED;
+    }
+
+    release_upstream(map, length, upstream_conn, px->reusable && !px->upstream_eof, epoll_fd);
+    free_exchange(client);
+
+    return PROXY_DONE;
+}
+
+/*
+    Handles a broken upstream connection
+
+    A pooled connection the upstream had already closed fails before any response byte arrives.
+    The request is then replayed once over a fresh connection, as long as the upstream cannot
+    have acted on it: none of it was sent yet, or it is a GET, which is safe to run twice.
+*/
+static int
+upstream_failed(struct conn *map, int length, struct conn *client, struct conn *upstream_conn,
+                int epoll_fd)
+{
+    struct proxy_exchange *px = client->proxy;
+    bool streaming = upstream_conn->state == UPSTREAM_STREAMING;
+    bool response_started = streaming
+                            || (upstream_conn->state == UPSTREAM_RECEIVING
+                                && (upstream_conn->buffer[0] != '\0'
+                                    || client->response->start_line.response.status_code != 0));
+    bool replayable = px->out_offset == 0
+                      || client->request->start_line.request.method == HTTP_GET;
+    bool retry = px->reused && !response_started && replayable;
+    struct upstream *upstream = upstream_conn->upstream;
+
+    close_upstream(map, length, upstream_conn, epoll_fd);
+    client->peer_fd = -1;
+
+    if (retry) {
+        fprintf(stderr, "proxy: pooled upstream connection went stale, reconnecting\n");
+        px->out_offset = 0;
+        px->body_offset = 0;
+        if (open_upstream(map, length, client, upstream, epoll_fd) == 0) {
+            return PROXY_IN_PROGRESS;
+        }
+    }
+
+    bool head_sent = streaming && px->out_offset > 0;
+    free_exchange(client);
+
+    return head_sent ? PROXY_FAILED : PROXY_BAD_GATEWAY;
+}
+
+/*
+    Starts forwarding the client's request to an upstream
+
+    The client stops being read until the proxied response is complete.
+*/
+int
+proxy_start(struct conn *map, int length, struct conn *client, struct upstream *upstream,
+            int epoll_fd)
+{
+    if (!map || !client || !upstream || upstream->addrlen == 0) {
+        fprintf(stderr, "proxy: no usable upstream\n");
+        return PROXY_BAD_GATEWAY;
+    }
+
+    client->proxy = calloc(1, sizeof(struct proxy_exchange));
+    if (!client->proxy) {
+        perror("Failed to allocate memory");
+        return PROXY_BAD_GATEWAY;
+    }
+
+    if (build_upstream_request(client->proxy, client->request) != 0
+        || open_upstream(map, length, client, upstream, epoll_fd) != 0) {
+        free_exchange(client);
+        return PROXY_BAD_GATEWAY;
+    }
+
+    set_conn_state(client, PROXYING);
+    if (watch_fd(epoll_fd, client->fd, PAUSED_EPOLL_FLAGS) != 0) {
+        return PROXY_FAILED;
+    }
+
+    return PROXY_IN_PROGRESS;
+}
+
+/*
+    Drives a proxied exchange from an epoll event on either of its sockets
+
+    *client_fd is set to the client the result applies to, or -1 when the event only concerned
+    an idle pooled connection.
+*/
+int
+proxy_handle_event(struct conn *map, int length, struct conn *conn, uint32_t events,
+                   int epoll_fd, int *client_fd)
+{
+    *client_fd = -1;
+
+    // Event on the client side of an exchange
+    if (conn->upstream == NULL) {
+        struct conn *upstream_conn = get_conn(map, conn->peer_fd, length);
+
+        *client_fd = conn->fd;
+
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            return PROXY_FAILED;
+        }
+
+        if (conn->proxy && upstream_conn && upstream_conn->state == UPSTREAM_STREAMING) {
+            return stream_response(map, length, conn, upstream_conn, epoll_fd);
+        }
+
+        return PROXY_IN_PROGRESS;
+    }
+
+    // Only a close (or stray bytes) can arrive on an idle pooled connection
+    if (conn->state == UPSTREAM_IDLE) {
+        fprintf(stderr, "proxy: upstream closed pooled connection %d\n", conn->fd);
+        close_upstream(map, length, conn, epoll_fd);
+        return PROXY_IN_PROGRESS;
+    }
+
+    struct conn *client = get_conn(map, conn->peer_fd, length);
+
+    if (client == NULL || client->proxy == NULL) {
+        close_upstream(map, length, conn, epoll_fd);
+        return PROXY_IN_PROGRESS;
+    }
+
+    struct proxy_exchange *px = client->proxy;
+    int ret;
+
+    *client_fd = client->fd;
+
+    if (events & EPOLLERR) {
+        return upstream_failed(map, length, client, conn, epoll_fd);
+    }
+
+    switch (conn->state) {
+    case UPSTREAM_CONNECTING: {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == -1 || err != 0) {
+            fprintf(stderr, "proxy: connect to %s failed: %s\n", conn->upstream->address,
+                    strerror(err));
+            return upstream_failed(map, length, client, conn, epoll_fd);
+        }
+        set_conn_state(conn, UPSTREAM_SENDING);
+    }
+        [[fallthrough]];
+    case UPSTREAM_SENDING:
+        ret = send_upstream_request(px, conn->fd, client->request);
+        if (ret < 0) {
+            return upstream_failed(map, length, client, conn, epoll_fd);
+        } else if (ret > 0) {
+            return PROXY_IN_PROGRESS;
+        }
+
+        // Parse the upstream response into the client's (fresh) response message
+        free_http_message(client->response);
+        *client->response = init_http_message();
+        memset(conn->buffer, 0, UPSTREAM_BUFFER_SIZE);
+
+        set_conn_state(conn, UPSTREAM_RECEIVING);
+        if (watch_fd(epoll_fd, conn->fd, RECV_EPOLL_FLAGS) != 0) {
+            return upstream_failed(map, length, client, conn, epoll_fd);
+        }
+        [[fallthrough]];
+    case UPSTREAM_RECEIVING:
+        // Keep parsing headers only once the status line is in
+        ret = parse_http_headers(client->response, conn->buffer, UPSTREAM_BUFFER_SIZE, conn->fd,
+                                 client->response->start_line.response.status_code != 0, RESPONSE);
+        if (ret < 0) {
+            return upstream_failed(map, length, client, conn, epoll_fd);
+        } else if (ret > 0) {
+            return PROXY_IN_PROGRESS;
+        }
+
+        if (build_client_response(px, client, conn->buffer) != 0) {
+            return upstream_failed(map, length, client, conn, epoll_fd);
+        }
+
+        set_conn_state(conn, UPSTREAM_STREAMING);
+        if (watch_fd(epoll_fd, client->fd, SEND_EPOLL_FLAGS) != 0) {
+            return upstream_failed(map, length, client, conn, epoll_fd);
+        }
+        [[fallthrough]];
+    case UPSTREAM_STREAMING:
+        return stream_response(map, length, client, conn, epoll_fd);
+
+    default:
+        return PROXY_IN_PROGRESS;
+    }
+}
+
+/*
+    Ends an exchange whose upstream has not connected, answered or taken more of the response
+    for PROXY_UPSTREAM_TIMEOUT seconds. A client still reading the response counts as activity.
+
+    Returns PROXY_IN_PROGRESS while there is time left, otherwise what the client should get
+*/
+int
+proxy_check_timeout(struct conn *map, int length, struct conn *client, time_t now, int epoll_fd)
+{
+    struct conn *upstream_conn = get_conn(map, client->peer_fd, length);
+
+    if (!client->proxy || !upstream_conn
+        || now - MAX(client->last_activity, upstream_conn->last_activity)
+               < PROXY_UPSTREAM_TIMEOUT) {
+        return PROXY_IN_PROGRESS;
+    }
+
+    bool head_sent = upstream_conn->state == UPSTREAM_STREAMING && client->proxy->out_offset > 0;
+
+    fprintf(stderr, "proxy: upstream connection %d timed out\n", upstream_conn->fd);
+    close_upstream(map, length, upstream_conn, epoll_fd);
+    free_exchange(client);
+
+    return head_sent ? PROXY_FAILED : PROXY_GATEWAY_TIMEOUT;
+}
+
+/*
+    Tears down the proxy side of a connection that is being closed
+*/
+void
+proxy_abort(struct conn *map, int length, struct conn *conn, int epoll_fd)
+{
+    if (!conn) {
+        return;
+    }
+
+    if (conn->proxy) {
+        // A half-finished exchange leaves the upstream connection unusable
+        struct conn *upstream_conn = get_conn(map, conn->peer_fd, length);
+
+        if (upstream_conn && upstream_conn->upstream) {
+            close_upstream(map, length, upstream_conn, epoll_fd);
+        }
+        free_exchange(conn);
+    } else if (conn->upstream) {
+        forget_idle(conn->upstream, conn->fd);
+
+        struct conn *client = get_conn(map, conn->peer_fd, length);
+        if (client) {
+            client->peer_fd = -1;
+        }
+    }
+}
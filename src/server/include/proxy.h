@@ -0,0 +1,66 @@
+/*
+    Header File for the reverse proxy route type
+*/
+
+#pragma once
+
+#include "conn_map.h"
+#include "http_builder.h"
+#include "http_parser.h"
+#include "keep_alive.h"
+#include "macros.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define UPSTREAM_POOL_SIZE 8        // Idle kept-alive connections kept per upstream
+#define UPSTREAM_BUFFER_SIZE 8 * KB // Buffer for the upstream response head
+#define PROXY_PIPE_SIZE 256 * KB    // Requested capacity of the splice() pipe
+
+/*
+    Results of the proxy functions, as seen by the event loop
+*/
+enum PROXY_RESULT
+{
+    PROXY_GATEWAY_TIMEOUT = -3, // The upstream went quiet before anything was sent, a 504
+    PROXY_BAD_GATEWAY = -2,     // Nothing was sent to the client yet, answer with a 502
+    PROXY_FAILED = -1,          // The response is broken mid-way, close the client
+    PROXY_DONE = 0,             // The client got the whole response
+    PROXY_IN_PROGRESS = 1,      // Waiting on epoll
+};
+
+/*
+    Upstream server a proxy route forwards to
+
+    Each upstream keeps a pool of idle kept-alive connections. Pooled connections stay in the
+    connection map and the epoll set so an upstream closing one of them is noticed right away.
+*/
+struct upstream
+{
+    const char *name;              // Name routes refer to
+    const char *address;           // "host:port" or "unix:/path/to.sock"
+    struct sockaddr_storage addr;  // Resolved once by proxy_init()
+    socklen_t addrlen;             // 0 when the address could not be resolved
+    int idle_fds[UPSTREAM_POOL_SIZE];
+    int idle_count;
+};
+
+int proxy_init(void);
+struct upstream *find_upstream(const char *name);
+
+int proxy_start(struct conn *map, int length, struct conn *client, struct upstream *upstream,
+                int epoll_fd);
+int proxy_handle_event(struct conn *map, int length, struct conn *conn, uint32_t events,
+                       int epoll_fd, int *client_fd);
+int proxy_check_timeout(struct conn *map, int length, struct conn *client, time_t now,
+                        int epoll_fd);
+void proxy_abort(struct conn *map, int length, struct conn *conn, int epoll_fd);
@@ -0,0 +1,130 @@
+/*
+    Per-client request rate limiting
+
+    Every client address owns a token bucket holding up to RATE_LIMIT_BURST requests, refilled
+    at RATE_LIMIT_RATE per second. A request takes a token, and a client with none left gets a
+    429 telling it when the next one is due. A client that keeps under the rate is never
+    refused, however long its connections live.
+
+    Buckets sit in a fixed open-addressing table and are refilled lazily from the loop clock
+    when their client next makes a request. The clock is read once per loop wakeup from the
+    vDSO, so a request costs no system call and touches only its bucket's cache line. When a
+    probe window is full, its stalest bucket is reused. A client idle that long has a full
+    bucket anyway, so forgetting it changes nothing.
+*/
+
+#define _GNU_SOURCE
+
+#include "rate_limit.h"
+
+static struct rate_bucket buckets[RATE_LIMIT_BUCKETS];
+static uint32_t loop_clock = 0; // Milliseconds, wraps every 49 days, only differences are used
+
+static const uint8_t unspecified_address[16] = { 0 };
+
+/*
+    Reduces a peer address to the 16-byte key buckets are found by
+*/
+void
+client_address_from_sockaddr(const struct sockaddr_storage *addr, uint8_t address[16])
+{
+    memset(address, 0, 16);
+
+    if (addr->ss_family == AF_INET6) {
+        memcpy(address, &((const struct sockaddr_in6 *) addr)->sin6_addr, 16);
+    } else if (addr->ss_family == AF_INET) {
+        // ::ffff:a.b.c.d, so one client is one bucket whichever socket family it came in on
+        address[10] = 0xff;
+        address[11] = 0xff;
+        memcpy(address + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+    }
+}
+
+/*
+    Advances the loop clock, called once per event loop wakeup
+*/
+void
+rate_limit_tick(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    loop_clock = (uint32_t) (now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+static uint32_t
+hash_address(const uint8_t address[16])
+{
+    uint64_t high;
+    uint64_t low;
+
+    memcpy(&high, address, 8);
+    memcpy(&low, address + 8, 8);
+
+    uint64_t hash = high * 0x9e3779b97f4a7c15ULL ^ low * 0xc2b2ae3d27d4eb4fULL;
+
+    return (uint32_t) (hash ^ hash >> 32);
+}
+
+/*
+    Finds the client's bucket, or claims one for it
+*/
+static struct rate_bucket *
+find_bucket(const uint8_t address[16])
+{
+    uint32_t index = hash_address(address);
+    struct rate_bucket *free_bucket = NULL;
+    struct rate_bucket *stalest = NULL;
+
+    for (int i = 0; i < RATE_LIMIT_PROBES; i++) {
+        struct rate_bucket *bucket = &buckets[(index + i) & (RATE_LIMIT_BUCKETS - 1)];
+
+        if (memcmp(bucket->address, address, 16) == 0) {
+            return bucket;
+        } else if (memcmp(bucket->address, unspecified_address, 16) == 0) {
+            free_bucket = free_bucket ? free_bucket : bucket;
+        } else if (!stalest
+                   || loop_clock - bucket->refilled_at > loop_clock - stalest->refilled_at) {
+            stalest = bucket;
+        }
+    }
+
+    struct rate_bucket *reuse = free_bucket ? free_bucket : stalest;
+
+    memcpy(reuse->address, address, 16);
+    reuse->tokens = RATE_LIMIT_BURST * RATE_LIMIT_TOKEN;
+    reuse->refilled_at = loop_clock;
+    return reuse;
+}
+
+/*
+    Charges one request to a client
+
+    Returns 0 if it may go ahead, or the seconds until it may try again
+*/
+int
+rate_limit_take(const uint8_t address[16])
+{
+    // Clients without an IP address, e.g. on a Unix socket, are not limited
+    if (!RATE_LIMIT_ENABLED || memcmp(address, unspecified_address, 16) == 0) {
+        return 0;
+    }
+
+    struct rate_bucket *bucket = find_bucket(address);
+    uint64_t refill
+        = (uint64_t) (loop_clock - bucket->refilled_at) * RATE_LIMIT_RATE * RATE_LIMIT_TOKEN / 1000;
+
+    bucket->tokens = MIN(bucket->tokens + refill, RATE_LIMIT_BURST * RATE_LIMIT_TOKEN);
+    bucket->refilled_at = loop_clock;
+
+    if (bucket->tokens >= RATE_LIMIT_TOKEN) {
+        bucket->tokens -= RATE_LIMIT_TOKEN;
+        return 0;
+    }
+
+    // Whole seconds until the missing part of a token has trickled in, rounded up
+    uint32_t missing = RATE_LIMIT_TOKEN - bucket->tokens;
+    uint32_t per_second = RATE_LIMIT_RATE * RATE_LIMIT_TOKEN;
+
+    return (missing + per_second - 1) / per_second;
+}
@@ -0,0 +1,35 @@
+/*
+    Header File for per-client request rate limiting
+*/
+
+#pragma once
+
+#include "macros.h"
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define RATE_LIMIT_RATE 50      // Requests per second a client may sustain
+#define RATE_LIMIT_BURST 100    // Requests a client may make at once after being quiet
+#define RATE_LIMIT_BUCKETS 4096 // Clients tracked at once, a power of two
+#define RATE_LIMIT_PROBES 8     // Slots looked at before the stalest one is reused
+
+#define RATE_LIMIT_TOKEN 1000 // Tokens are kept in thousandths of a request
+
+/*
+    A client's bucket, two to a cache line
+*/
+struct rate_bucket
+{
+    uint8_t address[16];  // IPv6, or IPv4-mapped; all zeros when the slot is free
+    uint32_t tokens;      // In RATE_LIMIT_TOKEN units
+    uint32_t refilled_at; // Loop clock in milliseconds when tokens was last brought up to date
+};
+
+void client_address_from_sockaddr(const struct sockaddr_storage *addr, uint8_t address[16]);
+
+void rate_limit_tick(void);
+int rate_limit_take(const uint8_t address[16]);
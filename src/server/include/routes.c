@@ -2,6 +2,38 @@
 #define _GNU_SOURCE
 
 #include "routes.h"
+#include "busy_poll.h"
+#include "file_cache.h"
+#include "memory_budget.h"
+#include "offload.h"
+#include "sse.h"
+#include "static_pack.h"
+#include "websocket.h"
+
+static int static_root_fd = -1; // See static_root_open()
+
+/*
+    Sets a file of the static directory as the response body
+
+    Looks in the static pack, then the file cache, before falling back to the file itself.
+*/
+int
+serve_static_file(const HTTP_MESSAGE *request, HTTP_MESSAGE *response, const char *path)
+{
+    if (static_pack_respond(request, response, path) == 0
+        || file_cache_get(request, response, path) == 0) {
+        return 0;
+    }
+
+    char file_path[MAX_HTTP_BODY_FILE_PATH];
+
+    snprintf(file_path, sizeof(file_path), "%s%s", STATIC_PATH_STR, path);
+    if (file_cache_load(request, response, path, file_path, -1) == 0) {
+        return 0;
+    }
+
+    return http_message_open_existing_file(response, path, O_RDONLY, false);
+}
 
 int
 default_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
@@ -13,7 +45,7 @@ default_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
 
     response->start_line.response.status_code = STATUS_OK;
     strcpy(response->start_line.response.status_message, "OK");
-    return http_message_open_existing_file(response, "html/index.html", O_RDONLY, false);
+    return serve_static_file(request, response, "html/index.html");
 }
 
 int
@@ -26,17 +58,17 @@ echo_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
     }
 
     // Read the request body
-    const char *content_type
-        = get_header_value(request->headers, MAX_HEADER_LENGTH, "Content-Type");
+    const char *content_type = get_known_header(request, HEADER_CONTENT_TYPE);
 
-    if (strcmp("text/plain", content_type) == 0) {
+    if (content_type && strcmp("text/plain", content_type) == 0) {
 
         ssize_t bytes_read = 0;
 
-        char *file_contents = malloc(request->body_length + 1);
+        char *file_contents = arena_alloc(request->arena, request->body_length + 1);
 
         if (!file_contents) {
-            perror("Failed to allocate memory");
+            build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error",
+                                 NULL);
             return -1;
         }
 
@@ -45,7 +77,6 @@ echo_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
         if ((bytes_read = read(request->body_fd, file_contents, request->body_length)) == -1) {
             perror("Failed to read from temp file");
             close(request->body_fd);
-            free(file_contents);
             build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error",
                                  NULL);
             return -1;
@@ -59,7 +90,6 @@ echo_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
         if (write(response->body_fd, file_contents, bytes_read) == -1) {
             perror("Failed to write to temp file");
             close(response->body_fd);
-            free(file_contents);
             build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error",
                                  NULL);
             return -1;
@@ -67,20 +97,145 @@ echo_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
 
         response->start_line.response.status_code = STATUS_OK;
         strcpy(response->start_line.response.status_message, "OK");
-        free(file_contents);
 
     } else {
         // Unsupported media type
         response->start_line.response.status_code = STATUS_UNSUPPORTED_MEDIA_TYPE;
         strcpy(response->start_line.response.status_message, "Unsupported Media Type");
-        http_message_open_existing_file(response, "html/UnsupportedMediaType.html", O_RDONLY,
-                                        false);
+        serve_static_file(request, response, "html/UnsupportedMediaType.html");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Opens the static directory that static_handler() resolves every request beneath
+
+    Returns 0, or -1 when there is no static directory, in which case static files are refused
+*/
+int
+static_root_open(void)
+{
+    static_root_fd = open(STATIC_PATH_STR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (static_root_fd == -1) {
+        perror("Failed to open the static directory");
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+static_root_close(void)
+{
+    if (static_root_fd != -1) {
+        close(static_root_fd);
+        static_root_fd = -1;
+    }
+}
+
+static int
+hex_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower((unsigned char) c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/*
+    Rewrites a /static request target in place into a path relative to the static directory
+
+    The query is dropped and the rest percent-decoded, then empty and "." segments are removed
+    and each ".." takes the segment before it away. An empty result names the directory itself.
+    Returns 0, -1 for a target outside /static, or -2 for a malformed one or one climbing out
+*/
+static int
+static_relative_path(char *path)
+{
+    const char *prefix = STATIC_PATH_STR + 1; // "/static/"
+    size_t prefix_length = strlen(prefix);
+
+    path[strcspn(path, "?#")] = '\0';
+    if (strncmp(path, prefix, prefix_length) != 0) {
         return -1;
     }
 
+    // Decoding only ever shortens the path, so it is written over itself
+    char *in = path + prefix_length;
+    char *out = path;
+
+    while (*in) {
+        if (*in != '%') {
+            *out++ = *in++;
+            continue;
+        }
+
+        int high = hex_value(in[1]);
+        int low = high == -1 ? -1 : hex_value(in[2]);
+
+        if (low == -1 || (high == 0 && low == 0)) {
+            return -2;
+        }
+        *out++ = (char) (high << 4 | low);
+        in += 3;
+    }
+    *out = '\0';
+
+    // Then segment by segment, again over itself
+    in = path;
+    out = path;
+    while (*in) {
+        size_t length = strcspn(in, "/");
+
+        if (length == 2 && in[0] == '.' && in[1] == '.') {
+            if (out == path) {
+                return -2;
+            }
+            do {
+                out--;
+            } while (out > path && *out != '/');
+        } else if (length > 0 && !(length == 1 && in[0] == '.')) {
+            if (out > path) {
+                *out++ = '/';
+            }
+            memmove(out, in, length);
+            out += length;
+        }
+
+        in += length;
+        in += *in == '/';
+    }
+    *out = '\0';
+
     return 0;
 }
 
+/*
+    Opens path beneath the static directory, the kernel refusing anything that resolves outside
+    it, through ".." or symlinks, as well as /proc style magic links
+
+    Opened non-blocking, so a FIFO under the directory cannot stall the loop before the caller
+    turns it away as not a regular file. Regular files are read the same either way.
+
+    Returns the file descriptor, or -1 with errno set
+*/
+static int
+open_beneath_static_root(const char *path)
+{
+    struct open_how how = { .flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK,
+                            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+
+    if (static_root_fd == -1) {
+        errno = EACCES;
+        return -1;
+    }
+
+    return (int) syscall(SYS_openat2, static_root_fd, path[0] ? path : ".", &how, sizeof(how));
+}
+
 int
 static_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
 {
@@ -89,82 +244,99 @@ static_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
         return -1;
     }
 
-    add_header(response, "Connection", "close");
-
     printf("Static file request: %s\n", request->start_line.request.request_target);
 
-    // Get route
-    char route[MAX_TARGET_LENGTH + 1] = { 0 }; // +1 for the leading '.'
+    // Path relative to the static directory, naming the file in the pack and the file cache
+    char key[MAX_TARGET_LENGTH];
     size_t target_len = strlen(request->start_line.request.request_target);
-    if (target_len >= MAX_TARGET_LENGTH) {
-        printf("Request target too long: %s\n", request->start_line.request.request_target);
+    int ret = -1;
+
+    if (target_len < sizeof(key)) {
+        memcpy(key, request->start_line.request.request_target, target_len + 1);
+        ret = static_relative_path(key);
+    }
+
+    if (ret == -1) {
+        printf("Not a static file: %s\n", request->start_line.request.request_target);
         response->start_line.response.status_code = STATUS_NOT_FOUND;
         strcpy(response->start_line.response.status_message, "Not Found");
-        http_message_open_existing_file(response, "html/NotFound.html", O_RDONLY, false);
+        serve_static_file(request, response, "html/NotFound.html");
+        return -1;
+    } else if (ret < 0) {
+        printf("Access denied: %s\n", request->start_line.request.request_target);
+        response->start_line.response.status_code = STATUS_FORBIDDEN;
+        strcpy(response->start_line.response.status_message, "Forbidden");
+        serve_static_file(request, response, "html/Forbidden.html");
         return -1;
     }
-    snprintf(route, sizeof route, ".%s", request->start_line.request.request_target);
 
     int method = request->start_line.request.method;
 
     response->start_line.response.protocol = request->start_line.request.protocol;
 
-    // Get the absolute path of the requested file
-    char resolved_path[MAX_TARGET_LENGTH];
-    if (realpath(route, resolved_path) == NULL) {
-        printf("Failed to resolve path: %s\n", route);
-        response->start_line.response.status_code = STATUS_NOT_FOUND;
-        strcpy(response->start_line.response.status_message, "Not Found");
-        http_message_open_existing_file(response, "html/NotFound.html", O_RDONLY, false);
-        return -1;
+    // Packed and cached files need no path resolution
+    if (method == HTTP_GET && key[0]
+        && (static_pack_respond(request, response, key) == 0
+            || file_cache_get(request, response, key) == 0)) {
+        response->start_line.response.status_code = STATUS_OK;
+        strcpy(response->start_line.response.status_message, "OK");
+        return 0;
     }
 
-    // Get the absolute path of the static directory
-    char static_dir_resolved[MAX_TARGET_LENGTH];
-    if (realpath(STATIC_PATH_STR, static_dir_resolved) == NULL) {
-        printf("Failed to resolve static directory path: %s\n", STATIC_PATH_STR);
+    // One system call resolves the path safely and opens it
+    int fd = open_beneath_static_root(key);
+    struct stat path_stat;
+
+    if (fd == -1 && (errno == EXDEV || errno == ELOOP || errno == EACCES)) {
+        printf("Access denied: %s\n", key);
         response->start_line.response.status_code = STATUS_FORBIDDEN;
         strcpy(response->start_line.response.status_message, "Forbidden");
-        http_message_open_existing_file(response, "html/Forbidden.html", O_RDONLY, false);
+        serve_static_file(request, response, "html/Forbidden.html");
         return -1;
-    }
-
-    // Check that its a file rather than a directory
-    struct stat path_stat;
-    if (stat(resolved_path, &path_stat) != 0) {
-        printf("Failed to stat path: %s\n", resolved_path);
+    } else if (fd == -1 || fstat(fd, &path_stat) != 0) {
+        printf("Failed to open path: %s\n", key);
+        if (fd != -1) {
+            close(fd);
+        }
         response->start_line.response.status_code = STATUS_NOT_FOUND;
         strcpy(response->start_line.response.status_message, "Not Found");
-        http_message_open_existing_file(response, "html/NotFound.html", O_RDONLY, false);
+        serve_static_file(request, response, "html/NotFound.html");
         return -1;
     }
-    if (S_ISDIR(path_stat.st_mode)) {
-        printf("Requested path is a directory: %s\n", resolved_path);
-        response->start_line.response.status_code = STATUS_FORBIDDEN;
-    }
 
-    // Check if the resolved path is still under the static directory
-    if (strncmp(resolved_path, static_dir_resolved, strlen(static_dir_resolved)) != 0) {
-        printf("Access denied: %s\n", resolved_path);
+    // Check that its a file rather than a directory
+    if (!S_ISREG(path_stat.st_mode)) {
+        printf("Requested path is not a file: %s\n", key);
+        close(fd);
         response->start_line.response.status_code = STATUS_FORBIDDEN;
         strcpy(response->start_line.response.status_message, "Forbidden");
-        http_message_open_existing_file(response, "html/Forbidden.html", O_RDONLY, false);
+        serve_static_file(request, response, "html/Forbidden.html");
         return -1;
     }
 
     // Only accept GET requests
     if (method != HTTP_GET) {
         printf("Method not allowed: %d\n", method);
+        close(fd);
         response->start_line.response.status_code = STATUS_METHOD_NOT_ALLOWED;
         strcpy(response->start_line.response.status_message, "Method Not Allowed");
         add_header(response, "Allow", "GET");
         return -1;
     }
 
+    // The path names the file for its MIME type and for cache revalidation
+    char file_path[MAX_HTTP_BODY_FILE_PATH];
+
+    snprintf(file_path, sizeof(file_path), "%s%s", STATIC_PATH_STR, key);
+
     // File is accessible
     response->start_line.response.status_code = STATUS_OK;
     strcpy(response->start_line.response.status_message, "OK");
-    http_message_open_existing_file(response, resolved_path, O_RDONLY, true);
+    if (file_cache_load(request, response, key, file_path, fd) == 0) {
+        close(fd);
+    } else {
+        http_message_set_body_fd(response, fd, file_path, path_stat.st_size);
+    }
     return 0;
 }
 
@@ -186,6 +358,13 @@ favicon_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
         return -1;
     }
 
+    if (static_pack_respond(request, response, "favicon.ico") == 0) {
+        response->start_line.response.status_code = STATUS_OK;
+        strcpy(response->start_line.response.status_message, "OK");
+        add_header(response, "Cache-Control", "public, max-age=86400"); // Cache for 1 day
+        return 0;
+    }
+
     // Try to serve favicon.ico from static directory
     const char *favicon_path = "./static/favicon.ico";
 
@@ -194,7 +373,6 @@ favicon_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
         // File exists, serve it
         response->start_line.response.status_code = STATUS_OK;
         strcpy(response->start_line.response.status_message, "OK");
-        add_header(response, "Content-Type", "image/x-icon");
         add_header(response, "Cache-Control", "public, max-age=86400"); // Cache for 1 day
         return http_message_open_existing_file(response, favicon_path, O_RDONLY, true);
     } else {
@@ -204,3 +382,769 @@ favicon_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
         return 0;
     }
 }
+
+/*
+    Answers 200 with a JSON body formatted by the handler
+
+    Returns 0, or -1 with a 500 built when the body could not be stored
+*/
+static int
+send_json_body(HTTP_MESSAGE *response, const char *body, int length)
+{
+    if (http_message_open_temp_file(response, length) != 0) {
+        return -1;
+    }
+
+    if (write(response->body_fd, body, length) != length) {
+        perror("Failed to write to temp file");
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error",
+                             NULL);
+        return -1;
+    }
+
+    response->start_line.response.status_code = STATUS_OK;
+    strcpy(response->start_line.response.status_message, "OK");
+    return 0;
+}
+
+/*
+    Reports the file cache counters as JSON
+*/
+int
+file_cache_stats_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
+{
+    if (!request || !response) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    struct file_cache_stats stats;
+    char body[256];
+
+    file_cache_get_stats(&stats);
+
+    int body_length = snprintf(body, sizeof(body),
+                               "{\"hits\":%ld,\"misses\":%ld,\"evictions\":%ld,\"entries\":%ld,"
+                               "\"bytes\":%ld,\"budget\":%ld}\n",
+                               stats.hits, stats.misses, stats.evictions, stats.entries,
+                               stats.bytes, (long) FILE_CACHE_BUDGET);
+
+    return send_json_body(response, body, body_length);
+}
+
+/*
+    Reports where the event loop's time went as JSON, see busy_poll.c
+*/
+int
+busy_poll_stats_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
+{
+    if (!request || !response) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    struct busy_poll_stats stats;
+    char body[256];
+
+    busy_poll_get_stats(&stats);
+
+    int body_length = snprintf(body, sizeof(body),
+                               "{\"enabled\":%s,\"spin_ns\":%ld,\"blocked_ns\":%ld,"
+                               "\"work_ns\":%ld,\"polls\":%ld,\"empty_polls\":%ld,"
+                               "\"back_offs\":%ld}\n",
+                               BUSY_POLL_ENABLED ? "true" : "false", stats.spin_ns,
+                               stats.blocked_ns, stats.work_ns, stats.polls, stats.empty_polls,
+                               stats.back_offs);
+
+    return send_json_body(response, body, body_length);
+}
+
+/*
+    Reports the offload pool's queue depth and wait times as JSON
+*/
+int
+offload_stats_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
+{
+    if (!request || !response) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    struct offload_stats stats;
+    char body[512];
+
+    offload_get_stats(&stats);
+
+    int body_length = snprintf(
+        body, sizeof(body),
+        "{\"threads\":%d,\"submitted\":%ld,\"completed\":%ld,\"cancelled\":%ld,"
+        "\"rejected\":%ld,\"queue_depth\":%ld,\"max_queue_depth\":%ld,"
+        "\"avg_wait_us\":%.1f,\"max_wait_us\":%.1f,\"avg_run_us\":%.1f}\n",
+        OFFLOAD_THREADS, stats.submitted, stats.completed, stats.cancelled, stats.rejected,
+        stats.queue_depth, stats.max_queue_depth,
+        stats.completed ? stats.wait_ns / 1000.0 / stats.completed : 0.0,
+        stats.max_wait_ns / 1000.0,
+        stats.completed ? stats.run_ns / 1000.0 / stats.completed : 0.0);
+
+    return send_json_body(response, body, body_length);
+}
+
+/*
+    Reports what connections hold against the memory budget as JSON, see memory_budget.c
+*/
+int
+memory_stats_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
+{
+    if (!request || !response) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    struct memory_budget_stats stats;
+    char body[512];
+
+    memory_budget_get_stats(&stats);
+
+    int body_length = snprintf(
+        body, sizeof(body),
+        "{\"used\":%lld,\"peak\":%lld,\"soft_limit\":%ld,\"hard_limit\":%ld,"
+        "\"connection_limit\":%ld,\"messages\":%lld,\"arenas\":%lld,\"temp_files\":%lld,"
+        "\"http2\":%lld,\"paused\":%d,\"shed\":%ld,\"accepting\":%s}\n",
+        stats.used, stats.peak, MEMORY_SOFT_LIMIT, MEMORY_HARD_LIMIT, MEMORY_CONNECTION_LIMIT,
+        stats.messages, stats.arenas, stats.temp_files, stats.http2, stats.paused, stats.shed,
+        stats.accepting ? "true" : "false");
+
+    return send_json_body(response, body, body_length);
+}
+
+/*
+    Reports which process sent the request as JSON, known for clients on the Unix socket
+*/
+int
+whoami_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
+{
+    if (!request || !response) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    const HTTP_CREDENTIALS *credentials = &request->credentials;
+    char body[128];
+    int body_length;
+
+    if (credentials->known) {
+        body_length = snprintf(body, sizeof(body),
+                               "{\"transport\":\"unix\",\"pid\":%d,\"uid\":%u,\"gid\":%u}\n",
+                               (int) credentials->pid, (unsigned) credentials->uid,
+                               (unsigned) credentials->gid);
+    } else {
+        body_length = snprintf(body, sizeof(body), "{\"transport\":\"tcp\"}\n");
+    }
+
+    return send_json_body(response, body, body_length);
+}
+
+/*
+    Per-request state of checksum_stream_handler()
+*/
+struct checksum_state
+{
+    uint64_t hash;
+    long bytes;
+};
+
+/*
+    Streams the request body through a 64-bit FNV-1a hash and answers with the digest
+
+    The body is never written to disk, so memory use is bounded regardless of upload size.
+*/
+int
+checksum_stream_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response, int event,
+                        const char *chunk, int chunk_length, void **state)
+{
+    if (!request || !response || !state) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    struct checksum_state *checksum = *state;
+
+    if (checksum == NULL && event != BODY_STREAM_ABORT) {
+        checksum = arena_calloc(request->arena, 1, sizeof(struct checksum_state));
+        if (!checksum) {
+            build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error",
+                                 NULL);
+            return -1;
+        }
+        checksum->hash = 0xcbf29ce484222325ULL; // FNV offset basis
+        *state = checksum;
+    }
+
+    switch (event) {
+    case BODY_STREAM_DATA:
+        for (int i = 0; i < chunk_length; i++) {
+            checksum->hash ^= (unsigned char) chunk[i];
+            checksum->hash *= 0x100000001b3ULL; // FNV prime
+        }
+        checksum->bytes += chunk_length;
+        return BODY_STREAM_CONTINUE;
+
+    case BODY_STREAM_RESUME:
+        return BODY_STREAM_CONTINUE;
+
+    case BODY_STREAM_END: {
+        char digest[64] = { 0 };
+        int digest_length = snprintf(digest, sizeof(digest), "%016llx %ld\n",
+                                     (unsigned long long) checksum->hash, checksum->bytes);
+
+        *state = NULL;
+
+        if (http_message_open_temp_file(response, digest_length) != 0) {
+            return -1;
+        }
+
+        if (write(response->body_fd, digest, digest_length) != digest_length) {
+            perror("Failed to write to temp file");
+            build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error",
+                                 NULL);
+            return -1;
+        }
+
+        response->start_line.response.status_code = STATUS_OK;
+        strcpy(response->start_line.response.status_message, "OK");
+        return 0;
+    }
+
+    default:
+        *state = NULL;
+        return 0;
+    }
+}
+
+/*
+    One part of an upload, see upload_stream_handler()
+*/
+struct upload_part
+{
+    char name[MULTIPART_MAX_PARAMETER];
+    char path[MAX_HTTP_BODY_FILE_PATH]; // Where a file part went, "" for a field
+    char *value;                        // A field's contents, in the request arena
+    long capacity;
+    long length;
+};
+
+/*
+    Per-request state of upload_stream_handler()
+*/
+struct upload_state
+{
+    struct multipart_parser parser;
+    HTTP_MESSAGE *request;
+    HTTP_MESSAGE *response;
+    int fd; // File part being written, or -1
+    struct upload_part parts[UPLOAD_MAX_PARTS];
+    int count;
+    bool failed; // A callback built the error response
+};
+
+/*
+    Names a file part's destination: a random prefix, then its filename stripped of any
+    directories and of characters a shell or a URL would trip over
+*/
+static void
+upload_file_path(const char *filename, char *path, size_t size)
+{
+    const char *base = filename + strlen(filename);
+    char prefix[17] = { 0 };
+    char name[65] = { 0 };
+    size_t n = 0;
+
+    while (base > filename && base[-1] != '/' && base[-1] != '\\') {
+        base--;
+    }
+    base += strspn(base, ".");
+
+    for (; *base && n < sizeof(name) - 1; base++) {
+        name[n++] = isalnum((unsigned char) *base) || strchr("._-", *base) ? *base : '_';
+    }
+
+    random_string(prefix, sizeof(prefix) - 1);
+    snprintf(path, size, "%s%s-%s", UPLOAD_PATH_STR, prefix, n > 0 ? name : "upload");
+}
+
+static int
+upload_fail(struct upload_state *upload, int status_code, const char *status_message)
+{
+    build_error_response(upload->response, status_code, status_message, NULL);
+    upload->failed = true;
+    return -1;
+}
+
+static int
+upload_part_begin(void *ctx, struct multipart_part *part)
+{
+    struct upload_state *upload = ctx;
+
+    if (upload->count == UPLOAD_MAX_PARTS) {
+        return upload_fail(upload, STATUS_CONTENT_TOO_LARGE, "Content Too Large");
+    }
+
+    struct upload_part *entry = &upload->parts[upload->count++];
+
+    memset(entry, 0, sizeof(*entry));
+    snprintf(entry->name, sizeof(entry->name), "%s", part->name);
+
+    if (part->filename[0] == '\0') {
+        return 0;
+    }
+
+    if (mkdir(UPLOAD_PATH_STR, 0755) == -1 && errno != EEXIST) {
+        perror("Failed to create the upload directory");
+        return upload_fail(upload, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error");
+    }
+
+    // A name taken by an earlier upload gets another prefix
+    for (int attempt = 0; upload->fd == -1 && attempt < 8; attempt++) {
+        upload_file_path(part->filename, entry->path, sizeof(entry->path));
+        upload->fd = open(entry->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (upload->fd == -1 && errno != EEXIST) {
+            break;
+        }
+    }
+
+    if (upload->fd == -1) {
+        perror("Failed to create upload file");
+        entry->path[0] = '\0';
+        return upload_fail(upload, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error");
+    }
+
+    return 0;
+}
+
+/*
+    Writes a file part's contents straight from the receive buffer, or keeps a field's
+*/
+static int
+upload_part_data(void *ctx, struct multipart_part *part, const char *data, int length)
+{
+    struct upload_state *upload = ctx;
+    struct upload_part *entry = &upload->parts[upload->count - 1];
+
+    (void) part;
+
+    if (upload->fd != -1) {
+        while (length > 0) {
+            ssize_t n = write(upload->fd, data, length);
+
+            if (n == -1 && errno == EINTR) {
+                continue;
+            } else if (n == -1) {
+                perror("Failed to write upload file");
+                return upload_fail(upload, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error");
+            }
+            data += n;
+            length -= n;
+            entry->length += n;
+        }
+        return 0;
+    }
+
+    if (entry->length + length > UPLOAD_MAX_FIELD) {
+        return upload_fail(upload, STATUS_CONTENT_TOO_LARGE, "Content Too Large");
+    }
+
+    // Fields are small, they grow by doubling in the arena
+    if (entry->length + length + 1 > entry->capacity) {
+        long capacity = MAX(entry->capacity * 2, MAX(entry->length + length + 1, 256));
+        char *value = arena_alloc(upload->request->arena, capacity);
+
+        if (!value) {
+            return upload_fail(upload, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error");
+        }
+        if (entry->length > 0) {
+            memcpy(value, entry->value, entry->length);
+        }
+        entry->value = value;
+        entry->capacity = capacity;
+    }
+
+    memcpy(entry->value + entry->length, data, length);
+    entry->length += length;
+    entry->value[entry->length] = '\0';
+    return 0;
+}
+
+static int
+upload_part_end(void *ctx, struct multipart_part *part)
+{
+    struct upload_state *upload = ctx;
+
+    (void) part;
+
+    if (upload->fd != -1) {
+        close(upload->fd);
+        upload->fd = -1;
+    }
+
+    return 0;
+}
+
+/*
+    Closes and removes whatever files a failed or abandoned upload wrote
+*/
+static void
+upload_release(struct upload_state *upload)
+{
+    if (upload->fd != -1) {
+        close(upload->fd);
+        upload->fd = -1;
+    }
+
+    for (int i = 0; i < upload->count; i++) {
+        if (upload->parts[i].path[0] != '\0') {
+            unlink(upload->parts[i].path);
+        }
+    }
+}
+
+/*
+    Writes s as a JSON string, escaped, at out, which has room for 6 bytes per byte of s plus 2
+
+    Returns the bytes written
+*/
+static int
+json_string(char *out, const char *s, long length)
+{
+    char *p = out;
+
+    *p++ = '"';
+    for (long i = 0; i < length; i++) {
+        unsigned char c = s[i];
+
+        if (c == '"' || c == '\\') {
+            *p++ = '\\';
+            *p++ = c;
+        } else if (c < 0x20) {
+            p += sprintf(p, "\\u%04x", c);
+        } else {
+            *p++ = c;
+        }
+    }
+    *p++ = '"';
+
+    return (int) (p - out);
+}
+
+/*
+    Answers a finished upload with each part as JSON: where files went, what fields held
+*/
+static int
+upload_respond(struct upload_state *upload)
+{
+    HTTP_MESSAGE *response = upload->response;
+    long size = 32;
+
+    // Keys and the byte count, then what json_string() may need for the name and the file path
+    // or field value, a file's contents stay on disk
+    for (int i = 0; i < upload->count; i++) {
+        const struct upload_part *entry = &upload->parts[i];
+
+        size += 64 + 6 * (strlen(entry->name) + strlen(entry->path) + 2);
+        size += entry->path[0] == '\0' ? 6 * entry->length : 0;
+    }
+
+    char *body = arena_alloc(upload->request->arena, size);
+
+    if (!body) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    int body_length = sprintf(body, "{\"parts\":[");
+
+    for (int i = 0; i < upload->count; i++) {
+        struct upload_part *entry = &upload->parts[i];
+
+        body_length += sprintf(body + body_length, "%s{\"name\":", i > 0 ? "," : "");
+        body_length += json_string(body + body_length, entry->name, strlen(entry->name));
+        body_length += sprintf(body + body_length, ",\"bytes\":%ld,", entry->length);
+        if (entry->path[0] != '\0') {
+            body_length += sprintf(body + body_length, "\"file\":");
+            body_length += json_string(body + body_length, entry->path, strlen(entry->path));
+        } else {
+            body_length += sprintf(body + body_length, "\"value\":");
+            body_length += json_string(body + body_length, entry->value ? entry->value : "",
+                                       entry->length);
+        }
+        body[body_length++] = '}';
+    }
+    body_length += sprintf(body + body_length, "]}\n");
+
+    return send_json_body(response, body, body_length);
+}
+
+/*
+    Takes a multipart/form-data upload as it arrives
+
+    File parts are written to UPLOAD_PATH_STR as their bytes come in, fields of up to
+    UPLOAD_MAX_FIELD bytes are kept in memory, and nothing is spooled to a temp file first.
+*/
+int
+upload_stream_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response, int event,
+                      const char *chunk, int chunk_length, void **state)
+{
+    if (!request || !response || !state) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    struct upload_state *upload = *state;
+
+    if (upload == NULL && event != BODY_STREAM_ABORT) {
+        char boundary[MULTIPART_MAX_BOUNDARY + 1];
+        struct multipart_callbacks callbacks = { .part_begin = upload_part_begin,
+                                                 .part_data = upload_part_data,
+                                                 .part_end = upload_part_end };
+
+        if (multipart_boundary(get_known_header(request, HEADER_CONTENT_TYPE), boundary,
+                               sizeof(boundary))
+            != 0) {
+            build_error_response(response, STATUS_UNSUPPORTED_MEDIA_TYPE,
+                                 "Unsupported Media Type", NULL);
+            return -1;
+        }
+
+        upload = arena_calloc(request->arena, 1, sizeof(struct upload_state));
+        if (!upload) {
+            build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error",
+                                 NULL);
+            return -1;
+        }
+
+        callbacks.ctx = upload;
+        upload->request = request;
+        upload->response = response;
+        upload->fd = -1;
+        multipart_init(&upload->parser, boundary, &callbacks);
+        *state = upload;
+    }
+
+    switch (event) {
+    case BODY_STREAM_DATA:
+        if (multipart_feed(&upload->parser, chunk, chunk_length) != 0) {
+            if (!upload->failed) {
+                build_error_response(response, STATUS_BAD_REQUEST, "Bad Request", NULL);
+            }
+            upload_release(upload);
+            *state = NULL;
+            return -1;
+        }
+        return BODY_STREAM_CONTINUE;
+
+    case BODY_STREAM_RESUME:
+        return BODY_STREAM_CONTINUE;
+
+    case BODY_STREAM_END:
+        *state = NULL;
+
+        if (multipart_finish(&upload->parser) != 0) {
+            build_error_response(response, STATUS_BAD_REQUEST, "Bad Request", NULL);
+            upload_release(upload);
+            return -1;
+        }
+
+        return upload_respond(upload);
+
+    default:
+        if (upload) {
+            upload_release(upload);
+        }
+        *state = NULL;
+        return 0;
+    }
+}
+
+/*
+    Publishes the request body as an event on the SSE channel named by the rest of the path
+*/
+int
+publish_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
+{
+    if (!request || !response) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    char channel[SSE_MAX_CHANNEL_NAME];
+
+    if (!sse_channel_name(request->start_line.request.request_target, channel)) {
+        response->start_line.response.status_code = STATUS_NOT_FOUND;
+        strcpy(response->start_line.response.status_message, "Not Found");
+        serve_static_file(request, response, "html/NotFound.html");
+        return -1;
+    }
+
+    char *data = arena_alloc(request->arena, request->body_length + 1);
+
+    if (!data) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    if (request->body_length > 0
+        && pread(request->body_fd, data, request->body_length, 0) != request->body_length) {
+        perror("Failed to read from temp file");
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    int subscribers = sse_publish(channel, NULL, data, request->body_length);
+
+    if (subscribers < 0) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    char summary[64];
+    int summary_length
+        = snprintf(summary, sizeof(summary), "Queued for %d subscribers\n", subscribers);
+
+    if (http_message_open_temp_file(response, summary_length) != 0
+        || write(response->body_fd, summary, summary_length) != summary_length) {
+        build_error_response(response, STATUS_INTERNAL_SERVER_ERROR, "Internal Server Error", NULL);
+        return -1;
+    }
+
+    response->start_line.response.status_code = STATUS_OK;
+    strcpy(response->start_line.response.status_message, "OK");
+    return 0;
+}
+
+/*
+    Sends every WebSocket message straight back to the client
+*/
+int
+echo_websocket_handler(struct websocket *ws, int event, int opcode, const char *data, int length)
+{
+    if (event != WEBSOCKET_MESSAGE) {
+        return 0;
+    }
+
+    return websocket_send(ws, opcode, data, length);
+}
+
+/*
+    Route table, matched in order by find_route()
+*/
+static const struct route routes[] = {
+    { .path = "/", .method = HTTP_GET, .allow = "GET", .handler = default_handler },
+    { .path = "/echo",
+      .method = HTTP_POST,
+      .allow = "POST",
+      .handler = echo_handler,
+      .blocking = true,
+      .max_body = 16 * MB },
+    { .path = "/checksum",
+      .method = HTTP_POST,
+      .allow = "POST",
+      .stream_handler = checksum_stream_handler,
+      .max_body = 1 * GB },
+    { .path = "/upload",
+      .method = HTTP_POST,
+      .allow = "POST",
+      .stream_handler = upload_stream_handler,
+      .max_body = 1 * GB },
+    { .path = "/ws/echo",
+      .method = HTTP_GET,
+      .allow = "GET",
+      .websocket = echo_websocket_handler },
+    { .path = SSE_ROUTE_PREFIX,
+      .prefix = true,
+      .method = HTTP_GET,
+      .allow = "GET, POST",
+      .sse = true },
+    { .path = SSE_ROUTE_PREFIX,
+      .prefix = true,
+      .method = HTTP_POST,
+      .allow = "GET, POST",
+      .handler = publish_handler },
+    { .path = "/stats/file-cache",
+      .method = HTTP_GET,
+      .allow = "GET",
+      .handler = file_cache_stats_handler },
+    { .path = "/stats/busy-poll",
+      .method = HTTP_GET,
+      .allow = "GET",
+      .handler = busy_poll_stats_handler },
+    { .path = "/stats/offload",
+      .method = HTTP_GET,
+      .allow = "GET",
+      .handler = offload_stats_handler },
+    { .path = "/stats/memory",
+      .method = HTTP_GET,
+      .allow = "GET",
+      .handler = memory_stats_handler },
+    { .path = "/whoami", .method = HTTP_GET, .allow = "GET", .handler = whoami_handler },
+    { .path = "/favicon.ico", .method = HTTP_GET, .allow = "GET", .handler = favicon_handler },
+    { .path = "/static",
+      .prefix = true,
+      .method = HTTP_GET,
+      .allow = "GET",
+      .handler = static_handler },
+    { .path = PROXY_ROUTE_PREFIX,
+      .prefix = true,
+      .method = ROUTE_ANY_METHOD,
+      .upstream = PROXY_UPSTREAM_NAME,
+      .max_body = 64 * MB },
+};
+
+bool
+route_allows_method(const struct route *route, int method)
+{
+    return route && (route->method == ROUTE_ANY_METHOD || route->method == method);
+}
+
+/*
+    Largest request body the route takes, requests without a route get the default
+*/
+long
+route_max_body(const struct route *route)
+{
+    return route && route->max_body > 0 ? route->max_body : ROUTE_DEFAULT_MAX_BODY;
+}
+
+/*
+    Finds the route for a request target and method
+
+    If the path matches but the method does not, the first route for that path is returned so
+    the caller can answer with a 405 and its Allow header. Returns NULL when no path matches.
+*/
+const struct route *
+find_route(const char *target, int method)
+{
+    const struct route *path_match = NULL;
+
+    if (!target) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        const struct route *route = &routes[i];
+        bool matched = route->prefix ? strncmp(target, route->path, strlen(route->path)) == 0
+                                     : strcmp(target, route->path) == 0;
+
+        if (!matched) {
+            continue;
+        }
+
+        if (route_allows_method(route, method)) {
+            return route;
+        }
+
+        if (path_match == NULL) {
+            path_match = route;
+        }
+    }
+
+    return path_match;
+}
@@ -1,13 +1,19 @@
 
 #pragma once
 
+#include "arena.h"
 #include "connect.h"
 #include "http_builder.h"
 #include "http_parser.h"
 #include "ip_helper.h"
 #include "macros.h"
+#include "multipart.h"
+#include "random.h"
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <signal.h>
@@ -15,11 +21,119 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#define UPLOAD_MAX_PARTS 32        // Parts one upload may have
+#define UPLOAD_MAX_FIELD (64 * KB) // Largest field kept in memory, files have no limit
+
+/*
+    Events delivered to a streaming body handler
+*/
+enum BODY_STREAM_EVENT
+{
+    BODY_STREAM_DATA,   // A chunk of the body has arrived
+    BODY_STREAM_RESUME, // Polled while paused, return BODY_STREAM_CONTINUE to read again
+    BODY_STREAM_END,    // The whole body has arrived, the handler must build the response
+    BODY_STREAM_ABORT,  // The connection went away, the handler must release its state
+};
+
+/*
+    Return values of a streaming body handler (negative values reject the request)
+*/
+enum BODY_STREAM_RESULT
+{
+    BODY_STREAM_CONTINUE = 0,
+    BODY_STREAM_PAUSE = 1,
+};
+
+/*
+    Route handler
+
+    Fills in the response to request. Scratch memory comes from request->arena, see arena.h,
+    which is given back once the response is out, so handlers never free() what they take.
+*/
+typedef int (*request_handler)(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
+
+/*
+    Streaming body handler
+
+    Receives the request body chunk by chunk while the connection is in PARSING_BODY instead of
+    after it has been spooled to a temp file. Returning BODY_STREAM_PAUSE drops EPOLLIN interest
+    until a later BODY_STREAM_RESUME call returns BODY_STREAM_CONTINUE. The handler owns *state,
+    which can live in request->arena for as long as the request does.
+*/
+typedef int (*body_stream_handler)(HTTP_MESSAGE *request, HTTP_MESSAGE *response, int event,
+                                   const char *chunk, int chunk_length, void **state);
+
+/*
+    Events delivered to a WebSocket handler
+*/
+enum WEBSOCKET_EVENT
+{
+    WEBSOCKET_OPEN,    // Handshake done, the handler may send and set up its state
+    WEBSOCKET_MESSAGE, // A complete text or binary message has arrived
+    WEBSOCKET_CLOSE,   // The connection is going away, the handler must release its state
+};
+
+struct websocket;
+
+/*
+    WebSocket handler
+
+    Called on the event loop for every event of a connection upgraded on the route. Messages are
+    sent back with websocket_send(). Returning a negative value closes the connection.
+*/
+typedef int (*websocket_handler)(struct websocket *ws, int event, int opcode, const char *data,
+                                 int length);
+
+#define ROUTE_ANY_METHOD -1
+#define ROUTE_DEFAULT_MAX_BODY (1 * MB) // Request body limit of routes without a max_body
+
+/*
+    Route table entry
+
+    Routes are matched in order, first on path and then on method.
+*/
+struct route
+{
+    const char *path;                   // Request target (or prefix) to match
+    bool prefix;                        // Match path as a prefix of the request target
+    int method;                         // Accepted HTTP method, or ROUTE_ANY_METHOD
+    const char *allow;                  // Allow header sent back with a 405
+    request_handler handler;            // Called once the body has been spooled
+    body_stream_handler stream_handler; // Called per body chunk instead of handler
+    const char *upstream;               // Forward to this upstream instead of a handler
+    websocket_handler websocket;        // Accept "Upgrade: websocket" and hand messages here
+    bool sse;                           // Subscribe to the channel named by the rest of the path
+    bool blocking;                      // Run handler on the offload pool, off the event loop
+    long max_body;                      // Largest request body taken, 0 for the default
+};
+
+const struct route *find_route(const char *target, int method);
+bool route_allows_method(const struct route *route, int method);
+long route_max_body(const struct route *route);
+
+int static_root_open(void);
+void static_root_close(void);
+int serve_static_file(const HTTP_MESSAGE *request, HTTP_MESSAGE *response, const char *path);
+
 int default_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
 int echo_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
 int static_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
 int favicon_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
+int file_cache_stats_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
+int busy_poll_stats_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
+int offload_stats_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
+int memory_stats_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
+int whoami_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
+int upload_stream_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response, int event,
+                          const char *chunk, int chunk_length, void **state);
+int checksum_stream_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response, int event,
+                            const char *chunk, int chunk_length, void **state);
+int publish_handler(HTTP_MESSAGE *request, HTTP_MESSAGE *response);
+int echo_websocket_handler(struct websocket *ws, int event, int opcode, const char *data,
+                           int length);
@@ -0,0 +1,491 @@
+/*
+    Server-Sent Events channels
+
+    A GET on an SSE route turns the connection into a long-lived text/event-stream subscriber of
+    the channel named by the rest of the path. Publishing serializes an event once into a
+    refcounted buffer and queues a reference to it on every subscriber of the channel. Each
+    subscriber writes its queue with writev() as far as its socket takes it and picks up the rest
+    on EPOLLOUT.
+
+    A subscriber that falls SSE_QUEUE_LENGTH events behind either misses new events or is
+    disconnected, per SSE_DISCONNECT_SLOW_CONSUMERS.
+*/
+
+#define _GNU_SOURCE
+
+#include "sse.h"
+
+static struct sse_channel channels[SSE_MAX_CHANNELS];
+
+// Keep-alive comment shared by all subscribers, the module keeps a reference to it
+static struct sse_event *heartbeat = NULL;
+
+#define SSE_HEARTBEAT ": keep-alive\n\n"
+
+static struct sse_event *
+new_event(int capacity)
+{
+    struct sse_event *event = malloc(sizeof(struct sse_event) + capacity);
+
+    if (!event) {
+        perror("Failed to allocate memory");
+        return NULL;
+    }
+
+    event->refcount = 1;
+    event->length = 0;
+    return event;
+}
+
+static void
+release_event(struct sse_event *event)
+{
+    if (--event->refcount == 0) {
+        free(event);
+    }
+}
+
+static struct sse_channel *
+find_channel(const char *name)
+{
+    for (int i = 0; i < SSE_MAX_CHANNELS; i++) {
+        if (channels[i].name[0] != '\0' && strcmp(channels[i].name, name) == 0) {
+            return &channels[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Extracts the channel name from a request target under SSE_ROUTE_PREFIX
+
+    Channel names are one non-empty path segment, the query string is ignored.
+*/
+bool
+sse_channel_name(const char *target, char name[SSE_MAX_CHANNEL_NAME])
+{
+    if (strncmp(target, SSE_ROUTE_PREFIX, strlen(SSE_ROUTE_PREFIX)) != 0) {
+        return false;
+    }
+
+    target += strlen(SSE_ROUTE_PREFIX);
+
+    size_t length = strcspn(target, "?#");
+
+    if (length == 0 || length >= SSE_MAX_CHANNEL_NAME || memchr(target, '/', length)) {
+        return false;
+    }
+
+    memcpy(name, target, length);
+    name[length] = '\0';
+    return true;
+}
+
+/*
+    Queues a reference to an event on a subscriber, applying the slow consumer policy
+
+    Returns 0 if queued, 1 if dropped, -1 if the subscriber must be disconnected
+*/
+static int
+enqueue_event(struct sse_subscriber *subscriber, struct sse_event *event)
+{
+    if (subscriber->queue_count == SSE_QUEUE_LENGTH) {
+        if (SSE_DISCONNECT_SLOW_CONSUMERS) {
+            fprintf(stderr, "[FD: %d] SSE subscriber too slow, disconnecting\n", subscriber->fd);
+            return -1;
+        }
+        subscriber->dropped++;
+        return 1;
+    }
+
+    int slot = (subscriber->queue_head + subscriber->queue_count) % SSE_QUEUE_LENGTH;
+
+    event->refcount++;
+    subscriber->queue[slot] = event;
+    subscriber->queue_count++;
+    subscriber->last_sent = time(NULL);
+    return 0;
+}
+
+/*
+    Writes queued events with writev() until the socket would block or the queue is empty
+
+    Returns 0 when drained, 1 when blocked on EPOLLOUT, -1 on error
+*/
+static int
+flush_queue(struct sse_subscriber *subscriber)
+{
+    struct iovec iov[SSE_QUEUE_LENGTH];
+
+    while (subscriber->queue_count > 0) {
+        for (int i = 0; i < subscriber->queue_count; i++) {
+            struct sse_event *event
+                = subscriber->queue[(subscriber->queue_head + i) % SSE_QUEUE_LENGTH];
+            int skip = i == 0 ? subscriber->head_offset : 0;
+
+            iov[i].iov_base = event->data + skip;
+            iov[i].iov_len = event->length - skip;
+        }
+
+        ssize_t n = writev(subscriber->fd, iov, subscriber->queue_count);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+
+        // Release every event written in full, remember how far into the next one we got
+        while (n > 0) {
+            struct sse_event *event = subscriber->queue[subscriber->queue_head];
+            int remaining = event->length - subscriber->head_offset;
+
+            if (n < remaining) {
+                subscriber->head_offset += n;
+                break;
+            }
+
+            n -= remaining;
+            subscriber->head_offset = 0;
+            subscriber->queue_head = (subscriber->queue_head + 1) % SSE_QUEUE_LENGTH;
+            subscriber->queue_count--;
+            release_event(event);
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Hands a subscriber that cannot keep up over to the event loop for cleanup
+
+    The shutdown() surfaces as EPOLLHUP on its socket, as the publisher has no access to the
+    connection table.
+*/
+static void
+disconnect_subscriber(struct sse_subscriber *subscriber)
+{
+    shutdown(subscriber->fd, SHUT_RDWR);
+}
+
+/*
+    Formats an event: "id:", optional "event:", one "data:" line per line of data
+*/
+static struct sse_event *
+serialize_event(uint64_t id, const char *event_name, const char *data, int length)
+{
+    int lines = 1;
+
+    for (int i = 0; i < length; i++) {
+        lines += data[i] == '\n';
+    }
+
+    int capacity = 32 + (event_name ? strlen(event_name) + 8 : 0) + length + lines * 7 + 2;
+    struct sse_event *event = new_event(capacity);
+
+    if (!event) {
+        return NULL;
+    }
+
+    char *out = event->data;
+
+    out += sprintf(out, "id: %llu\n", (unsigned long long) id);
+    if (event_name) {
+        out += sprintf(out, "event: %s\n", event_name);
+    }
+
+    const char *line = data;
+    const char *end = data + length;
+
+    while (1) {
+        const char *newline = memchr(line, '\n', end - line);
+        const char *line_end = newline ? newline : end;
+        int line_length = line_end - line;
+
+        // A CR before the LF would end the line early on the client side
+        if (line_length > 0 && line[line_length - 1] == '\r') {
+            line_length--;
+        }
+
+        memcpy(out, "data: ", 6);
+        memcpy(out + 6, line, line_length);
+        out[6 + line_length] = '\n';
+        out += 7 + line_length;
+
+        if (!newline) {
+            break;
+        }
+        line = newline + 1;
+    }
+
+    *out++ = '\n';
+    event->length = out - event->data;
+    return event;
+}
+
+/*
+    Whether a subscription to a channel could be set up right now
+*/
+bool
+sse_can_subscribe(const char *channel)
+{
+    if (find_channel(channel)) {
+        return true;
+    }
+
+    for (int i = 0; i < SSE_MAX_CHANNELS; i++) {
+        if (channels[i].name[0] == '\0') {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/*
+    Answers the request on conn with a text/event-stream and subscribes it to a channel
+
+    The channel is created on its first subscriber. The connection's HTTP buffers are released,
+    only the subscriber state stays behind. Returns 0, or -1 if the connection must be closed
+*/
+int
+sse_subscribe(struct conn *conn, int epoll_fd, const char *channel_name)
+{
+    struct sse_channel *channel = find_channel(channel_name);
+
+    for (int i = 0; channel == NULL && i < SSE_MAX_CHANNELS; i++) {
+        if (channels[i].name[0] == '\0') {
+            channel = &channels[i];
+            memset(channel, 0, sizeof(struct sse_channel));
+            strcpy(channel->name, channel_name);
+        }
+    }
+
+    if (!channel) {
+        fprintf(stderr, "[FD: %d] No room for SSE channel %s\n", conn->fd, channel_name);
+        return -1;
+    }
+
+    struct sse_subscriber *subscriber = calloc(1, sizeof(struct sse_subscriber));
+
+    if (!subscriber) {
+        perror("Failed to allocate memory");
+        if (channel->subscriber_count == 0) {
+            channel->name[0] = '\0';
+        }
+        return -1;
+    }
+
+    subscriber->fd = conn->fd;
+    subscriber->channel = channel;
+    subscriber->next = channel->subscribers;
+    if (channel->subscribers) {
+        channel->subscribers->prev = subscriber;
+    }
+    channel->subscribers = subscriber;
+    channel->subscriber_count++;
+    conn->sse = subscriber;
+
+    // The response head and the retry hint go out as the first, private, event
+    HTTP_MESSAGE *response = conn->response;
+    char head[1 * KB];
+
+    response->start_line.response.protocol = HTTP_1_1;
+    response->start_line.response.status_code = STATUS_OK;
+    strcpy(response->start_line.response.status_message, "OK");
+    add_header(response, "Content-Type", "text/event-stream");
+    add_header(response, "Cache-Control", "no-cache");
+
+    if (build_header(response, RESPONSE, head, sizeof(head)) != 0) {
+        return -1;
+    }
+
+    struct sse_event *event = new_event(strlen(head) + 32);
+
+    if (!event) {
+        return -1;
+    }
+    event->length = sprintf(event->data, "%sretry: %d\n\n", head, SSE_RETRY_MS);
+    enqueue_event(subscriber, event);
+    release_event(event);
+
+    fprintf(stderr, "[FD: %d] SSE subscriber %d on channel %s\n", conn->fd,
+            channel->subscriber_count, channel->name);
+
+    free(conn->buffer);
+    conn->buffer = NULL;
+    free_http_message(conn->request);
+    free(conn->request);
+    conn->request = NULL;
+    free_http_message(conn->response);
+    free(conn->response);
+    conn->response = NULL;
+
+    set_conn_state(conn, EVENT_STREAM);
+
+    struct epoll_event ev = { 0 };
+
+    ev.events = DUPLEX_EPOLL_FLAGS;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        return -1;
+    }
+
+    return flush_queue(subscriber) < 0 ? -1 : 0;
+}
+
+/*
+    Handles an epoll event on a subscriber connection
+
+    Subscribers have nothing to say, anything they send is discarded. Returns 0, or -1 if the
+    connection must be closed
+*/
+int
+sse_handle_event(struct conn *conn, uint32_t events)
+{
+    struct sse_subscriber *subscriber = conn->sse;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        return -1;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        char discard[512];
+
+        while (1) {
+            ssize_t n = recv(conn->fd, discard, sizeof(discard), 0);
+
+            if (n == 0) {
+                fprintf(stderr, "[FD: %d] SSE subscriber went away\n", conn->fd);
+                return -1;
+            } else if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                perror("recv");
+                return -1;
+            }
+        }
+    }
+
+    return flush_queue(subscriber) < 0 ? -1 : 0;
+}
+
+/*
+    Sends a keep-alive comment to a subscriber that has been quiet for SSE_HEARTBEAT_INTERVAL,
+    so that proxies and the client notice a dead connection
+
+    Returns 0, or -1 if the connection must be closed
+*/
+int
+sse_check_timeout(struct conn *conn, time_t now)
+{
+    struct sse_subscriber *subscriber = conn->sse;
+
+    if (now - subscriber->last_sent < SSE_HEARTBEAT_INTERVAL) {
+        return 0;
+    }
+
+    if (heartbeat == NULL) {
+        heartbeat = new_event(strlen(SSE_HEARTBEAT));
+        if (!heartbeat) {
+            return -1;
+        }
+        heartbeat->length = strlen(SSE_HEARTBEAT);
+        memcpy(heartbeat->data, SSE_HEARTBEAT, heartbeat->length);
+    }
+
+    if (enqueue_event(subscriber, heartbeat) < 0) {
+        return -1;
+    }
+
+    return flush_queue(subscriber) < 0 ? -1 : 0;
+}
+
+/*
+    Unsubscribes a connection that is going away and drops its queued references
+*/
+void
+sse_abort(struct conn *conn)
+{
+    if (!conn || !conn->sse) {
+        return;
+    }
+
+    struct sse_subscriber *subscriber = conn->sse;
+    struct sse_channel *channel = subscriber->channel;
+
+    if (subscriber->prev) {
+        subscriber->prev->next = subscriber->next;
+    } else {
+        channel->subscribers = subscriber->next;
+    }
+    if (subscriber->next) {
+        subscriber->next->prev = subscriber->prev;
+    }
+
+    if (--channel->subscriber_count == 0) {
+        channel->name[0] = '\0';
+    }
+
+    if (subscriber->dropped > 0) {
+        fprintf(stderr, "[FD: %d] SSE subscriber missed %ld events\n", subscriber->fd,
+                subscriber->dropped);
+    }
+
+    while (subscriber->queue_count > 0) {
+        release_event(subscriber->queue[subscriber->queue_head]);
+        subscriber->queue_head = (subscriber->queue_head + 1) % SSE_QUEUE_LENGTH;
+        subscriber->queue_count--;
+    }
+
+    free(subscriber);
+    conn->sse = NULL;
+}
+
+/*
+    Publishes an event to every subscriber of a channel
+
+    The event is serialized once and shared; each subscriber writes what it can right away.
+    event may be NULL for the default "message" type. Returns the number of subscribers the
+    event was queued for, or -1 on error
+*/
+int
+sse_publish(const char *channel_name, const char *event_name, const char *data, int length)
+{
+    struct sse_channel *channel = find_channel(channel_name);
+
+    if (!channel) {
+        return 0;
+    }
+
+    struct sse_event *event = serialize_event(++channel->last_id, event_name, data, length);
+
+    if (!event) {
+        return -1;
+    }
+
+    int queued = 0;
+
+    for (struct sse_subscriber *subscriber = channel->subscribers; subscriber;
+         subscriber = subscriber->next) {
+        int ret = enqueue_event(subscriber, event);
+
+        if (ret == 0) {
+            queued++;
+        }
+
+        if (ret < 0 || flush_queue(subscriber) < 0) {
+            disconnect_subscriber(subscriber);
+        }
+    }
+
+    // Drop the publisher's reference, subscribers hold the rest
+    release_event(event);
+    return queued;
+}
@@ -0,0 +1,76 @@
+/*
+    Header File for Server-Sent Events channels
+*/
+
+#pragma once
+
+#include "conn_map.h"
+#include "http_builder.h"
+#include "http_parser.h"
+#include "macros.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SSE_MAX_CHANNELS 64
+#define SSE_MAX_CHANNEL_NAME 64
+#define SSE_QUEUE_LENGTH 64         // Events a subscriber may fall behind by
+#define SSE_HEARTBEAT_INTERVAL 15   // Seconds of silence before a keep-alive comment is sent
+#define SSE_RETRY_MS 3000           // Reconnection delay suggested to clients
+
+/*
+    A serialized event, shared by every subscriber queue it sits in
+*/
+struct sse_event
+{
+    int refcount;
+    int length;
+    char data[];
+};
+
+struct sse_channel;
+
+/*
+    Subscriber state of a connection, hung off struct conn once it streams events
+
+    The queue holds references to shared events, so a publish costs one pointer per subscriber.
+*/
+struct sse_subscriber
+{
+    int fd;
+    struct sse_channel *channel;
+    struct sse_subscriber *prev;
+    struct sse_subscriber *next;
+    struct sse_event *queue[SSE_QUEUE_LENGTH];
+    int queue_head;
+    int queue_count;
+    int head_offset;  // Bytes of the oldest event already written
+    long dropped;     // Events that did not fit in the queue
+    time_t last_sent; // Last time an event was queued
+};
+
+/*
+    A named channel and its subscribers
+*/
+struct sse_channel
+{
+    char name[SSE_MAX_CHANNEL_NAME];
+    uint64_t last_id; // id: of the last event published
+    struct sse_subscriber *subscribers;
+    int subscriber_count;
+};
+
+bool sse_channel_name(const char *target, char name[SSE_MAX_CHANNEL_NAME]);
+bool sse_can_subscribe(const char *channel);
+int sse_subscribe(struct conn *conn, int epoll_fd, const char *channel);
+int sse_handle_event(struct conn *conn, uint32_t events);
+int sse_check_timeout(struct conn *conn, time_t now);
+void sse_abort(struct conn *conn);
+
+int sse_publish(const char *channel, const char *event, const char *data, int length);
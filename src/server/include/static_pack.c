@@ -0,0 +1,177 @@
+/*
+    Static files served from a mapped asset pack
+
+    "make pack" bundles the static directory into one file (see pack.h). It is mapped once at
+    startup and hits are answered straight from the mapping: the response's pre-rendered header
+    lines and body go out with one writev() of the header block and content, without opening or
+    stat()ing the file per request. Files missing from the pack, or requests over HTTP/2,
+    whose DATA frames are sent from a file, are served from the filesystem as before.
+*/
+
+#define _GNU_SOURCE
+
+#include "static_pack.h"
+
+static const char *pack = NULL; // The mapping, or NULL when serving from the filesystem
+static size_t pack_size = 0;
+static const struct pack_entry *entries = NULL;
+static uint32_t entry_count = 0;
+
+static bool
+span_is_valid(struct pack_span span)
+{
+    return span.offset <= pack_size && span.length <= pack_size - span.offset;
+}
+
+static bool
+entry_is_valid(const struct pack_entry *entry)
+{
+    return span_is_valid(entry->path) && span_is_valid(entry->mime_type)
+           && span_is_valid(entry->etag) && span_is_valid(entry->body)
+           && span_is_valid(entry->headers) && span_is_valid(entry->gzip_body)
+           && span_is_valid(entry->gzip_headers) && entry->body.length <= INT32_MAX;
+}
+
+/*
+    Maps the pack at path
+
+    Returns 0, or -1 if there is no usable pack, in which case static files come from disk
+*/
+int
+static_pack_load(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            perror(path);
+        }
+        printf("server: no static pack at %s, serving %s from the filesystem\n", path,
+               STATIC_PATH_STR);
+        return -1;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(struct pack_header)) {
+        fprintf(stderr, "Static pack %s is truncated\n", path);
+        close(fd);
+        return -1;
+    }
+
+    // Prefaulted, so the first requests don't pay for the page faults
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        perror("mmap static pack");
+        return -1;
+    }
+
+    const struct pack_header *header = map;
+
+    pack = map;
+    pack_size = st.st_size;
+    entries = (const struct pack_entry *) (pack + sizeof(struct pack_header));
+    entry_count = header->entry_count;
+
+    bool valid = memcmp(header->magic, PACK_MAGIC, PACK_MAGIC_LENGTH) == 0
+                 && header->file_size == pack_size
+                 && entry_count <= (pack_size - sizeof(struct pack_header))
+                                       / sizeof(struct pack_entry);
+
+    for (uint32_t i = 0; valid && i < entry_count; i++) {
+        valid = entry_is_valid(&entries[i]);
+    }
+
+    if (!valid) {
+        fprintf(stderr, "Static pack %s is corrupt, rebuild it with \"make pack\"\n", path);
+        static_pack_unload();
+        return -1;
+    }
+
+    printf("server: serving %u static files from %s\n", entry_count, path);
+    return 0;
+}
+
+void
+static_pack_unload(void)
+{
+    if (pack) {
+        munmap((void *) pack, pack_size);
+    }
+
+    pack = NULL;
+    pack_size = 0;
+    entries = NULL;
+    entry_count = 0;
+}
+
+/*
+    Looks up a file by its path relative to the static directory, e.g. "html/index.html"
+*/
+const struct pack_entry *
+static_pack_find(const char *path)
+{
+    if (!pack) {
+        return NULL;
+    }
+
+    size_t length = strlen(path);
+    uint64_t hash = pack_hash(path, length);
+    uint32_t low = 0;
+    uint32_t high = entry_count;
+
+    // Entries are sorted by hash, find the first one with ours
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (entries[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    for (uint32_t i = low; i < entry_count && entries[i].hash == hash; i++) {
+        if (entries[i].path.length == length
+            && memcmp(pack + entries[i].path.offset, path, length) == 0) {
+            return &entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+    Sets the response body to a packed file, gzipped if the client accepts it
+
+    Returns 0, or -1 if the file must be served from the filesystem
+*/
+int
+static_pack_respond(const HTTP_MESSAGE *request, HTTP_MESSAGE *response, const char *path)
+{
+    if (!pack || (request && request->start_line.request.protocol == HTTP_2_0)) {
+        return -1;
+    }
+
+    const struct pack_entry *entry = static_pack_find(path);
+
+    if (!entry) {
+        return -1;
+    }
+
+    const char *accept_encoding
+        = request ? get_known_header(request, HEADER_ACCEPT_ENCODING) : NULL;
+
+    if (entry->gzip_body.length > 0 && header_has_token(accept_encoding, "gzip")) {
+        return http_message_set_body_data(response, pack + entry->gzip_body.offset,
+                                          entry->gzip_body.length,
+                                          pack + entry->gzip_headers.offset,
+                                          entry->gzip_headers.length);
+    }
+
+    return http_message_set_body_data(response, pack + entry->body.offset, entry->body.length,
+                                      pack + entry->headers.offset, entry->headers.length);
+}
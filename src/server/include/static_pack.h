@@ -0,0 +1,22 @@
+/*
+    Header File for serving static files from a mapped asset pack
+*/
+
+#pragma once
+
+#include "http_lib.h"
+#include "macros.h"
+#include "pack.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int static_pack_load(const char *path);
+void static_pack_unload(void);
+
+const struct pack_entry *static_pack_find(const char *path);
+int static_pack_respond(const HTTP_MESSAGE *request, HTTP_MESSAGE *response, const char *path);
@@ -0,0 +1,229 @@
+/*
+    TLS termination with kernel TLS
+
+    OpenSSL only runs the handshake. Once it completes, the session keys are handed to the kernel
+    (SSL_OP_ENABLE_KTLS installs the "tls" TCP ULP on the socket), which from then on encrypts
+    what we send and decrypts what we receive. The SSL object is freed and the connection carries
+    on as a plain socket: recv(), send() and the sendfile() of output_queue_flush() are unchanged
+    and a static file still goes out without being copied through user space.
+
+    The kernel must take over both directions, which OpenSSL 3.0 only does for TLS 1.2, so the
+    protocol and ciphers are pinned to what it can offload. A connection whose session could not
+    be moved into the kernel is closed after the handshake.
+
+    Resumption uses session tickets, plus a server-side cache for clients that resume by ID.
+*/
+
+#define _GNU_SOURCE
+
+#include "tls.h"
+
+static SSL_CTX *tls_context = NULL;
+
+/*
+    Prints the OpenSSL error queue after a failed call
+*/
+static void
+print_tls_errors(const char *what)
+{
+    unsigned long error;
+    char message[256];
+
+    fprintf(stderr, "%s failed\n", what);
+    while ((error = ERR_get_error()) != 0) {
+        ERR_error_string_n(error, message, sizeof(message));
+        fprintf(stderr, "    %s\n", message);
+    }
+}
+
+/*
+    Whether the kernel provides the "tls" TCP ULP
+
+    Installing it on a socket that is not connected fails with ENOTCONN once the module is found,
+    and ENOENT when there is no such module.
+*/
+static bool
+kernel_tls_available(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1) {
+        perror("socket");
+        return false;
+    }
+
+    int ret = setsockopt(fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"));
+    int error = errno;
+
+    close(fd);
+    return ret == 0 || error != ENOENT;
+}
+
+/*
+    Points epoll at the direction the handshake is waiting on
+*/
+static int
+wait_for(struct conn *conn, int epoll_fd, uint32_t events)
+{
+    struct epoll_event ev = { 0 };
+
+    ev.events = events;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Sets up the server context from a PEM certificate chain and private key
+
+    Returns 0, or -1 if the files cannot be used or the kernel has no TLS support
+*/
+int
+tls_init(const char *cert_file, const char *key_file)
+{
+    if (!kernel_tls_available()) {
+        fprintf(stderr, "Kernel TLS is not available, load it with \"modprobe tls\"\n");
+        return -1;
+    }
+
+    tls_context = SSL_CTX_new(TLS_server_method());
+    if (!tls_context) {
+        print_tls_errors("SSL_CTX_new");
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(tls_context, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(tls_context, TLS1_2_VERSION);
+    SSL_CTX_set_options(tls_context, SSL_OP_ENABLE_KTLS | SSL_OP_CIPHER_SERVER_PREFERENCE
+                                         | SSL_OP_NO_RENEGOTIATION);
+
+    SSL_CTX_set_session_cache_mode(tls_context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(tls_context, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_session_id_context(tls_context, (const unsigned char *) TLS_SESSION_ID_CONTEXT,
+                                   strlen(TLS_SESSION_ID_CONTEXT));
+
+    if (SSL_CTX_set_cipher_list(tls_context, TLS_CIPHERS) != 1) {
+        print_tls_errors("SSL_CTX_set_cipher_list");
+        tls_cleanup();
+        return -1;
+    }
+
+    if (SSL_CTX_use_certificate_chain_file(tls_context, cert_file) != 1) {
+        print_tls_errors(cert_file);
+        tls_cleanup();
+        return -1;
+    }
+
+    if (SSL_CTX_use_PrivateKey_file(tls_context, key_file, SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(tls_context) != 1) {
+        print_tls_errors(key_file);
+        tls_cleanup();
+        return -1;
+    }
+
+    printf("server: TLS enabled with %s\n", cert_file);
+    return 0;
+}
+
+void
+tls_cleanup(void)
+{
+    SSL_CTX_free(tls_context);
+    tls_context = NULL;
+}
+
+/*
+    Starts the handshake on a newly accepted connection
+
+    Returns 0 when TLS is not in use or the handshake is under way, -1 on failure
+*/
+int
+tls_accept(struct conn *conn, int epoll_fd)
+{
+    if (!tls_context) {
+        return 0;
+    }
+
+    conn->tls = SSL_new(tls_context);
+    if (!conn->tls) {
+        print_tls_errors("SSL_new");
+        return -1;
+    }
+
+    if (SSL_set_fd(conn->tls, conn->fd) != 1) {
+        print_tls_errors("SSL_set_fd");
+        tls_abort(conn);
+        return -1;
+    }
+
+    SSL_set_accept_state(conn->tls);
+    set_conn_state(conn, TLS_HANDSHAKE);
+
+    // The ClientHello may already be queued
+    return tls_handle_event(conn, epoll_fd) < 0 ? -1 : 0;
+}
+
+/*
+    Drives the handshake on a socket event
+
+    Returns TLS_IN_PROGRESS, TLS_ESTABLISHED once the connection is ready for its first request,
+    or -1 if it must be closed
+*/
+int
+tls_handle_event(struct conn *conn, int epoll_fd)
+{
+    int ret = SSL_do_handshake(conn->tls);
+
+    if (ret != 1) {
+        switch (SSL_get_error(conn->tls, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return wait_for(conn, epoll_fd, RECV_EPOLL_FLAGS) == 0 ? TLS_IN_PROGRESS : -1;
+        case SSL_ERROR_WANT_WRITE:
+            return wait_for(conn, epoll_fd, SEND_EPOLL_FLAGS) == 0 ? TLS_IN_PROGRESS : -1;
+        case SSL_ERROR_SYSCALL:
+            fprintf(stderr, "[FD %d]: Client left during the TLS handshake\n", conn->fd);
+            ERR_clear_error();
+            return -1;
+        default:
+            print_tls_errors("TLS handshake");
+            return -1;
+        }
+    }
+
+    if (!BIO_get_ktls_send(SSL_get_wbio(conn->tls))
+        || !BIO_get_ktls_recv(SSL_get_rbio(conn->tls))) {
+        fprintf(stderr, "[FD %d]: Kernel TLS could not take over %s, closing\n", conn->fd,
+                SSL_get_cipher_name(conn->tls));
+        return -1;
+    }
+
+    fprintf(stderr, "[FD %d]: TLS established, %s%s\n", conn->fd, SSL_get_cipher_name(conn->tls),
+            SSL_session_reused(conn->tls) ? ", resumed" : "");
+
+    // No close_notify: the kernel owns the record layer now, the SSL object only holds state
+    SSL_free(conn->tls);
+    conn->tls = NULL;
+
+    set_conn_state(conn, IDLE);
+
+    // Re-arming reports a request that arrived with the client's Finished
+    return wait_for(conn, epoll_fd, RECV_EPOLL_FLAGS) == 0 ? TLS_ESTABLISHED : -1;
+}
+
+/*
+    Frees the session of a connection closed mid-handshake
+*/
+void
+tls_abort(struct conn *conn)
+{
+    if (!conn || !conn->tls) {
+        return;
+    }
+
+    SSL_free(conn->tls);
+    conn->tls = NULL;
+}
@@ -0,0 +1,38 @@
+/*
+    Header File for TLS termination with kernel TLS
+*/
+
+#pragma once
+
+#include "conn_map.h"
+#include "macros.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Only ciphers the kernel can take over, in both directions
+#define TLS_CIPHERS                                                                                \
+    "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"                                   \
+    "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384"
+#define TLS_SESSION_ID_CONTEXT SERVER_NAME
+#define TLS_SESSION_CACHE_SIZE 1024 // Sessions kept for clients resuming by ID instead of ticket
+
+enum TLS_RESULT
+{
+    TLS_IN_PROGRESS, // Waiting on the socket, epoll interest updated
+    TLS_ESTABLISHED, // Kernel TLS set up, the connection reads and writes plaintext from now on
+};
+
+int tls_init(const char *cert_file, const char *key_file);
+void tls_cleanup(void);
+
+int tls_accept(struct conn *conn, int epoll_fd);
+int tls_handle_event(struct conn *conn, int epoll_fd);
+void tls_abort(struct conn *conn);
@@ -0,0 +1,129 @@
+/*
+    Per-request phase tracing
+
+    Every request gets a CLOCK_MONOTONIC timestamp at each phase in enum TRACE_PHASE, taken
+    where the connection changes state, see set_conn_state(). Once the response is out, or the
+    connection closes, the request's timestamps are copied into a ring holding the last
+    TRACE_RING_RECORDS requests. Only the event loop writes to it, so it needs no locking.
+
+    SIGUSR1 dumps the ring to TRACE_DUMP_PATH, and "make traceview" builds the tool that turns a
+    dump into Chrome trace JSON and per-phase latency percentiles.
+*/
+
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+static struct trace_record ring[TRACE_RING_RECORDS];
+static uint64_t written = 0; // Records ever written, the next one goes to written % size
+
+static int64_t
+now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+    Stamps the time the request reached phase, unless it already had
+*/
+void
+trace_mark(struct trace_span *span, int phase)
+{
+    if (!TRACE_ENABLED || span->at[phase] != 0) {
+        return;
+    }
+
+    span->at[phase] = now_ns();
+}
+
+/*
+    Records the connection's request in the ring and starts over for the next one
+
+    sent says the response went out, so the request also gets its last byte. A connection
+    that never started a request records nothing.
+*/
+void
+trace_end(struct trace_span *span, int fd, int request, bool sent)
+{
+    if (!TRACE_ENABLED || span->at[TRACE_FIRST_BYTE] == 0) {
+        trace_reset(span);
+        return;
+    }
+
+    if (sent) {
+        trace_mark(span, TRACE_LAST_BYTE);
+    }
+
+    struct trace_record *record = &ring[written % TRACE_RING_RECORDS];
+
+    record->fd = fd;
+    record->request = request;
+    memcpy(record->at, span->at, sizeof(record->at));
+    written++;
+
+    trace_reset(span);
+}
+
+void
+trace_reset(struct trace_span *span)
+{
+    memset(span->at, 0, sizeof(span->at));
+}
+
+static int
+write_all(int fd, const void *data, size_t length)
+{
+    const char *ptr = data;
+
+    while (length > 0) {
+        ssize_t n = write(fd, ptr, length);
+
+        if (n == -1) {
+            perror("write trace dump");
+            return -1;
+        }
+        ptr += n;
+        length -= n;
+    }
+
+    return 0;
+}
+
+/*
+    Writes the requests in the ring to path, oldest first
+
+    Returns the number of requests written, or -1
+*/
+int
+trace_dump(const char *path)
+{
+    uint64_t count = written < TRACE_RING_RECORDS ? written : TRACE_RING_RECORDS;
+    struct trace_file_header header = { .phase_count = TRACE_PHASE_COUNT, .record_count = count };
+
+    memcpy(header.magic, TRACE_MAGIC, TRACE_MAGIC_LENGTH);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        perror("open trace dump");
+        return -1;
+    }
+
+    // Once the ring has wrapped, the oldest record is the one written next
+    uint64_t start = (written - count) % TRACE_RING_RECORDS;
+    uint64_t until_end = MIN(count, TRACE_RING_RECORDS - start);
+
+    if (write_all(fd, &header, sizeof(header)) != 0
+        || write_all(fd, &ring[start], until_end * sizeof(struct trace_record)) != 0
+        || write_all(fd, ring, (count - until_end) * sizeof(struct trace_record)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    close(fd);
+    printf("server: wrote %llu traced requests to %s\n", (unsigned long long) count, path);
+    return (int) count;
+}
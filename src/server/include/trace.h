@@ -0,0 +1,30 @@
+/*
+    Header File for per-request phase tracing
+*/
+
+#pragma once
+
+#include "macros.h"
+#include "trace_file.h"
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_RING_RECORDS 8192 // Finished requests kept for a dump, a power of two
+
+/*
+    Timestamps of the request a connection is on, hung off struct conn
+*/
+struct trace_span
+{
+    int64_t at[TRACE_PHASE_COUNT];
+};
+
+void trace_mark(struct trace_span *span, int phase);
+void trace_end(struct trace_span *span, int fd, int request, bool sent);
+void trace_reset(struct trace_span *span);
+int trace_dump(const char *path);
@@ -0,0 +1,266 @@
+/*
+    Zero-downtime binary upgrades
+
+    The running server fork()s and exec()s the binary on disk, keeping one end of a Unix socket
+    pair open in the new process and naming it in UPGRADE_ENV. The listening socket is passed
+    over it with SCM_RIGHTS, so both processes share one accept queue: connections that arrive
+    during the handoff wait in the queue instead of being refused. Once the new process is
+    accepting it writes a byte back, and the old one stops accepting and drains.
+*/
+
+#define _GNU_SOURCE
+
+#include "upgrade.h"
+
+extern char **environ;
+
+static int inherited_control_fd = -1; // New binary's end of the control socket
+
+/*
+    Builds the environment for the new binary: ours, plus UPGRADE_ENV naming the control socket
+
+    Done before fork(), as the child may only call async-signal-safe functions until exec().
+*/
+static char **
+build_environment(char *upgrade_variable)
+{
+    int count = 0;
+
+    while (environ[count]) {
+        count++;
+    }
+
+    char **envp = calloc(count + 2, sizeof(char *));
+
+    if (!envp) {
+        perror("Failed to allocate memory");
+        return NULL;
+    }
+
+    int j = 0;
+    size_t prefix_length = strlen(UPGRADE_ENV "=");
+
+    for (int i = 0; i < count; i++) {
+        if (strncmp(environ[i], UPGRADE_ENV "=", prefix_length) != 0) {
+            envp[j++] = environ[i];
+        }
+    }
+    envp[j] = upgrade_variable;
+
+    return envp;
+}
+
+/*
+    Sends the listening socket over the control socket
+*/
+static int
+send_listener(int control_fd, int listen_fd)
+{
+    char byte = 'L';
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+
+    memset(&control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+    while (sendmsg(control_fd, &msg, 0) == -1) {
+        if (errno != EINTR) {
+            perror("sendmsg");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Starts the new binary and hands it the listening socket
+
+    Returns the non-blocking control socket to watch for upgrade_wait_ready(), or -1
+*/
+int
+upgrade_spawn(int listen_fd)
+{
+    char exe[PATH_MAX];
+    ssize_t exe_length = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+
+    if (exe_length == -1) {
+        perror("readlink /proc/self/exe");
+        return -1;
+    }
+    exe[exe_length] = '\0';
+
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+
+    char upgrade_variable[64];
+
+    snprintf(upgrade_variable, sizeof(upgrade_variable), "%s=%d", UPGRADE_ENV, sv[1]);
+
+    char **envp = build_environment(upgrade_variable);
+    char *argv[] = { exe, NULL };
+    sigset_t no_signals;
+
+    sigemptyset(&no_signals);
+
+    if (!envp) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        // Client sockets and the epoll instance must not leak into the new process
+        close_range(3, sv[1] - 1, 0);
+        close_range(sv[1] + 1, ~0U, 0);
+        fcntl(sv[1], F_SETFD, 0);
+        sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+        execve(exe, argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+    close(sv[1]);
+
+    if (pid == -1) {
+        perror("fork");
+        close(sv[0]);
+        return -1;
+    }
+
+    fprintf(stderr, "Binary upgrade: started %s as PID %d\n", exe, pid);
+
+    if (send_listener(sv[0], listen_fd) != 0) {
+        close(sv[0]);
+        return -1;
+    }
+
+    int flags = fcntl(sv[0], F_GETFL, 0);
+
+    if (flags == -1 || fcntl(sv[0], F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        close(sv[0]);
+        return -1;
+    }
+
+    return sv[0];
+}
+
+/*
+    Reads the new binary's answer on the control socket
+
+    Returns 1 once it is accepting, 0 if it has not answered yet, -1 if it went away without
+    taking over
+*/
+int
+upgrade_wait_ready(int control_fd)
+{
+    char byte;
+
+    while (1) {
+        ssize_t n = read(control_fd, &byte, 1);
+
+        if (n == 1) {
+            return 1;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+/*
+    Takes over the listening socket of the server that exec'd us
+
+    Returns the listening socket, or -1 when this process was not started by an upgrade
+*/
+int
+upgrade_inherit_listener(void)
+{
+    const char *value = getenv(UPGRADE_ENV);
+
+    if (!value) {
+        return -1;
+    }
+
+    int control_fd = atoi(value);
+    unsetenv(UPGRADE_ENV);
+    fcntl(control_fd, F_SETFD, FD_CLOEXEC);
+
+    char byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    union
+    {
+        struct cmsghdr header;
+        char buffer[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = { 0 };
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ssize_t n;
+
+    while ((n = recvmsg(control_fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+        ;
+
+    struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "Binary upgrade: no listening socket received\n");
+        close(control_fd);
+        return -1;
+    }
+
+    int listen_fd;
+
+    memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+    inherited_control_fd = control_fd;
+
+    printf("server: took over listening socket FD %d from the previous process\n", listen_fd);
+
+    return listen_fd;
+}
+
+/*
+    Tells the previous process we are accepting, so it can stop and drain
+*/
+int
+upgrade_ready(void)
+{
+    if (inherited_control_fd == -1) {
+        return 0;
+    }
+
+    int ret = write(inherited_control_fd, "R", 1) == 1 ? 0 : -1;
+
+    close(inherited_control_fd);
+    inherited_control_fd = -1;
+    return ret;
+}
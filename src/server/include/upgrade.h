@@ -0,0 +1,25 @@
+/*
+    Header File for zero-downtime binary upgrades
+*/
+
+#pragma once
+
+#include "macros.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define UPGRADE_ENV "HTTPSERVER_UPGRADE_FD" // Control socket handed to the new binary
+
+int upgrade_spawn(int listen_fd);
+int upgrade_wait_ready(int control_fd);
+
+int upgrade_inherit_listener(void);
+int upgrade_ready(void);
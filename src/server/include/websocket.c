@@ -0,0 +1,839 @@
+/*
+    WebSocket connections (RFC 6455)
+
+    A GET on a route with a websocket handler that carries a valid "Upgrade: websocket" handshake
+    is answered with a 101, after which the connection belongs to its struct websocket. Frames
+    are parsed incrementally as bytes arrive, so a frame may be split across any number of reads.
+    Data frames are unmasked in place into the message buffer (SIMD on x86-64) and complete
+    messages are handed to the route's handler. Pings are answered on the spot; our own pings
+    are sent from the timeout sweep once the peer has been silent for WEBSOCKET_PING_INTERVAL.
+*/
+
+#define _GNU_SOURCE
+
+#include "websocket.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define WEBSOCKET_SIMD_UNMASK
+#endif
+
+/*
+    Unmasks bytes one at a time, offset being the position of data[0] in the frame payload
+*/
+static void
+unmask_scalar(uint8_t *data, size_t length, const uint8_t mask[4], size_t offset)
+{
+    for (size_t i = 0; i < length; i++) {
+        data[i] ^= mask[(offset + i) & 3];
+    }
+}
+
+#ifdef WEBSOCKET_SIMD_UNMASK
+/*
+    XORs whole 32-byte blocks with the repeated key, returns how many bytes were done
+*/
+__attribute__((target("avx2"))) static size_t
+unmask_avx2(uint8_t *data, size_t length, uint32_t key)
+{
+    __m256i mask = _mm256_set1_epi32((int) key);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (data + i));
+        _mm256_storeu_si256((__m256i *) (data + i), _mm256_xor_si256(block, mask));
+    }
+
+    return i;
+}
+
+/*
+    XORs whole 16-byte blocks with the repeated key, returns how many bytes were done
+*/
+static size_t
+unmask_sse2(uint8_t *data, size_t length, uint32_t key)
+{
+    __m128i mask = _mm_set1_epi32((int) key);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+        _mm_storeu_si128((__m128i *) (data + i), _mm_xor_si128(block, mask));
+    }
+
+    return i;
+}
+#endif
+
+/*
+    Unmasks payload bytes in place
+
+    The vector paths work on a copy of the mask rotated to offset; they only ever consume
+    multiples of 4 bytes, so the scalar tail picks up where the key left off.
+*/
+static void
+unmask(uint8_t *data, size_t length, const uint8_t mask[4], size_t offset)
+{
+    size_t done = 0;
+
+#ifdef WEBSOCKET_SIMD_UNMASK
+    static int has_avx2 = -1;
+    uint8_t rotated[4];
+    uint32_t key;
+
+    for (int i = 0; i < 4; i++) {
+        rotated[i] = mask[(offset + i) & 3];
+    }
+    memcpy(&key, rotated, sizeof(key));
+
+    if (has_avx2 == -1) {
+        has_avx2 = __builtin_cpu_supports("avx2");
+    }
+
+    if (has_avx2) {
+        done = unmask_avx2(data, length, key);
+    }
+    done += unmask_sse2(data + done, length - done, key);
+#endif
+
+    unmask_scalar(data + done, length - done, mask, offset + done);
+}
+
+/*
+    Whether a text message is well-formed UTF-8 (no overlong forms, surrogates or values past
+    U+10FFFF)
+*/
+static bool
+is_valid_utf8(const uint8_t *data, int length)
+{
+    int i = 0;
+
+    while (i < length) {
+        uint8_t c = data[i];
+        uint32_t codepoint;
+        int continuation;
+
+        if (c < 0x80) {
+            i++;
+            continue;
+        } else if ((c & 0xe0) == 0xc0) {
+            codepoint = c & 0x1f;
+            continuation = 1;
+        } else if ((c & 0xf0) == 0xe0) {
+            codepoint = c & 0x0f;
+            continuation = 2;
+        } else if ((c & 0xf8) == 0xf0) {
+            codepoint = c & 0x07;
+            continuation = 3;
+        } else {
+            return false;
+        }
+
+        if (i + continuation >= length) {
+            return false;
+        }
+
+        for (int j = 1; j <= continuation; j++) {
+            if ((data[i + j] & 0xc0) != 0x80) {
+                return false;
+            }
+            codepoint = (codepoint << 6) | (data[i + j] & 0x3f);
+        }
+
+        if ((continuation == 1 && codepoint < 0x80) || (continuation == 2 && codepoint < 0x800)
+            || (continuation == 3 && codepoint < 0x10000) || codepoint > 0x10ffff
+            || (codepoint >= 0xd800 && codepoint <= 0xdfff)) {
+            return false;
+        }
+
+        i += continuation + 1;
+    }
+
+    return true;
+}
+
+static void
+encode_base64(const uint8_t *src, int length, char *dst)
+{
+    static const char alphabet[]
+        = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+
+    for (i = 0; i + 2 < length; i += 3) {
+        *dst++ = alphabet[src[i] >> 2];
+        *dst++ = alphabet[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+        *dst++ = alphabet[((src[i + 1] & 0x0f) << 2) | (src[i + 2] >> 6)];
+        *dst++ = alphabet[src[i + 2] & 0x3f];
+    }
+
+    if (i < length) {
+        *dst++ = alphabet[src[i] >> 2];
+        if (i + 1 < length) {
+            *dst++ = alphabet[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+            *dst++ = alphabet[(src[i + 1] & 0x0f) << 2];
+        } else {
+            *dst++ = alphabet[(src[i] & 0x03) << 4];
+            *dst++ = '=';
+        }
+        *dst++ = '=';
+    }
+
+    *dst = '\0';
+}
+
+/*
+    Makes room for length more bytes in the output buffer
+
+    Fails once a peer that stopped reading holds more than WEBSOCKET_MAX_OUTPUT unsent bytes.
+*/
+static int
+reserve_output(struct websocket *ws, int length)
+{
+    if (ws->out_offset == ws->out_length) {
+        ws->out_offset = 0;
+        ws->out_length = 0;
+    }
+
+    if (ws->out_length - ws->out_offset + length > WEBSOCKET_MAX_OUTPUT) {
+        fprintf(stderr, "[FD: %d] WebSocket peer is not reading, output limit reached\n", ws->fd);
+        return -1;
+    }
+
+    if (ws->out_length + length <= ws->out_capacity) {
+        return 0;
+    }
+
+    // Reclaim what has been sent before growing
+    if (ws->out_offset > 0) {
+        memmove(ws->out, ws->out + ws->out_offset, ws->out_length - ws->out_offset);
+        ws->out_length -= ws->out_offset;
+        ws->out_offset = 0;
+        if (ws->out_length + length <= ws->out_capacity) {
+            return 0;
+        }
+    }
+
+    int capacity = MAX(MAX(ws->out_capacity * 2, ws->out_length + length), 4 * KB);
+    uint8_t *out = realloc(ws->out, capacity);
+
+    if (!out) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+
+    ws->out = out;
+    ws->out_capacity = capacity;
+    return 0;
+}
+
+/*
+    Queues an unmasked frame (server frames are never masked)
+*/
+static int
+queue_frame(struct websocket *ws, int opcode, const void *payload, int length)
+{
+    uint8_t header[WEBSOCKET_MAX_HEADER_LENGTH];
+    int header_length = 2;
+
+    header[0] = 0x80 | opcode; // FIN, we never fragment
+    if (length < 126) {
+        header[1] = length;
+    } else if (length <= 0xffff) {
+        header[1] = 126;
+        header[2] = (length >> 8) & 0xff;
+        header[3] = length & 0xff;
+        header_length = 4;
+    } else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            header[9 - i] = ((uint64_t) length >> (i * 8)) & 0xff;
+        }
+        header_length = 10;
+    }
+
+    if (reserve_output(ws, header_length + length) != 0) {
+        return -1;
+    }
+
+    memcpy(ws->out + ws->out_length, header, header_length);
+    ws->out_length += header_length;
+    if (length > 0) {
+        memcpy(ws->out + ws->out_length, payload, length);
+        ws->out_length += length;
+    }
+
+    return 0;
+}
+
+/*
+    Writes queued frames until the socket would block or nothing is left
+
+    The output buffer is released once drained. Returns 0 when idle, 1 when blocked on EPOLLOUT,
+    -1 on error
+*/
+static int
+flush_output(struct websocket *ws)
+{
+    while (ws->out_offset < ws->out_length) {
+        ssize_t n = send(ws->fd, ws->out + ws->out_offset, ws->out_length - ws->out_offset, 0);
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+        }
+        ws->out_offset += n;
+    }
+
+    free(ws->out);
+    ws->out = NULL;
+    ws->out_length = 0;
+    ws->out_offset = 0;
+    ws->out_capacity = 0;
+    return 0;
+}
+
+/*
+    Calls the handler, making sure WEBSOCKET_CLOSE is delivered exactly once
+*/
+static int
+notify(struct websocket *ws, int event, int opcode, const char *data, int length)
+{
+    if (ws->closed) {
+        return 0;
+    }
+
+    if (event == WEBSOCKET_CLOSE) {
+        ws->closed = true;
+    }
+
+    return ws->handler(ws, event, opcode, data, length);
+}
+
+static void
+reset_message(struct websocket *ws)
+{
+    free(ws->message);
+    ws->message = NULL;
+    ws->message_length = 0;
+    ws->message_opcode = 0;
+}
+
+/*
+    Sends a close frame for a protocol violation, the caller then drops the connection
+
+    Always returns -1 so the parser can return it directly.
+*/
+static int
+fail_connection(struct websocket *ws, int code)
+{
+    fprintf(stderr, "[FD: %d] WebSocket failed with close code %d\n", ws->fd, code);
+    websocket_close(ws, code);
+    return -1;
+}
+
+/*
+    Validates a frame header that has been read in full and prepares for its payload
+*/
+static int
+start_frame(struct websocket *ws)
+{
+    uint8_t *header = ws->header;
+    int length_field = header[1] & 0x7f;
+    int pos = 2;
+
+    ws->fin = header[0] & 0x80;
+    ws->opcode = header[0] & 0x0f;
+
+    // No extension was negotiated, so the RSV bits must be clear; clients must mask
+    if ((header[0] & 0x70) || !(header[1] & 0x80)) {
+        return fail_connection(ws, WEBSOCKET_PROTOCOL_ERROR);
+    }
+
+    if (length_field == 126) {
+        ws->payload_length = (header[2] << 8) | header[3];
+        pos = 4;
+    } else if (length_field == 127) {
+        ws->payload_length = 0;
+        for (int i = 0; i < 8; i++) {
+            ws->payload_length = (ws->payload_length << 8) | header[2 + i];
+        }
+        pos = 10;
+        if (ws->payload_length >> 63) {
+            return fail_connection(ws, WEBSOCKET_PROTOCOL_ERROR);
+        }
+    } else {
+        ws->payload_length = length_field;
+    }
+
+    memcpy(ws->mask, &header[pos], sizeof(ws->mask));
+    ws->payload_read = 0;
+
+    switch (ws->opcode) {
+    case WEBSOCKET_CLOSE_FRAME:
+    case WEBSOCKET_PING:
+    case WEBSOCKET_PONG:
+        if (!ws->fin || ws->payload_length > WEBSOCKET_MAX_CONTROL_PAYLOAD) {
+            return fail_connection(ws, WEBSOCKET_PROTOCOL_ERROR);
+        }
+        return 0;
+
+    case WEBSOCKET_CONTINUATION:
+        if (ws->message_opcode == 0) {
+            return fail_connection(ws, WEBSOCKET_PROTOCOL_ERROR);
+        }
+        break;
+
+    case WEBSOCKET_TEXT:
+    case WEBSOCKET_BINARY:
+        if (ws->message_opcode != 0) {
+            return fail_connection(ws, WEBSOCKET_PROTOCOL_ERROR);
+        }
+        ws->message_opcode = ws->opcode;
+        break;
+
+    default:
+        return fail_connection(ws, WEBSOCKET_PROTOCOL_ERROR);
+    }
+
+    if (ws->payload_length > (uint64_t) (WEBSOCKET_MAX_MESSAGE_SIZE - ws->message_length)) {
+        return fail_connection(ws, WEBSOCKET_MESSAGE_TOO_BIG);
+    }
+
+    // Grow the message buffer by exactly this frame's payload
+    if (ws->payload_length > 0) {
+        char *message = realloc(ws->message, ws->message_length + ws->payload_length);
+
+        if (!message) {
+            perror("Failed to allocate memory");
+            return fail_connection(ws, WEBSOCKET_INTERNAL_ERROR);
+        }
+        ws->message = message;
+    }
+
+    return 0;
+}
+
+/*
+    Acts on a frame whose payload has been read in full
+
+    Returns 0, or -1 if the connection must be dropped
+*/
+static int
+end_frame(struct websocket *ws)
+{
+    int length = (int) ws->payload_length;
+
+    switch (ws->opcode) {
+    case WEBSOCKET_PING:
+        if (ws->close_sent) {
+            return 0;
+        }
+        return queue_frame(ws, WEBSOCKET_PONG, ws->control, length);
+
+    case WEBSOCKET_PONG:
+        ws->ping_sent = 0;
+        return 0;
+
+    case WEBSOCKET_CLOSE_FRAME: {
+        int code = WEBSOCKET_NO_STATUS;
+
+        if (length == 1) {
+            return fail_connection(ws, WEBSOCKET_PROTOCOL_ERROR);
+        } else if (length >= 2) {
+            code = (ws->control[0] << 8) | ws->control[1];
+        }
+
+        ws->close_received = true;
+        fprintf(stderr, "[FD: %d] WebSocket closed by peer with code %d\n", ws->fd, code);
+
+        // Echo the status code back, the connection is dropped once it is on the wire
+        if (!ws->close_sent) {
+            ws->close_sent = time(NULL);
+            return queue_frame(ws, WEBSOCKET_CLOSE_FRAME, ws->control, MIN(length, 2));
+        }
+        return 0;
+    }
+
+    default:
+        break;
+    }
+
+    ws->message_length += length;
+
+    if (!ws->fin) {
+        return 0;
+    }
+
+    // Data arriving after our close frame is read but no longer delivered
+    int ret = 0;
+
+    if (ws->message_opcode == WEBSOCKET_TEXT
+        && !is_valid_utf8((const uint8_t *) ws->message, ws->message_length)) {
+        ret = fail_connection(ws, WEBSOCKET_INVALID_DATA);
+    } else if (!ws->close_sent
+               && notify(ws, WEBSOCKET_MESSAGE, ws->message_opcode, ws->message,
+                         ws->message_length)
+                      < 0) {
+        websocket_close(ws, WEBSOCKET_INTERNAL_ERROR);
+    }
+
+    reset_message(ws);
+    return ret;
+}
+
+/*
+    Runs received bytes through the frame parser
+
+    Frame headers are collected in ws->header, payloads are copied straight to their destination
+    and unmasked there. Returns 0, or -1 if the connection must be dropped
+*/
+static int
+process_input(struct websocket *ws, const uint8_t *data, int length)
+{
+    int pos = 0;
+
+    while (pos < length && !ws->close_received) {
+        if (ws->header_length < ws->header_needed) {
+            int n = MIN(ws->header_needed - ws->header_length, length - pos);
+
+            memcpy(ws->header + ws->header_length, data + pos, n);
+            ws->header_length += n;
+            pos += n;
+
+            if (ws->header_length < ws->header_needed) {
+                break;
+            }
+
+            // The first two bytes tell how long the rest of the header is
+            if (ws->header_needed == 2) {
+                int length_field = ws->header[1] & 0x7f;
+
+                ws->header_needed += length_field == 126 ? 2 : length_field == 127 ? 8 : 0;
+                ws->header_needed += ws->header[1] & 0x80 ? 4 : 0;
+                if (ws->header_needed > 2) {
+                    continue;
+                }
+            }
+
+            if (start_frame(ws) < 0) {
+                return -1;
+            }
+        } else {
+            int n = (int) MIN(ws->payload_length - ws->payload_read, (uint64_t) (length - pos));
+            uint8_t *dst = ws->opcode >= WEBSOCKET_CLOSE_FRAME
+                               ? ws->control + ws->payload_read
+                               : (uint8_t *) ws->message + ws->message_length + ws->payload_read;
+
+            memcpy(dst, data + pos, n);
+            unmask(dst, n, ws->mask, ws->payload_read);
+            ws->payload_read += n;
+            pos += n;
+        }
+
+        if (ws->payload_read == ws->payload_length) {
+            ws->header_length = 0;
+            ws->header_needed = 2;
+            if (end_frame(ws) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Reads and parses frames until the socket would block
+
+    Returns 0, or -1 when the connection must be closed
+*/
+static int
+read_input(struct websocket *ws)
+{
+    uint8_t buffer[16 * KB];
+
+    while (!ws->close_received) {
+        ssize_t n = recv(ws->fd, buffer, sizeof(buffer), 0);
+
+        if (n == 0) {
+            fprintf(stderr, "[FD: %d] Client closed the WebSocket connection\n", ws->fd);
+            return -1;
+        }
+
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            perror("recv");
+            return -1;
+        }
+
+        ws->last_received = time(NULL);
+
+        if (process_input(ws, buffer, n) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+    Whether a request is a valid WebSocket opening handshake
+*/
+bool
+websocket_is_upgrade(const HTTP_MESSAGE *request)
+{
+    const char *key = get_known_header(request, HEADER_SEC_WEBSOCKET_KEY);
+    const char *version = get_known_header(request, HEADER_SEC_WEBSOCKET_VERSION);
+
+    return request->start_line.request.method == HTTP_GET
+           && request->start_line.request.protocol == HTTP_1_1
+           && header_has_token(get_known_header(request, HEADER_UPGRADE), "websocket")
+           && header_has_token(get_known_header(request, HEADER_CONNECTION), "upgrade")
+           && version && strcmp(version, WEBSOCKET_VERSION) == 0 && key
+           && strlen(key) == 24; // base64 of a 16-byte nonce
+}
+
+/*
+    Completes the opening handshake and switches a connection to WebSocket
+
+    conn->request is the handshake request. The 101 is queued, the HTTP buffers of the
+    connection are released and bytes read past the request head are parsed as frames.
+
+    Returns 0, or -1 if the connection must be closed
+*/
+int
+websocket_start(struct conn *conn, int epoll_fd, websocket_handler handler)
+{
+    struct websocket *ws = calloc(1, sizeof(struct websocket));
+
+    if (!ws) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+
+    ws->fd = conn->fd;
+    ws->handler = handler;
+    ws->header_needed = 2;
+    ws->last_received = time(NULL);
+    conn->websocket = ws;
+
+    HTTP_MESSAGE *request = conn->request;
+    HTTP_MESSAGE *response = conn->response;
+
+    // Sec-WebSocket-Accept is base64(SHA-1(key + GUID))
+    char key[64 + sizeof(WEBSOCKET_GUID)];
+    uint8_t digest[SHA1_DIGEST_LENGTH];
+    char accept[32];
+
+    snprintf(key, sizeof(key), "%s%s", get_known_header(request, HEADER_SEC_WEBSOCKET_KEY),
+             WEBSOCKET_GUID);
+    sha1(key, strlen(key), digest);
+    encode_base64(digest, sizeof(digest), accept);
+
+    response->start_line.response.protocol = HTTP_1_1;
+    response->start_line.response.status_code = STATUS_SWITCHING_PROTOCOLS;
+    strcpy(response->start_line.response.status_message, "Switching Protocols");
+    add_header(response, "Upgrade", "websocket");
+    add_header(response, "Connection", "Upgrade");
+    add_header(response, "Sec-WebSocket-Accept", accept);
+
+    char head[1 * KB];
+
+    if (build_header(response, RESPONSE, head, sizeof(head)) != 0
+        || reserve_output(ws, strlen(head)) != 0) {
+        return -1;
+    }
+    memcpy(ws->out, head, strlen(head));
+    ws->out_length = strlen(head);
+
+    fprintf(stderr, "[FD: %d] WebSocket opened: %s\n", conn->fd,
+            request->start_line.request.request_target);
+
+    // Frames the client sent right behind its handshake
+    int buffered_length = request->buffered_length;
+    uint8_t *buffered = NULL;
+
+    if (buffered_length > 0) {
+        buffered = malloc(buffered_length);
+        if (!buffered) {
+            perror("Failed to allocate memory");
+            return -1;
+        }
+        memcpy(buffered, conn->buffer, buffered_length);
+    }
+
+    // Only the small struct websocket stays behind for an idle connection
+    free(conn->buffer);
+    conn->buffer = NULL;
+    free_http_message(conn->request);
+    free(conn->request);
+    conn->request = NULL;
+    free_http_message(conn->response);
+    free(conn->response);
+    conn->response = NULL;
+
+    set_conn_state(conn, WEBSOCKET);
+
+    struct epoll_event ev = { 0 };
+
+    ev.events = DUPLEX_EPOLL_FLAGS;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        free(buffered);
+        return -1;
+    }
+
+    if (notify(ws, WEBSOCKET_OPEN, 0, NULL, 0) < 0) {
+        websocket_close(ws, WEBSOCKET_INTERNAL_ERROR);
+    }
+
+    int ret = buffered ? process_input(ws, buffered, buffered_length) : 0;
+
+    free(buffered);
+    if (ret < 0) {
+        flush_output(ws);
+        return -1;
+    }
+
+    return websocket_handle_event(conn, EPOLLIN);
+}
+
+/*
+    Handles an epoll event on a WebSocket connection
+
+    Returns 0, or -1 if the connection must be closed
+*/
+int
+websocket_handle_event(struct conn *conn, uint32_t events)
+{
+    struct websocket *ws = conn->websocket;
+    int ret = 0;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        return -1;
+    }
+
+    if (events & (EPOLLIN | EPOLLRDHUP)) {
+        ret = read_input(ws);
+    }
+
+    // Also sends the close frame of a failed connection, as far as the socket takes it
+    int flushed = flush_output(ws);
+
+    if (ret < 0 || flushed < 0) {
+        return -1;
+    }
+
+    // The closing handshake is complete once our reply to the peer's close frame is out
+    if (ws->close_received && flushed == 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+    Keep-alive timers, run from the server's timeout sweep
+
+    A peer silent for WEBSOCKET_PING_INTERVAL is pinged and dropped if the pong does not come
+    back within WEBSOCKET_PONG_TIMEOUT. A closing handshake we started is given
+    WEBSOCKET_CLOSE_TIMEOUT to complete. Returns 0, or -1 if the connection must be closed
+*/
+int
+websocket_check_timeout(struct conn *conn, time_t now)
+{
+    struct websocket *ws = conn->websocket;
+
+    if (ws->close_sent) {
+        return now - ws->close_sent > WEBSOCKET_CLOSE_TIMEOUT ? -1 : 0;
+    }
+
+    if (ws->ping_sent) {
+        if (now - ws->ping_sent > WEBSOCKET_PONG_TIMEOUT) {
+            fprintf(stderr, "[FD: %d] WebSocket ping went unanswered\n", ws->fd);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (now - ws->last_received < WEBSOCKET_PING_INTERVAL) {
+        return 0;
+    }
+
+    ws->ping_sent = now;
+    if (queue_frame(ws, WEBSOCKET_PING, NULL, 0) != 0) {
+        return -1;
+    }
+
+    return flush_output(ws) < 0 ? -1 : 0;
+}
+
+/*
+    Releases the WebSocket state of a connection that is going away
+*/
+void
+websocket_abort(struct conn *conn)
+{
+    if (!conn || !conn->websocket) {
+        return;
+    }
+
+    struct websocket *ws = conn->websocket;
+
+    notify(ws, WEBSOCKET_CLOSE, 0, NULL, 0);
+    fprintf(stderr, "[FD: %d] WebSocket released\n", ws->fd);
+
+    reset_message(ws);
+    free(ws->out);
+    free(ws);
+    conn->websocket = NULL;
+}
+
+/*
+    Queues a message for the peer and writes as much of the output as the socket takes
+
+    Returns 0, or -1 if the connection is closing or the peer is too far behind
+*/
+int
+websocket_send(struct websocket *ws, int opcode, const char *data, int length)
+{
+    if (!ws || ws->close_sent || (opcode != WEBSOCKET_TEXT && opcode != WEBSOCKET_BINARY)) {
+        return -1;
+    }
+
+    if (queue_frame(ws, opcode, data, length) != 0) {
+        return -1;
+    }
+
+    return flush_output(ws) < 0 ? -1 : 0;
+}
+
+/*
+    Starts the closing handshake with a status code
+
+    The connection is dropped once the peer answers with its own close frame, or after
+    WEBSOCKET_CLOSE_TIMEOUT.
+*/
+int
+websocket_close(struct websocket *ws, int code)
+{
+    if (!ws || ws->close_sent) {
+        return 0;
+    }
+
+    uint8_t payload[2] = { (code >> 8) & 0xff, code & 0xff };
+
+    ws->close_sent = time(NULL);
+    if (queue_frame(ws, WEBSOCKET_CLOSE_FRAME, payload, sizeof(payload)) != 0) {
+        return -1;
+    }
+
+    return flush_output(ws) < 0 ? -1 : 0;
+}
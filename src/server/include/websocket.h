@@ -0,0 +1,96 @@
+/*
+    Header File for WebSocket connections (RFC 6455)
+*/
+
+#pragma once
+
+#include "conn_map.h"
+#include "http_builder.h"
+#include "http_parser.h"
+#include "macros.h"
+#include "routes.h"
+#include "sha1.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WEBSOCKET_VERSION "13"
+
+#define WEBSOCKET_MAX_HEADER_LENGTH 14      // 2 + 8 byte extended length + 4 byte mask
+#define WEBSOCKET_MAX_CONTROL_PAYLOAD 125
+#define WEBSOCKET_MAX_MESSAGE_SIZE 1 * MB   // Larger messages are closed with 1009
+#define WEBSOCKET_MAX_OUTPUT 4 * MB         // Unsent bytes a slow reader may hold us to
+#define WEBSOCKET_PING_INTERVAL 30          // Seconds of silence before we ping
+#define WEBSOCKET_PONG_TIMEOUT 10           // Seconds a ping may go unanswered
+#define WEBSOCKET_CLOSE_TIMEOUT 5           // Seconds to wait for the peer's close frame
+
+enum WEBSOCKET_OPCODE
+{
+    WEBSOCKET_CONTINUATION = 0x0,
+    WEBSOCKET_TEXT = 0x1,
+    WEBSOCKET_BINARY = 0x2,
+    WEBSOCKET_CLOSE_FRAME = 0x8,
+    WEBSOCKET_PING = 0x9,
+    WEBSOCKET_PONG = 0xa,
+};
+
+enum WEBSOCKET_CLOSE_CODE
+{
+    WEBSOCKET_NORMAL_CLOSURE = 1000,
+    WEBSOCKET_GOING_AWAY = 1001,
+    WEBSOCKET_PROTOCOL_ERROR = 1002,
+    WEBSOCKET_NO_STATUS = 1005,
+    WEBSOCKET_INVALID_DATA = 1007,
+    WEBSOCKET_MESSAGE_TOO_BIG = 1009,
+    WEBSOCKET_INTERNAL_ERROR = 1011,
+};
+
+/*
+    WebSocket state of a connection, hung off struct conn once the handshake is done
+
+    Everything that is only needed mid-message (the message being assembled, unsent output) is
+    allocated on demand and freed once drained, so an idle WebSocket costs just this struct.
+*/
+struct websocket
+{
+    int fd;
+    websocket_handler handler;
+    void *state;             // Owned by the handler
+    uint8_t header[WEBSOCKET_MAX_HEADER_LENGTH];
+    int header_length;       // Bytes of the current frame header read so far
+    int header_needed;       // Size of the current frame header once known
+    uint8_t opcode;          // Opcode of the frame being read
+    bool fin;
+    uint8_t mask[4];
+    uint64_t payload_length; // Payload of the frame being read
+    uint64_t payload_read;
+    uint8_t message_opcode;  // TEXT or BINARY of the message being assembled, or 0
+    char *message;           // Data frames of that message, unmasked
+    int message_length;
+    uint8_t control[WEBSOCKET_MAX_CONTROL_PAYLOAD];
+    uint8_t *out;            // Frames waiting to be sent
+    int out_length;
+    int out_offset;
+    int out_capacity;
+    time_t last_received;    // Last time the peer sent anything
+    time_t ping_sent;        // When our unanswered ping went out, or 0
+    time_t close_sent;       // When our close frame was queued, or 0
+    bool close_received;
+    bool closed;             // WEBSOCKET_CLOSE delivered, the handler state is gone
+};
+
+bool websocket_is_upgrade(const HTTP_MESSAGE *request);
+
+int websocket_start(struct conn *conn, int epoll_fd, websocket_handler handler);
+int websocket_handle_event(struct conn *conn, uint32_t events);
+int websocket_check_timeout(struct conn *conn, time_t now);
+void websocket_abort(struct conn *conn);
+
+int websocket_send(struct websocket *ws, int opcode, const char *data, int length);
+int websocket_close(struct websocket *ws, int code);
@@ -8,8 +8,24 @@
 #include "http_builder.h"
 #include "http_lib.h"
 #include "http_parser.h"
+#include "include/arena.h"
+#include "include/busy_poll.h"
 #include "include/connect.h"
+#include "include/file_cache.h"
+#include "include/http2.h"
+#include "include/keep_alive.h"
+#include "include/memory_budget.h"
+#include "include/offload.h"
+#include "include/page_cache.h"
+#include "include/probes.h"
+#include "include/proxy.h"
+#include "include/rate_limit.h"
 #include "include/routes.h"
+#include "include/sse.h"
+#include "include/static_pack.h"
+#include "include/tls.h"
+#include "include/upgrade.h"
+#include "include/websocket.h"
 #include "ip_helper.h"
 #include "macros.h"
 #include <arpa/inet.h>
@@ -21,6 +37,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -29,27 +46,141 @@
 
 #include <sys/epoll.h>
 
-#define SERVER_NAME "HttpServer"
-
 #define MAX_EPOLL_EVENTS 16
 #define MAX_CONNECTIONS 64
 #define TIMEOUT_LIMIT 999999999
-#define ACTIONS_LIMIT 1000
 
-#define RECV_EPOLL_FLAGS EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR | EPOLLET
-#define SEND_EPOLL_FLAGS EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLERR | EPOLLET
+#define BODY_STREAM_POLL_MS 10 // How often paused streaming body handlers are polled
+#define KEEPALIVE_POLL_MS 1000 // How often keep-alive and idle timers are checked
+#define DRAIN_TIMEOUT 30 // Seconds open connections get to finish once we stop accepting
 
 static volatile sig_atomic_t shutdown_requested = 0;
+static bool draining = false; // Stopped accepting, connections close after their response
+static time_t drain_deadline = 0;
 
 void
 cleanup_connection(struct conn *connection_map, int fd, int max_connections, int epoll_fd)
 {
+    struct conn *conn = get_conn(connection_map, fd, max_connections);
+
+    PROBE2(close, fd, conn ? conn->requests : 0);
+
+    // Let a streaming body handler release whatever it still holds
+    if (conn && conn->route && conn->route->stream_handler && conn->stream_state) {
+        conn->route->stream_handler(conn->request, conn->response, BODY_STREAM_ABORT, NULL, 0,
+                                    &conn->stream_state);
+    }
+
+    // A proxied exchange cut short also takes its upstream connection down
+    proxy_abort(connection_map, max_connections, conn, epoll_fd);
+
+    // Likewise every stream of an HTTP/2 connection
+    http2_abort(conn);
+
+    // And a WebSocket's handler
+    websocket_abort(conn);
+
+    // An SSE subscriber leaves its channel
+    sse_abort(conn);
+
+    // A TLS handshake still under way releases its session
+    tls_abort(conn);
+
+    // A handler still running on the offload pool keeps the messages until it returns
+    offload_cancel(conn);
+
+    // The request is traced up to the close, with a last byte if its response was under way
+    if (conn) {
+        trace_end(&conn->trace, fd, conn->requests, conn->trace.at[TRACE_ROUTED] != 0);
+    }
+
     // Remove from epoll first to prevent future events
     epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
     // Then remove from connection map (this will close the fd)
     remove_conn_from_map(connection_map, fd, max_connections);
 }
 
+/*
+    Renders the connection's response once and queues it, the header block then its body
+
+    The body is queued where it already is, the cached bytes or the file, so the response
+    messages must stay alive until the queue is drained.
+*/
+int
+queue_response(struct conn *conn)
+{
+    HTTP_MESSAGE *response = conn->response;
+    char head[MAX_HEADERS_SIZE];
+    int ret = 0;
+
+    // Create Headers about the body, an in-memory body brings its own
+    if (!response->body_data && add_body_headers(response) < 0) {
+        return -1;
+    }
+
+    if (build_header(response, RESPONSE, head, sizeof(head)) != 0) {
+        fprintf(stderr, "Failed to build header\n");
+        return -1;
+    }
+
+    // Sent from the arena, which is only reset once the response is out
+    int head_length = strlen(head);
+    char *copy = arena_strndup(conn->arena, head, head_length);
+
+    if (!copy || output_queue_push_memory(&conn->output, copy, head_length, false) != 0) {
+        return -1;
+    }
+    conn->head_end = conn->output.queued_bytes;
+
+    if (response->body_data) {
+        ret = output_queue_push_memory(&conn->output, response->body_data, response->body_length,
+                                       false);
+    } else if (response->body_fd != -1) {
+        ret = output_queue_push_file(&conn->output, response->body_fd, 0,
+                                     get_file_length(response->body_fd));
+    }
+
+    set_conn_state(conn, SENDING_HEADERS);
+    return ret;
+}
+
+/*
+    Writes the connection's queue, file data a PAGE_CACHE_WINDOW at a time
+
+    A window that is not in the page cache is read in on the offload pool first, with the
+    connection parked in WAITING_DISK. Returns 0 when the queue is empty, 1 when the socket is
+    full, 2 when parked, or -1 on failure
+*/
+int
+send_output(struct conn *conn, int offload_fd, int epoll_fd)
+{
+    int ret;
+
+    do {
+        struct output_segment *front = output_queue_front(&conn->output);
+
+        if (front && front->type == OUTPUT_FILE) {
+            long window = MIN(front->end - front->offset, PAGE_CACHE_WINDOW);
+
+            // page_cache_fault_in() reads the window at the body's file position
+            if (offload_fd != -1 && !page_cache_is_resident(front->fd, front->offset, window)
+                && lseek(front->fd, front->offset, SEEK_SET) != -1
+                && offload_submit(conn, page_cache_fault_in, WAITING_DISK, epoll_fd) == 0) {
+                return 2;
+            }
+            page_cache_advise(front->fd, front->offset, front->end);
+        }
+
+        ret = output_queue_flush(&conn->output, conn->fd, PAGE_CACHE_WINDOW);
+
+        if (conn->state != SENDING_BODY && conn->output.sent_bytes >= conn->head_end) {
+            set_conn_state(conn, SENDING_BODY);
+        }
+    } while (ret == 2);
+
+    return ret;
+}
+
 int
 send_error_response(HTTP_MESSAGE *response, int fd, struct conn *map, int epoll_fd)
 {
@@ -60,37 +191,29 @@ send_error_response(HTTP_MESSAGE *response, int fd, struct conn *map, int epoll_
 
     add_header(response, "Connection", "close");
 
-    int ret;
     struct conn *curr_conn = get_conn(map, fd, MAX_CONNECTIONS);
 
+    // A response already under way cannot be followed by another, the close tells the client
+    if (!output_queue_empty(&curr_conn->output)
+        && (curr_conn->state == SENDING_HEADERS || curr_conn->state == SENDING_BODY
+            || curr_conn->state == WAITING_DISK)) {
+        cleanup_connection(map, fd, MAX_CONNECTIONS, epoll_fd);
+        return -1;
+    }
+
     // Set socket to blocking
     int flags = fcntl(fd, F_GETFL, 0);
     flags &= ~O_NONBLOCK;
     fcntl(fd, F_SETFL, flags);
 
-    set_conn_state(curr_conn, SENDING_HEADERS);
-    ret = build_and_send_headers(response, fd, curr_conn->offset, false, RESPONSE);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to send HTTP headers to client\n");
+    // Without the offload pool the blocking socket takes the whole queue in one go
+    if (queue_response(curr_conn) != 0 || send_output(curr_conn, -1, epoll_fd) != 0) {
+        fprintf(stderr, "Failed to send HTTP response to client\n");
         // Special case where we can't send an HTTP message to the client, so simply close the fd.
         cleanup_connection(map, fd, MAX_CONNECTIONS, epoll_fd);
         return -1;
     }
 
-    int body_length = get_file_length(response->body_fd);
-
-    if (body_length > 0) {
-        set_conn_state(curr_conn, SENDING_BODY);
-        ret = build_and_send_body(response, fd);
-        if (ret < 0) {
-            fprintf(stderr, "Failed to send HTTP headers to client\n");
-            // Special case where we can't send an HTTP message to the client, so simply close the
-            // fd.
-            cleanup_connection(map, fd, MAX_CONNECTIONS, epoll_fd);
-            return -1;
-        }
-    }
-
     cleanup_connection(map, fd, MAX_CONNECTIONS, epoll_fd);
 
     return 0;
@@ -111,58 +234,318 @@ server_router(HTTP_MESSAGE *request, HTTP_MESSAGE *response)
     // Send back response always in HTTP 1.1
     response->start_line.response.protocol = HTTP_1_1;
 
+    PROBE2(route_start, route, method);
+
     if (!route || strlen(route) == 0) {
         response->start_line.response.status_code = STATUS_BAD_REQUEST;
         strcpy(response->start_line.response.status_message, "Bad Request");
-        http_message_open_existing_file(response, "html/NotFound.html", O_RDONLY, false);
+        serve_static_file(request, response, "html/NotFound.html");
+        PROBE3(route_end, route, method, response->start_line.response.status_code);
         return 0;
     }
 
-    // Setup Routes
-    if (strcmp(route, "/") == 0) {
-        if (method == HTTP_GET) {
-            default_handler(request, response);
+    const struct route *matched = find_route(route, method);
+
+    if (matched == NULL) {
+        response->start_line.response.status_code = STATUS_NOT_FOUND;
+        strcpy(response->start_line.response.status_message, "Not Found");
+        serve_static_file(request, response, "html/NotFound.html");
+    } else if (matched->method != method
+               || (matched->handler == NULL && !matched->websocket && !matched->sse)) {
+        response->start_line.response.status_code = STATUS_METHOD_NOT_ALLOWED;
+        strcpy(response->start_line.response.status_message, "Method Not Allowed");
+        add_header(response, "Allow", matched->allow);
+    } else if (matched->websocket) {
+        // Only reached when the request is not a valid WebSocket handshake
+        response->start_line.response.status_code = STATUS_UPGRADE_REQUIRED;
+        strcpy(response->start_line.response.status_message, "Upgrade Required");
+        add_header(response, "Upgrade", "websocket");
+        add_header(response, "Sec-WebSocket-Version", WEBSOCKET_VERSION);
+    } else if (matched->sse) {
+        // Only reached when the connection could not subscribe
+        if (request->start_line.request.protocol == HTTP_2_0) {
+            response->start_line.response.status_code = STATUS_HTTP_VERSION_NOT_SUPPORTED;
+            strcpy(response->start_line.response.status_message, "HTTP Version Not Supported");
         } else {
-            response->start_line.response.status_code = STATUS_METHOD_NOT_ALLOWED;
-            strcpy(response->start_line.response.status_message, "Method Not Allowed");
-            add_header(response, "Allow", "GET");
+            response->start_line.response.status_code = STATUS_NOT_FOUND;
+            strcpy(response->start_line.response.status_message, "Not Found");
+            serve_static_file(request, response, "html/NotFound.html");
         }
-    } else if (strcmp(route, "/echo") == 0) {
-        if (method == HTTP_POST) {
-            echo_handler(request, response);
-        } else {
-            response->start_line.response.status_code = STATUS_METHOD_NOT_ALLOWED;
-            strcpy(response->start_line.response.status_message, "Method Not Allowed");
-            add_header(response, "Allow", "POST");
+    } else {
+        PROBE1(handler_start, matched->path);
+        int ret = matched->handler(request, response);
+        PROBE2(handler_end, matched->path, ret);
+    }
+
+    PROBE3(route_end, route, method, response->start_line.response.status_code);
+    return 0;
+}
+
+/*
+    Whether the connection's request is served by a streaming body handler
+*/
+bool
+is_stream_route(const struct conn *conn)
+{
+    return conn->route && conn->route->stream_handler
+           && conn->route->method == (int) conn->request->start_line.request.method;
+}
+
+/*
+    Decides on the request body before any of it is read
+
+    A body over the route's limit gets a 413 and an expectation other than 100-continue a 417.
+    Bodies are only ever framed by Content-Length here, so one sent with a Transfer-Encoding
+    gets a 501 rather than being taken as empty, which would let its bytes pass for the next
+    request, or reach a pooled upstream connection as one.
+
+    A body the memory budget has no room for gets a 503, a streamed one is never held so only
+    the spooled ones are charged for it. A client waiting on "Expect: 100-continue" is told to
+    go ahead once all of that passed and its route takes the request, or else gets the final
+    response, so a refused upload is never read or stored.
+
+    Returns 0 to go on and read the body, or 1 when the request was answered
+*/
+int
+admit_request_body(struct conn *conn, struct conn *map, int epoll_fd)
+{
+    static const char interim[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    HTTP_MESSAGE *request = conn->request;
+    HTTP_MESSAGE *response = conn->response;
+    long length = get_content_length(request);
+    bool accepted = route_allows_method(conn->route, request->start_line.request.method);
+    const char *expect = get_known_header(request, HEADER_EXPECT);
+
+    // HTTP/1.0 clients cannot expect anything
+    if (request->start_line.request.protocol == HTTP_1_0) {
+        expect = NULL;
+    }
+
+    if (get_known_header(request, HEADER_TRANSFER_ENCODING)) {
+        build_error_response(response, STATUS_NOT_IMPLEMENTED, "Not Implemented", NULL);
+    } else if (length < 0) {
+        build_error_response(response, STATUS_BAD_REQUEST, "Bad Request", NULL);
+    } else if (expect && strcasecmp(expect, "100-continue") != 0) {
+        build_error_response(response, STATUS_EXPECTATION_FAILED, "Expectation Failed", NULL);
+    } else if (length > route_max_body(conn->route)) {
+        build_error_response(response, STATUS_CONTENT_TOO_LARGE, "Content Too Large", NULL);
+    } else if (!memory_budget_admit(conn->memory_used, is_stream_route(conn) ? 0 : length)) {
+        build_error_response(response, STATUS_SERVICE_UNAVAILABLE, "Service Unavailable", NULL);
+        add_header(response, "Retry-After", "1");
+    } else if (!expect || length == 0 || request->buffered_length > 0) {
+        // Nothing to wait for, or the client is already sending its body
+        return 0;
+    } else if (!accepted) {
+        // The 404 or 405 is all the client gets
+        server_router(request, response);
+    } else {
+        // What the socket does not take now goes out ahead of the final response
+        if (output_queue_push_memory(&conn->output, interim, sizeof(interim) - 1, false) != 0
+            || output_queue_flush(&conn->output, conn->fd, 0) < 0) {
+            cleanup_connection(map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+            return 1;
         }
-    } else if (strcmp(route, "/favicon.ico") == 0) {
-        if (method == HTTP_GET) {
-            favicon_handler(request, response);
-        } else {
-            response->start_line.response.status_code = STATUS_METHOD_NOT_ALLOWED;
-            strcpy(response->start_line.response.status_message, "Method Not Allowed");
-            add_header(response, "Allow", "GET");
+        return 0;
+    }
+
+    add_header(response, "Server", SERVER_NAME);
+    send_error_response(response, conn->fd, map, epoll_fd);
+    return 1;
+}
+
+/*
+    Sends the responses of connections whose handler finished on the offload pool
+*/
+void
+resume_offloaded(struct conn *connection_map, int epoll_fd)
+{
+    struct conn *conn;
+    struct epoll_event ev;
+    int ret;
+
+    while ((conn = offload_next_completed(&ret)) != NULL) {
+        // A body window read in, or failed to, is sent either way
+        if (conn->state == WAITING_DISK) {
+            memset(&ev, 0, sizeof(struct epoll_event));
+            ev.events = SEND_EPOLL_FLAGS;
+            ev.data.fd = conn->fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+                perror("epoll_ctl for client socket:");
+                cleanup_connection(connection_map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+            }
+            continue;
         }
-    } else if (strncmp(route, "/static", 7) == 0) {
-        if (method == HTTP_GET) {
-            static_handler(request, response);
+
+        if (ret != 0) {
+            fprintf(stderr, "Failed to parse HTTP request\n");
+            // error response is built inside the server router
+            send_error_response(conn->response, conn->fd, connection_map, epoll_fd);
+            continue;
         }
-    } else {
-        response->start_line.response.status_code = STATUS_NOT_FOUND;
-        strcpy(response->start_line.response.status_message, "Not Found");
-        http_message_open_existing_file(response, "html/NotFound.html", O_RDONLY, false);
+
+        keep_alive_add_headers(conn, conn->response, draining);
+
+        // Print the built HTTP Response for DEBUG purposes
+        print_http_message(conn->response, RESPONSE);
+
+        if (queue_response(conn) != 0) {
+            cleanup_connection(connection_map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+            continue;
+        }
+
+        // The socket is writable, so this reports EPOLLOUT right away and the send starts there
+        memset(&ev, 0, sizeof(struct epoll_event));
+        ev.events = SEND_EPOLL_FLAGS;
+        ev.data.fd = conn->fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+            perror("epoll_ctl for client socket:");
+            cleanup_connection(connection_map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+        }
+    }
+}
+
+/*
+    Hands a body chunk from the parser to the connection's streaming body handler
+*/
+int
+stream_body_chunk(void *ctx, const char *chunk, int chunk_length)
+{
+    struct conn *conn = ctx;
+
+    return conn->route->stream_handler(conn->request, conn->response, BODY_STREAM_DATA, chunk,
+                                       chunk_length, &conn->stream_state);
+}
+
+/*
+    Drops EPOLLIN interest while a streaming body handler is paused
+*/
+int
+pause_body_stream(struct conn *conn, int epoll_fd)
+{
+    struct epoll_event ev = { 0 };
+
+    ev.events = PAUSED_EPOLL_FLAGS;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        return -1;
+    }
+
+    conn->body_paused = true;
+    fprintf(stderr, "[FD: %d] Body stream paused\n", conn->fd);
+    return 0;
+}
+
+/*
+    Polls a paused streaming body handler and restores EPOLLIN interest once it is ready
+
+    Re-arming with EPOLL_CTL_MOD reports EPOLLIN again if body bytes arrived while paused.
+*/
+int
+resume_body_stream(struct conn *conn, int epoll_fd)
+{
+    int ret = conn->route->stream_handler(conn->request, conn->response, BODY_STREAM_RESUME, NULL,
+                                          0, &conn->stream_state);
+    if (ret != BODY_STREAM_CONTINUE) {
+        return ret;
+    }
+
+    struct epoll_event ev = { 0 };
+
+    ev.events = RECV_EPOLL_FLAGS;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        return -1;
+    }
+
+    conn->body_paused = false;
+    fprintf(stderr, "[FD: %d] Body stream resumed\n", conn->fd);
+    return 0;
+}
+
+/*
+    Ends a response exchange: closes the connection or waits for the next request
+*/
+int
+finish_response(struct conn *conn, struct conn *map, int epoll_fd)
+{
+    if (!keep_alive_persists(conn, draining)) {
+        fprintf(stderr, "[FD %d]: Closed connection\n", conn->fd);
+        cleanup_connection(map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+        return 0;
     }
 
+    struct epoll_event ev = { 0 };
+
+    ev.events = RECV_EPOLL_FLAGS;
+    ev.data.fd = conn->fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+        perror("epoll_ctl for client socket:");
+        cleanup_connection(map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+        return -1;
+    }
+
+    // The keep-alive timeout runs from here, a body sent from the offload pool may have taken long
+    update_conn_time(conn);
+    arena_reset(conn->arena);
+    set_conn_state(conn, IDLE);
     return 0;
 }
 
+/*
+    Writes the connection's queued response, then closes it or waits for the next request
+
+    Called again on EPOLLOUT while the socket is full, and once a parked body window is read in
+*/
+void
+send_response(struct conn *conn, struct conn *map, int offload_fd, int epoll_fd)
+{
+    int ret = send_output(conn, offload_fd, epoll_fd);
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to send HTTP response to client\n");
+        // Special case where we can't send an HTTP message to the client, so simply close the fd.
+        cleanup_connection(map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+        return;
+    } else if (ret == 2) {
+        // Parked until the next window is in the page cache
+        return;
+    } else if (ret == 1) {
+        struct epoll_event ev = { 0 };
+
+        ev.events = SEND_EPOLL_FLAGS;
+        ev.data.fd = conn->fd;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+            perror("epoll_ctl for client socket:");
+            cleanup_connection(map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+            return;
+        }
+        fprintf(stderr, "[FD: %d] Sent back to epoll\n", conn->fd);
+        return;
+    }
+
+    PROBE3(response_end, conn->fd, conn->response->start_line.response.status_code,
+           conn->output.sent_bytes - conn->head_end);
+    finish_response(conn, map, epoll_fd);
+}
+
 int
 accept_loop(int server_fd, int epoll_fd, struct conn *map)
 {
-    int client_fd;
+    int client_fd = 0;
+    struct sockaddr_storage client_addr;
+    int idle_count;
 
-    while (get_conn_map_length(map, MAX_CONNECTIONS) < MAX_CONNECTIONS) {
-        client_fd = accept_connection(server_fd);
+    while (1) {
+        bool full = get_conn_map_length(map, MAX_CONNECTIONS) >= MAX_CONNECTIONS;
+
+        // A full server makes room by closing the connection that has been idle longest
+        if (full && !keep_alive_oldest_idle(map, MAX_CONNECTIONS, &idle_count)) {
+            break;
+        }
+
+        client_fd = accept_connection(server_fd, &client_addr);
         if (client_fd == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 /* no more pending connections */
@@ -173,6 +556,13 @@ accept_loop(int server_fd, int epoll_fd, struct conn *map)
             }
         }
 
+        if (full) {
+            struct conn *idle = keep_alive_oldest_idle(map, MAX_CONNECTIONS, &idle_count);
+
+            fprintf(stderr, "Server full, closed idle connection on FD %d\n", idle->fd);
+            cleanup_connection(map, idle->fd, MAX_CONNECTIONS, epoll_fd);
+        }
+
         // Add this debug check
         if (client_fd == 0) {
             fprintf(stderr, "WARNING: accept_connection returned FD 0 (stdin)!\n");
@@ -208,6 +598,22 @@ accept_loop(int server_fd, int epoll_fd, struct conn *map)
         struct conn *client_conn = get_conn(map, client_fd, MAX_CONNECTIONS);
         set_conn_state(client_conn, IDLE);
         update_conn_time(client_conn);
+        trace_mark(&client_conn->trace, TRACE_ACCEPT);
+        PROBE2(accept, client_fd, client_addr.ss_family);
+        client_address_from_sockaddr(&client_addr, client_conn->client_address);
+
+        // A Unix socket client is on this host, there is no NIC to busy poll or network to
+        // encrypt for, and the kernel can tell us which process it is
+        if (client_addr.ss_family == AF_UNIX) {
+            get_peer_credentials(client_fd, &client_conn->credentials);
+        } else {
+            busy_poll_setup_socket(client_fd);
+
+            if (tls_accept(client_conn, epoll_fd) != 0) {
+                cleanup_connection(map, client_fd, MAX_CONNECTIONS, epoll_fd);
+                continue;
+            }
+        }
 
         fprintf(stderr, "accept_loop(): Added FD %d to server\n", client_fd);
     }
@@ -219,7 +625,7 @@ accept_loop(int server_fd, int epoll_fd, struct conn *map)
         client_fd != -1 && 
         get_conn_map_length(map, MAX_CONNECTIONS) >= MAX_CONNECTIONS
     ) {
-        client_fd = accept_connection(server_fd);
+        client_fd = accept_connection(server_fd, NULL);
         if (errno == EAGAIN || errno == EWOULDBLOCK || client_fd == -1) {
             /* no more pending connections */
             break;
@@ -229,14 +635,201 @@ accept_loop(int server_fd, int epoll_fd, struct conn *map)
         fprintf(stderr, "Server full, rejected connection on FD %d\n", client_fd);
     }
 
-    return 0;
-}
+    return 0;
+}
+
+void
+unwind_server(int sig)
+{
+    (void) sig;
+    shutdown_requested = 1;
+}
+
+/*
+    Routes SIGINT, SIGTERM, SIGUSR1 and SIGUSR2 to a signalfd, so they wake epoll_wait() like any event
+*/
+int
+setup_signalfd(void)
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        perror("sigprocmask");
+        return -1;
+    }
+
+    int signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    if (signal_fd == -1) {
+        perror("signalfd");
+    }
+
+    return signal_fd;
+}
+
+/*
+    Stops accepting and lets the open connections finish
+
+    HTTP/1 connections are closed after their next response, HTTP/2 connections get a GOAWAY,
+    WebSockets a 1001 close and SSE subscribers are dropped so they reconnect elsewhere. The loop
+    exits once no client connection is left, or after DRAIN_TIMEOUT.
+*/
+void
+start_drain(struct conn *map, int *server_fd, int *unix_fd, int epoll_fd)
+{
+    if (draining) {
+        return;
+    }
+
+    draining = true;
+    drain_deadline = time(NULL) + DRAIN_TIMEOUT;
+
+    // Connections still in the accept queue are the new process's, if there is one
+    if (*server_fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *server_fd, NULL);
+        remove_conn_from_map(map, *server_fd, MAX_CONNECTIONS);
+        *server_fd = -1;
+    }
+
+    // After an upgrade the socket file is already the new process's, otherwise it goes
+    if (*unix_fd != -1) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, *unix_fd, NULL);
+        remove_conn_from_map(map, *unix_fd, MAX_CONNECTIONS);
+        close(*unix_fd);
+        *unix_fd = -1;
+        unix_server_unlink(UNIX_SOCKET_PATH);
+    }
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        struct conn *conn = &map[i];
+
+        if (conn->fd == -1) {
+            continue;
+        }
+
+        if (conn->http2 != NULL && http2_drain(conn) < 0) {
+            cleanup_connection(map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+        } else if (conn->websocket != NULL
+                   && websocket_close(conn->websocket, WEBSOCKET_GOING_AWAY) < 0) {
+            cleanup_connection(map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+        } else if (conn->sse != NULL) {
+            cleanup_connection(map, conn->fd, MAX_CONNECTIONS, epoll_fd);
+        }
+    }
+
+    fprintf(stderr, "Draining: no longer accepting, exiting within %d seconds\n", DRAIN_TIMEOUT);
+}
+
+/*
+    Acts on the signals queued on the signalfd
+
+    SIGINT stops right away, SIGTERM drains, SIGUSR1 dumps the request trace, SIGUSR2 starts the
+    binary on disk, hands it the listening socket and drains once it is accepting.
+*/
+void
+handle_signals(int signal_fd, struct conn *map, int *server_fd, int *unix_fd, int *upgrade_fd,
+               int epoll_fd)
+{
+    struct signalfd_siginfo info;
+
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        switch (info.ssi_signo) {
+        case SIGINT:
+            unwind_server(SIGINT);
+            break;
+
+        case SIGTERM:
+            start_drain(map, server_fd, unix_fd, epoll_fd);
+            break;
+
+        case SIGUSR1:
+            trace_dump(TRACE_DUMP_PATH);
+            break;
+
+        case SIGUSR2:
+            if (draining || *upgrade_fd != -1) {
+                fprintf(stderr, "Binary upgrade already in progress\n");
+                break;
+            }
+
+            // Only the TCP listener is handed over, a Unix socket alone is just bound again
+            if (*server_fd == -1) {
+                fprintf(stderr, "Binary upgrade needs the TCP listener, still serving\n");
+                break;
+            }
+
+            *upgrade_fd = upgrade_spawn(*server_fd);
+            if (*upgrade_fd == -1) {
+                fprintf(stderr, "Binary upgrade failed, still serving\n");
+                break;
+            }
+
+            struct epoll_event ev = { 0 };
+
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = *upgrade_fd;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, *upgrade_fd, &ev) == -1) {
+                perror("epoll_ctl for upgrade socket:");
+                close(*upgrade_fd);
+                *upgrade_fd = -1;
+            }
+            break;
+        }
+    }
+}
+
+/*
+    Adds a listening socket to the connection map and epoll, nothing to do for -1
+
+    Returns 0, or -1 on failure
+*/
+int
+watch_listener(struct conn *map, int listen_fd, int epoll_fd)
+{
+    struct epoll_event ev = { 0 };
+
+    if (listen_fd == -1) {
+        return 0;
+    }
+
+    add_conn_to_map(map, listen_fd, MAX_CONNECTIONS);
+
+    fprintf(stderr, "DEBUG: Added listening FD %d to connection map\n", listen_fd);
+
+    // Set listening socket to non blocking so epoll can continue
+    int flags = fcntl(listen_fd, F_GETFL, 0);
+    if (flags == -1) {
+        perror("fcntl F_GETFL");
+        return -1;
+    }
+    if (fcntl(listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl F_SETFL");
+        remove_conn_from_map(map, listen_fd, MAX_CONNECTIONS);
+        return -1;
+    }
+
+    // Add listening socket to EPOLL
+    ev.data.fd = listen_fd;
+    ev.events = EPOLLIN | EPOLLET;
+
+    fprintf(stderr, "Adding Server FD %d to EPOLL\n", listen_fd);
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+        perror("epoll_ctl for listening socket:");
+        remove_conn_from_map(map, listen_fd, MAX_CONNECTIONS);
+        return -1;
+    }
+
+    // Exec'd upgrades must not inherit it, upgrade_spawn() passes the TCP one explicitly
+    fcntl(listen_fd, F_SETFD, FD_CLOEXEC);
 
-void
-unwind_server(int sig)
-{
-    (void) sig;
-    shutdown_requested = 1;
+    return 0;
 }
 
 int
@@ -249,66 +842,111 @@ epoll_implementation(void)
     int num_events;
 
     int epoll_fd;
-    int server_fd;
+    int server_fd; // TCP listener, or -1
+    int unix_fd;   // Unix socket listener, or -1
 
-    signal(SIGINT, unwind_server);
+    int signal_fd = setup_signalfd();
+    int upgrade_fd = -1; // Control socket to a new binary taking over, see upgrade.c
+
+    // A client hanging up mid-response must surface as EPIPE, not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
     initialize_conn_map(connection_map, MAX_CONNECTIONS);
 
-    // Setup server
-    server_fd = server_setup();
+    proxy_init();
 
-    fprintf(stderr, "DEBUG: server_setup() returned FD %d\n", server_fd);
+    static_pack_load(STATIC_PACK_PATH);
+    static_root_open();
 
-    if (server_fd == -1) {
-        fprintf(stderr, "Server setup failed.\n");
+    if (TLS_ENABLED && tls_init(TLS_CERT_FILE, TLS_KEY_FILE) != 0) {
+        fprintf(stderr, "TLS setup failed.\n");
         return -1;
     }
 
-    add_conn_to_map(connection_map, server_fd, MAX_CONNECTIONS);
-
-    fprintf(stderr, "DEBUG: Added server FD %d to connection map\n", server_fd);
-    fprintf(stderr, "DEBUG: Connection map slot 0 has FD %d\n", connection_map[0].fd);
+    // Setup server, or take over the listening socket of the process that exec'd us
+    server_fd = -1;
+    if (TCP_LISTEN_ENABLED) {
+        server_fd = upgrade_inherit_listener();
+        if (server_fd != -1) {
+            setup_sigchld_handler();
+        } else {
+            server_fd = server_setup();
+        }
 
-    // Set listening socket to non blocking so epoll can continue
-    int flags = fcntl(server_fd, F_GETFL, 0);
-    if (flags == -1) {
-        perror("fcntl F_GETFL");
-        return -1;
+        fprintf(stderr, "DEBUG: server_setup() returned FD %d\n", server_fd);
+    } else {
+        setup_sigchld_handler();
     }
-    if (fcntl(server_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("fcntl F_SETFL");
-        remove_conn_from_map(connection_map, server_fd, MAX_CONNECTIONS);
+
+    // The Unix socket is bound anew by every process, see unix_server_setup()
+    unix_fd = UNIX_SOCKET_PATH[0] != '\0' ? unix_server_setup(UNIX_SOCKET_PATH) : -1;
+
+    if (server_fd == -1 && unix_fd == -1) {
+        fprintf(stderr, "Server setup failed.\n");
         return -1;
     }
 
     // Setup EPOLL
     epoll_fd = epoll_create1(0);
 
-    // Add listening socket to EPOLL
-    ev.data.fd = server_fd;
-    ev.events = EPOLLIN | EPOLLET;
-
-    fprintf(stderr, "Adding Server FD %d to EPOLL\n", server_fd);
+    if (watch_listener(connection_map, server_fd, epoll_fd) != 0
+        || watch_listener(connection_map, unix_fd, epoll_fd) != 0) {
+        return -1;
+    }
 
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
-        perror("epoll_ctl for listening socket:");
-        remove_conn_from_map(connection_map, server_fd, MAX_CONNECTIONS);
+    ev.data.fd = signal_fd;
+    ev.events = EPOLLIN;
+    if (signal_fd != -1 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) == -1) {
+        perror("epoll_ctl for signalfd:");
         return -1;
     }
 
+    // Without a pool, blocking routes run inline
+    int offload_fd = offload_init(epoll_fd);
+
+    // We are accepting, a process that handed us the socket can drain now
+    upgrade_ready();
+
     while (1) {
 
         if (shutdown_requested) {
             break;
         }
 
-        if ((num_events = epoll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, -1)) == -1) {
+        // Paused streaming body handlers are polled, so don't block forever while any exist,
+        // and WebSocket, SSE, proxy and idle connection timers need the sweep to run while
+        // nothing happens
+        int wait_timeout = -1;
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            if (connection_map[i].fd != -1 && connection_map[i].body_paused) {
+                wait_timeout = BODY_STREAM_POLL_MS;
+                break;
+            }
+            if (connection_map[i].fd != -1
+                && (connection_map[i].websocket != NULL || connection_map[i].sse != NULL
+                    || connection_map[i].proxy != NULL
+                    || keep_alive_is_idle(&connection_map[i]))) {
+                wait_timeout = KEEPALIVE_POLL_MS;
+            }
+        }
+
+        // A draining server checks its deadline
+        if (draining && (wait_timeout == -1 || wait_timeout > KEEPALIVE_POLL_MS)) {
+            wait_timeout = KEEPALIVE_POLL_MS;
+        }
+
+        if ((num_events = busy_poll_wait(epoll_fd, events, MAX_EPOLL_EVENTS, wait_timeout))
+            == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             perror("epoll_wait: ");
             unwind_server(SIGINT);
             continue;
         };
 
+        rate_limit_tick();
+
         // Handle events
         for (int event_iter = 0; event_iter < num_events; event_iter++) {
 
@@ -319,6 +957,35 @@ epoll_implementation(void)
             fprintf(stderr, "DEBUG: Processing epoll event for FD %d, events=0x%x\n", curr_fd,
                     curr_event.events);
 
+            // Signals and the upgrade control socket are not connections
+            if (curr_fd == signal_fd) {
+                handle_signals(signal_fd, connection_map, &server_fd, &unix_fd, &upgrade_fd,
+                               epoll_fd);
+                continue;
+            }
+
+            if (curr_fd == offload_fd) {
+                resume_offloaded(connection_map, epoll_fd);
+                continue;
+            }
+
+            if (curr_fd == upgrade_fd) {
+                int ret = upgrade_wait_ready(upgrade_fd);
+
+                if (ret == 0) {
+                    continue;
+                } else if (ret == 1) {
+                    fprintf(stderr, "Binary upgrade: new process is accepting\n");
+                    start_drain(connection_map, &server_fd, &unix_fd, epoll_fd);
+                } else {
+                    fprintf(stderr, "Binary upgrade: new process exited, still serving\n");
+                }
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, upgrade_fd, NULL);
+                close(upgrade_fd);
+                upgrade_fd = -1;
+                continue;
+            }
+
             if (curr_conn == NULL) {
                 fprintf(stderr, "Unknown FD (%d) for event iter %d\n", curr_fd, event_iter);
                 // Add this debug to see if FD 0 is anywhere in the connection map
@@ -333,24 +1000,79 @@ epoll_implementation(void)
                 continue;
             }
 
-            curr_conn->action_count++;
-
             update_conn_time(curr_conn);
 
             // Recieve a new request
-            if (curr_fd == server_fd && curr_event.events & EPOLLIN) {
-                if (accept_loop(server_fd, epoll_fd, connection_map) == -1) {
+            if ((curr_fd == server_fd || curr_fd == unix_fd) && curr_event.events & EPOLLIN) {
+                // Over the soft memory limit new connections wait in the backlog
+                if (!memory_budget_accepting()) {
+                    continue;
+                }
+                if (accept_loop(curr_fd, epoll_fd, connection_map) == -1) {
                     perror("accept_loop");
                 }
                 continue;
             }
 
+            // Connections still in their TLS handshake
+            else if (curr_conn->tls != NULL) {
+                if (tls_handle_event(curr_conn, epoll_fd) < 0) {
+                    cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                }
+                continue;
+            }
+
+            // HTTP/2 connections are driven by their session
+            else if (curr_conn->http2 != NULL) {
+                if (http2_handle_event(curr_conn, curr_event.events) < 0) {
+                    cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                }
+                continue;
+            }
+
+            // Likewise WebSocket connections
+            else if (curr_conn->websocket != NULL) {
+                if (websocket_handle_event(curr_conn, curr_event.events) < 0) {
+                    cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                }
+                continue;
+            }
+
+            // And SSE subscribers
+            else if (curr_conn->sse != NULL) {
+                if (sse_handle_event(curr_conn, curr_event.events) < 0) {
+                    cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                }
+                continue;
+            }
+
+            // Upstream connections and clients waiting on them belong to the proxy
+            else if (curr_conn->upstream != NULL || curr_conn->state == PROXYING) {
+                int client_fd = -1;
+                int ret = proxy_handle_event(connection_map, MAX_CONNECTIONS, curr_conn,
+                                             curr_event.events, epoll_fd, &client_fd);
+                struct conn *client_conn = get_conn(connection_map, client_fd, MAX_CONNECTIONS);
+
+                if (client_conn == NULL || ret == PROXY_IN_PROGRESS) {
+                    continue;
+                }
+
+                if (ret == PROXY_DONE) {
+                    finish_response(client_conn, connection_map, epoll_fd);
+                } else if (ret == PROXY_BAD_GATEWAY) {
+                    build_error_response(client_conn->response, STATUS_BAD_GATEWAY, "Bad Gateway",
+                                         NULL);
+                    send_error_response(client_conn->response, client_fd, connection_map,
+                                        epoll_fd);
+                } else {
+                    cleanup_connection(connection_map, client_fd, MAX_CONNECTIONS, epoll_fd);
+                }
+                continue;
+            }
+
             // Finish a write operation
             else if (curr_event.events & EPOLLOUT) {
 
-                int ret = 0;
-                int original_state = curr_conn->state;
-
                 if (curr_conn->request == NULL) {
                     // The request should also be built
                     if (curr_conn->response == NULL) {
@@ -371,8 +1093,6 @@ epoll_implementation(void)
                     continue;
                 }
 
-                HTTP_MESSAGE *response = curr_conn->response;
-
                 switch (curr_conn->state) {
 
                 // These events do not send any data so send an error
@@ -387,73 +1107,17 @@ epoll_implementation(void)
                     send_error_response(curr_conn->response, curr_fd, connection_map, epoll_fd);
                     continue;
 
+                // Queued by resume_offloaded(), or the socket had been full
                 case SENDING_HEADERS:
-                    set_conn_state(curr_conn, SENDING_HEADERS);
-                    ret = build_and_send_headers(response, curr_fd, curr_conn->offset,
-                                                 original_state == SENDING_HEADERS, RESPONSE);
-                    if (ret < 0) {
-                        fprintf(stderr, "Failed to send HTTP headers to client\n");
-                        // Special case where we can't send an HTTP message to the client, so simply
-                        // close the fd.
-                        cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
-                        continue;
-                    } else if (ret > 0) {
-                        curr_conn->offset = ret; // build_and_send_headers() returns the number of
-                                                 // bytes read for a partial read
-                        memset(&ev, 0, sizeof(struct epoll_event));
-                        ev.events = SEND_EPOLL_FLAGS;
-                        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, curr_fd, &ev) == -1) {
-                            perror("epoll_ctl for client socket:");
-                            cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
-                            continue;
-                        }
-                        fprintf(stderr, "[FD: %d] Sent back to epoll\n", curr_fd);
-                        continue;
-                    }
                     [[fallthrough]];
-                case SENDING_BODY:
-                    set_conn_state(curr_conn, SENDING_BODY);
-                    int body_length = get_file_length(response->body_fd);
-                    if (body_length > 0) {
-                        ret = build_and_send_body(response, curr_fd);
-                        if (ret < 0) {
-                            fprintf(stderr, "Failed to send HTTP headers to client\n");
-                            // Special case where we can't send an HTTP message to the client, so
-                            // simply close the fd.
-                            cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
-                            continue;
-                        } else if (ret > 0) {
-                            memset(&ev, 0, sizeof(struct epoll_event));
-                            ev.events = SEND_EPOLL_FLAGS;
-                            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, curr_fd, &ev) == -1) {
-                                perror("epoll_ctl for client socket:");
-                                cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS,
-                                                   epoll_fd);
-                                continue;
-                            }
-                            fprintf(stderr, "[FD: %d] Sent back to epoll\n", curr_fd);
-                            continue;
-                        }
-                    }
+                // The next window is in the page cache, see send_output()
+                case WAITING_DISK:
                     [[fallthrough]];
+                case SENDING_BODY:
+                    send_response(curr_conn, connection_map, offload_fd, epoll_fd);
+                    continue;
                 default:
-                    const char *connection_header_value
-                        = get_header_value(curr_conn->request->headers,
-                                           curr_conn->request->header_count, "Connection");
-                    if (connection_header_value && strcmp(connection_header_value, "close") == 0) {
-                        cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
-                        continue;
-                    }
-
-                    memset(&ev, 0, sizeof(struct epoll_event));
-                    ev.events = RECV_EPOLL_FLAGS;
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, curr_fd, &ev) == -1) {
-                        perror("epoll_ctl for client socket:");
-                        cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
-                        continue;
-                    }
-
-                    set_conn_state(curr_conn, IDLE);
+                    continue;
                 }
             }
 
@@ -485,15 +1149,32 @@ epoll_implementation(void)
                         continue;
                     } else {
                         // Reset the buffer on reading a new request
-                        curr_conn->offset = 0;
                         memset(curr_conn->buffer, 0, 8 * KB);
+                        curr_conn->route = NULL;
+                        curr_conn->stream_state = NULL;
+                        curr_conn->body_paused = false;
+
+                        // A kept-alive connection must not carry the previous exchange over
+                        free_http_message(request);
+                        *request = init_http_message();
+                        request->arena = curr_conn->arena;
+                        free_http_message(response);
+                        *response = init_http_message();
+                        response->arena = curr_conn->arena;
+                        add_header(response, "Server", SERVER_NAME);
                     }
                     [[fallthrough]];
                 case PARSING_HEADERS:
                     set_conn_state(curr_conn, PARSING_HEADERS);
                     ret = parse_http_headers(request, curr_conn->buffer, 8 * KB, curr_fd,
                                              original_state == PARSING_HEADERS, REQUEST);
-                    if (ret < 0) {
+                    if (ret == -2) {
+                        fprintf(stderr, "[FD %d]: Client closed the connection\n", curr_fd);
+                        // Most likely between requests, so there is no request to trace
+                        trace_reset(&curr_conn->trace);
+                        cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                        continue;
+                    } else if (ret < 0) {
                         fprintf(stderr, "Failed to parse HTTP request headers\n");
                         build_error_response(response, STATUS_BAD_REQUEST, "Bad Request", NULL);
                         send_error_response(response, curr_fd, connection_map, epoll_fd);
@@ -506,100 +1187,181 @@ epoll_implementation(void)
                     [[fallthrough]];
                 case PARSING_BODY:
                     set_conn_state(curr_conn, PARSING_BODY);
-                    ret = parse_http_body(request, curr_conn->buffer, 8 * KB, curr_fd,
-                                          original_state == PARSING_BODY);
-                    if (ret < 0) {
-                        fprintf(stderr, "Failed to parse HTTP request body\n");
-                        build_error_response(response, STATUS_BAD_REQUEST, "Bad Request", NULL);
-                        send_error_response(response, curr_fd, connection_map, epoll_fd);
-                        continue;
-                    } else if (ret > 0) {
-                        // Send back to epoll
-                        fprintf(stderr, "[FD: %d] Sent back to epoll\n", curr_fd);
+
+                    // Switch to HTTP/2 on the connection preface or an "Upgrade: h2c" request
+                    if (original_state != PARSING_BODY
+                        && (http2_is_preface(request) || http2_is_upgrade(request))) {
+                        if (http2_start(curr_conn, epoll_fd, http2_is_upgrade(request),
+                                        server_router)
+                            != 0) {
+                            cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                        }
                         continue;
                     }
 
-                    // Print HTTP Request for DEBUG purposes
-                    print_http_message(request, REQUEST);
+                    // HTTP/2 streams are charged one by one in dispatch_stream()
+                    if (original_state != PARSING_BODY) {
+                        curr_conn->requests++;
+                        // A pipelined request read with this one cannot be served, see keep_alive.c
+                        curr_conn->read_ahead
+                            = request->buffered_length > MAX(get_content_length(request), 0);
 
-                    if (server_router(request, response) != 0) {
-                        fprintf(stderr, "Failed to parse HTTP request\n");
-                        // error response is built inside the server router
-                        send_error_response(response, curr_fd, connection_map, epoll_fd);
+                        int retry_after = rate_limit_take(curr_conn->client_address);
+
+                        if (retry_after > 0) {
+                            char retry_after_str[16];
+
+                            snprintf(retry_after_str, sizeof(retry_after_str), "%d", retry_after);
+                            build_error_response(response, STATUS_TOO_MANY_REQUESTS,
+                                                 "Too Many Requests", NULL);
+                            add_header(response, "Retry-After", retry_after_str);
+                            add_header(response, "Server", SERVER_NAME);
+                            send_error_response(response, curr_fd, connection_map, epoll_fd);
+                            continue;
+                        }
+                    }
+
+                    if (original_state != PARSING_BODY) {
+                        request->credentials = curr_conn->credentials;
+                        curr_conn->route = find_route(request->start_line.request.request_target,
+                                                      request->start_line.request.method);
+                    }
+
+                    // A refused body is answered before it is read
+                    if (original_state != PARSING_BODY
+                        && admit_request_body(curr_conn, connection_map, epoll_fd) != 0) {
                         continue;
-                    };
+                    }
 
-                    // Print the built HTTP Response for DEBUG purposes
-                    print_http_message(response, RESPONSE);
-                    [[fallthrough]];
-                case SENDING_HEADERS:
-                    set_conn_state(curr_conn, SENDING_HEADERS);
-                    ret = build_and_send_headers(response, curr_fd, curr_conn->offset,
-                                                 original_state == SENDING_HEADERS, RESPONSE);
-                    if (ret < 0) {
-                        fprintf(stderr, "Failed to send HTTP headers to client\n");
-                        // Special case where we can't send an HTTP message to the client, so simply
-                        // close the fd.
-                        cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                    if (original_state != PARSING_BODY && curr_conn->route
+                        && curr_conn->route->websocket && websocket_is_upgrade(request)) {
+                        if (websocket_start(curr_conn, epoll_fd, curr_conn->route->websocket)
+                            != 0) {
+                            cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                        }
                         continue;
-                    } else if (ret > 0) {
-                        curr_conn->offset = ret; // build_and_send_headers() returns the number of
-                                                 // bytes read for a partial read
-                        memset(&ev, 0, sizeof(struct epoll_event));
-                        ev.events = SEND_EPOLL_FLAGS;
-                        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, curr_fd, &ev) == -1) {
-                            perror("epoll_ctl for client socket:");
+                    }
+
+                    char channel[SSE_MAX_CHANNEL_NAME];
+
+                    if (original_state != PARSING_BODY && curr_conn->route && curr_conn->route->sse
+                        && route_allows_method(curr_conn->route,
+                                               request->start_line.request.method)
+                        && sse_channel_name(request->start_line.request.request_target, channel)
+                        && sse_can_subscribe(channel)) {
+                        if (sse_subscribe(curr_conn, epoll_fd, channel) != 0) {
                             cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
-                            continue;
                         }
-                        fprintf(stderr, "[FD: %d] Sent back to epoll\n", curr_fd);
                         continue;
                     }
-                    [[fallthrough]];
-                case SENDING_BODY:
-                    set_conn_state(curr_conn, SENDING_BODY);
-                    int body_length = get_file_length(response->body_fd);
-                    if (body_length > 0) {
-                        ret = build_and_send_body(response, curr_fd);
+
+                    if (is_stream_route(curr_conn)) {
+                        ret = parse_http_body_chunks(request, curr_conn->buffer, 8 * KB, curr_fd,
+                                                     stream_body_chunk, curr_conn);
+                        if (ret == -6) {
+                            fprintf(stderr, "Streaming body handler rejected the request\n");
+                            // error response is built inside the handler
+                            send_error_response(response, curr_fd, connection_map, epoll_fd);
+                            continue;
+                        } else if (ret < 0) {
+                            fprintf(stderr, "Failed to parse HTTP request body\n");
+                            build_error_response(response, STATUS_BAD_REQUEST, "Bad Request",
+                                                 NULL);
+                            send_error_response(response, curr_fd, connection_map, epoll_fd);
+                            continue;
+                        } else if (ret == 2) {
+                            if (pause_body_stream(curr_conn, epoll_fd) != 0) {
+                                cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS,
+                                                   epoll_fd);
+                            }
+                            continue;
+                        } else if (ret > 0) {
+                            // Send back to epoll
+                            fprintf(stderr, "[FD: %d] Sent back to epoll\n", curr_fd);
+                            continue;
+                        }
+
+                        trace_mark(&curr_conn->trace, TRACE_BODY_COMPLETE);
+                        print_http_message(request, REQUEST);
+
+                        if (curr_conn->route->stream_handler(request, response, BODY_STREAM_END,
+                                                             NULL, 0, &curr_conn->stream_state)
+                            < 0) {
+                            fprintf(stderr, "Streaming body handler failed\n");
+                            send_error_response(response, curr_fd, connection_map, epoll_fd);
+                            continue;
+                        }
+                    } else {
+                        ret = parse_http_body(request, curr_conn->buffer, 8 * KB, curr_fd,
+                                              original_state == PARSING_BODY,
+                                              curr_conn->pipe_fds);
                         if (ret < 0) {
-                            fprintf(stderr, "Failed to send HTTP headers to client\n");
-                            // Special case where we can't send an HTTP message to the client, so
-                            // simply close the fd.
-                            cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
+                            fprintf(stderr, "Failed to parse HTTP request body\n");
+                            build_error_response(response, STATUS_BAD_REQUEST, "Bad Request",
+                                                 NULL);
+                            send_error_response(response, curr_fd, connection_map, epoll_fd);
                             continue;
                         } else if (ret > 0) {
-                            memset(&ev, 0, sizeof(struct epoll_event));
-                            ev.events = SEND_EPOLL_FLAGS;
-                            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, curr_fd, &ev) == -1) {
-                                perror("epoll_ctl for client socket:");
+                            // Send back to epoll
+                            fprintf(stderr, "[FD: %d] Sent back to epoll\n", curr_fd);
+                            continue;
+                        }
+
+                        trace_mark(&curr_conn->trace, TRACE_BODY_COMPLETE);
+
+                        // Print HTTP Request for DEBUG purposes
+                        print_http_message(request, REQUEST);
+
+                        if (curr_conn->route && curr_conn->route->upstream) {
+                            ret = proxy_start(connection_map, MAX_CONNECTIONS, curr_conn,
+                                              find_upstream(curr_conn->route->upstream), epoll_fd);
+                            if (ret == PROXY_BAD_GATEWAY) {
+                                build_error_response(response, STATUS_BAD_GATEWAY, "Bad Gateway",
+                                                     NULL);
+                                send_error_response(response, curr_fd, connection_map, epoll_fd);
+                            } else if (ret == PROXY_FAILED) {
                                 cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS,
                                                    epoll_fd);
-                                continue;
                             }
-                            fprintf(stderr, "[FD: %d] Sent back to epoll\n", curr_fd);
                             continue;
                         }
-                    }
-                    [[fallthrough]];
-                default:
-                    const char *connection_header_value
-                        = get_header_value(curr_conn->request->headers,
-                                           curr_conn->request->header_count, "Connection");
-                    if (connection_header_value && strcmp(connection_header_value, "close") == 0) {
-                        fprintf(stderr, "[FD %d]: Closed connection\n", curr_fd);
-                        cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
-                        continue;
+
+                        if (curr_conn->route && curr_conn->route->blocking && offload_fd != -1) {
+                            if (offload_submit(curr_conn, server_router, WAITING_HANDLER, epoll_fd)
+                                != 0) {
+                                build_error_response(response, STATUS_SERVICE_UNAVAILABLE,
+                                                     "Service Unavailable", NULL);
+                                send_error_response(response, curr_fd, connection_map, epoll_fd);
+                            }
+                            continue;
+                        }
+
+                        if (server_router(request, response) != 0) {
+                            fprintf(stderr, "Failed to parse HTTP request\n");
+                            // error response is built inside the server router
+                            send_error_response(response, curr_fd, connection_map, epoll_fd);
+                            continue;
+                        };
                     }
 
-                    memset(&ev, 0, sizeof(struct epoll_event));
-                    ev.events = RECV_EPOLL_FLAGS;
-                    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, curr_fd, &ev) == -1) {
-                        perror("epoll_ctl for client socket:");
+                    keep_alive_add_headers(curr_conn, response, draining);
+
+                    // Print the built HTTP Response for DEBUG purposes
+                    print_http_message(response, RESPONSE);
+
+                    if (queue_response(curr_conn) != 0) {
+                        fprintf(stderr, "Failed to queue HTTP response\n");
                         cleanup_connection(connection_map, curr_fd, MAX_CONNECTIONS, epoll_fd);
                         continue;
                     }
-
-                    set_conn_state(curr_conn, IDLE);
+                    [[fallthrough]];
+                case SENDING_HEADERS:
+                    [[fallthrough]];
+                case SENDING_BODY:
+                    send_response(curr_conn, connection_map, offload_fd, epoll_fd);
+                    continue;
+                default:
+                    continue;
                 }
             }
 
@@ -629,8 +1391,9 @@ epoll_implementation(void)
             time_t now = time(NULL);
             int ret;
 
-            // Keep the server fd alive
-            if (connection_map[i].fd == server_fd) {
+            // Keep the listeners alive, upstream connections are the proxy's business
+            if (connection_map[i].fd == server_fd || connection_map[i].fd == unix_fd
+                || connection_map[i].upstream != NULL) {
                 continue;
             }
 
@@ -638,28 +1401,81 @@ epoll_implementation(void)
                 continue;
             }
 
-            if (now - connection_map[i].last_activity > TIMEOUT_LIMIT) {
+            // The offload pool owns the messages until the handler returns
+            if (connection_map[i].offload != NULL) {
+                continue;
+            }
 
-                if (connection_map[i].response == NULL) {
-                    shallow_copy_http_message_to_conn(&connection_map[i], init_http_message(),
-                                                      RESPONSE);
+            // A proxied request waits on its upstream, which has its own limit
+            if (connection_map[i].proxy != NULL) {
+                ret = proxy_check_timeout(connection_map, MAX_CONNECTIONS, &connection_map[i],
+                                          now, epoll_fd);
+                if (ret == PROXY_GATEWAY_TIMEOUT) {
+                    build_error_response(connection_map[i].response, STATUS_GATEWAY_TIMEOUT,
+                                         "Gateway Timeout", NULL);
+                    send_error_response(connection_map[i].response, connection_map[i].fd,
+                                        connection_map, epoll_fd);
+                } else if (ret == PROXY_FAILED) {
+                    cleanup_connection(connection_map, connection_map[i].fd, MAX_CONNECTIONS,
+                                       epoll_fd);
                 }
+                continue;
+            }
 
-                build_error_response(connection_map[i].response, STATUS_REQUEST_TIMEOUT,
-                                     "Request Timeout", NULL);
-                add_header(connection_map[i].response, "Server", SERVER_NAME);
-                add_header(connection_map[i].response, "Connection", "close");
+            // An HTTP/2 connection carries many requests, so only its idle time is limited
+            if (connection_map[i].http2 != NULL) {
+                if (connection_map[i].body_paused
+                    && http2_resume_streams(&connection_map[i]) < 0) {
+                    fprintf(stderr, "HTTP/2 streaming body handler failed while paused\n");
+                    cleanup_connection(connection_map, connection_map[i].fd, MAX_CONNECTIONS,
+                                       epoll_fd);
+                } else if (now - connection_map[i].last_activity > TIMEOUT_LIMIT) {
+                    cleanup_connection(connection_map, connection_map[i].fd, MAX_CONNECTIONS,
+                                       epoll_fd);
+                }
+                continue;
+            }
 
-                ret = send_error_response(connection_map[i].response, connection_map[i].fd,
-                                          connection_map, epoll_fd);
-                if (ret < 0) {
-                    fprintf(stderr, "Failed to send HTTP response to client successfully\n");
+            // WebSockets are long-lived, only their keep-alive timers apply
+            if (connection_map[i].websocket != NULL) {
+                if (websocket_check_timeout(&connection_map[i], now) < 0) {
+                    cleanup_connection(connection_map, connection_map[i].fd, MAX_CONNECTIONS,
+                                       epoll_fd);
+                }
+                continue;
+            }
+
+            // Subscribers only get keep-alive comments
+            if (connection_map[i].sse != NULL) {
+                if (sse_check_timeout(&connection_map[i], now) < 0) {
+                    cleanup_connection(connection_map, connection_map[i].fd, MAX_CONNECTIONS,
+                                       epoll_fd);
                 }
+                continue;
+            }
 
-                cleanup_connection(connection_map, connection_map[i].fd, MAX_CONNECTIONS, epoll_fd);
+            // Waiting for the next request is not a slow request, the connection just goes
+            if (keep_alive_is_idle(&connection_map[i])) {
+                if (now - connection_map[i].last_activity >= KEEP_ALIVE_TIMEOUT) {
+                    fprintf(stderr, "[FD %d]: Closed idle connection\n", connection_map[i].fd);
+                    cleanup_connection(connection_map, connection_map[i].fd, MAX_CONNECTIONS,
+                                       epoll_fd);
+                }
+                continue;
             }
 
-            else if (connection_map[i].action_count >= ACTIONS_LIMIT) {
+            if (connection_map[i].body_paused) {
+                if (resume_body_stream(&connection_map[i], epoll_fd) < 0) {
+                    fprintf(stderr, "Streaming body handler failed while paused\n");
+                    send_error_response(connection_map[i].response, connection_map[i].fd,
+                                        connection_map, epoll_fd);
+                    continue;
+                }
+                // A paused upload is not an idle one
+                update_conn_time(&connection_map[i]);
+            }
+
+            if (now - connection_map[i].last_activity > TIMEOUT_LIMIT) {
 
                 if (connection_map[i].response == NULL) {
                     shallow_copy_http_message_to_conn(&connection_map[i], init_http_message(),
@@ -680,14 +1496,70 @@ epoll_implementation(void)
                 cleanup_connection(connection_map, connection_map[i].fd, MAX_CONNECTIONS, epoll_fd);
             }
         }
+
+        // Idle connections past the budget go, the ones that waited longest first
+        int idle_count;
+        struct conn *idle;
+
+        while ((idle = keep_alive_oldest_idle(connection_map, MAX_CONNECTIONS, &idle_count))
+               && idle_count > KEEP_ALIVE_IDLE_BUDGET) {
+            fprintf(stderr, "[FD %d]: Closed idle connection over budget\n", idle->fd);
+            cleanup_connection(connection_map, idle->fd, MAX_CONNECTIONS, epoll_fd);
+        }
+
+        bool was_accepting = memory_budget_accepting();
+
+        memory_budget_update(connection_map, MAX_CONNECTIONS, epoll_fd);
+
+        // The listeners are edge-triggered, so take what queued up while accepts were stopped
+        if (!was_accepting && memory_budget_accepting()) {
+            if ((server_fd != -1 && accept_loop(server_fd, epoll_fd, connection_map) == -1)
+                || (unix_fd != -1 && accept_loop(unix_fd, epoll_fd, connection_map) == -1)) {
+                perror("accept_loop");
+            }
+        }
+
+        // A draining server is done once its clients are, pooled upstreams don't count
+        if (draining) {
+            int clients = 0;
+
+            for (int i = 0; i < MAX_CONNECTIONS; i++) {
+                if (connection_map[i].fd != -1 && connection_map[i].upstream == NULL) {
+                    clients++;
+                }
+            }
+
+            if (clients == 0) {
+                fprintf(stderr, "Draining: all connections finished\n");
+                break;
+            } else if (time(NULL) >= drain_deadline) {
+                fprintf(stderr, "Draining: deadline passed, closing %d connections\n", clients);
+                break;
+            }
+        }
     }
 
-    // Cleanup code
+    busy_poll_print_stats();
+
+    // Cleanup code, handlers still running on the pool finish first
+    offload_shutdown();
     free_conn_map(connection_map, MAX_CONNECTIONS);
+    tls_cleanup();
+    static_pack_unload();
+    static_root_close();
+    file_cache_clear();
+    if (upgrade_fd != -1)
+        close(upgrade_fd);
+    if (signal_fd != -1)
+        close(signal_fd);
     if (epoll_fd != -1)
         close(epoll_fd);
     if (server_fd != -1)
         close(server_fd);
+    if (unix_fd != -1) {
+        close(unix_fd);
+        unix_server_unlink(UNIX_SOCKET_PATH);
+    }
 
     return 0;
 }
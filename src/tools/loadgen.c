@@ -0,0 +1,361 @@
+/*
+** loadgen.c -- measures request latency against a running server
+**
+** Usage: loadgen [-c connections] [-n requests] [-r rate] [-p path] [-u socket] [host [port]]
+**
+** Each connection is a thread sending GET requests one at a time, reconnecting whenever the
+** server closes. With -r, every connection sends at a fixed rate and latency is measured from
+** when each request was due, so a stalled server shows up in the tail instead of slowing the
+** client down with it. Prints throughput and latency percentiles.
+**
+** With -u, connects to the server's Unix socket (UNIX_SOCKET_PATH) instead of host and port.
+** Running the same workload both ways compares loopback TCP with a Unix socket, e.g.
+**     Build/loadgen -c 4 -n 20000 127.0.0.1 8080
+**     Build/loadgen -c 4 -n 20000 -u Build/server.sock
+**
+** Turn RATE_LIMIT_ENABLED off in macros.h first, every connection comes from the same address.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RESPONSE_BUFFER_SIZE (256 * 1024)
+
+struct worker
+{
+    pthread_t thread;
+    long *latencies; // Nanoseconds, one per completed request
+    long completed;
+    long errors; // Failed exchanges and non-2xx responses
+    long reconnects;
+};
+
+static const char *host = "127.0.0.1";
+static const char *port = "8080";
+static const char *path = "/";
+static int connections = 8;
+static long requests = 10000; // Per connection
+static double rate = 0;       // Requests per second per connection, 0 for back-to-back
+static const char *unix_path = NULL;
+static struct addrinfo *server_addr = NULL;
+static struct sockaddr_un unix_addr = { .sun_family = AF_UNIX };
+static struct addrinfo unix_info = { .ai_family = AF_UNIX, .ai_socktype = SOCK_STREAM };
+
+static long
+now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void
+sleep_until(long deadline)
+{
+    struct timespec ts = { .tv_sec = deadline / 1000000000L, .tv_nsec = deadline % 1000000000L };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int
+open_connection(void)
+{
+    int fd = socket(server_addr->ai_family, server_addr->ai_socktype, server_addr->ai_protocol);
+    int yes = 1;
+
+    if (fd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    if (connect(fd, server_addr->ai_addr, server_addr->ai_addrlen) == -1) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+
+    if (server_addr->ai_family != AF_UNIX) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    return fd;
+}
+
+/*
+    Sends one request and reads its response
+
+    Returns the status code, or -1 on failure. Sets *keep_alive when the connection can be reused
+*/
+static int
+exchange(int fd, const char *request, int request_length, char *buf, bool *keep_alive)
+{
+    int sent = 0;
+
+    while (sent < request_length) {
+        ssize_t n = send(fd, request + sent, request_length - sent, MSG_NOSIGNAL);
+
+        if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+
+    int received = 0;
+    char *header_end = NULL;
+
+    while (!header_end) {
+        ssize_t n = recv(fd, buf + received, RESPONSE_BUFFER_SIZE - 1 - received, 0);
+
+        if (n <= 0) {
+            return -1;
+        }
+        received += n;
+        buf[received] = '\0';
+        header_end = strstr(buf, "\r\n\r\n");
+    }
+
+    int status = -1;
+    long content_length = -1;
+
+    *keep_alive = strncmp(buf, "HTTP/1.1", 8) == 0;
+    sscanf(buf, "HTTP/%*s %d", &status);
+
+    for (char *line = strstr(buf, "\r\n"); line && line < header_end;
+         line = strstr(line + 2, "\r\n")) {
+        if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+            content_length = strtol(line + 17, NULL, 10);
+        } else if (strncasecmp(line + 2, "Connection: close", 17) == 0) {
+            *keep_alive = false;
+        }
+    }
+
+    long body_received = received - (header_end + 4 - buf);
+
+    // Without a length the body runs until the server closes
+    if (content_length < 0) {
+        *keep_alive = false;
+    }
+
+    while (content_length < 0 || body_received < content_length) {
+        ssize_t n = recv(fd, buf, RESPONSE_BUFFER_SIZE, 0);
+
+        if (n == 0 && content_length < 0) {
+            break;
+        } else if (n <= 0) {
+            return -1;
+        }
+        body_received += n;
+    }
+
+    return status;
+}
+
+static void *
+run_worker(void *arg)
+{
+    struct worker *worker = arg;
+    char request[1024];
+    char *buf = malloc(RESPONSE_BUFFER_SIZE);
+    int request_length = snprintf(request, sizeof(request),
+                                  "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n\r\n",
+                                  path, host);
+    long interval = rate > 0 ? (long) (1000000000.0 / rate) : 0;
+    long due = now_ns();
+    int fd = -1;
+
+    if (!buf) {
+        perror("malloc");
+        return NULL;
+    }
+
+    for (long i = 0; i < requests; i++) {
+        if (interval > 0) {
+            due += interval;
+            sleep_until(due);
+        } else {
+            due = now_ns();
+        }
+
+        if (fd == -1) {
+            fd = open_connection();
+            worker->reconnects++;
+            if (fd == -1) {
+                worker->errors++;
+                continue;
+            }
+        }
+
+        bool keep_alive = false;
+        int status = exchange(fd, request, request_length, buf, &keep_alive);
+
+        if (status < 200 || status > 299) {
+            worker->errors++;
+        } else {
+            worker->latencies[worker->completed++] = now_ns() - due;
+        }
+
+        if (status < 0 || !keep_alive) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    if (fd != -1) {
+        close(fd);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int
+compare_longs(const void *a, const void *b)
+{
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(const long *sorted, long count, double p)
+{
+    long index = (long) (p / 100.0 * (count - 1) + 0.5);
+
+    return sorted[index] / 1000.0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:n:r:p:u:")) != -1) {
+        switch (opt) {
+        case 'c':
+            connections = atoi(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'p':
+            path = optarg;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-c connections] [-n requests] [-r rate] [-p path] [-u socket] "
+                    "[host [port]]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind < argc) {
+        host = argv[optind++];
+    }
+    if (optind < argc) {
+        port = argv[optind++];
+    }
+
+    if (connections <= 0 || requests <= 0) {
+        fprintf(stderr, "Connections and requests must be positive\n");
+        return 1;
+    }
+
+    if (unix_path) {
+        if (strlen(unix_path) >= sizeof(unix_addr.sun_path)) {
+            fprintf(stderr, "Socket path %s is too long\n", unix_path);
+            return 1;
+        }
+        strcpy(unix_addr.sun_path, unix_path);
+        unix_info.ai_addr = (struct sockaddr *) &unix_addr;
+        unix_info.ai_addrlen = sizeof(unix_addr);
+        server_addr = &unix_info;
+    } else {
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        int ret = getaddrinfo(host, port, &hints, &server_addr);
+
+        if (ret != 0) {
+            fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+            return 1;
+        }
+    }
+
+    struct worker *workers = calloc(connections, sizeof(struct worker));
+
+    if (!workers) {
+        perror("calloc");
+        return 1;
+    }
+
+    long start = now_ns();
+
+    for (int i = 0; i < connections; i++) {
+        workers[i].latencies = malloc(requests * sizeof(long));
+        if (!workers[i].latencies
+            || pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Failed to start connection %d\n", i);
+            return 1;
+        }
+    }
+
+    long completed = 0;
+    long errors = 0;
+    long reconnects = 0;
+
+    for (int i = 0; i < connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        reconnects += workers[i].reconnects;
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    long *all = malloc((completed ? completed : 1) * sizeof(long));
+    long count = 0;
+
+    for (int i = 0; i < connections && all; i++) {
+        memcpy(all + count, workers[i].latencies, workers[i].completed * sizeof(long));
+        count += workers[i].completed;
+        free(workers[i].latencies);
+    }
+
+    printf("%ld requests in %.2fs (%.0f/s), %ld errors, %ld connections opened\n", completed,
+           elapsed, completed / elapsed, errors, reconnects);
+
+    if (all && count > 0) {
+        qsort(all, count, sizeof(long), compare_longs);
+        printf("latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               percentile_us(all, count, 50), percentile_us(all, count, 90),
+               percentile_us(all, count, 99), percentile_us(all, count, 99.9),
+               all[count - 1] / 1000.0);
+    }
+
+    free(all);
+    free(workers);
+    if (!unix_path) {
+        freeaddrinfo(server_addr);
+    }
+    return errors > 0;
+}
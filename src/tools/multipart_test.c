@@ -0,0 +1,204 @@
+/*
+** multipart_test.c -- checks the streaming multipart/form-data parser against split bodies
+**
+** Usage: multipart_test
+**
+** Feeds each body in one piece, one byte at a time, and split at every pair of offsets, and
+** checks that the same parts come out every time. Exits non-zero when any split differs.
+*/
+
+#define _GNU_SOURCE
+
+#include "multipart.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRANSCRIPT_SIZE 4096
+
+// The 70 characters RFC 2046 allows, and all of them but the last
+#define LONGEST_BOUNDARY_PREFIX                                                                    \
+    "012345678901234567890123456789012345678901234567890123456789012345678"
+#define LONGEST_BOUNDARY LONGEST_BOUNDARY_PREFIX "9"
+
+/*
+    A body, its boundary, and the parts it holds as "name:filename=contents;" entries
+*/
+struct test_case
+{
+    const char *title;
+    const char *boundary;
+    const char *body;
+    const char *parts;
+};
+
+static const struct test_case cases[] = {
+    { "delimiter starting after a '\\r' in contents", "XXXXXXXXXX",
+      "--XXXXXXXXXX\r\n"
+      "Content-Disposition: form-data; name=\"a\"\r\n\r\n"
+      "hello\rB\r\n"
+      "--XXXXXXXXXX\r\n"
+      "Content-Disposition: form-data; name=\"b\"; filename=\"b.txt\"\r\n"
+      "Content-Type: text/plain\r\n\r\n"
+      "\r\r\n--XXX\r\n--XXXXXXXXX\r\r\n--XXXXXXXXXY\r\n"
+      "--XXXXXXXXXX--\r\n",
+      "a:=hello\rB;b:b.txt=\r\r\n--XXX\r\n--XXXXXXXXX\r\r\n--XXXXXXXXXY;" },
+    { "preamble, transport padding and epilogue", "b0undary",
+      "preamble \r\n--b0undar\r\n"
+      "--b0undary \t\r\n"
+      "Content-Disposition: form-data; name=\"empty\"\r\n\r\n"
+      "\r\n--b0undary\r\n"
+      "Content-Disposition: form-data; name=\"x\"\r\n\r\n"
+      "\r\n\r\n\r\r\r\n"
+      "--b0undary--epilogue \r\n--b0undary\r\n",
+      "empty:=;x:=\r\n\r\n\r\r;" },
+    { "longest boundary", LONGEST_BOUNDARY,
+      "--" LONGEST_BOUNDARY "\r\n"
+      "Content-Disposition: form-data; name=\"long\"\r\n\r\n"
+      "\r\n--" LONGEST_BOUNDARY_PREFIX "\r\r\n"
+      "--" LONGEST_BOUNDARY "--\r\n",
+      "long:=\r\n--" LONGEST_BOUNDARY_PREFIX "\r;" },
+};
+
+#define CASE_COUNT (sizeof(cases) / sizeof(cases[0]))
+
+struct transcript
+{
+    char text[TRANSCRIPT_SIZE];
+    size_t length;
+};
+
+static int
+append(struct transcript *transcript, const char *data, size_t length)
+{
+    if (transcript->length + length >= sizeof(transcript->text)) {
+        return -1;
+    }
+
+    memcpy(transcript->text + transcript->length, data, length);
+    transcript->length += length;
+    transcript->text[transcript->length] = '\0';
+    return 0;
+}
+
+static int
+on_begin(void *ctx, struct multipart_part *part)
+{
+    struct transcript *transcript = ctx;
+
+    if (append(transcript, part->name, strlen(part->name)) != 0 || append(transcript, ":", 1) != 0
+        || append(transcript, part->filename, strlen(part->filename)) != 0) {
+        return -1;
+    }
+    return append(transcript, "=", 1);
+}
+
+static int
+on_data(void *ctx, struct multipart_part *part, const char *data, int length)
+{
+    (void) part;
+    return append(ctx, data, length);
+}
+
+static int
+on_end(void *ctx, struct multipart_part *part)
+{
+    (void) part;
+    return append(ctx, ";", 1);
+}
+
+/*
+    Parses body fed as the pieces between the given offsets into transcript
+
+    Returns 0, or -1 when the parser failed or the body did not end
+*/
+static int
+parse_split(const struct test_case *test, const size_t *splits, int split_count,
+            struct transcript *transcript)
+{
+    static struct multipart_parser parser;
+    struct multipart_callbacks callbacks = { on_begin, on_data, on_end, transcript };
+    size_t length = strlen(test->body);
+    size_t from = 0;
+
+    transcript->length = 0;
+    transcript->text[0] = '\0';
+
+    if (multipart_init(&parser, test->boundary, &callbacks) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i <= split_count; i++) {
+        size_t to = i < split_count ? splits[i] : length;
+
+        if (multipart_feed(&parser, test->body + from, (int) (to - from)) != 0) {
+            return -1;
+        }
+        from = to;
+    }
+
+    return multipart_finish(&parser);
+}
+
+static bool
+check(const struct test_case *test, const size_t *splits, int split_count)
+{
+    struct transcript transcript;
+
+    if (parse_split(test, splits, split_count, &transcript) == 0
+        && strcmp(transcript.text, test->parts) == 0) {
+        return true;
+    }
+
+    fprintf(stderr, "FAIL %s: split at", test->title);
+    for (int i = 0; i < split_count; i++) {
+        fprintf(stderr, " %zu", splits[i]);
+    }
+    fprintf(stderr, "\n");
+    return false;
+}
+
+int
+main(void)
+{
+    int failed = 0;
+
+    for (size_t c = 0; c < CASE_COUNT; c++) {
+        const struct test_case *test = &cases[c];
+        size_t length = strlen(test->body);
+        size_t *bytes = malloc(length * sizeof(*bytes));
+        size_t splits[2];
+        long runs = 0;
+
+        if (!bytes) {
+            perror("malloc");
+            return 1;
+        }
+
+        failed += !check(test, NULL, 0);
+
+        for (size_t i = 0; i < length; i++) {
+            bytes[i] = i + 1;
+        }
+        failed += !check(test, bytes, (int) length - 1);
+        free(bytes);
+
+        for (splits[0] = 1; splits[0] < length; splits[0]++) {
+            for (splits[1] = splits[0]; splits[1] < length; splits[1]++) {
+                failed += !check(test, splits, 2);
+                runs++;
+            }
+        }
+
+        printf("%s: %ld splits\n", test->title, runs + 2);
+    }
+
+    if (failed > 0) {
+        printf("%d failed\n", failed);
+        return 1;
+    }
+
+    printf("All passed\n");
+    return 0;
+}
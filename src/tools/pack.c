@@ -0,0 +1,320 @@
+/*
+** pack.c -- bundles the static directory into one indexed pack file
+**
+** Usage: pack <static directory> <pack file>
+**
+** Each file gets its Content-Type, an ETag and its response headers rendered ahead of time, and
+** a gzip variant when that makes it smaller. The server maps the result, see static_pack.c.
+*/
+
+#define _GNU_SOURCE
+
+#include "http_lib.h"
+#include "pack.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MAX_PACK_FILES 4096
+#define GZIP_MIN_SAVING 64 // Bytes a gzip variant must save to be worth a second copy
+
+struct pack_file
+{
+    char *path; // Relative to the static directory
+    char *body;
+    size_t body_length;
+    char *gzip_body;
+    size_t gzip_length;
+    char mime_type[128];
+    char etag[24];
+    struct pack_entry entry;
+};
+
+static struct pack_file files[MAX_PACK_FILES];
+static int file_count = 0;
+static size_t root_length = 0;
+
+/*
+    Reads a whole file into memory
+*/
+static char *
+read_file(const char *path, size_t length)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd == -1) {
+        perror(path);
+        return NULL;
+    }
+
+    char *data = malloc(length ? length : 1);
+    size_t done = 0;
+
+    while (data && done < length) {
+        ssize_t n = read(fd, data + done, length - done);
+
+        if (n <= 0) {
+            perror(path);
+            free(data);
+            data = NULL;
+            break;
+        }
+        done += n;
+    }
+
+    close(fd);
+    return data;
+}
+
+/*
+    Compresses a body into a gzip member, returns NULL if it does not shrink enough
+*/
+static char *
+gzip_body(const char *body, size_t length, size_t *gzip_length)
+{
+    z_stream stream = { 0 };
+    size_t capacity = deflateBound(&stream, length) + 32;
+    char *out = malloc(capacity);
+
+    if (!out) {
+        return NULL;
+    }
+
+    // 15 window bits + 16 selects the gzip wrapper
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY)
+        != Z_OK) {
+        free(out);
+        return NULL;
+    }
+
+    stream.next_in = (Bytef *) body;
+    stream.avail_in = length;
+    stream.next_out = (Bytef *) out;
+    stream.avail_out = capacity;
+
+    int ret = deflate(&stream, Z_FINISH);
+
+    *gzip_length = stream.total_out;
+    deflateEnd(&stream);
+
+    if (ret != Z_STREAM_END || *gzip_length + GZIP_MIN_SAVING > length) {
+        free(out);
+        return NULL;
+    }
+
+    return out;
+}
+
+static int
+add_file(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void) ftw;
+
+    if (type != FTW_F || !S_ISREG(st->st_mode)) {
+        return 0;
+    }
+
+    if (file_count == MAX_PACK_FILES) {
+        fprintf(stderr, "More than %d files, skipping %s\n", MAX_PACK_FILES, path);
+        return 0;
+    }
+
+    struct pack_file *file = &files[file_count];
+
+    file->path = strdup(path + root_length);
+    file->body_length = st->st_size;
+    file->body = read_file(path, file->body_length);
+
+    if (!file->path || !file->body) {
+        return -1;
+    }
+
+    if (get_content_type_from_path(file->path, file->mime_type, sizeof(file->mime_type)) != 0) {
+        snprintf(file->mime_type, sizeof(file->mime_type), "application/octet-stream");
+    }
+
+    snprintf(file->etag, sizeof(file->etag), "\"%016" PRIx64 "\"",
+             pack_hash(file->body, file->body_length));
+
+    file->gzip_body = gzip_body(file->body, file->body_length, &file->gzip_length);
+
+    file_count++;
+    return 0;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+    uint64_t x = ((const struct pack_file *) a)->entry.hash;
+    uint64_t y = ((const struct pack_file *) b)->entry.hash;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+    Appends bytes to the data section, returns where they went
+*/
+static struct pack_span
+append(FILE *out, uint64_t *offset, const void *data, size_t length, size_t alignment)
+{
+    static const char zeros[PACK_ALIGNMENT] = { 0 };
+    size_t padding = (alignment - *offset % alignment) % alignment;
+
+    fwrite(zeros, 1, padding, out);
+    *offset += padding;
+
+    struct pack_span span = { .offset = *offset, .length = length };
+
+    fwrite(data, 1, length, out);
+    *offset += length;
+
+    return span;
+}
+
+/*
+    Renders the header lines that go with one variant of a file
+*/
+static int
+render_headers(char *buf, size_t size, const struct pack_file *file, size_t length, bool gzip)
+{
+    return snprintf(buf, size,
+                    "Content-Type: %s\r\n"
+                    "Content-Length: %zu\r\n"
+                    "ETag: %s\r\n"
+                    "%s%s",
+                    file->mime_type, length, file->etag,
+                    file->gzip_body ? "Vary: Accept-Encoding\r\n" : "",
+                    gzip ? "Content-Encoding: gzip\r\n" : "");
+}
+
+/*
+    Writes the index followed by the data section
+*/
+static int
+write_pack(const char *pack_path)
+{
+    char temp_path[PATH_MAX];
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", pack_path);
+
+    FILE *out = fopen(temp_path, "wb");
+
+    if (!out) {
+        perror(temp_path);
+        return -1;
+    }
+
+    for (int i = 0; i < file_count; i++) {
+        files[i].entry.hash = pack_hash(files[i].path, strlen(files[i].path));
+    }
+    qsort(files, file_count, sizeof(files[0]), compare_entries);
+
+    struct pack_header header = { 0 };
+    uint64_t offset = sizeof(header) + (uint64_t) file_count * sizeof(struct pack_entry);
+
+    // The index is written last, once every offset is known
+    fseek(out, offset, SEEK_SET);
+
+    for (int i = 0; i < file_count; i++) {
+        struct pack_file *file = &files[i];
+        struct pack_entry *entry = &file->entry;
+        char headers[512];
+        int length;
+
+        entry->path = append(out, &offset, file->path, strlen(file->path), 1);
+        entry->mime_type = append(out, &offset, file->mime_type, strlen(file->mime_type), 1);
+        entry->etag = append(out, &offset, file->etag, strlen(file->etag), 1);
+
+        length = render_headers(headers, sizeof(headers), file, file->body_length, false);
+        entry->headers = append(out, &offset, headers, length, 1);
+
+        if (file->gzip_body) {
+            length = render_headers(headers, sizeof(headers), file, file->gzip_length, true);
+            entry->gzip_headers = append(out, &offset, headers, length, 1);
+            entry->gzip_body
+                = append(out, &offset, file->gzip_body, file->gzip_length, PACK_ALIGNMENT);
+        }
+
+        entry->body = append(out, &offset, file->body, file->body_length, PACK_ALIGNMENT);
+    }
+
+    memcpy(header.magic, PACK_MAGIC, PACK_MAGIC_LENGTH);
+    header.entry_count = file_count;
+    header.file_size = offset;
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    for (int i = 0; i < file_count; i++) {
+        fwrite(&files[i].entry, sizeof(struct pack_entry), 1, out);
+    }
+
+    int failed = ferror(out);
+
+    if (fclose(out) != 0 || failed) {
+        perror(temp_path);
+        unlink(temp_path);
+        return -1;
+    }
+
+    // Never leave a running server mapping a half-written pack
+    if (rename(temp_path, pack_path) == -1) {
+        perror(pack_path);
+        unlink(temp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <static directory> <pack file>\n", argv[0]);
+        return 1;
+    }
+
+    char root[PATH_MAX];
+
+    // Entries are named relative to the directory, without a leading '/'
+    snprintf(root, sizeof(root), "%s", argv[1]);
+    root_length = strlen(root);
+    while (root_length > 1 && root[root_length - 1] == '/') {
+        root[--root_length] = '\0';
+    }
+    root_length++;
+
+    if (nftw(root, add_file, 16, FTW_PHYS) != 0) {
+        fprintf(stderr, "Failed to read %s\n", root);
+        return 1;
+    }
+
+    if (write_pack(argv[2]) != 0) {
+        return 1;
+    }
+
+    size_t total = 0;
+    int gzipped = 0;
+
+    for (int i = 0; i < file_count; i++) {
+        printf("  %-40s %8zu", files[i].path, files[i].body_length);
+        if (files[i].gzip_body) {
+            printf("  gzip %zu", files[i].gzip_length);
+            gzipped++;
+        }
+        printf("\n");
+        total += files[i].body_length;
+    }
+    printf("Packed %d files (%zu bytes, %d with gzip variants) into %s\n", file_count, total,
+           gzipped, argv[2]);
+
+    return 0;
+}
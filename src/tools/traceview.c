@@ -0,0 +1,224 @@
+/*
+** traceview.c -- summarizes a request trace dumped by the server
+**
+** Usage: traceview <trace dump> [chrome trace json]
+**
+** Send the server SIGUSR1 to dump its last requests to TRACE_DUMP_PATH. Prints latency
+** percentiles for the time each request spent between consecutive phases. With a second
+** argument also writes the requests as Chrome trace events, one row per connection, to load in
+** chrome://tracing or https://ui.perfetto.dev.
+*/
+
+#define _GNU_SOURCE
+
+#include "trace_file.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    The time between two phases, named for what the server was doing
+*/
+struct interval
+{
+    const char *name;
+    int from;
+    int to;
+};
+
+static const struct interval intervals[] = {
+    { "wait", TRACE_ACCEPT, TRACE_FIRST_BYTE },
+    { "read headers", TRACE_FIRST_BYTE, TRACE_HEADERS_PARSED },
+    { "read body", TRACE_HEADERS_PARSED, TRACE_BODY_COMPLETE },
+    { "handle", TRACE_BODY_COMPLETE, TRACE_ROUTED },
+    { "send headers", TRACE_ROUTED, TRACE_HEADERS_SENT },
+    { "send body", TRACE_HEADERS_SENT, TRACE_LAST_BYTE },
+    { "total", TRACE_FIRST_BYTE, TRACE_LAST_BYTE },
+};
+
+#define INTERVAL_COUNT (sizeof(intervals) / sizeof(intervals[0]))
+
+static int
+compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile_us(const int64_t *sorted, size_t count, double p)
+{
+    size_t index = (size_t) (p / 100.0 * (count - 1) + 0.5);
+
+    return sorted[index] / 1000.0;
+}
+
+static struct trace_record *
+read_dump(const char *path, uint64_t *count)
+{
+    FILE *file = fopen(path, "rb");
+    struct trace_file_header header;
+
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, TRACE_MAGIC, TRACE_MAGIC_LENGTH) != 0
+        || header.phase_count != TRACE_PHASE_COUNT) {
+        fprintf(stderr, "%s: not a trace dump from this version of the server\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    struct trace_record *records = malloc((header.record_count ? header.record_count : 1)
+                                          * sizeof(struct trace_record));
+
+    if (!records) {
+        perror("malloc");
+        fclose(file);
+        return NULL;
+    }
+
+    if (fread(records, sizeof(struct trace_record), header.record_count, file)
+        != header.record_count) {
+        fprintf(stderr, "%s: truncated\n", path);
+        free(records);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+    *count = header.record_count;
+    return records;
+}
+
+static void
+print_percentiles(const struct trace_record *records, uint64_t count)
+{
+    int64_t *durations = malloc((count ? count : 1) * sizeof(int64_t));
+
+    if (!durations) {
+        perror("malloc");
+        return;
+    }
+
+    printf("%-14s %8s %10s %10s %10s %10s %10s\n", "phase (us)", "count", "p50", "p90", "p99",
+           "p99.9", "max");
+
+    for (size_t i = 0; i < INTERVAL_COUNT; i++) {
+        size_t n = 0;
+
+        // Requests that never reached either end, e.g. no body or closed early, are left out
+        for (uint64_t r = 0; r < count; r++) {
+            int64_t from = records[r].at[intervals[i].from];
+            int64_t to = records[r].at[intervals[i].to];
+
+            if (from != 0 && to != 0) {
+                durations[n++] = to - from;
+            }
+        }
+
+        if (n == 0) {
+            printf("%-14s %8d\n", intervals[i].name, 0);
+            continue;
+        }
+
+        qsort(durations, n, sizeof(int64_t), compare_int64);
+        printf("%-14s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", intervals[i].name, n,
+               percentile_us(durations, n, 50), percentile_us(durations, n, 90),
+               percentile_us(durations, n, 99), percentile_us(durations, n, 99.9),
+               durations[n - 1] / 1000.0);
+    }
+
+    free(durations);
+}
+
+/*
+    Writes every interval of every request as a complete ("X") event, microseconds from the
+    first timestamp in the dump
+*/
+static int
+write_chrome_trace(const char *path, const struct trace_record *records, uint64_t count)
+{
+    FILE *file = fopen(path, "w");
+    int64_t origin = INT64_MAX;
+    bool first = true;
+
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    for (uint64_t r = 0; r < count; r++) {
+        for (int phase = 0; phase < TRACE_PHASE_COUNT; phase++) {
+            if (records[r].at[phase] != 0 && records[r].at[phase] < origin) {
+                origin = records[r].at[phase];
+            }
+        }
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+    for (uint64_t r = 0; r < count; r++) {
+        // "total" spans the others, so only the phases themselves are drawn
+        for (size_t i = 0; i + 1 < INTERVAL_COUNT; i++) {
+            int64_t from = records[r].at[intervals[i].from];
+            int64_t to = records[r].at[intervals[i].to];
+
+            if (from == 0 || to == 0) {
+                continue;
+            }
+
+            fprintf(file,
+                    "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%" PRId32
+                    ",\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"request\":%" PRIu32 "}}",
+                    first ? "" : ",\n", intervals[i].name, records[r].fd,
+                    (from - origin) / 1000.0, (to - from) / 1000.0, records[r].request);
+            first = false;
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s <trace dump> [chrome trace json]\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t count = 0;
+    struct trace_record *records = read_dump(argv[1], &count);
+
+    if (!records) {
+        return 1;
+    }
+
+    printf("%" PRIu64 " requests\n", count);
+    print_percentiles(records, count);
+
+    int ret = 0;
+
+    if (argc == 3) {
+        ret = write_chrome_trace(argv[2], records, count) != 0;
+    }
+
+    free(records);
+    return ret;
+}